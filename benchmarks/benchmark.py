@@ -0,0 +1,260 @@
+# Copyright (c) 2021 Leiden University Medical Center
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+"""
+Throughput benchmarks for fastq-filter.
+
+Synthetic FASTQ datasets are generated with a fixed seed, so every run and
+every commit is measured on the same data. Each filter is measured alone and
+in every combination with the other filters, for each read length, quality
+profile, number of input files and input compression. The results are
+written as JSON so they can be compared across commits.
+
+Run from the root of the repository with::
+
+    python benchmarks/benchmark.py -o results.json
+"""
+
+import argparse
+import gzip
+import itertools
+import json
+import os
+import platform
+import random
+import subprocess
+import sys
+import time
+from pathlib import Path
+from typing import Callable, Dict, List, Tuple
+
+import fastq_filter
+from fastq_filter import (
+    AverageErrorRateFilter,
+    MaximumLengthFilter,
+    MedianQualityFilter,
+    MinimumLengthFilter,
+    filter_fastq,
+)
+
+DEFAULT_READ_LENGTHS = (75, 150, 10_000)
+DEFAULT_LAYOUTS = (1, 2, 3)
+DEFAULT_BASES = 20_000_000
+DEFAULT_REPEATS = 3
+SEED = 0
+
+
+def high_qualities(rand: random.Random, length: int) -> List[int]:
+    return [rand.randint(30, 40) for _ in range(length)]
+
+
+def declining_qualities(rand: random.Random, length: int) -> List[int]:
+    """Qualities that drop towards the end of the read, as on Illumina."""
+    start = rand.randint(30, 40)
+    end = rand.randint(2, 30)
+    return [max(2, min(41, round(start + (end - start) * i / length +
+                                 rand.gauss(0, 3))))
+            for i in range(length)]
+
+
+def uniform_qualities(rand: random.Random, length: int) -> List[int]:
+    return [rand.randint(2, 41) for _ in range(length)]
+
+
+QUALITY_PROFILES: Dict[str, Callable[[random.Random, int], List[int]]] = {
+    "high": high_qualities,
+    "declining": declining_qualities,
+    "uniform": uniform_qualities,
+}
+
+
+def filter_sets(read_length: int) -> Dict[str, Callable[[], List[Callable]]]:
+    """
+    Every combination of filters. The thresholds are chosen so that each
+    filter removes part of the reads of the synthetic datasets. The filters
+    are returned as factories because they keep counts.
+    """
+    factories = {
+        "min_length": lambda: MinimumLengthFilter(read_length),
+        "max_length": lambda: MaximumLengthFilter(read_length * 5 // 4),
+        "average_error_rate": lambda: AverageErrorRateFilter(0.001),
+        "median_quality": lambda: MedianQualityFilter(30),
+    }
+    sets = {}
+    for size in range(1, len(factories) + 1):
+        for names in itertools.combinations(factories, size):
+            sets["+".join(names)] = (
+                lambda names=names: [factories[name]() for name in names])
+    return sets
+
+
+def generate_dataset(data_dir: Path, read_length: int, profile: str,
+                     layout: int, bases: int, compressed: bool
+                     ) -> Tuple[List[str], int, int]:
+    """
+    Writes the FASTQ files of a dataset unless they exist already. Read
+    lengths vary between 0.5 and 1.5 times the read length, so that the
+    length filters have something to do.
+
+    :return: The file names, the number of reads per file and the total
+             uncompressed size.
+    """
+    number_of_reads = max(1, bases // read_length)
+    suffix = ".fastq.gz" if compressed else ".fastq"
+    names = [str(data_dir / f"{profile}_{read_length}bp_R{i + 1}{suffix}")
+             for i in range(layout)]
+    sizes = []
+    for i, name in enumerate(names):
+        # Each file has its own seed so R1 is the same in every layout.
+        rand = random.Random(f"{SEED} {read_length} {profile} {i}")
+        quality_function = QUALITY_PROFILES[profile]
+        size = 0
+        path = Path(name)
+        write = not path.exists()
+        opener = gzip.open if compressed else open
+        with opener(name, "wb") if write else open(os.devnull, "wb") as out:
+            for n in range(number_of_reads):
+                length = rand.randint(read_length // 2, read_length * 3 // 2)
+                sequence = "".join(rand.choices("ACGT", k=length))
+                qualities = "".join(
+                    chr(q + 33) for q in quality_function(rand, length))
+                record = (f"@read{n}/{i + 1}\n{sequence}\n+\n"
+                          f"{qualities}\n").encode("ascii")
+                size += len(record)
+                out.write(record)
+        sizes.append(size)
+    return names, number_of_reads, sum(sizes)
+
+
+def time_filter_fastq(input_files: List[str], output_dir: Path,
+                      filter_factory: Callable[[], List[Callable]],
+                      compressed: bool, repeats: int) -> float:
+    suffix = ".fastq.gz" if compressed else ".fastq"
+    output_files = [str(output_dir / f"out_R{i + 1}{suffix}")
+                    for i in range(len(input_files))]
+    timings = []
+    for _ in range(repeats):
+        filters = filter_factory()
+        start = time.perf_counter()
+        filter_fastq(input_files, output_files, filters)
+        timings.append(time.perf_counter() - start)
+    for output_file in output_files:
+        os.remove(output_file)
+    return min(timings)
+
+
+def git_commit() -> str:
+    try:
+        return subprocess.run(
+            ["git", "rev-parse", "HEAD"], capture_output=True, check=True,
+            text=True, cwd=Path(__file__).parent).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return "unknown"
+
+
+def metadata() -> Dict:
+    return {
+        "fastq_filter_version": getattr(fastq_filter, "__version__",
+                                        "unknown"),
+        "commit": git_commit(),
+        "python": platform.python_version(),
+        "platform": platform.platform(),
+        "machine": platform.machine(),
+        "cpu_count": os.cpu_count(),
+        "timestamp": time.strftime("%Y-%m-%dT%H:%M:%S%z"),
+    }
+
+
+def argument_parser() -> argparse.ArgumentParser:
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("-o", "--output", default="benchmark_results.json",
+                        help="JSON file to write the results to. "
+                             "Default: benchmark_results.json.")
+    parser.add_argument("--data-dir", default="benchmark_data",
+                        help="Directory for the generated datasets. Existing "
+                             "datasets are reused. Default: benchmark_data.")
+    parser.add_argument("--read-lengths", type=int, nargs="+",
+                        default=list(DEFAULT_READ_LENGTHS),
+                        help="Read lengths of the datasets. Default: "
+                             f"{' '.join(map(str, DEFAULT_READ_LENGTHS))}.")
+    parser.add_argument("--profiles", nargs="+", choices=QUALITY_PROFILES,
+                        default=["declining"],
+                        help="Quality profiles of the datasets. "
+                             "Default: declining.")
+    parser.add_argument("--layouts", type=int, nargs="+",
+                        default=list(DEFAULT_LAYOUTS),
+                        help="Number of files per dataset: 1 for single-end, "
+                             "2 for paired-end, etc. Default: 1 2 3.")
+    parser.add_argument("--compression", nargs="+",
+                        choices=["plain", "gzip"], default=["plain", "gzip"],
+                        help="Input and output compression. "
+                             "Default: plain gzip.")
+    parser.add_argument("--filters", nargs="+",
+                        help="Only run these filter combinations, for "
+                             "example 'min_length+average_error_rate'. "
+                             "Default: all combinations.")
+    parser.add_argument("--bases", type=int, default=DEFAULT_BASES,
+                        help="Approximate number of bases per file. "
+                             f"Default: {DEFAULT_BASES}.")
+    parser.add_argument("--repeats", type=int, default=DEFAULT_REPEATS,
+                        help="Number of runs per benchmark. The fastest run "
+                             f"is reported. Default: {DEFAULT_REPEATS}.")
+    return parser
+
+
+def main():
+    args = argument_parser().parse_args()
+    data_dir = Path(args.data_dir)
+    data_dir.mkdir(parents=True, exist_ok=True)
+    results = []
+    for read_length, profile, layout, compression in itertools.product(
+            args.read_lengths, args.profiles, args.layouts, args.compression):
+        compressed = compression == "gzip"
+        input_files, reads, size = generate_dataset(
+            data_dir, read_length, profile, layout, args.bases, compressed)
+        for name, factory in filter_sets(read_length).items():
+            if args.filters and name not in args.filters:
+                continue
+            seconds = time_filter_fastq(input_files, data_dir, factory,
+                                        compressed, args.repeats)
+            result = {
+                "read_length": read_length,
+                "profile": profile,
+                "layout": layout,
+                "compression": compression,
+                "filters": name,
+                "reads": reads,
+                "bytes": size,
+                "seconds": seconds,
+                "reads_per_second": reads / seconds,
+                "megabytes_per_second": size / seconds / 1_000_000,
+            }
+            results.append(result)
+            print(f"{read_length:>6}bp {profile:<9} {layout} file(s) "
+                  f"{compression:<5} {name:<55} "
+                  f"{result['reads_per_second']:>12,.0f} reads/s "
+                  f"{result['megabytes_per_second']:>8.1f} MB/s",
+                  file=sys.stderr)
+    with open(args.output, "wt") as output:
+        json.dump({"metadata": metadata(), "results": results}, output,
+                  indent=2)
+
+
+if __name__ == "__main__":
+    main()
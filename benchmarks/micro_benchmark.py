@@ -0,0 +1,266 @@
+# Copyright (c) 2021 Leiden University Medical Center
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+"""
+Micro-benchmarks for the kernels of the fastq-filter C extension.
+
+The phred kernels and each filter are measured in isolation on records of a
+fixed length, without reading or writing files. The phred kernels are
+measured with the batch functions, which use the kernels of the filters
+without a Python call per record: average_error_rate_batch for the summed
+error rates and qualmedian_batch for the histogram and its median.
+
+Every benchmark is run once for each kernel variant the CPU supports, in a
+separate process with the FASTQ_FILTER_KERNELS environment variable set, so
+the scalar and vectorized kernels are measured on the same data. The times
+are reported in nanoseconds per record and per base.
+
+Run from the root of the repository with::
+
+    python benchmarks/micro_benchmark.py -o micro_results.json
+
+and compare a later commit with those results with::
+
+    python benchmarks/micro_benchmark.py --compare micro_results.json \
+        -o new_results.json
+
+which exits with status 1 when a benchmark became slower than allowed.
+"""
+
+import argparse
+import array
+import json
+import os
+import random
+import subprocess
+import sys
+import time
+from typing import Callable, Dict, List, Tuple
+
+from benchmark import metadata
+
+from dnaio import SequenceRecord
+
+from fastq_filter import _filters
+
+DEFAULT_READ_LENGTHS = (50, 150, 300, 10_000)
+DEFAULT_BASES = 2_000_000
+DEFAULT_REPEATS = 5
+DEFAULT_MAX_SLOWDOWN = 1.10
+DEFAULT_OUTPUT = "micro_results.json"
+SEED = 0
+
+FILTERS: Dict[str, Callable[[], Callable]] = {
+    # The thresholds let the records pass, but only after the filters have
+    # looked at most of the record.
+    "AverageErrorRateFilter": lambda: _filters.AverageErrorRateFilter(1.0),
+    "MedianQualityFilter": lambda: _filters.MedianQualityFilter(21),
+    "SlidingWindowErrorRateFilter":
+        lambda: _filters.SlidingWindowErrorRateFilter(1.0),
+    "MinimumLengthFilter": lambda: _filters.MinimumLengthFilter(0),
+    "MaximumLengthFilter": lambda: _filters.MaximumLengthFilter(1 << 40),
+    "MaximumNFilter": lambda: _filters.MaximumNFilter(0),
+    "MaximumHomopolymerFilter": lambda: _filters.MaximumHomopolymerFilter(20),
+}
+
+
+def kernel_variants() -> List[str]:
+    """The kernel variants supported by this CPU, slowest first."""
+    variants = ["scalar"]
+    if _filters.KERNELS == "avx2":
+        variants.append("sse2")
+    if _filters.KERNELS not in variants:
+        variants.append(_filters.KERNELS)
+    return variants
+
+
+def records_of_length(length: int, bases: int
+                      ) -> List[Tuple[SequenceRecord, ...]]:
+    rand = random.Random(f"{SEED} {length}")
+    number_of_records = max(1, bases // length)
+    records = []
+    for i in range(number_of_records):
+        sequence = "".join(rand.choices("ACGT", k=length))
+        qualities = "".join(chr(rand.randint(2, 41) + 33)
+                            for _ in range(length))
+        records.append((SequenceRecord(f"read{i}", sequence, qualities),))
+    return records
+
+
+def best_time(function: Callable[[], object], repeats: int) -> int:
+    """The fastest of repeats runs of function in nanoseconds."""
+    timings = []
+    for _ in range(repeats):
+        start = time.perf_counter_ns()
+        function()
+        timings.append(time.perf_counter_ns() - start)
+    return min(timings)
+
+
+def benchmarks(records: List[Tuple[SequenceRecord, ...]]
+               ) -> Dict[str, Callable[[], object]]:
+    qualities = "".join(record[0].qualities for record in records)
+    phred_scores = qualities.encode("ascii")
+    length = len(records[0][0])
+    offsets = array.array("q", range(0, len(phred_scores) + 1, length))
+    out = array.array("d", bytes(8 * len(records)))
+
+    def average_error_rate():
+        _filters.average_error_rate_batch(phred_scores, offsets=offsets,
+                                          out=out)
+
+    def qualmedian():
+        _filters.qualmedian_batch(phred_scores, offsets=offsets, out=out)
+
+    functions = {"average_error_rate_batch": average_error_rate,
+                 "qualmedian_batch": qualmedian}
+    for name, factory in FILTERS.items():
+        def call(filter_func=factory()):
+            for record in records:
+                filter_func(record)
+        functions[f"{name}.__call__"] = call
+    return functions
+
+
+def run_benchmarks(read_lengths: List[int], bases: int, repeats: int
+                   ) -> List[Dict]:
+    """Runs the benchmarks with the kernels selected in this process."""
+    results = []
+    for length in read_lengths:
+        records = records_of_length(length, bases)
+        for name, function in benchmarks(records).items():
+            nanoseconds = best_time(function, repeats)
+            results.append({
+                "kernels": _filters.KERNELS,
+                "benchmark": name,
+                "read_length": length,
+                "records": len(records),
+                "ns_per_record": nanoseconds / len(records),
+                "ns_per_base": nanoseconds / (len(records) * length),
+            })
+    return results
+
+
+def run_variant(variant: str, args: argparse.Namespace) -> List[Dict]:
+    """Runs the benchmarks in a new process with the given kernels."""
+    command = [sys.executable, __file__, "--worker",
+               "--bases", str(args.bases), "--repeats", str(args.repeats),
+               "--read-lengths", *map(str, args.read_lengths)]
+    env = dict(os.environ, FASTQ_FILTER_KERNELS=variant)
+    worker = subprocess.run(command, env=env, stdout=subprocess.PIPE,
+                            check=True, text=True)
+    return json.loads(worker.stdout)
+
+
+def regressions(results: List[Dict], baseline: List[Dict],
+                max_slowdown: float) -> List[Tuple[Dict, Dict]]:
+    """The results that are more than max_slowdown times the baseline."""
+    baseline_results = {
+        (result["kernels"], result["benchmark"], result["read_length"]):
+        result for result in baseline}
+    slower = []
+    for result in results:
+        key = (result["kernels"], result["benchmark"], result["read_length"])
+        before = baseline_results.get(key)
+        if (before is not None and
+                result["ns_per_base"] > before["ns_per_base"] * max_slowdown):
+            slower.append((before, result))
+    return slower
+
+
+def argument_parser() -> argparse.ArgumentParser:
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("-o", "--output",
+                        help="JSON file to write the results to. Required "
+                             "with --compare, and must differ from its file. "
+                             "Default: " + DEFAULT_OUTPUT + ".")
+    parser.add_argument("--read-lengths", type=int, nargs="+",
+                        default=list(DEFAULT_READ_LENGTHS),
+                        help="Lengths of the records. Default: "
+                             f"{' '.join(map(str, DEFAULT_READ_LENGTHS))}.")
+    parser.add_argument("--kernels", nargs="+",
+                        help="Kernel variants to measure: scalar, sse2, avx2 "
+                             "or neon. Default: all variants this CPU "
+                             "supports.")
+    parser.add_argument("--bases", type=int, default=DEFAULT_BASES,
+                        help="Approximate number of bases per benchmark. "
+                             f"Default: {DEFAULT_BASES}.")
+    parser.add_argument("--repeats", type=int, default=DEFAULT_REPEATS,
+                        help="Number of runs per benchmark. The fastest run "
+                             f"is reported. Default: {DEFAULT_REPEATS}.")
+    parser.add_argument("--compare", metavar="RESULTS",
+                        help="Results of an earlier run. Exit with status 1 "
+                             "when a benchmark is slower than allowed by "
+                             "--max-slowdown. The results are not updated, so "
+                             "a regression does not become the new baseline.")
+    parser.add_argument("--max-slowdown", type=float,
+                        default=DEFAULT_MAX_SLOWDOWN,
+                        help="Allowed ratio of the time per base to the "
+                             "time in --compare. "
+                             f"Default: {DEFAULT_MAX_SLOWDOWN}.")
+    parser.add_argument("--worker", action="store_true",
+                        help=argparse.SUPPRESS)
+    return parser
+
+
+def main():
+    parser = argument_parser()
+    args = parser.parse_args()
+    if args.compare:
+        if args.output is None:
+            parser.error("--compare requires an explicit -o/--output.")
+        if os.path.abspath(args.output) == os.path.abspath(args.compare):
+            parser.error("-o/--output must not be the --compare file.")
+    elif args.output is None:
+        args.output = DEFAULT_OUTPUT
+    if args.worker:
+        json.dump(run_benchmarks(args.read_lengths, args.bases, args.repeats),
+                  sys.stdout)
+        return
+    baseline = None
+    if args.compare:
+        with open(args.compare, "rt") as baseline_file:
+            baseline = json.load(baseline_file)["results"]
+    results = []
+    for variant in args.kernels or kernel_variants():
+        variant_results = run_variant(variant, args)
+        if variant_results and variant_results[0]["kernels"] != variant:
+            sys.exit(f"Kernels {variant} are not supported by this CPU.")
+        for result in variant_results:
+            print(f"{result['kernels']:<6} {result['benchmark']:<38} "
+                  f"{result['read_length']:>6}bp "
+                  f"{result['ns_per_record']:>10.1f} ns/record "
+                  f"{result['ns_per_base']:>7.3f} ns/base", file=sys.stderr)
+        results.extend(variant_results)
+    with open(args.output, "wt") as output:
+        json.dump({"metadata": metadata(), "results": results}, output,
+                  indent=2)
+    if baseline is not None:
+        slower = regressions(results, baseline, args.max_slowdown)
+        for before, after in slower:
+            print(f"Regression: {after['kernels']} {after['benchmark']} "
+                  f"{after['read_length']}bp went from "
+                  f"{before['ns_per_base']:.3f} to "
+                  f"{after['ns_per_base']:.3f} ns/base.", file=sys.stderr)
+        if slower:
+            sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
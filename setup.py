@@ -60,5 +60,6 @@ setup(
         "dnaio>=0.9.0"
     ],
     entry_points={"console_scripts": [
-        "fastq-filter = fastq_filter:main"]}
+        "fastq-filter = fastq_filter:main",
+        "fastq-filter-merge = fastq_filter:merge_main"]}
 )
@@ -18,25 +18,43 @@
 # OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 # SOFTWARE.
 import argparse
+import collections
+import concurrent.futures
 import contextlib
 import functools
+import io
+import json
 import logging
-from typing import Callable, Iterable, Iterator, List, Tuple
+import mmap
+import os
+import sys
+import time
+from typing import (Any, BinaryIO, Callable, Dict, Iterable, Iterator, List,
+                    Optional, Sequence, Tuple, TypeVar, Union)
 
 import dnaio
 
-import xopen  # type: ignore
-
 from ._filters import (
     AverageErrorRateFilter,
     DEFAULT_PHRED_SCORE_OFFSET,
+    FilterPipeline,
+    MaximumHomopolymerFilter,
     MaximumLengthFilter,
+    MaximumNFilter,
     MedianQualityFilter,
     MinimumLengthFilter,
+    SlidingWindowErrorRateFilter,
     average_error_rate,
+    average_error_rate_batch,
+    complete_record_offsets,
     qualmean,
+    qualmean_batch,
     qualmedian,
+    qualmedian_batch,
 )
+from .compression import open_input, open_output
+from .sharding import (ShardReader, is_bgzf_file, merge_files, merge_reports,
+                       parse_shard, shard_range)
 
 __version__ = "1.0.0-dev"
 
@@ -45,36 +63,74 @@ __all__ = [
     "fastq_records_to_file",
     "filter_fastq",
     "AverageErrorRateFilter",
+    "FilterPipeline",
+    "MaximumHomopolymerFilter",
     "MaximumLengthFilter",
+    "MaximumNFilter",
     "MedianQualityFilter",
     "MinimumLengthFilter",
+    "SlidingWindowErrorRateFilter",
     "average_error_rate",
+    "average_error_rate_batch",
     "qualmean",
+    "qualmean_batch",
     "qualmedian",
+    "qualmedian_batch",
     "DEFAULT_PHRED_SCORE_OFFSET"
 ]
 
 DEFAULT_COMPRESSION_LEVEL = 2
+READ_BUFFER_SIZE = 1024 * 1024
+DEFAULT_OUTPUT_BUFFER_SIZE = 1024 * 1024
+
+# The stages of filter_fastq for which the time can be measured.
+STAGES = ("read", "parse", "filter", "serialize", "write")
+
+T = TypeVar("T")
 
+# Filters that can be combined in a FilterPipeline.
+BUILTIN_FILTERS = (AverageErrorRateFilter, MaximumHomopolymerFilter,
+                   MaximumLengthFilter, MaximumNFilter, MedianQualityFilter,
+                   MinimumLengthFilter, SlidingWindowErrorRateFilter)
 
-def file_to_fastq_records(filepath: str) -> Iterator[dnaio.Sequence]:
+
+def file_to_fastq_records(filepath: str, input_threads: int = 0
+                          ) -> Iterator[dnaio.Sequence]:
     """Parse a FASTQ file into a generator of Sequence objects"""
-    opener = functools.partial(xopen.xopen, threads=0)
+    opener = functools.partial(open_input, threads=input_threads)
     with dnaio.open(filepath, opener=opener) as record_h:  # type: ignore
         yield from record_h
 
 
 def fastq_records_to_file(records: Iterable[dnaio.Sequence], filepath: str,
-                          compression_level: int = DEFAULT_COMPRESSION_LEVEL):
-    with xopen.xopen(filepath, mode='wb', threads=0,
-                     compresslevel=compression_level) as output_h:
+                          compression_level: int = DEFAULT_COMPRESSION_LEVEL,
+                          compression_threads: int = 0, bgzf: bool = False):
+    with open_output(filepath, compression_level, compression_threads,
+                     bgzf) as output_h:
         for record in records:
             output_h.write(record.fastq_bytes())
 
 
-def multiple_files_to_records(input_files: List[str],
+def shard_records(input_file: str, start: Tuple[int, int],
+                  end: Optional[Tuple[int, int]]) -> Iterator[dnaio.Sequence]:
+    """Parse the records of a shard of a FASTQ file."""
+    with io.BufferedReader(ShardReader(input_file, start, end),
+                           READ_BUFFER_SIZE) as shard_h:
+        with dnaio.open(shard_h) as record_h:  # type: ignore
+            yield from record_h
+
+
+def multiple_files_to_records(input_files: List[str], input_threads: int = 0,
+                              shard: Optional[Tuple[int, int]] = None
                               ) -> Iterator[Tuple[dnaio.SequenceRecord, ...]]:
-    readers = [file_to_fastq_records(f) for f in input_files]
+    if shard is None:
+        readers = [file_to_fastq_records(f, input_threads)
+                   for f in input_files]
+    else:
+        starts, ends = shard_range(input_files, *shard)
+        shard_ends = ends or [None] * len(starts)
+        readers = [shard_records(f, start, end) for f, start, end in
+                   zip(input_files, starts, shard_ends)]
     iterators = [iter(reader) for reader in readers]
 
     # By differentiating between single, paired and multiple files we can
@@ -86,7 +142,7 @@ def multiple_files_to_records(input_files: List[str],
             if not record1.is_mate(record2):
                 raise dnaio.FastqFormatError(
                     f"Records are out of sync, names "
-                    f"{record1}, f{record2} do not match.",
+                    f"{record1.name}, {record2.name} do not match.",
                     line=None)
             yield record1, record2
     else:
@@ -108,9 +164,56 @@ def multiple_files_to_records(input_files: List[str],
             pass
 
 
+def timed_iterator(iterable: Iterable[T], stage_times: Dict[str, float],
+                   stage: str) -> Iterator[T]:
+    """Yield from iterable and add the time spent waiting for each item to
+    the stage in stage_times."""
+    iterator = iter(iterable)
+    perf_counter = time.perf_counter
+    while True:
+        start = perf_counter()
+        try:
+            item = next(iterator)
+        except StopIteration:
+            stage_times[stage] += perf_counter() - start
+            return
+        stage_times[stage] += perf_counter() - start
+        yield item
+
+
+def can_use_pipeline(filters: List[Callable]) -> bool:
+    """Check whether the filters can be evaluated by a FilterPipeline."""
+    if not all(isinstance(filter_func, BUILTIN_FILTERS)
+               for filter_func in filters):
+        return False
+    phred_offsets = {filter_func.phred_offset for filter_func in filters
+                     if hasattr(filter_func, "phred_offset")}
+    return len(phred_offsets) <= 1
+
+
+def check_shardable(input_files: List[str]):
+    """Raise a ValueError when an input file can not be split into shards."""
+    for input_file in input_files:
+        if not (is_uncompressed_file(input_file) or is_bgzf_file(input_file)):
+            raise ValueError(f"Sharding requires uncompressed or BGZF input "
+                             f"files, got {input_file!r}.")
+
+
 def filter_fastq(input_files: List[str], output_files: List[str],
                  filters: List[Callable[[Tuple[dnaio.SequenceRecord, ...]], bool]],
-                 compression_level: int = DEFAULT_COMPRESSION_LEVEL):
+                 compression_level: int = DEFAULT_COMPRESSION_LEVEL,
+                 threads: int = 1,
+                 compression_threads: int = 0,
+                 bgzf: bool = False,
+                 input_threads: int = 0,
+                 stage_times: Optional[Dict[str, float]] = None,
+                 statistics: Optional[Dict[str, Any]] = None,
+                 output_buffer_size: int = DEFAULT_OUTPUT_BUFFER_SIZE,
+                 max_buffer_size: Optional[int] = None,
+                 shard: Optional[Tuple[int, int]] = None,
+                 auto_order: bool = False,
+                 failed_output_files: Optional[List[str]] = None
+                 ) -> Optional[Tuple[int, int]]:
     """
     Filter FASTQ input files with the filters in filters and write
     the results to the output file.
@@ -122,41 +225,572 @@ def filter_fastq(input_files: List[str], output_files: List[str],
     automatically.
     :param compression_level: Compression level for the output files (if
     applicable)
+    :param threads: Number of threads used for filtering. Only applies to the
+    native path.
+    :param compression_threads: Number of threads used for compressing gzip
+    output files. 0 compresses on the main thread.
+    :param bgzf: Write gzip output files in the BGZF format.
+    :param input_threads: Number of threads used for decompressing gzip
+    input files. 0 decompresses on the main thread.
+    :param stage_times: When given, the time in seconds spent in each of the
+    STAGES is added to it. "read" includes decompression, and also parsing
+    when records are created. Filters should be created with timed=True to
+    also measure the time of each filter.
+    :param statistics: When given, it is updated with the length and mean
+    quality histograms of the passed and failed reads, as collected by a
+    FilterPipeline created with statistics=True. Only the native path
+    collects histograms.
+    :param output_buffer_size: Passing records are collected and written
+    once this many bytes are buffered for one of the output files.
+    :param max_buffer_size: The maximum number of bytes of FASTQ data that are
+    being filtered at the same time with multiple threads. Only applies to
+    the native path.
+    :param shard: An (index, count) tuple to only filter shard index of
+    count shards of the input files, see the sharding module. The input
+    files must be uncompressed or BGZF files.
+    :param auto_order: Let the FilterPipeline order the filters by their
+    measured cost and rejection rate. Only applies to the native path.
+    :param failed_output_files: When given, the records that fail the
+    filters are written to these files, one for each input file, in the
+    same pass as the passing records.
+    When all filters are fastq-filter filters the native path in
+    filter_fastq_native is used.
+    :return: The number of record tuples that were evaluated and that passed
+    on the native path, None otherwise. With auto_order the counters of the
+    first and last filter no longer give these numbers.
     """
     if len(input_files) != len(output_files):
         raise ValueError("Number of inputs and outputs should be equal.")
-    filtered_fastq_records = multiple_files_to_records(input_files)
+    if (failed_output_files is not None and
+            len(input_files) != len(failed_output_files)):
+        raise ValueError("Number of inputs and failed outputs should be "
+                         "equal.")
+    if output_buffer_size < 1:
+        raise ValueError(f"output_buffer_size must be at least 1, got "
+                         f"{output_buffer_size}.")
+    if shard is not None:
+        check_shardable(input_files)
+    if can_use_pipeline(filters):
+        pipeline = FilterPipeline(filters, statistics=statistics is not None,
+                                  auto_order=auto_order)
+        filter_fastq_native(input_files, output_files, pipeline,
+                            compression_level, threads, compression_threads,
+                            bgzf, input_threads, stage_times,
+                            output_buffer_size, max_buffer_size, shard,
+                            failed_output_files)
+        if statistics is not None:
+            statistics.update(pipeline.statistics)
+        return pipeline.total, pipeline.passed
+    fastq_records = multiple_files_to_records(input_files, input_threads,
+                                              shard)
+    times: Dict[str, float] = dict.fromkeys(STAGES, 0.0)
+    if stage_times is not None:
+        fastq_records = timed_iterator(fastq_records, times, "read")
+    filtered_fastq_records = fastq_records
     for filter_func in filters:
         filtered_fastq_records = filter(filter_func, filtered_fastq_records)
     with contextlib.ExitStack() as output_stack:
         outputs = [output_stack.enter_context(
-                   xopen.xopen(output_file, threads=0, mode="wb",
-                               compresslevel=compression_level))
+                   open_output(output_file, compression_level,
+                               compression_threads, bgzf))
                    for output_file in output_files]
-        # Use faster methods for more common cases before falling back to
-        # generic multiple files mode (which is slower).
-        if len(outputs) == 1:
+        failed_outputs = [output_stack.enter_context(
+                          open_output(output_file, compression_level,
+                                      compression_threads, bgzf))
+                          for output_file in failed_output_files or []]
+        # Passing records are collected in a buffer for each output, which is
+        # written once it holds output_buffer_size bytes, rather than writing
+        # each record separately. Use faster methods for more common cases
+        # before falling back to generic multiple files mode (which is
+        # slower).
+        if failed_output_files is not None:
+            output_buffers = OutputBuffers(outputs, output_buffer_size)
+            failed_buffers = OutputBuffers(failed_outputs, output_buffer_size)
+            split_fastq_records(fastq_records, filters, output_buffers,
+                                failed_buffers,
+                                times if stage_times is not None else None)
+            write_start = time.perf_counter()
+            output_buffers.flush()
+            failed_buffers.flush()
+        elif stage_times is not None:
+            perf_counter = time.perf_counter
+            output_buffers = OutputBuffers(outputs, output_buffer_size)
+            # The time waiting for passing records includes the time spent
+            # reading, which is subtracted afterwards.
+            for records in timed_iterator(filtered_fastq_records, times,
+                                          "filter"):
+                start = perf_counter()
+                serialized = [record.fastq_bytes() for record in records]
+                serialized_time = perf_counter()
+                output_buffers.write(serialized)
+                times["serialize"] += serialized_time - start
+                times["write"] += perf_counter() - serialized_time
+            times["filter"] -= times["read"]
+            write_start = perf_counter()
+            output_buffers.flush()
+        elif len(outputs) == 1:
             output = outputs[0]
+            buffer = bytearray()
             for record, in filtered_fastq_records:
-                output.write(record.fastq_bytes())
+                buffer += record.fastq_bytes()
+                if len(buffer) >= output_buffer_size:
+                    output.write(buffer)
+                    buffer.clear()
+            output.write(buffer)
         elif len(outputs) == 2:
             output1 = outputs[0]
             output2 = outputs[1]
+            buffer1 = bytearray()
+            buffer2 = bytearray()
             for record1, record2 in filtered_fastq_records:
-                output1.write(record1.fastq_bytes())
-                output2.write(record2.fastq_bytes())
-        elif len(outputs) == 3:
-            output1 = outputs[0]
-            output2 = outputs[1]
-            output3 = outputs[2]
-            for record1, record2, record3 in filtered_fastq_records:
-                output1.write(record1.fastq_bytes())
-                output2.write(record2.fastq_bytes())
-                output3.write(record3.fastq_bytes())
-        else:  # More than 3 files is quite uncommon.
+                buffer1 += record1.fastq_bytes()
+                buffer2 += record2.fastq_bytes()
+                if (len(buffer1) >= output_buffer_size or
+                        len(buffer2) >= output_buffer_size):
+                    output1.write(buffer1)
+                    output2.write(buffer2)
+                    buffer1.clear()
+                    buffer2.clear()
+            output1.write(buffer1)
+            output2.write(buffer2)
+        else:  # More than 2 files is quite uncommon.
+            output_buffers = OutputBuffers(outputs, output_buffer_size)
             for records in filtered_fastq_records:
-                for record, output in zip(records, outputs):
-                    output.write(record.fastq_bytes())
+                output_buffers.write([record.fastq_bytes()
+                                      for record in records])
+            output_buffers.flush()
+    if stage_times is not None:
+        # Closing flushes the last compressed data.
+        times["write"] += time.perf_counter() - write_start
+        for stage, stage_time in times.items():
+            stage_times[stage] = stage_times.get(stage, 0.0) + stage_time
+    return None
+
+
+def split_fastq_records(
+        records: Iterable[Tuple[dnaio.SequenceRecord, ...]],
+        filters: List[Callable[[Tuple[dnaio.SequenceRecord, ...]], bool]],
+        output_buffers: "OutputBuffers",
+        failed_buffers: "OutputBuffers",
+        times: Optional[Dict[str, float]] = None):
+    """
+    Write the record tuples that pass all filters to output_buffers and the
+    others to failed_buffers. The filters are evaluated in order up to the
+    first that fails, as with the chained filters of filter_fastq, so their
+    counters are the same. The records are written as the filters left them,
+    so a failing record keeps the cuts of the trimming filters it passed.
+    When times is given, the filter, serialize and write times are added to
+    it.
+    """
+    if times is None:
+        for records_tuple in records:
+            passed = all(filter_func(records_tuple) for filter_func in filters)
+            serialized = [record.fastq_bytes() for record in records_tuple]
+            if passed:
+                output_buffers.write(serialized)
+            else:
+                failed_buffers.write(serialized)
+        return
+    perf_counter = time.perf_counter
+    for records_tuple in records:
+        start = perf_counter()
+        passed = all(filter_func(records_tuple) for filter_func in filters)
+        filtered_time = perf_counter()
+        serialized = [record.fastq_bytes() for record in records_tuple]
+        serialized_time = perf_counter()
+        if passed:
+            output_buffers.write(serialized)
+        else:
+            failed_buffers.write(serialized)
+        times["filter"] += filtered_time - start
+        times["serialize"] += serialized_time - filtered_time
+        times["write"] += perf_counter() - serialized_time
+
+
+class OutputBuffers:
+    """
+    Collects data for a set of output files and writes it in bulk. The data
+    for all files is written at the same time, once the buffer of one of the
+    files holds at least buffer_size bytes, so paired output files are
+    always written in step.
+    """
+    def __init__(self, outputs: List[BinaryIO],
+                 buffer_size: int = DEFAULT_OUTPUT_BUFFER_SIZE):
+        if buffer_size < 1:
+            raise ValueError(f"buffer_size must be at least 1, got "
+                             f"{buffer_size}.")
+        self.outputs = outputs
+        self.buffer_size = buffer_size
+        self.buffers = [bytearray() for _ in outputs]
+        self.buffered = False
+
+    def write(self, data: Sequence[Union[bytes, bytearray, memoryview]]):
+        """Add data for each of the outputs, in the order of the outputs."""
+        buffer_size = self.buffer_size
+        if not self.buffered and len(data[0]) * 2 >= buffer_size:
+            # Large data, such as the passing records of a chunk, is written
+            # as is rather than copied into the buffers first. Chunks are
+            # cut at record boundaries, so their passing records are usually
+            # a bit smaller than a full buffer.
+            for output, output_data in zip(self.outputs, data):
+                output.write(output_data)
+            return
+        full = False
+        for buffer, output_data in zip(self.buffers, data):
+            buffer += output_data
+            full |= len(buffer) >= buffer_size
+        self.buffered = True
+        if full:
+            self.flush()
+
+    def flush(self):
+        """Write the buffered data to the outputs."""
+        for output, buffer in zip(self.outputs, self.buffers):
+            if buffer:
+                output.write(buffer)
+                buffer.clear()
+        self.buffered = False
+
+
+def fastq_chunks(inputs: List[BinaryIO]) -> Iterator[List[bytes]]:
+    """
+    Read the FASTQ inputs in blocks and yield lists with a chunk for each
+    input. The chunks in a list contain the same number of complete records
+    and can be filtered independently of the other chunks.
+    """
+    buffers = [b""] * len(inputs)
+    at_eof = [False] * len(inputs)
+    made_progress = True
+    while not all(at_eof):
+        for i, input_h in enumerate(inputs):
+            # Files with longer records are consumed slower. Only top up
+            # buffers that are running low, unless no records could be
+            # processed at all because a record exceeds the buffer.
+            if at_eof[i] or (made_progress and
+                             len(buffers[i]) >= READ_BUFFER_SIZE):
+                continue
+            block = input_h.read(READ_BUFFER_SIZE)
+            if block:
+                buffers[i] += block
+            else:
+                at_eof[i] = True
+                # The last record may lack a terminating newline.
+                if buffers[i] and not buffers[i].endswith(b"\n"):
+                    buffers[i] += b"\n"
+        offsets = complete_record_offsets(buffers)
+        made_progress = any(offsets)
+        if made_progress:
+            yield [buffer[:n] for buffer, n in zip(buffers, offsets)]
+            buffers = [buffer[n:] for buffer, n in zip(buffers, offsets)]
+    if any(buffers):
+        if all(buffers):
+            raise dnaio.FastqFormatError(
+                "Premature end of file encountered.", line=None)
+        raise dnaio.FastqFormatError("Input files have an unequal number"
+                                     " of FASTQ records.", line=None)
+
+
+# Magic bytes of the compression formats that xopen can read.
+COMPRESSION_MAGICS = (b"\x1f\x8b", b"BZh", b"\xfd7zXZ\x00", b"\x28\xb5\x2f\xfd")
+COMPRESSION_EXTENSIONS = (".gz", ".bz2", ".xz", ".zst")
+
+
+def is_uncompressed_file(filename: str) -> bool:
+    """Check whether filename is a regular file that is not compressed."""
+    if filename == "-" or filename.endswith(COMPRESSION_EXTENSIONS):
+        return False
+    if not os.path.isfile(filename):
+        return False
+    with open(filename, "rb") as file_h:
+        start = file_h.read(6)
+    return not start.startswith(COMPRESSION_MAGICS)
+
+
+@contextlib.contextmanager
+def map_file(filename: str) -> Iterator[Union[mmap.mmap, bytes]]:
+    """
+    Memory map a file for reading. The kernel is advised that the mapping
+    is read sequentially, so it reads ahead aggressively.
+    """
+    with open(filename, "rb") as file_h:
+        if os.fstat(file_h.fileno()).st_size == 0:
+            # Empty files can not be mapped.
+            yield b""
+            return
+        mapping = mmap.mmap(file_h.fileno(), 0, access=mmap.ACCESS_READ)
+    for advice in ("MADV_SEQUENTIAL", "MADV_HUGEPAGE"):
+        if hasattr(mmap, advice):
+            try:
+                mapping.madvise(getattr(mmap, advice))
+            except OSError:  # Not all advice is supported for all files.
+                pass
+    try:
+        yield mapping
+    finally:
+        try:
+            mapping.close()
+        except BufferError:
+            # Chunks are still referenced, for instance by a traceback. The
+            # file is unmapped when the last of them is freed.
+            pass
+
+
+def mapped_fastq_chunks(mappings: Sequence[Union[mmap.mmap, bytes, memoryview]]
+                        ) -> Iterator[List[memoryview]]:
+    """
+    Yield lists with a chunk for each memory mapped FASTQ file, like
+    fastq_chunks. The chunks are views on the mappings, so the data is not
+    copied.
+    """
+    views = [memoryview(mapping) for mapping in mappings]
+    positions = [0] * len(views)
+    window = READ_BUFFER_SIZE
+    while True:
+        windows = [view[position:position + window]
+                   for view, position in zip(views, positions)]
+        offsets = complete_record_offsets(windows)
+        if any(offsets):
+            yield [chunk[:n] for chunk, n in zip(windows, offsets)]
+            positions = [position + n for position, n in zip(positions, offsets)]
+            window = READ_BUFFER_SIZE
+            continue
+        if all(position + len(chunk) == len(view) for position, chunk, view
+               in zip(positions, windows, views)):
+            break
+        # A record does not fit in the window.
+        window *= 2
+    # Only incomplete records are left. The last record may lack a
+    # terminating newline, which is added to a copy of the remainder.
+    remainder_sizes = [len(view) - position
+                       for view, position in zip(views, positions)]
+    if any(remainder_sizes) and not all(remainder_sizes):
+        raise dnaio.FastqFormatError("Input files have an unequal number"
+                                     " of FASTQ records.", line=None)
+    remainders = [bytes(view[position:])
+                  for view, position in zip(views, positions)]
+    remainders = [remainder + b"\n" if remainder and
+                  not remainder.endswith(b"\n") else remainder
+                  for remainder in remainders]
+    offsets = complete_record_offsets(remainders)
+    if any(offsets):
+        yield [memoryview(remainder)[:n]
+               for remainder, n in zip(remainders, offsets)]
+    left = [len(remainder) - n for remainder, n in zip(remainders, offsets)]
+    if any(left):
+        if all(left):
+            raise dnaio.FastqFormatError(
+                "Premature end of file encountered.", line=None)
+        raise dnaio.FastqFormatError("Input files have an unequal number"
+                                     " of FASTQ records.", line=None)
+
+
+def shard_chunks(stack: contextlib.ExitStack, input_files: List[str],
+                 shard: Tuple[int, int]
+                 ) -> Iterator[Sequence[Union[bytes, memoryview]]]:
+    """
+    Yield the chunks of a shard of the input files, like fastq_chunks.
+    Uncompressed files are memory mapped and the shard is a slice of the
+    mappings. The files are closed by the stack.
+    """
+    starts, ends = shard_range(input_files, *shard)
+    shard_ends = ends or [None] * len(starts)
+    if all(is_uncompressed_file(f) for f in input_files):
+        mappings = [stack.enter_context(map_file(input_file))
+                    for input_file in input_files]
+        return mapped_fastq_chunks([
+            memoryview(mapping)[sum(start):None if end is None else sum(end)]
+            for mapping, start, end in zip(mappings, starts, shard_ends)])
+    inputs = [stack.enter_context(ShardReader(input_file, start, end))
+              for input_file, start, end in zip(input_files, starts,
+                                                shard_ends)]
+    return fastq_chunks(inputs)  # type: ignore
+
+
+def filter_chunks_threaded(
+        filter_chunk: Callable[[Sequence[Union[bytes, memoryview]]], T],
+        chunks: Iterable[Sequence[Union[bytes, memoryview]]],
+        threads: int,
+        max_buffer_size: Optional[int] = None) -> Iterator[T]:
+    """
+    Filter the chunks with filter_chunk on multiple threads. The results are
+    yielded in the same order as the chunks.
+
+    :param max_buffer_size: The maximum number of bytes of the chunks in
+    flight, including their passing records and the result that was yielded
+    last. The next chunk is only read when a chunk of the largest size so far
+    fits, so a stalled consumer stops the reading. A single chunk is always
+    allowed, also when it is larger.
+    """
+    with concurrent.futures.ThreadPoolExecutor(threads) as executor:
+        # Limit the number of chunks in flight to bound the memory usage.
+        pending: collections.deque = collections.deque()
+        # The passing records of a chunk can be as large as the chunk, so
+        # each chunk is counted twice.
+        in_flight = 0
+        largest_chunk = 0
+        for chunk in chunks:
+            chunk_size = 2 * sum(len(part) for part in chunk)
+            largest_chunk = max(largest_chunk, chunk_size)
+            in_flight += chunk_size
+            pending.append((executor.submit(filter_chunk, chunk), chunk_size))
+            while pending and (
+                    len(pending) >= threads * 2 or
+                    (max_buffer_size is not None and
+                     in_flight + largest_chunk > max_buffer_size)):
+                future, chunk_size = pending.popleft()
+                # The result counts until the consumer asks for the next.
+                yield future.result()
+                in_flight -= chunk_size
+        while pending:
+            yield pending.popleft()[0].result()
+
+
+def filter_fastq_native(input_files: List[str], output_files: List[str],
+                        pipeline: FilterPipeline,
+                        compression_level: int = DEFAULT_COMPRESSION_LEVEL,
+                        threads: int = 1,
+                        compression_threads: int = 0,
+                        bgzf: bool = False,
+                        input_threads: int = 0,
+                        stage_times: Optional[Dict[str, float]] = None,
+                        output_buffer_size: int = DEFAULT_OUTPUT_BUFFER_SIZE,
+                        max_buffer_size: Optional[int] = None,
+                        shard: Optional[Tuple[int, int]] = None,
+                        failed_output_files: Optional[List[str]] = None):
+    """
+    Filter FASTQ input files with a FilterPipeline without creating Python
+    objects for each record. The FASTQ data is read in chunks and the passing
+    records are copied to the output files as is. Uncompressed input files
+    are memory mapped, so the chunks are filtered in place.
+
+    :param input_files: FASTQ input filenames. Compressed files are handled
+    automatically.
+    :param output_files: FASTQ output filenames. Compressed files are handled
+    automatically.
+    :param pipeline: The pipeline with filters to apply.
+    :param compression_level: Compression level for the output files (if
+    applicable)
+    :param threads: Number of threads used for filtering the chunks. The
+    output is written in input order regardless.
+    :param compression_threads: Number of threads used for compressing gzip
+    output files. 0 compresses on the main thread.
+    :param bgzf: Write gzip output files in the BGZF format.
+    :param input_threads: Number of threads used for decompressing gzip
+    input files. 0 decompresses on the main thread.
+    :param stage_times: When given, the time in seconds spent in each of the
+    STAGES is added to it. With multiple threads the parse and filter times
+    are summed over the threads.
+    :param output_buffer_size: The passing records of small chunks are
+    collected until this many bytes are buffered for one of the output files.
+    :param max_buffer_size: The maximum number of bytes of the chunks that
+    are being filtered by multiple threads, see filter_chunks_threaded.
+    :param shard: An (index, count) tuple to only filter shard index of
+    count shards of the input files, see filter_fastq.
+    :param failed_output_files: When given, the failing records are written
+    to these files, one for each input file. They are split off in the same
+    pipeline.filter_buffers call as the passing records.
+    """
+    if len(input_files) != len(output_files):
+        raise ValueError("Number of inputs and outputs should be equal.")
+    if (failed_output_files is not None and
+            len(input_files) != len(failed_output_files)):
+        raise ValueError("Number of inputs and failed outputs should be "
+                         "equal.")
+    if threads < 1:
+        raise ValueError(f"threads must be at least 1, got {threads}.")
+    if max_buffer_size is not None and max_buffer_size < 1:
+        raise ValueError(f"max_buffer_size must be at least 1, got "
+                         f"{max_buffer_size}.")
+    with contextlib.ExitStack() as stack:
+        chunks: Iterable[Sequence[Union[bytes, memoryview]]]
+        if shard is not None:
+            chunks = shard_chunks(stack, input_files, shard)
+        elif all(is_uncompressed_file(f) for f in input_files):
+            mappings = [stack.enter_context(map_file(input_file))
+                        for input_file in input_files]
+            chunks = mapped_fastq_chunks(mappings)
+        else:
+            inputs = [stack.enter_context(open_input(input_file,
+                                                     threads=input_threads))
+                      for input_file in input_files]
+            chunks = fastq_chunks(inputs)
+        outputs = [stack.enter_context(
+                   open_output(output_file, compression_level,
+                               compression_threads, bgzf))
+                   for output_file in output_files]
+        output_buffers = OutputBuffers(outputs, output_buffer_size)
+        failed_buffers: Optional[OutputBuffers] = None
+        if failed_output_files is not None:
+            failed_outputs = [stack.enter_context(
+                              open_output(output_file, compression_level,
+                                          compression_threads, bgzf))
+                              for output_file in failed_output_files]
+            failed_buffers = OutputBuffers(failed_outputs, output_buffer_size)
+        keep_failed = failed_buffers is not None
+
+        def filter_chunk(chunk: Sequence[Union[bytes, memoryview]]
+                         ) -> Tuple[Tuple[memoryview, ...],
+                                    Optional[Tuple[memoryview, ...]]]:
+            # The failing records are split off in the same call.
+            result = pipeline.filter_buffers(chunk, failed=keep_failed)
+            return result[0], (result[2] if keep_failed else None)
+        if stage_times is None:
+            if threads == 1:
+                results: Iterable[Tuple[Tuple[memoryview, ...],
+                                        Optional[Tuple[memoryview, ...]]]] = (
+                    map(filter_chunk, chunks))
+            else:
+                results = filter_chunks_threaded(filter_chunk, chunks, threads,
+                                                 max_buffer_size)
+            for passed, failed in results:
+                output_buffers.write(passed)
+                if failed_buffers is not None:
+                    failed_buffers.write(failed)  # type: ignore
+            output_buffers.flush()
+            if failed_buffers is not None:
+                failed_buffers.flush()
+            return
+        times: Dict[str, float] = dict.fromkeys(STAGES, 0.0)
+        perf_counter = time.perf_counter
+        filter_time = sum(filter_func.time for filter_func in pipeline.filters)
+
+        def timed_filter_chunk(chunk: Sequence[Union[bytes, memoryview]]
+                               ) -> Tuple[Tuple[memoryview, ...],
+                                          Optional[Tuple[memoryview, ...]],
+                                          float]:
+            start = perf_counter()
+            passed, failed = filter_chunk(chunk)
+            return passed, failed, perf_counter() - start
+        chunks = timed_iterator(chunks, times, "read")
+        if threads == 1:
+            timed_results: Iterable[Tuple[Tuple[memoryview, ...],
+                                          Optional[Tuple[memoryview, ...]],
+                                          float]] = map(timed_filter_chunk,
+                                                        chunks)
+        else:
+            timed_results = filter_chunks_threaded(timed_filter_chunk, chunks,
+                                                   threads, max_buffer_size)
+        for passed, failed, chunk_time in timed_results:
+            times["parse"] += chunk_time
+            start = perf_counter()
+            output_buffers.write(passed)
+            if failed_buffers is not None:
+                failed_buffers.write(failed)  # type: ignore
+            times["write"] += perf_counter() - start
+        # The filters are evaluated while parsing, so their time is moved
+        # from the parse stage to the filter stage.
+        filter_time = sum(filter_func.time
+                          for filter_func in pipeline.filters) - filter_time
+        times["parse"] -= filter_time
+        times["filter"] += filter_time
+        write_start = perf_counter()
+        output_buffers.flush()
+        if failed_buffers is not None:
+            failed_buffers.flush()
+    # Closing flushes the last compressed data.
+    times["write"] += perf_counter() - write_start
+    for stage, stage_time in times.items():
+        stage_times[stage] = stage_times.get(stage, 0.0) + stage_time
 
 
 def initiate_logger(verbose: int = 0, quiet: int = 0):
@@ -173,6 +807,13 @@ def initiate_logger(verbose: int = 0, quiet: int = 0):
     logger.addHandler(console_handler)
 
 
+def shard_argument(value: str) -> Tuple[int, int]:
+    try:
+        return parse_shard(value)
+    except ValueError as error:
+        raise argparse.ArgumentTypeError(str(error))
+
+
 def argument_parser() -> argparse.ArgumentParser:
     parser = argparse.ArgumentParser()
     parser.description = "Filter FASTQ files on various metrics."
@@ -186,10 +827,23 @@ def argument_parser() -> argparse.ArgumentParser:
                              "Flag can be used multiple times. An output must "
                              "be given for each input. Default: stdout.",
                         action='append')
+    parser.add_argument("--failed-output", metavar="FAILED_OUTPUT",
+                        help="Write the reads that fail the filters to this "
+                             "file. Flag can be used multiple times, once "
+                             "for each input. The reads are split off in the "
+                             "same pass as the passing reads.",
+                        action='append')
     parser.add_argument("-l", "--min-length", type=int,
                         help="The minimum length for a read.")
     parser.add_argument("-L", "--max-length", type=int,
                         help="The maximum length for a read.")
+    parser.add_argument("--max-n", type=float,
+                        help="The maximum number of N bases in a read. A "
+                             "number below 1 is a fraction of the read "
+                             "length.")
+    parser.add_argument("--max-homopolymer", type=int,
+                        help="The maximum length of a run of the same base "
+                             "in a read, such as a poly-G tail.")
     parser.add_argument("-e", "--average-error-rate", type=float,
                         help="The minimum average per base error rate.")
     parser.add_argument("-q", "--mean-quality", type=int,
@@ -199,16 +853,85 @@ def argument_parser() -> argparse.ArgumentParser:
                              "to '-e 0.001'.")
     parser.add_argument("-Q", "--median-quality", type=int,
                         help="The minimum median phred score.")
+    parser.add_argument("-w", "--window-quality", type=int,
+                        help="The minimum mean quality of every window of "
+                             "--window-size bases in a read. Reads with a "
+                             "window of lower quality are rejected.")
+    parser.add_argument("--window-size", type=int, default=4,
+                        help="The number of bases in a window for "
+                             "'--window-quality'. Default: 4.")
+    parser.add_argument("--window-trim", action="store_true",
+                        help="Cut the reads at the start of the first window "
+                             "that fails '--window-quality' instead of "
+                             "rejecting them. The other filters check the "
+                             "cut reads. The windows are checked from the "
+                             "start, also with '--tail-first'.")
+    parser.add_argument("--tail-first", action="store_true",
+                        help="Scan the qualities from the end of the reads "
+                             "for the quality filters. Reads with low "
+                             "quality tails are rejected faster.")
+    parser.add_argument("--fixed-point", action="store_true",
+                        help="Sum the error rates for the average error rate "
+                             "and mean quality filters in fixed-point "
+                             "integers instead of doubles. The average error "
+                             "rate may deviate up to 3e-8 from the exact "
+                             "value.")
     parser.add_argument("-c", "--compression-level", type=int,
                         default=DEFAULT_COMPRESSION_LEVEL,
                         help=f"Compression level for the output files. "
                              f"Relevant when output files have a .gz "
                              f"extension. Default: {DEFAULT_COMPRESSION_LEVEL}"
                         )
+    parser.add_argument("--input-threads", type=int, default=0,
+                        help="Number of threads used for decompressing gzip "
+                             "input files. With 0 the input is decompressed "
+                             "on the main thread. BGZF input is decompressed "
+                             "in parallel when more than 1 thread is given. "
+                             "Default: 0.")
+    parser.add_argument("--compression-threads", type=int, default=0,
+                        help="Number of threads used for compressing gzip "
+                             "output files. With 0 the output is compressed "
+                             "on the main thread. Default: 0.")
+    parser.add_argument("--bgzf", action="store_true",
+                        help="Write gzip output files in the BGZF format, so "
+                             "they can be indexed.")
+    parser.add_argument("--output-buffer-size", type=int,
+                        default=DEFAULT_OUTPUT_BUFFER_SIZE,
+                        help=f"Number of bytes of passing records that are "
+                             f"collected before they are written. Default: "
+                             f"{DEFAULT_OUTPUT_BUFFER_SIZE}.")
+    parser.add_argument("-t", "--threads", type=int, default=1,
+                        help="Number of threads used for filtering. The "
+                             "order of the reads is preserved. Default: 1.")
+    parser.add_argument("--max-buffer-mb", type=int,
+                        help="The maximum size in MiB of the FASTQ data that "
+                             "is being filtered by the threads. Reading "
+                             "input pauses while it is reached, for instance "
+                             "when the output is not consumed. Default: no "
+                             "limit other than 2 chunks per thread.")
+    parser.add_argument("--shard", type=shard_argument, metavar="I/N",
+                        help="Only filter shard I of N shards of the input "
+                             "files, counting from 0. The shards can be "
+                             "filtered on different machines and combined "
+                             "with fastq-filter-merge. Requires uncompressed "
+                             "or BGZF input files.")
+    parser.add_argument("--auto-order", action="store_true",
+                        help="Time the filters on a sample of the reads and "
+                             "evaluate the filters that reject the most "
+                             "reads for their cost first. Without this flag "
+                             "the filters are evaluated from low to high "
+                             "expected cost.")
     parser.add_argument("--verbose", action="count", default=0,
-                        help="Report stats on individual filters.")
+                        help="Report stats on individual filters and the "
+                             "time spent reading, parsing, filtering and "
+                             "writing.")
     parser.add_argument("--quiet", action="count", default=0,
                         help="Turn of logging output.")
+    parser.add_argument("--json-report", metavar="FILE",
+                        help="Write a JSON report with the counts and times "
+                             "of each filter and stage, and histograms of "
+                             "the length and mean quality of the passed and "
+                             "failed reads.")
     return parser
 
 
@@ -221,41 +944,202 @@ def main():
     log = logging.getLogger("fastq-filter")
     log.info(f"input files: {', '.join(args.input)}")
     log.info(f"output files: {', '.join(output)}")
+    if args.failed_output:
+        log.info(f"failed output files: {', '.join(args.failed_output)}")
 
-    # Filters are ordered from low cost to high cost.
+    # The stages are only timed when they are reported.
+    timed = args.verbose > 0 or args.json_report is not None
+    # Filters are ordered from low cost to high cost. A trimming filter goes
+    # first, so the other filters check the trimmed reads.
+    if args.window_quality and args.window_trim:
+        error_rate = 10 ** -(args.window_quality / 10)
+        filters.append(SlidingWindowErrorRateFilter(
+            error_rate, args.window_size, timed=timed, trim=True))
     if args.min_length:
-        filters.append(MinimumLengthFilter(args.min_length))
+        filters.append(MinimumLengthFilter(args.min_length, timed=timed))
     if args.max_length:
-        filters.append(MaximumLengthFilter(args.max_length))
+        filters.append(MaximumLengthFilter(args.max_length, timed=timed))
+    if args.max_n is not None:
+        filters.append(MaximumNFilter(args.max_n, timed=timed))
+    if args.max_homopolymer is not None:
+        filters.append(MaximumHomopolymerFilter(args.max_homopolymer,
+                                                timed=timed))
     if args.average_error_rate:
-        filters.append(AverageErrorRateFilter(args.average_error_rate))
+        filters.append(AverageErrorRateFilter(args.average_error_rate,
+                                              tail_first=args.tail_first,
+                                              fixed_point=args.fixed_point,
+                                              timed=timed))
     if args.mean_quality:
         error_rate = 10 ** -(args.mean_quality / 10)
-        filters.append(AverageErrorRateFilter(error_rate))
+        filters.append(AverageErrorRateFilter(error_rate,
+                                              tail_first=args.tail_first,
+                                              fixed_point=args.fixed_point,
+                                              timed=timed))
     if args.median_quality:
-        filters.append(MedianQualityFilter(args.median_quality))
+        filters.append(MedianQualityFilter(args.median_quality,
+                                           tail_first=args.tail_first,
+                                           timed=timed))
+    if args.window_quality and not args.window_trim:
+        error_rate = 10 ** -(args.window_quality / 10)
+        filters.append(SlidingWindowErrorRateFilter(
+            error_rate, args.window_size, tail_first=args.tail_first,
+            timed=timed))
     for filter in filters:
         log.info(f"{filter.name}: {filter.threshold}")
     if not filters:
         log.warning("No filters were applied. Was this intentional?")
 
-    filter_fastq(filters=filters,
-                 input_files=args.input,
-                 output_files=output,
-                 compression_level=args.compression_level)
+    stage_times: Optional[Dict[str, float]] = {} if timed else None
+    statistics: Optional[Dict[str, Any]] = (
+        {} if args.json_report is not None else None)
+    max_buffer_size = (args.max_buffer_mb * 1024 * 1024
+                       if args.max_buffer_mb is not None else None)
+    start = time.perf_counter()
+    counts = filter_fastq(filters=filters,
+                          input_files=args.input,
+                          output_files=output,
+                          compression_level=args.compression_level,
+                          threads=args.threads,
+                          compression_threads=args.compression_threads,
+                          bgzf=args.bgzf,
+                          input_threads=args.input_threads,
+                          stage_times=stage_times,
+                          statistics=statistics,
+                          output_buffer_size=args.output_buffer_size,
+                          max_buffer_size=max_buffer_size,
+                          shard=args.shard,
+                          auto_order=args.auto_order,
+                          failed_output_files=args.failed_output)
+    wall_time = time.perf_counter() - start
+    if counts is None and filters:
+        counts = (filters[0].total, filters[-1].passed)
 
-    if filters:
-        total = filters[0].total
-        passed = filters[-1].passed
+    if counts is not None and filters:
+        total, passed = counts
         failed = total - passed
         log.info(f"processed {total} reads.")
-        log.info(f"passed: {passed} ({passed * 100 / total :.2f}%)")
-        log.info(f"failed: {failed} ({failed * 100 / total :.2f}%)")
+        log.info(f"passed: {passed} ({percentage(passed, total)})")
+        log.info(f"failed: {failed} ({percentage(failed, total)})")
 
     for filter in filters:
         log.debug(f"{filter.name}: "
                   f"{filter.total} processed, {filter.passed} passed "
-                  f"({filter.passed * 100 / filter.total :.2f}%)")
+                  f"({percentage(filter.passed, filter.total)})")
+
+    if args.verbose > 0 and stage_times is not None:
+        log_stage_times(log, stage_times, filters, wall_time,
+                        counts[0] if counts is not None else 0)
+
+    if args.json_report is not None:
+        report = json_report(args.input, output, filters, wall_time,
+                             stage_times or {}, statistics or {}, args.shard,
+                             counts)
+        with open(args.json_report, "wt") as report_file:
+            json.dump(report, report_file, indent=2)
+            report_file.write("\n")
+
+
+def percentage(count: int, total: int) -> str:
+    """
+    Format count as a percentage of total, or "-" when total is 0. A shard
+    or a filter after one that rejected every read can have no reads.
+    """
+    return f"{count * 100 / total:.2f}%" if total else "-"
+
+
+def log_stage_times(log: logging.Logger, stage_times: Dict[str, float],
+                    filters: List[Callable], wall_time: float,
+                    reads: Optional[int] = None):
+    """
+    Log the time, share of wall time and throughput of each stage. reads is
+    the number of processed reads, by default the total of the first filter.
+    """
+    if reads is None:
+        reads = filters[0].total if filters else 0
+    log.debug(f"wall time: {wall_time:.3f}s")
+    timings = [(stage, stage_time, reads)
+               for stage, stage_time in stage_times.items()]
+    timings.extend((f"filter {filter_func.name}", filter_func.time,
+                    filter_func.total) for filter_func in filters)
+    for stage, stage_time, stage_reads in timings:
+        share = stage_time * 100 / wall_time if wall_time else 0.0
+        reads_per_second = (f"{stage_reads / stage_time:,.0f} reads/s"
+                            if stage_time > 0 else "-")
+        log.debug(f"{stage}: {stage_time:.3f}s ({share:.1f}% of wall time), "
+                  f"{reads_per_second}")
+
+
+def json_report(input_files: List[str], output_files: List[str],
+                filters: List[Callable], wall_time: float,
+                stage_times: Dict[str, float], statistics: Dict[str, Any],
+                shard: Optional[Tuple[int, int]] = None,
+                counts: Optional[Tuple[int, int]] = None) -> Dict[str, Any]:
+    """
+    Create the report written with --json-report. Times are in seconds. The
+    statistics are the histograms collected by the FilterPipeline. counts
+    are the numbers of processed and passed reads, by default those of the
+    first and last filter.
+    """
+    if counts is None and filters:
+        counts = (filters[0].total, filters[-1].passed)
+    return {
+        "shard": f"{shard[0]}/{shard[1]}" if shard is not None else None,
+        "input_files": input_files,
+        "output_files": output_files,
+        "total": counts[0] if counts is not None and filters else None,
+        "passed": counts[1] if counts is not None and filters else None,
+        "wall_time": wall_time,
+        "stage_times": stage_times,
+        "filters": [
+            {"name": filter_func.name,
+             "threshold": filter_func.threshold,
+             "total": filter_func.total,
+             "passed": filter_func.passed,
+             "time": filter_func.time}
+            for filter_func in filters
+        ],
+        "histograms": statistics,
+    }
+
+
+def merge_argument_parser() -> argparse.ArgumentParser:
+    parser = argparse.ArgumentParser()
+    parser.description = ("Combine the outputs and reports of the shards of a "
+                          "fastq-filter run made with --shard.")
+    parser.add_argument("input", nargs="*",
+                        help="The output files of the shards of one input "
+                             "file, in shard order. For paired files the "
+                             "outputs of each file are merged separately.")
+    parser.add_argument("-o", "--output", default="-",
+                        help="The merged output file. The shard outputs are "
+                             "concatenated as is, so it should have the same "
+                             "compression format. Default: stdout.")
+    parser.add_argument("--report", metavar="FILE", action="append",
+                        default=[],
+                        help="A JSON report of a shard. Flag can be used "
+                             "multiple times, in shard order.")
+    parser.add_argument("--json-report", metavar="FILE",
+                        help="Write the sums of the counts, times and "
+                             "histograms in the shard reports to this file.")
+    return parser
+
+
+def merge_main():
+    args = merge_argument_parser().parse_args()
+    if args.input:
+        if args.output == "-":
+            merge_files(args.input, sys.stdout.buffer)
+        else:
+            with open(args.output, "wb") as output_h:
+                merge_files(args.input, output_h)
+    if args.json_report is not None:
+        reports = []
+        for report_file in args.report:
+            with open(report_file, "rt") as report_h:
+                reports.append(json.load(report_h))
+        with open(args.json_report, "wt") as report_h:
+            json.dump(merge_reports(reports), report_h, indent=2)
+            report_h.write("\n")
 
 
 if __name__ == "__main__":  # pragma: no cover
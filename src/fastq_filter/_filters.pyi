@@ -18,41 +18,151 @@
 # OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 # SOFTWARE.
 
-from typing import Tuple, Union
+from typing import (Any, Dict, Iterable, List, Literal, Optional, Sequence,
+                    Tuple, TypeVar, Union, overload)
 
 from dnaio import SequenceRecord
 
 DEFAULT_PHRED_SCORE_OFFSET: int = ...
+# The selected phred and sequence kernels: "scalar", "sse2", "avx2" or "neon".
+KERNELS: str = ...
+
+# Any object supporting the buffer protocol with one byte items is accepted.
+_Buffer = Union[bytes, bytearray, memoryview]
+_PhredScores = Union[str, _Buffer]
+# A writable buffer of float64 values, such as array.array("d") or a NumPy
+# array.
+_Out = TypeVar("_Out", bound=Any)
 
 class _Filter:
     threshold: Union[int, float]
     passed: int
     total: int
+    time: float
+    timed: bool
     name: str
 
     def __init__(self): ...
 
     def __call__(self, __records: Tuple[SequenceRecord, ...]) -> bool: ...
 
+    def filter_batch(self, __record_tuples: Sequence[Tuple[SequenceRecord, ...]]
+                     ) -> bytes: ...
+
 class _QualityFilter(_Filter):
     phred_offset: int
+    tail_first: bool
 
-    def __init__(self, threshold: float,
-                 phred_offset: int = DEFAULT_PHRED_SCORE_OFFSET): ...
+    def __init__(self, threshold: float, *,
+                 phred_offset: int = DEFAULT_PHRED_SCORE_OFFSET,
+                 tail_first: bool = False,
+                 timed: bool = False): ...
 
 
 class _LengthFilter(_Filter):
-    def __init__(self, threshold: int): ...
+    def __init__(self, threshold: int, *, timed: bool = False): ...
+
+
+class AverageErrorRateFilter(_QualityFilter):
+    fixed_point: bool
+
+    def __init__(self, threshold: float, *,
+                 phred_offset: int = DEFAULT_PHRED_SCORE_OFFSET,
+                 tail_first: bool = False,
+                 timed: bool = False,
+                 fixed_point: bool = False): ...
 
 
-class AverageErrorRateFilter(_QualityFilter): ...
 class MedianQualityFilter(_QualityFilter): ...
 class MinimumLengthFilter(_LengthFilter): ...
 class MaximumLengthFilter(_LengthFilter): ...
 
-def qualmean(phred_scores: str, phred_offset: int = DEFAULT_PHRED_SCORE_OFFSET): ...
 
-def qualmedian(phred_scores: str, phred_offset: int = DEFAULT_PHRED_SCORE_OFFSET): ...
+class SlidingWindowErrorRateFilter(_QualityFilter):
+    window_size: int
+    trim: bool
+
+    def __init__(self, threshold: float, window_size: int = 4, *,
+                 phred_offset: int = DEFAULT_PHRED_SCORE_OFFSET,
+                 tail_first: bool = False,
+                 timed: bool = False,
+                 trim: bool = False): ...
+
+
+class MaximumNFilter(_Filter):
+    threshold: float
+
+    def __init__(self, threshold: float, *, timed: bool = False): ...
+
+
+class MaximumHomopolymerFilter(_LengthFilter): ...
+
+
+class FilterPipeline:
+    filters: Tuple[_Filter, ...]
+    statistics: Optional[Dict[str, Dict[str, List[List[int]]]]]
+    total: int
+    passed: int
+    auto_order: bool
+
+    def __init__(self, filters: Iterable[_Filter], *,
+                 statistics: bool = False, auto_order: bool = False): ...
+
+    def __call__(self, __records: Tuple[SequenceRecord, ...]) -> bool: ...
+
+    def filter_batch(self, __record_tuples: Sequence[Tuple[SequenceRecord, ...]]
+                     ) -> bytes: ...
+
+    @overload
+    def filter_buffers(self, __buffers: Sequence[_Buffer], *,
+                       failed: Literal[False] = False
+                       ) -> Tuple[Tuple[memoryview, ...], Tuple[int, ...]]: ...
+    @overload
+    def filter_buffers(self, __buffers: Sequence[_Buffer], *,
+                       failed: Literal[True]
+                       ) -> Tuple[Tuple[memoryview, ...], Tuple[int, ...],
+                                  Tuple[memoryview, ...]]: ...
 
-def average_error_rate(phred_scores: str,
+def qualmean(phred_scores: _PhredScores,
+             phred_offset: int = DEFAULT_PHRED_SCORE_OFFSET): ...
+
+def qualmedian(phred_scores: _PhredScores,
+               phred_offset: int = DEFAULT_PHRED_SCORE_OFFSET): ...
+
+def average_error_rate(phred_scores: _PhredScores,
                        phred_offset: int = DEFAULT_PHRED_SCORE_OFFSET): ...
+
+@overload
+def qualmean_batch(phred_scores: Union[_PhredScores, Sequence[_PhredScores]],
+                   phred_offset: int = DEFAULT_PHRED_SCORE_OFFSET, *,
+                   offsets: Optional[Any] = None, out: None = None
+                   ) -> List[float]: ...
+@overload
+def qualmean_batch(phred_scores: Union[_PhredScores, Sequence[_PhredScores]],
+                   phred_offset: int = DEFAULT_PHRED_SCORE_OFFSET, *,
+                   offsets: Optional[Any] = None, out: _Out
+                   ) -> _Out: ...
+
+@overload
+def qualmedian_batch(phred_scores: Union[_PhredScores, Sequence[_PhredScores]],
+                     phred_offset: int = DEFAULT_PHRED_SCORE_OFFSET, *,
+                     offsets: Optional[Any] = None, out: None = None
+                     ) -> List[float]: ...
+@overload
+def qualmedian_batch(phred_scores: Union[_PhredScores, Sequence[_PhredScores]],
+                     phred_offset: int = DEFAULT_PHRED_SCORE_OFFSET, *,
+                     offsets: Optional[Any] = None, out: _Out
+                     ) -> _Out: ...
+
+@overload
+def average_error_rate_batch(phred_scores: Union[_PhredScores, Sequence[_PhredScores]],
+                             phred_offset: int = DEFAULT_PHRED_SCORE_OFFSET, *,
+                             offsets: Optional[Any] = None, out: None = None
+                             ) -> List[float]: ...
+@overload
+def average_error_rate_batch(phred_scores: Union[_PhredScores, Sequence[_PhredScores]],
+                             phred_offset: int = DEFAULT_PHRED_SCORE_OFFSET, *,
+                             offsets: Optional[Any] = None, out: _Out
+                             ) -> _Out: ...
+
+def complete_record_offsets(__buffers: Sequence[_Buffer]) -> Tuple[int, ...]: ...
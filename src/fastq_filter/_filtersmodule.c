@@ -24,66 +24,690 @@
 
 #include "structmember.h"
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
 #include "score_to_error_rate.h"
 #define MAXIMUM_PHRED_SCORE 126
 #define DEFAULT_PHRED_SCORE_OFFSET 33
 
 
-static inline double 
-sum_error_rate(const uint8_t *phred_scores, size_t phred_length, uint8_t phred_offset) {
-    double total_error_rate = 0.0;
-    uint8_t score;
+/*
+ * Phred kernels
+ * =============
+ * The quality strings are first validated as a whole, after which the error
+ * rates or histogram counts are accumulated without any per-byte checks.
+ * Validation is vectorized with SSE2 or AVX2 on x86-64 and with NEON on
+ * AArch64. On x86-64 the AVX2 kernel is only used when the CPU supports it,
+ * which is checked once at module initialization. The KERNELS module
+ * constant names the selected kernels.
+ * The error rates are summed with scalar lookups. A gather based AVX2 sum was
+ * measured to be slower than the lookups on CPUs with gather mitigations.
+ */
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#if defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_AVX2 1
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+static int
+phred_scores_valid_scalar(const uint8_t *phred_scores, size_t phred_length,
+                          uint8_t phred_offset)
+{
     uint8_t max_score = MAXIMUM_PHRED_SCORE - phred_offset;
-    for (size_t i=0; i<phred_length; i+=1) {
-        score = phred_scores[i] - phred_offset;
-        if (score > max_score) {
-            PyErr_Format(
-                PyExc_ValueError,
-                "Character %c outside of valid phred range ('%c' to '%c')",
-                phred_scores[i], phred_offset, MAXIMUM_PHRED_SCORE);
-            return -1.0L;
+    int invalid = 0;
+    for (size_t i=0; i < phred_length; i+=1) {
+        invalid |= (uint8_t)(phred_scores[i] - phred_offset) > max_score;
+    }
+    return !invalid;
+}
+
+#ifdef HAVE_SSE2
+static int
+phred_scores_valid_sse2(const uint8_t *phred_scores, size_t phred_length,
+                        uint8_t phred_offset)
+{
+    __m128i offset = _mm_set1_epi8((char)phred_offset);
+    __m128i max_score = _mm_set1_epi8((char)(MAXIMUM_PHRED_SCORE - phred_offset));
+    __m128i invalid = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= phred_length; i += 16) {
+        __m128i phreds = _mm_loadu_si128((const __m128i *)(phred_scores + i));
+        __m128i scores = _mm_sub_epi8(phreds, offset);
+        // Scores above the maximum are changed by the unsigned minimum.
+        invalid = _mm_or_si128(
+            invalid, _mm_xor_si128(_mm_min_epu8(scores, max_score), scores));
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(invalid, _mm_setzero_si128())) != 0xFFFF) {
+        return 0;
+    }
+    return phred_scores_valid_scalar(phred_scores + i, phred_length - i, phred_offset);
+}
+#endif
+
+#ifdef HAVE_AVX2
+TARGET_AVX2 static int
+phred_scores_valid_avx2(const uint8_t *phred_scores, size_t phred_length,
+                        uint8_t phred_offset)
+{
+    __m256i offset = _mm256_set1_epi8((char)phred_offset);
+    __m256i max_score = _mm256_set1_epi8((char)(MAXIMUM_PHRED_SCORE - phred_offset));
+    __m256i invalid = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= phred_length; i += 32) {
+        __m256i phreds = _mm256_loadu_si256((const __m256i *)(phred_scores + i));
+        __m256i scores = _mm256_sub_epi8(phreds, offset);
+        invalid = _mm256_or_si256(
+            invalid, _mm256_xor_si256(_mm256_min_epu8(scores, max_score), scores));
+    }
+    if (!_mm256_testz_si256(invalid, invalid)) {
+        return 0;
+    }
+    return phred_scores_valid_sse2(phred_scores + i, phred_length - i, phred_offset);
+}
+#endif
+
+#ifdef HAVE_NEON
+static int
+phred_scores_valid_neon(const uint8_t *phred_scores, size_t phred_length,
+                        uint8_t phred_offset)
+{
+    uint8x16_t offset = vdupq_n_u8(phred_offset);
+    uint8x16_t max_score = vdupq_n_u8(MAXIMUM_PHRED_SCORE - phred_offset);
+    uint8x16_t invalid = vdupq_n_u8(0);
+    size_t i = 0;
+    for (; i + 16 <= phred_length; i += 16) {
+        uint8x16_t scores = vsubq_u8(vld1q_u8(phred_scores + i), offset);
+        invalid = vorrq_u8(invalid, vcgtq_u8(scores, max_score));
+    }
+    if (vmaxvq_u8(invalid) != 0) {
+        return 0;
+    }
+    return phred_scores_valid_scalar(phred_scores + i, phred_length - i, phred_offset);
+}
+#endif
+
+/**
+ * @brief Sums the error rates of phred scores that are known to be valid.
+ * Four independent accumulators are used so the additions do not have to
+ * wait on each other. The result may differ from a sequential sum in the
+ * last bits due to the different order of additions.
+ */
+static double
+sum_valid_error_rate(const uint8_t *phred_scores, size_t phred_length,
+                            uint8_t phred_offset)
+{
+    double sum0 = 0.0, sum1 = 0.0, sum2 = 0.0, sum3 = 0.0;
+    size_t i = 0;
+    for (; i + 4 <= phred_length; i += 4) {
+        sum0 += SCORE_TO_ERROR_RATE[phred_scores[i] - phred_offset];
+        sum1 += SCORE_TO_ERROR_RATE[phred_scores[i + 1] - phred_offset];
+        sum2 += SCORE_TO_ERROR_RATE[phred_scores[i + 2] - phred_offset];
+        sum3 += SCORE_TO_ERROR_RATE[phred_scores[i + 3] - phred_offset];
+    }
+    for (; i < phred_length; i += 1) {
+        sum0 += SCORE_TO_ERROR_RATE[phred_scores[i] - phred_offset];
+    }
+    return (sum0 + sum1) + (sum2 + sum3);
+}
+
+/*
+ * Error rate tables
+ * =================
+ * Quality filters build a table with the error rate of every possible byte
+ * at construction time, so the summation is a single lookup per byte without
+ * subtracting the phred offset. Bytes that are not valid phred scores for the
+ * offset map to a sentinel. The scores are validated before they are summed,
+ * so the sentinels are never added, but they make any sum that does include
+ * one stand out: NaN never compares as at most the threshold and the
+ * fixed-point sentinel alone is larger than the sum of a whole block of valid
+ * scores.
+ *
+ * In fixed-point mode the error rates are stored as integers scaled by
+ * 2 ** ERROR_RATE_FIXED_POINT_BITS, rounded to the nearest integer. The
+ * integer summation itself is exact, so the only error is the rounding of
+ * each table entry, which is at most 2 ** -(ERROR_RATE_FIXED_POINT_BITS + 1)
+ * per score. The average error rate therefore differs from the exact value by
+ * at most 2 ** -25, about 3.0e-8, regardless of the read length. Only reads
+ * whose average error rate is this close to the threshold can have a
+ * different outcome than with double precision.
+ */
+#define ERROR_RATE_FIXED_POINT_BITS 24
+#define ERROR_RATE_FIXED_POINT_INVALID UINT32_MAX
+
+static void
+error_rate_table_init(double *table, uint8_t phred_offset)
+{
+    for (int c=0; c < 256; c++) {
+        if (c >= phred_offset && c <= MAXIMUM_PHRED_SCORE) {
+            table[c] = SCORE_TO_ERROR_RATE[c - phred_offset];
+        } else {
+            table[c] = Py_NAN;
+        }
+    }
+}
+
+static void
+fixed_point_error_rate_table_init(uint32_t *table, uint8_t phred_offset)
+{
+    double scale = (double)(1 << ERROR_RATE_FIXED_POINT_BITS);
+    for (int c=0; c < 256; c++) {
+        if (c >= phred_offset && c <= MAXIMUM_PHRED_SCORE) {
+            table[c] = (uint32_t)lround(SCORE_TO_ERROR_RATE[c - phred_offset] * scale);
+        } else {
+            table[c] = ERROR_RATE_FIXED_POINT_INVALID;
         }
-        total_error_rate += SCORE_TO_ERROR_RATE[score];
     }
-    return total_error_rate;
 }
 
 /**
- * @brief Returns the average error rate based on an array of phred scores. 
- * 
- * @param phred_scores The array of phred scores.
- * @param phred_length The length of the phred scores array.
- * @param phred_offset The offset for the phred scores
- * @return double The average error rate or -1.0L on error.
+ * @brief Sums the error rates of phred scores using a table indexed by the
+ * raw byte. Uses four accumulators like sum_valid_error_rate.
  */
-static inline double 
-average_error_rate(const uint8_t *phred_scores, size_t phred_length, uint8_t phred_offset)
+static double
+sum_error_rate_table(const uint8_t *phred_scores, size_t phred_length,
+                     const double *table)
 {
-    double total_error_rate = sum_error_rate(phred_scores, phred_length, phred_offset);
-    if (total_error_rate < 0.0) {
-        return -1.0L;
+    double sum0 = 0.0, sum1 = 0.0, sum2 = 0.0, sum3 = 0.0;
+    size_t i = 0;
+    for (; i + 4 <= phred_length; i += 4) {
+        sum0 += table[phred_scores[i]];
+        sum1 += table[phred_scores[i + 1]];
+        sum2 += table[phred_scores[i + 2]];
+        sum3 += table[phred_scores[i + 3]];
+    }
+    for (; i < phred_length; i += 1) {
+        sum0 += table[phred_scores[i]];
     }
-    return total_error_rate / (double)phred_length;
+    return (sum0 + sum1) + (sum2 + sum3);
 }
 
-static inline int 
-make_histogram(size_t *histogram, const uint8_t *phred_scores, size_t phred_length, uint8_t phred_offset) 
+/*
+ * Without a gather instruction GCC vectorizes the fixed-point lookups by
+ * inserting the loaded values into vector lanes one by one, which was
+ * measured to be about 40% slower than the scalar lookups.
+ */
+#if defined(__GNUC__) && !defined(__clang__)
+#define NO_TREE_VECTORIZE __attribute__((optimize("no-tree-vectorize")))
+#else
+#define NO_TREE_VECTORIZE
+#endif
+
+/**
+ * @brief Sums the fixed-point error rates of phred scores using a table
+ * indexed by the raw byte. Integer additions are associative, so unlike the
+ * double sum the result does not depend on the order of the additions.
+ */
+NO_TREE_VECTORIZE static uint64_t
+sum_fixed_point_error_rate_table(const uint8_t *phred_scores,
+                                 size_t phred_length, const uint32_t *table)
 {
-    uint8_t score;
-    uint8_t max_score = MAXIMUM_PHRED_SCORE - phred_offset;
+    uint64_t sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+    size_t i = 0;
+    for (; i + 4 <= phred_length; i += 4) {
+        sum0 += table[phred_scores[i]];
+        sum1 += table[phred_scores[i + 1]];
+        sum2 += table[phred_scores[i + 2]];
+        sum3 += table[phred_scores[i + 3]];
+    }
+    for (; i < phred_length; i += 1) {
+        sum0 += table[phred_scores[i]];
+    }
+    return sum0 + sum1 + sum2 + sum3;
+}
 
-    for (size_t i=0; i < phred_length; i+= 1) {
-        score = phred_scores[i] - phred_offset;
-        if (score > max_score) {
+static int (*phred_scores_valid)(const uint8_t *, size_t, uint8_t) =
+    phred_scores_valid_scalar;
+
+static size_t
+count_phreds_below_scalar(const uint8_t *phred_scores, size_t phred_length,
+                          uint8_t raw_threshold)
+{
+    size_t count = 0;
+    for (size_t i=0; i < phred_length; i+=1) {
+        count += phred_scores[i] < raw_threshold;
+    }
+    return count;
+}
+
+/*
+ * The vectorized counters are only called on valid phred scores, which are
+ * all below 127, with a threshold of at most 127. A signed byte comparison
+ * can therefore be used. Each lane of the accumulator must not overflow, so
+ * these functions are called with at most MEDIAN_COUNT_BLOCK_SIZE bytes.
+ */
+#define MEDIAN_COUNT_BLOCK_SIZE 256
+
+#ifdef HAVE_SSE2
+static size_t
+count_phreds_below_sse2(const uint8_t *phred_scores, size_t phred_length,
+                        uint8_t raw_threshold)
+{
+    __m128i threshold = _mm_set1_epi8((char)raw_threshold);
+    __m128i counts = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= phred_length; i += 16) {
+        __m128i phreds = _mm_loadu_si128((const __m128i *)(phred_scores + i));
+        // Lanes that are below the threshold are -1.
+        counts = _mm_sub_epi8(counts, _mm_cmplt_epi8(phreds, threshold));
+    }
+    __m128i sums = _mm_sad_epu8(counts, _mm_setzero_si128());
+    size_t count = _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
+    return count + count_phreds_below_scalar(
+        phred_scores + i, phred_length - i, raw_threshold);
+}
+#endif
+
+#ifdef HAVE_AVX2
+TARGET_AVX2 static size_t
+count_phreds_below_avx2(const uint8_t *phred_scores, size_t phred_length,
+                        uint8_t raw_threshold)
+{
+    __m256i threshold = _mm256_set1_epi8((char)raw_threshold);
+    __m256i counts = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= phred_length; i += 32) {
+        __m256i phreds = _mm256_loadu_si256((const __m256i *)(phred_scores + i));
+        counts = _mm256_sub_epi8(counts, _mm256_cmpgt_epi8(threshold, phreds));
+    }
+    __m256i sums = _mm256_sad_epu8(counts, _mm256_setzero_si256());
+    size_t count = _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+                   _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+    return count + count_phreds_below_sse2(
+        phred_scores + i, phred_length - i, raw_threshold);
+}
+#endif
+
+#ifdef HAVE_NEON
+static size_t
+count_phreds_below_neon(const uint8_t *phred_scores, size_t phred_length,
+                        uint8_t raw_threshold)
+{
+    uint8x16_t threshold = vdupq_n_u8(raw_threshold);
+    uint8x16_t counts = vdupq_n_u8(0);
+    size_t i = 0;
+    for (; i + 16 <= phred_length; i += 16) {
+        uint8x16_t below = vcltq_u8(vld1q_u8(phred_scores + i), threshold);
+        counts = vsubq_u8(counts, below);
+    }
+    return vaddlvq_u8(counts) + count_phreds_below_scalar(
+        phred_scores + i, phred_length - i, raw_threshold);
+}
+#endif
+
+static size_t (*count_phreds_below)(const uint8_t *, size_t, uint8_t) =
+    count_phreds_below_scalar;
+
+/*
+ * Sequence kernels
+ * ================
+ * The sequence filters count N bases and look for homopolymers with byte
+ * compares on the sequence. Both ignore the case of the bases. Homopolymers
+ * are found with a mask of the positions where a base equals the next base,
+ * a homopolymer longer than max_run bases is a run of at least max_run set
+ * bits in it.
+ */
+
+#define CASE_BIT 0x20
+
+static size_t
+count_n_bases_scalar(const uint8_t *sequence, size_t sequence_length)
+{
+    size_t count = 0;
+    for (size_t i=0; i < sequence_length; i+=1) {
+        count += (sequence[i] | CASE_BIT) == 'n';
+    }
+    return count;
+}
+
+// The byte lanes of the vectorized counters overflow after 255 vectors.
+#define N_COUNT_BLOCK_VECTORS 255
+
+#ifdef HAVE_SSE2
+static size_t
+count_n_bases_sse2(const uint8_t *sequence, size_t sequence_length)
+{
+    __m128i case_bit = _mm_set1_epi8(CASE_BIT);
+    __m128i n = _mm_set1_epi8('n');
+    size_t count = 0;
+    size_t i = 0;
+    while (i + 16 <= sequence_length) {
+        __m128i counts = _mm_setzero_si128();
+        size_t block_end = i + N_COUNT_BLOCK_VECTORS * 16;
+        for (; i + 16 <= sequence_length && i < block_end; i += 16) {
+            __m128i bases = _mm_loadu_si128((const __m128i *)(sequence + i));
+            // Lanes with an N are -1.
+            counts = _mm_sub_epi8(
+                counts, _mm_cmpeq_epi8(_mm_or_si128(bases, case_bit), n));
+        }
+        __m128i sums = _mm_sad_epu8(counts, _mm_setzero_si128());
+        count += _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
+    }
+    return count + count_n_bases_scalar(sequence + i, sequence_length - i);
+}
+#endif
+
+#ifdef HAVE_AVX2
+TARGET_AVX2 static size_t
+count_n_bases_avx2(const uint8_t *sequence, size_t sequence_length)
+{
+    __m256i case_bit = _mm256_set1_epi8(CASE_BIT);
+    __m256i n = _mm256_set1_epi8('n');
+    size_t count = 0;
+    size_t i = 0;
+    while (i + 32 <= sequence_length) {
+        __m256i counts = _mm256_setzero_si256();
+        size_t block_end = i + N_COUNT_BLOCK_VECTORS * 32;
+        for (; i + 32 <= sequence_length && i < block_end; i += 32) {
+            __m256i bases = _mm256_loadu_si256((const __m256i *)(sequence + i));
+            counts = _mm256_sub_epi8(
+                counts, _mm256_cmpeq_epi8(_mm256_or_si256(bases, case_bit), n));
+        }
+        __m256i sums = _mm256_sad_epu8(counts, _mm256_setzero_si256());
+        count += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+                 _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+    }
+    return count + count_n_bases_sse2(sequence + i, sequence_length - i);
+}
+#endif
+
+#ifdef HAVE_NEON
+static size_t
+count_n_bases_neon(const uint8_t *sequence, size_t sequence_length)
+{
+    uint8x16_t case_bit = vdupq_n_u8(CASE_BIT);
+    uint8x16_t n = vdupq_n_u8('n');
+    size_t count = 0;
+    size_t i = 0;
+    while (i + 16 <= sequence_length) {
+        uint8x16_t counts = vdupq_n_u8(0);
+        size_t block_end = i + N_COUNT_BLOCK_VECTORS * 16;
+        for (; i + 16 <= sequence_length && i < block_end; i += 16) {
+            uint8x16_t bases = vorrq_u8(vld1q_u8(sequence + i), case_bit);
+            counts = vsubq_u8(counts, vceqq_u8(bases, n));
+        }
+        count += vaddlvq_u8(counts);
+    }
+    return count + count_n_bases_scalar(sequence + i, sequence_length - i);
+}
+#endif
+
+static size_t (*count_n_bases)(const uint8_t *, size_t) = count_n_bases_scalar;
+
+#if defined(__GNUC__)
+#define count_trailing_zeros64(x) ((size_t)__builtin_ctzll(x))
+#define count_leading_zeros64(x) ((size_t)__builtin_clzll(x))
+#else
+static inline size_t
+count_trailing_zeros64(uint64_t x)
+{
+    size_t count = 0;
+    while (!(x & 1)) {
+        x >>= 1;
+        count += 1;
+    }
+    return count;
+}
+
+static inline size_t
+count_leading_zeros64(uint64_t x)
+{
+    size_t count = 0;
+    while (!(x & ((uint64_t)1 << 63))) {
+        x <<= 1;
+        count += 1;
+    }
+    return count;
+}
+#endif
+
+/**
+ * @brief Checks for a run of at least run_length equal neighbouring bases in
+ * a scalar loop, continuing a run of carry equal neighbours before the
+ * sequence.
+ */
+static int
+equal_neighbours_run_scalar(const uint8_t *sequence, size_t sequence_length,
+                            size_t carry, size_t run_length)
+{
+    for (size_t i=1; i < sequence_length; i+=1) {
+        if ((sequence[i] | CASE_BIT) == (sequence[i - 1] | CASE_BIT)) {
+            carry += 1;
+            if (carry >= run_length) {
+                return 1;
+            }
+        } else {
+            carry = 0;
+        }
+    }
+    return 0;
+}
+
+#if defined(HAVE_SSE2) || defined(HAVE_NEON)
+/**
+ * @brief Checks a mask of 64 neighbour comparisons for a run of at least
+ * run_length set bits. Runs within the mask are found by ANDing the mask
+ * with shifted copies of itself, which takes log2(run_length) steps. carry is
+ * the number of set bits at the end of the previous mask and is updated for
+ * the next mask.
+ */
+static inline int
+equal_neighbours_mask_has_run(uint64_t equal, size_t *carry, size_t run_length)
+{
+    if (equal == UINT64_MAX) {
+        *carry += 64;
+        return *carry >= run_length;
+    }
+    if (*carry + count_trailing_zeros64(~equal) >= run_length) {
+        return 1;
+    }
+    if (run_length < 64) {
+        uint64_t runs = equal;
+        size_t runs_length = 1;
+        while (runs_length * 2 <= run_length) {
+            runs &= runs >> runs_length;
+            runs_length *= 2;
+        }
+        if (runs_length < run_length) {
+            runs &= runs >> (run_length - runs_length);
+        }
+        if (runs) {
+            return 1;
+        }
+    }
+    *carry = count_leading_zeros64(~equal);
+    return 0;
+}
+#endif
+
+static int
+homopolymer_longer_than_scalar(const uint8_t *sequence, size_t sequence_length,
+                               size_t max_run)
+{
+    return equal_neighbours_run_scalar(sequence, sequence_length, 0, max_run);
+}
+
+#ifdef HAVE_SSE2
+static int
+homopolymer_longer_than_sse2(const uint8_t *sequence, size_t sequence_length,
+                             size_t max_run)
+{
+    __m128i case_bit = _mm_set1_epi8(CASE_BIT);
+    size_t carry = 0;
+    size_t i = 0;
+    // Each base is compared with the next, so one byte beyond the 64
+    // compared bases is loaded.
+    for (; i + 65 <= sequence_length; i += 64) {
+        uint64_t equal = 0;
+        for (size_t j=0; j < 64; j += 16) {
+            __m128i bases = _mm_or_si128(
+                _mm_loadu_si128((const __m128i *)(sequence + i + j)), case_bit);
+            __m128i next = _mm_or_si128(
+                _mm_loadu_si128((const __m128i *)(sequence + i + j + 1)), case_bit);
+            uint64_t mask = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bases, next));
+            equal |= mask << j;
+        }
+        if (equal_neighbours_mask_has_run(equal, &carry, max_run)) {
+            return 1;
+        }
+    }
+    return equal_neighbours_run_scalar(sequence + i, sequence_length - i,
+                                       carry, max_run);
+}
+#endif
+
+#ifdef HAVE_AVX2
+TARGET_AVX2 static int
+homopolymer_longer_than_avx2(const uint8_t *sequence, size_t sequence_length,
+                             size_t max_run)
+{
+    __m256i case_bit = _mm256_set1_epi8(CASE_BIT);
+    size_t carry = 0;
+    size_t i = 0;
+    for (; i + 65 <= sequence_length; i += 64) {
+        uint64_t equal = 0;
+        for (size_t j=0; j < 64; j += 32) {
+            __m256i bases = _mm256_or_si256(
+                _mm256_loadu_si256((const __m256i *)(sequence + i + j)), case_bit);
+            __m256i next = _mm256_or_si256(
+                _mm256_loadu_si256((const __m256i *)(sequence + i + j + 1)), case_bit);
+            uint64_t mask = (uint32_t)_mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(bases, next));
+            equal |= mask << j;
+        }
+        if (equal_neighbours_mask_has_run(equal, &carry, max_run)) {
+            return 1;
+        }
+    }
+    return equal_neighbours_run_scalar(sequence + i, sequence_length - i,
+                                       carry, max_run);
+}
+#endif
+
+#ifdef HAVE_NEON
+static int
+homopolymer_longer_than_neon(const uint8_t *sequence, size_t sequence_length,
+                             size_t max_run)
+{
+    static const uint8_t bit_values[16] = {
+        1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t bits = vld1q_u8(bit_values);
+    uint8x16_t case_bit = vdupq_n_u8(CASE_BIT);
+    size_t carry = 0;
+    size_t i = 0;
+    for (; i + 65 <= sequence_length; i += 64) {
+        uint64_t equal = 0;
+        for (size_t j=0; j < 64; j += 16) {
+            uint8x16_t bases = vorrq_u8(vld1q_u8(sequence + i + j), case_bit);
+            uint8x16_t next = vorrq_u8(vld1q_u8(sequence + i + j + 1), case_bit);
+            // NEON has no movemask, the bits of each half are added instead.
+            uint8x16_t mask_bits = vandq_u8(vceqq_u8(bases, next), bits);
+            uint64_t mask = vaddv_u8(vget_low_u8(mask_bits)) |
+                            (vaddv_u8(vget_high_u8(mask_bits)) << 8);
+            equal |= mask << j;
+        }
+        if (equal_neighbours_mask_has_run(equal, &carry, max_run)) {
+            return 1;
+        }
+    }
+    return equal_neighbours_run_scalar(sequence + i, sequence_length - i,
+                                       carry, max_run);
+}
+#endif
+
+static int (*homopolymer_run_kernel)(const uint8_t *, size_t, size_t) =
+    homopolymer_longer_than_scalar;
+
+/**
+ * @brief Checks whether the sequence contains a homopolymer of more than
+ * max_run bases.
+ */
+static inline int
+homopolymer_longer_than(const uint8_t *sequence, size_t sequence_length,
+                        size_t max_run)
+{
+    if (sequence_length <= max_run) {
+        return 0;
+    }
+    if (max_run == 0) {
+        // Every base is a homopolymer of one.
+        return 1;
+    }
+    return homopolymer_run_kernel(sequence, sequence_length, max_run);
+}
+
+static const char *selected_kernels = "scalar";
+
+/**
+ * @brief Selects the fastest kernels the CPU supports. The selection only
+ * depends on the CPU so it is done once for the process.
+ *
+ * The FASTQ_FILTER_KERNELS environment variable limits the selection to
+ * "scalar" or, on x86-64, "sse2" kernels, so the variants can be compared
+ * in benchmarks and tests. Other values select the fastest kernels.
+ */
+static void
+select_simd_kernels(void)
+{
+    const char *limit = getenv("FASTQ_FILTER_KERNELS");
+    if (limit != NULL && strcmp(limit, "scalar") == 0) {
+        return;
+    }
+#if defined(HAVE_SSE2)
+    phred_scores_valid = phred_scores_valid_sse2;
+    count_phreds_below = count_phreds_below_sse2;
+    count_n_bases = count_n_bases_sse2;
+    homopolymer_run_kernel = homopolymer_longer_than_sse2;
+    selected_kernels = "sse2";
+#elif defined(HAVE_NEON)
+    phred_scores_valid = phred_scores_valid_neon;
+    count_phreds_below = count_phreds_below_neon;
+    count_n_bases = count_n_bases_neon;
+    homopolymer_run_kernel = homopolymer_longer_than_neon;
+    selected_kernels = "neon";
+#endif
+#ifdef HAVE_AVX2
+    if (limit != NULL && strcmp(limit, "sse2") == 0) {
+        return;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        phred_scores_valid = phred_scores_valid_avx2;
+        count_phreds_below = count_phreds_below_avx2;
+        count_n_bases = count_n_bases_avx2;
+        homopolymer_run_kernel = homopolymer_longer_than_avx2;
+        selected_kernels = "avx2";
+    }
+#endif
+}
+
+/**
+ * @brief Sets a ValueError for the first invalid phred score.
+ */
+static void
+raise_invalid_phred_error(const uint8_t *phred_scores, size_t phred_length,
+                          uint8_t phred_offset)
+{
+    uint8_t max_score = MAXIMUM_PHRED_SCORE - phred_offset;
+    for (size_t i=0; i < phred_length; i+=1) {
+        if ((uint8_t)(phred_scores[i] - phred_offset) > max_score) {
             PyErr_Format(
                 PyExc_ValueError,
                 "Character %c outside of valid phred range ('%c' to '%c')",
                 phred_scores[i], phred_offset, MAXIMUM_PHRED_SCORE);
-            return -1;
+            return;
         }
-        histogram[score] += 1;
     }
-    return 0;
 }
 
 static inline double 
@@ -115,131 +739,789 @@ median_from_histogram(size_t *histogram, size_t phred_length, uint8_t phred_offs
             } 
         }
     } 
-    PyErr_SetString(PyExc_RuntimeError, 
-                    "Unable to find median. This is an error in the code. "
-                    "Please contact the developers.");
     return -1.0L;
 }
 
 /**
- * @brief Returns a rounded up median phred_score. (i.e. 26.5 -> 27)
- * 
- * @param phred_scores Array of phred scores to calculate the median off.
- * @param phred_length The length of the phred_scores
- * @param phred_offset The phred offset
- * @return double The median, or -1.0 on error.
+ * @brief Returns the median of phred scores that are known to be valid.
+ * Rounded up as in qualmedian. Does not use the Python API.
+ *
+ * @return double The median, NaN for no scores, or -1.0 when the median
+ *         could not be found.
  */
 static double
-qualmedian(const uint8_t *phred_scores, size_t phred_length, uint8_t phred_offset)
+valid_qualmedian(const uint8_t *phred_scores, size_t phred_length, uint8_t phred_offset)
 {
     if (phred_length == 0) {
         return NAN;
     }
     size_t histogram[128];
     memset(histogram, 0, 128 * sizeof(size_t));
-    int ret = make_histogram(histogram, phred_scores, phred_length, phred_offset);
-    if (ret != 0) {
-        return -1.0L;
+    for (size_t i=0; i < phred_length; i+= 1) {
+        histogram[phred_scores[i] - phred_offset] += 1;
     }
     return median_from_histogram(histogram, phred_length, phred_offset);
 }
 
-PyDoc_STRVAR(qualmean__doc__,
-"qualmean($self, phred_scores, /, phred_offset=DEFAULT_PHRED_SCORE_OFFSET)\n"
-"--\n"
-"\n"
-"Returns the mean quality score. \n"
-"\n"
-"  phred_scores\n"
-"    ASCII string with the phred scores.\n"
-);
-
-#define QUALMEAN_METHODDEF    \
-    {"qualmean", (PyCFunction)(void(*)(void))qualmean, \
-     METH_VARARGS | METH_KEYWORDS, qualmean__doc__}
+#define QUALITY_STATISTIC_AVERAGE_ERROR_RATE 0
+#define QUALITY_STATISTIC_QUALMEAN 1
+#define QUALITY_STATISTIC_QUALMEDIAN 2
 
-static PyObject *
-qualmean(PyObject *module, PyObject *args, PyObject *kwargs)
+/**
+ * @brief Validates the phred scores and computes one of the
+ * QUALITY_STATISTIC statistics. Does not use the Python API, so it can be
+ * called without the GIL.
+ *
+ * @return double The statistic, or -1.0 on error. The error can be raised
+ *         with raise_quality_statistic_error.
+ */
+static double
+quality_statistic(int statistic, const uint8_t *phred_scores,
+                  size_t phred_length, uint8_t phred_offset)
 {
-    PyObject *phred_scores = NULL;
-    uint8_t phred_offset = DEFAULT_PHRED_SCORE_OFFSET;
-    char *kwarg_names[] = {"", "phred_offset", NULL};
-    const char *format = "O!|b:qualmean";
-    if (!PyArg_ParseTupleAndKeywords(
-        args, kwargs, format, kwarg_names,
-        &PyUnicode_Type,
-        &phred_scores,
-        &phred_offset)) {
-            return NULL;
+    if (!phred_scores_valid(phred_scores, phred_length, phred_offset)) {
+        return -1.0L;
     }
-
-    if (!PyUnicode_IS_COMPACT_ASCII(phred_scores)) {
-        PyErr_SetString(PyExc_ValueError,
-                        "phred_scores must be ASCII encoded.");
-        return NULL;
+    if (statistic == QUALITY_STATISTIC_QUALMEDIAN) {
+        return valid_qualmedian(phred_scores, phred_length, phred_offset);
     }
-    uint8_t *phreds = PyUnicode_DATA(phred_scores);
-    size_t phred_length = PyUnicode_GET_LENGTH(phred_scores);
-    double error_rate = average_error_rate(phreds, phred_length, phred_offset);
-    if (error_rate < 0.0L) {
-        return NULL;
+    double error_rate = sum_valid_error_rate(phred_scores, phred_length,
+                                             phred_offset) / (double)phred_length;
+    if (statistic == QUALITY_STATISTIC_QUALMEAN) {
+        return -10 * log10(error_rate);
     }
-    double phred_score = -10 * log10(error_rate);
-    return PyFloat_FromDouble(phred_score);
+    return error_rate;
 }
 
+static void
+raise_quality_statistic_error(const uint8_t *phred_scores, size_t phred_length,
+                              uint8_t phred_offset)
+{
+    raise_invalid_phred_error(phred_scores, phred_length, phred_offset);
+    if (!PyErr_Occurred()) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Unable to find median. This is an error in the code. "
+                        "Please contact the developers.");
+    }
+}
 
-PyDoc_STRVAR(average_error_rate__doc__,
-"average_error_rate($self, phred_scores, /, phred_offset=DEFAULT_PHRED_SCORE_OFFSET)\n"
-"--\n"
-"\n"
-"Returns the average_error_rate. \n"
-"\n"
-"  phred_scores\n"
-"    ASCII string with the phred scores.\n"
-);
+/*
+ * Releasing and reacquiring the GIL costs about as much as processing a few
+ * hundred phred scores. Only release it when there is enough work to make
+ * that worthwhile.
+ */
+#define GIL_RELEASE_MINIMUM_LENGTH 2048
 
-#define AVERAGE_ERROR_RATE_METHODDEF    \
-    {"average_error_rate", (PyCFunction)(void(*)(void))average_error_rate_py, \
-     METH_VARARGS | METH_KEYWORDS, average_error_rate__doc__}
+#define MAYBE_WITHOUT_GIL(release_gil, statement) \
+    do { \
+        if (release_gil) { \
+            Py_BEGIN_ALLOW_THREADS \
+            statement; \
+            Py_END_ALLOW_THREADS \
+        } else { \
+            statement; \
+        } \
+    } while (0)
 
-static PyObject *
-average_error_rate_py(PyObject *module, PyObject *args, PyObject *kwargs)
+/**
+ * A view on the data of a single record that the filters need. For records
+ * parsed from a buffer the pointers point into that buffer, for
+ * SequenceRecord objects they point into the qualities and sequence strings.
+ * The pointers are NULL when none of the filters needs them.
+ */
+typedef struct {
+    const uint8_t *qualities;
+    const uint8_t *sequence;
+    Py_ssize_t length;
+} RecordSpan;
+
+/**
+ * @brief Finds the first span with invalid phred scores. Does not use the
+ * Python API so it can be called without the GIL.
+ *
+ * @return Py_ssize_t The index of the invalid span, or -1 if all are valid.
+ */
+static Py_ssize_t
+find_invalid_record_span(const RecordSpan *spans, Py_ssize_t number_of_spans,
+                         uint8_t phred_offset)
 {
-    PyObject *phred_scores = NULL;
-    uint8_t phred_offset = DEFAULT_PHRED_SCORE_OFFSET;
-    char *kwarg_names[] = {"", "phred_offset", NULL};
-    const char *format = "O!|b:average_error_rate";
-    if (!PyArg_ParseTupleAndKeywords(
-        args, kwargs, format, kwarg_names,
-        &PyUnicode_Type,
-        &phred_scores,
-        &phred_offset)) {
-            return NULL;
+    for (Py_ssize_t i=0; i < number_of_spans; i++) {
+        if (!phred_scores_valid(spans[i].qualities, spans[i].length, phred_offset)) {
+            return i;
+        }
     }
+    return -1;
+}
 
-    if (!PyUnicode_IS_COMPACT_ASCII(phred_scores)) {
-        PyErr_SetString(PyExc_ValueError,
-                        "phred_scores must be ASCII encoded.");
-        return NULL;
+/**
+ * @brief Checks whether the median of the phred scores in the spans is at
+ * least the threshold, without calculating the median. Only the number of
+ * scores below the threshold is counted, which decides the outcome as soon as
+ * more than half of the scores are on one side of the threshold. The exact
+ * median is only needed when the count is even and the two middle values
+ * are on opposite sides of the threshold.
+ *
+ * The phred scores must have been validated. When tail_first is set the
+ * spans are scanned from the end.
+ *
+ * @return int 1 if the median is at least the threshold, 0 otherwise.
+ */
+static int
+median_at_least_threshold(const RecordSpan *spans, Py_ssize_t number_of_spans,
+                          double threshold, uint8_t phred_offset, int tail_first)
+{
+    size_t total_length = 0;
+    for (Py_ssize_t i=0; i < number_of_spans; i++) {
+        total_length += spans[i].length;
     }
-    uint8_t *phreds = PyUnicode_DATA(phred_scores);
-    size_t phred_length = PyUnicode_GET_LENGTH(phred_scores);
-    double error_rate = average_error_rate(phreds, phred_length, phred_offset);
-    if (error_rate < 0.0L) {
-        return NULL;
+    if (total_length == 0) {
+        // The median of no scores is NaN, which fails any threshold.
+        return 0;
+    }
+    // Integer scores are below the threshold when they are below ceil(threshold).
+    double integer_threshold = ceil(threshold);
+    if (integer_threshold <= 0.0) {
+        return 1;
+    }
+    uint8_t raw_threshold = MAXIMUM_PHRED_SCORE + 1;
+    if (integer_threshold + phred_offset <= MAXIMUM_PHRED_SCORE) {
+        raw_threshold = (uint8_t)integer_threshold + phred_offset;
+    }
+    size_t half = total_length / 2;
+    size_t odd = total_length % 2;
+    // The median passes when at most this many scores are below the threshold.
+    size_t max_below = odd ? half : half - 1;
+    size_t below = 0;
+    size_t remaining = total_length;
+    for (Py_ssize_t k=0; k < number_of_spans; k++) {
+        const RecordSpan *span = spans + (tail_first ? number_of_spans - 1 - k : k);
+        size_t phred_length = span->length;
+        for (size_t done=0; done < phred_length; done += MEDIAN_COUNT_BLOCK_SIZE) {
+            size_t block_length = phred_length - done;
+            if (block_length > MEDIAN_COUNT_BLOCK_SIZE) {
+                block_length = MEDIAN_COUNT_BLOCK_SIZE;
+            }
+            size_t start = tail_first ? phred_length - done - block_length : done;
+            below += count_phreds_below(span->qualities + start, block_length,
+                                        raw_threshold);
+            remaining -= block_length;
+            if (below > half) {
+                return 0;
+            }
+            if (below + remaining <= max_below) {
+                return 1;
+            }
+        }
+    }
+    if (below <= max_below) {
+        return 1;
     }
-    return PyFloat_FromDouble(error_rate);
+    // Even number of scores with the two middle values on opposite sides of
+    // the threshold: the median is the average of the highest score below
+    // the threshold and the lowest score at or above it.
+    uint8_t highest_below = 0;
+    uint8_t lowest_above = 255;
+    for (Py_ssize_t i=0; i < number_of_spans; i++) {
+        const uint8_t *phreds = spans[i].qualities;
+        for (Py_ssize_t j=0; j < spans[i].length; j++) {
+            uint8_t phred = phreds[j];
+            if (phred < raw_threshold) {
+                highest_below = phred > highest_below ? phred : highest_below;
+            } else {
+                lowest_above = phred < lowest_above ? phred : lowest_above;
+            }
+        }
+    }
+    double median = ((double)(highest_below - phred_offset) +
+                     (double)(lowest_above - phred_offset)) / 2.0;
+    return median >= threshold;
 }
 
-PyDoc_STRVAR(qualmedian__doc__,
+// The bound on the error rate sum is checked once per block of bases.
+#define ERROR_RATE_BLOCK_SIZE 64
+
+/**
+ * @brief Checks whether the average error rate of the phred scores in the
+ * spans is at most the threshold. Because error rates are never negative the
+ * outcome is known as soon as the partial sum exceeds the threshold times
+ * the total length, so the summation stops at the first block where that
+ * happens. Quality usually drops towards the end of a read, so with
+ * tail_first set, bad reads are rejected sooner by scanning from the end.
+ * The error rates are looked up in error_rates, or in fixed_point_error_rates
+ * when that is not NULL.
+ *
+ * The phred scores must have been validated.
+ *
+ * @return int 1 if the average error rate is at most the threshold,
+ *         0 otherwise.
+ */
+static int
+average_error_rate_at_most_threshold(const RecordSpan *spans,
+                                     Py_ssize_t number_of_spans,
+                                     double threshold,
+                                     const double *error_rates,
+                                     const uint32_t *fixed_point_error_rates,
+                                     int tail_first)
+{
+    size_t total_length = 0;
+    for (Py_ssize_t i=0; i < number_of_spans; i++) {
+        total_length += spans[i].length;
+    }
+    double total_length_d = (double)total_length;
+    if (fixed_point_error_rates != NULL) {
+        // The sum is compared in the fixed-point domain, which avoids a
+        // division per block. Sums below 2 ** 53 are exact as a double.
+        double limit = threshold * total_length_d *
+                       (double)(1 << ERROR_RATE_FIXED_POINT_BITS);
+        uint64_t fixed_sum = 0;
+        for (Py_ssize_t k=0; k < number_of_spans; k++) {
+            const RecordSpan *span = spans + (tail_first ? number_of_spans - 1 - k : k);
+            size_t phred_length = span->length;
+            for (size_t done=0; done < phred_length; done += ERROR_RATE_BLOCK_SIZE) {
+                size_t block_length = phred_length - done;
+                if (block_length > ERROR_RATE_BLOCK_SIZE) {
+                    block_length = ERROR_RATE_BLOCK_SIZE;
+                }
+                size_t start = tail_first ? phred_length - done - block_length : done;
+                fixed_sum += sum_fixed_point_error_rate_table(
+                    span->qualities + start, block_length,
+                    fixed_point_error_rates);
+                // Written as a negated comparison so a NaN threshold fails,
+                // as it does with double precision.
+                if (!((double)fixed_sum <= limit)) {
+                    return 0;
+                }
+            }
+        }
+        // When there are no scores the average is undefined, which fails.
+        return total_length > 0;
+    }
+    double error_sum = 0.0;
+    for (Py_ssize_t k=0; k < number_of_spans; k++) {
+        const RecordSpan *span = spans + (tail_first ? number_of_spans - 1 - k : k);
+        size_t phred_length = span->length;
+        for (size_t done=0; done < phred_length; done += ERROR_RATE_BLOCK_SIZE) {
+            size_t block_length = phred_length - done;
+            if (block_length > ERROR_RATE_BLOCK_SIZE) {
+                block_length = ERROR_RATE_BLOCK_SIZE;
+            }
+            size_t start = tail_first ? phred_length - done - block_length : done;
+            error_sum += sum_error_rate_table(span->qualities + start,
+                                              block_length, error_rates);
+            // Adding non-negative numbers never decreases the sum, so the
+            // final average can only be higher.
+            if (error_sum / total_length_d > threshold) {
+                return 0;
+            }
+        }
+    }
+    // When there are no scores the average is NaN, which fails.
+    return error_sum / total_length_d <= threshold;
+}
+
+/**
+ * @brief Computes the largest fixed-point error rate sum of a window of
+ * window bases that does not exceed the threshold.
+ *
+ * @return int 1 on success, 0 when the threshold is negative or NaN, which
+ *         fails every window.
+ */
+static inline int
+fixed_point_window_limit(double threshold, size_t window, uint64_t *limit)
+{
+    // Integer sums exceed the limit exactly when they exceed its floor.
+    double limit_d = threshold * (double)window *
+                     (double)(1 << ERROR_RATE_FIXED_POINT_BITS);
+    if (!(limit_d >= 0.0)) {
+        return 0;
+    }
+    *limit = limit_d < 18446744073709551615.0 ? (uint64_t)limit_d : UINT64_MAX;
+    return 1;
+}
+
+/**
+ * @brief Checks whether every window of window_size bases in each of the
+ * spans has an average error rate of at most the threshold. Reads that are
+ * shorter than the window are checked as a whole and empty reads pass.
+ *
+ * The window sum is updated for each base by adding the error rate of the
+ * base that enters the window and subtracting the one that leaves it. The
+ * error rates are fixed-point integers, so the additions and subtractions
+ * are exact and the sum does not drift over long reads. The average error
+ * rate of a window may deviate at most 2 ** -25 from the exact value.
+ *
+ * The phred scores must have been validated. With tail_first set the
+ * windows are checked from the end of the read, where a bad window is
+ * usually found.
+ *
+ * @return int 1 if no window exceeds the threshold, 0 otherwise.
+ */
+static int
+windows_at_most_threshold(const RecordSpan *spans, Py_ssize_t number_of_spans,
+                          double threshold, Py_ssize_t window_size,
+                          const uint32_t *fixed_point_error_rates,
+                          int tail_first)
+{
+    for (Py_ssize_t k=0; k < number_of_spans; k++) {
+        const uint8_t *phreds = spans[k].qualities;
+        size_t length = spans[k].length;
+        if (length == 0) {
+            continue;
+        }
+        size_t window = (size_t)window_size < length ? (size_t)window_size : length;
+        uint64_t limit;
+        if (!fixed_point_window_limit(threshold, window, &limit)) {
+            return 0;
+        }
+        size_t start = tail_first ? length - window : 0;
+        uint64_t sum = sum_fixed_point_error_rate_table(
+            phreds + start, window, fixed_point_error_rates);
+        if (sum > limit) {
+            return 0;
+        }
+        if (tail_first) {
+            for (size_t i=length - window; i > 0; i--) {
+                sum += fixed_point_error_rates[phreds[i - 1]];
+                sum -= fixed_point_error_rates[phreds[i - 1 + window]];
+                if (sum > limit) {
+                    return 0;
+                }
+            }
+        } else {
+            for (size_t i=window; i < length; i++) {
+                sum += fixed_point_error_rates[phreds[i]];
+                sum -= fixed_point_error_rates[phreds[i - window]];
+                if (sum > limit) {
+                    return 0;
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Returns the length to keep of a read that is cut at its first
+ * window, scanning from the start, with an average error rate above the
+ * threshold. That is the start of the window, or the whole length when no
+ * window exceeds the threshold. A read that is shorter than the window is
+ * checked as a whole, like in windows_at_most_threshold, and is cut to
+ * nothing when it fails. The phred scores must have been validated.
+ */
+static size_t
+window_trim_length(const uint8_t *phreds, size_t length, double threshold,
+                   Py_ssize_t window_size,
+                   const uint32_t *fixed_point_error_rates)
+{
+    if (length == 0) {
+        return 0;
+    }
+    size_t window = (size_t)window_size < length ? (size_t)window_size : length;
+    uint64_t limit;
+    if (!fixed_point_window_limit(threshold, window, &limit)) {
+        return 0;
+    }
+    uint64_t sum = sum_fixed_point_error_rate_table(
+        phreds, window, fixed_point_error_rates);
+    if (sum > limit) {
+        return 0;
+    }
+    for (size_t i=window; i < length; i++) {
+        sum += fixed_point_error_rates[phreds[i]];
+        sum -= fixed_point_error_rates[phreds[i - window]];
+        if (sum > limit) {
+            return i - window + 1;
+        }
+    }
+    return length;
+}
+
+/**
+ * @brief Returns the time of a monotonic clock in nanoseconds. Used for the
+ * optional timing of the filters, without the GIL.
+ */
+static uint64_t
+monotonic_ns(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER frequency = {0};
+    LARGE_INTEGER counter;
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+#endif
+}
+
+/**
+ * The phred scores of an ASCII str or of an object that supports the buffer
+ * protocol, such as bytes, bytearray, memoryview or a numpy uint8 array. The
+ * data is used in place. For buffers the view is held until
+ * PhredScores_Release, so the data can not be resized or freed while it is
+ * in use, also not while the GIL is released.
+ */
+typedef struct {
+    const uint8_t *data;
+    size_t length;
+    Py_buffer view;
+    int has_view;
+} PhredScores;
+
+/**
+ * @brief Gets the phred scores from a str or buffer object.
+ *
+ * @return int 0 on success, -1 with an exception set otherwise. The phred
+ *         scores must only be released on success.
+ */
+static int
+PhredScores_Init(PhredScores *self, PyObject *phred_scores)
+{
+    self->has_view = 0;
+    if (PyUnicode_Check(phred_scores)) {
+        if (!PyUnicode_IS_COMPACT_ASCII(phred_scores)) {
+            PyErr_SetString(PyExc_ValueError,
+                            "phred_scores must be ASCII encoded.");
+            return -1;
+        }
+        self->data = PyUnicode_DATA(phred_scores);
+        self->length = PyUnicode_GET_LENGTH(phred_scores);
+        return 0;
+    }
+    if (!PyObject_CheckBuffer(phred_scores)) {
+        PyErr_Format(PyExc_TypeError,
+                     "phred_scores must be str or a bytes-like object, got %s",
+                     Py_TYPE(phred_scores)->tp_name);
+        return -1;
+    }
+    if (PyObject_GetBuffer(phred_scores, &self->view, PyBUF_SIMPLE) != 0) {
+        return -1;
+    }
+    if (self->view.itemsize != 1) {
+        PyErr_Format(PyExc_TypeError,
+                     "phred_scores buffer must have an item size of 1, got %zd",
+                     self->view.itemsize);
+        PyBuffer_Release(&self->view);
+        return -1;
+    }
+    self->has_view = 1;
+    self->data = self->view.buf;
+    self->length = self->view.len;
+    return 0;
+}
+
+static void
+PhredScores_Release(PhredScores *self)
+{
+    if (self->has_view) {
+        PyBuffer_Release(&self->view);
+        self->has_view = 0;
+    }
+}
+
+static PyObject *
+quality_statistic_py(PyObject *args, PyObject *kwargs, const char *format,
+                     int statistic)
+{
+    PyObject *phred_scores_obj = NULL;
+    uint8_t phred_offset = DEFAULT_PHRED_SCORE_OFFSET;
+    char *kwarg_names[] = {"", "phred_offset", NULL};
+    if (!PyArg_ParseTupleAndKeywords(
+        args, kwargs, format, kwarg_names,
+        &phred_scores_obj,
+        &phred_offset)) {
+            return NULL;
+    }
+    PhredScores phred_scores;
+    if (PhredScores_Init(&phred_scores, phred_scores_obj) != 0) {
+        return NULL;
+    }
+    const uint8_t *phreds = phred_scores.data;
+    size_t phred_length = phred_scores.length;
+    double result;
+    MAYBE_WITHOUT_GIL(phred_length >= GIL_RELEASE_MINIMUM_LENGTH,
+        result = quality_statistic(statistic, phreds, phred_length, phred_offset));
+    if (result < 0.0L) {
+        raise_quality_statistic_error(phreds, phred_length, phred_offset);
+    }
+    PhredScores_Release(&phred_scores);
+    if (result < 0.0L) {
+        return NULL;
+    }
+    return PyFloat_FromDouble(result);
+}
+
+/**
+ * @brief Gets a C-contiguous buffer with items of 8 bytes in one of the
+ * native struct formats in formats.
+ *
+ * @return int 0 on success, -1 with an exception set otherwise.
+ */
+static int
+get_typed_buffer(PyObject *obj, Py_buffer *view, int flags,
+                 const char *formats, const char *name)
+{
+    if (PyObject_GetBuffer(obj, view,
+                           flags | PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) != 0) {
+        return -1;
+    }
+    const char *format = view->format != NULL ? view->format : "B";
+    if (format[0] == '@' || format[0] == '=') {
+        format += 1;
+    }
+    if (view->itemsize != 8 || format[0] == '\0' || format[1] != '\0' ||
+        strchr(formats, format[0]) == NULL) {
+        PyErr_Format(PyExc_TypeError,
+                     "%s must be a buffer of %s, got format '%s' with an item "
+                     "size of %zd.", name,
+                     formats[0] == 'd' ? "float64" : "int64",
+                     view->format != NULL ? view->format : "B",
+                     view->itemsize);
+        PyBuffer_Release(view);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Computes a statistic for each phred scores object in a sequence,
+ * or for each slice of a single phred scores object given by offsets. The
+ * phred scores are collected with the GIL held, the statistics are computed
+ * without it. The statistics are written to the out buffer when given and
+ * returned as a list otherwise.
+ */
+static PyObject *
+quality_statistic_batch_py(PyObject *args, PyObject *kwargs,
+                           const char *format, int statistic)
+{
+    PyObject *phred_scores_arg = NULL;
+    PyObject *offsets_obj = Py_None;
+    PyObject *out_obj = Py_None;
+    uint8_t phred_offset = DEFAULT_PHRED_SCORE_OFFSET;
+    char *kwarg_names[] = {"", "phred_offset", "offsets", "out", NULL};
+    if (!PyArg_ParseTupleAndKeywords(
+        args, kwargs, format, kwarg_names,
+        &phred_scores_arg,
+        &phred_offset,
+        &offsets_obj,
+        &out_obj)) {
+            return NULL;
+    }
+    PyObject *phred_scores_tuple = NULL;
+    PhredScores concatenated;
+    int has_concatenated = 0;
+    Py_buffer offsets_view;
+    int has_offsets_view = 0;
+    Py_buffer out_view;
+    int has_out_view = 0;
+    Py_ssize_t number_of_scores = 0;
+    Py_ssize_t number_of_initialized = 0;
+    PhredScores *phred_scores = NULL;
+    double *statistics = NULL;
+    PyObject *result = NULL;
+    const int64_t *offsets = NULL;
+    if (offsets_obj == Py_None) {
+        // A tuple holds references to the objects, so they can not be freed
+        // by another thread changing the sequence while the GIL is released.
+        phred_scores_tuple = PySequence_Tuple(phred_scores_arg);
+        if (phred_scores_tuple == NULL) {
+            return NULL;
+        }
+        number_of_scores = PyTuple_GET_SIZE(phred_scores_tuple);
+    } else {
+        if (PhredScores_Init(&concatenated, phred_scores_arg) != 0) {
+            return NULL;
+        }
+        has_concatenated = 1;
+        if (get_typed_buffer(offsets_obj, &offsets_view, PyBUF_SIMPLE,
+                             "qlnQLN", "offsets") != 0) {
+            goto error;
+        }
+        has_offsets_view = 1;
+        Py_ssize_t number_of_offsets = offsets_view.len / 8;
+        if (number_of_offsets < 1) {
+            PyErr_SetString(PyExc_ValueError,
+                            "offsets must contain at least one offset.");
+            goto error;
+        }
+        offsets = offsets_view.buf;
+        number_of_scores = number_of_offsets - 1;
+    }
+    if (out_obj != Py_None) {
+        if (get_typed_buffer(out_obj, &out_view, PyBUF_WRITABLE, "d",
+                             "out") != 0) {
+            goto error;
+        }
+        has_out_view = 1;
+        if (out_view.len / 8 != number_of_scores) {
+            PyErr_Format(PyExc_ValueError,
+                         "out must have a length of %zd, got %zd.",
+                         number_of_scores, out_view.len / 8);
+            goto error;
+        }
+        statistics = out_view.buf;
+    } else {
+        statistics = PyMem_Malloc(sizeof(double) * (number_of_scores + 1));
+        if (statistics == NULL) {
+            PyErr_NoMemory();
+            goto error;
+        }
+    }
+    if (phred_scores_tuple != NULL) {
+        phred_scores = PyMem_Malloc(sizeof(PhredScores) * (number_of_scores + 1));
+        if (phred_scores == NULL) {
+            PyErr_NoMemory();
+            goto error;
+        }
+        for (Py_ssize_t i=0; i < number_of_scores; i++) {
+            PyObject *phred_scores_obj = PyTuple_GET_ITEM(phred_scores_tuple, i);
+            if (PhredScores_Init(phred_scores + i, phred_scores_obj) != 0) {
+                if (PyErr_ExceptionMatches(PyExc_TypeError)) {
+                    PyErr_Format(PyExc_TypeError,
+                                 "phred_scores must be str or a bytes-like "
+                                 "object, got %s at index %zd.",
+                                 Py_TYPE(phred_scores_obj)->tp_name, i);
+                }
+                goto error;
+            }
+            number_of_initialized += 1;
+        }
+    }
+    Py_ssize_t failed_index = -1;
+    int invalid_offsets = 0;
+    const uint8_t *failed_phreds = NULL;
+    size_t failed_length = 0;
+    Py_BEGIN_ALLOW_THREADS
+    for (Py_ssize_t i=0; i < number_of_scores; i++) {
+        const uint8_t *phreds;
+        size_t phred_length;
+        if (offsets != NULL) {
+            int64_t start = offsets[i];
+            int64_t end = offsets[i + 1];
+            if (start < 0 || end < start ||
+                (uint64_t)end > (uint64_t)concatenated.length) {
+                failed_index = i;
+                invalid_offsets = 1;
+                break;
+            }
+            phreds = concatenated.data + start;
+            phred_length = end - start;
+        } else {
+            phreds = phred_scores[i].data;
+            phred_length = phred_scores[i].length;
+        }
+        statistics[i] = quality_statistic(statistic, phreds, phred_length,
+                                          phred_offset);
+        if (statistics[i] < 0.0L) {
+            failed_index = i;
+            failed_phreds = phreds;
+            failed_length = phred_length;
+            break;
+        }
+    }
+    Py_END_ALLOW_THREADS
+    if (invalid_offsets) {
+        PyErr_Format(PyExc_ValueError,
+                     "offsets must be increasing and within phred_scores, "
+                     "got %lld and %lld at index %zd.",
+                     (long long)offsets[failed_index],
+                     (long long)offsets[failed_index + 1], failed_index);
+        goto error;
+    }
+    if (failed_index >= 0) {
+        raise_quality_statistic_error(failed_phreds, failed_length,
+                                      phred_offset);
+        goto error;
+    }
+    if (has_out_view) {
+        Py_INCREF(out_obj);
+        result = out_obj;
+    } else {
+        result = PyList_New(number_of_scores);
+        for (Py_ssize_t i=0; result != NULL && i < number_of_scores; i++) {
+            PyObject *value = PyFloat_FromDouble(statistics[i]);
+            if (value == NULL) {
+                Py_CLEAR(result);
+                break;
+            }
+            PyList_SET_ITEM(result, i, value);
+        }
+    }
+error:
+    for (Py_ssize_t i=0; i < number_of_initialized; i++) {
+        PhredScores_Release(phred_scores + i);
+    }
+    PyMem_Free(phred_scores);
+    if (has_out_view) {
+        PyBuffer_Release(&out_view);
+    } else {
+        PyMem_Free(statistics);
+    }
+    if (has_offsets_view) {
+        PyBuffer_Release(&offsets_view);
+    }
+    if (has_concatenated) {
+        PhredScores_Release(&concatenated);
+    }
+    Py_XDECREF(phred_scores_tuple);
+    return result;
+}
+
+PyDoc_STRVAR(qualmean__doc__,
+"qualmean($self, phred_scores, /, phred_offset=DEFAULT_PHRED_SCORE_OFFSET)\n"
+"--\n"
+"\n"
+"Returns the mean quality score. \n"
+"\n"
+"  phred_scores\n"
+"    ASCII string or bytes-like object with the phred scores.\n"
+);
+
+#define QUALMEAN_METHODDEF    \
+    {"qualmean", (PyCFunction)(void(*)(void))qualmean, \
+     METH_VARARGS | METH_KEYWORDS, qualmean__doc__}
+
+static PyObject *
+qualmean(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    return quality_statistic_py(args, kwargs, "O|b:qualmean",
+                                QUALITY_STATISTIC_QUALMEAN);
+}
+
+
+PyDoc_STRVAR(average_error_rate__doc__,
+"average_error_rate($self, phred_scores, /, phred_offset=DEFAULT_PHRED_SCORE_OFFSET)\n"
+"--\n"
+"\n"
+"Returns the average_error_rate. \n"
+"\n"
+"  phred_scores\n"
+"    ASCII string or bytes-like object with the phred scores.\n"
+);
+
+#define AVERAGE_ERROR_RATE_METHODDEF    \
+    {"average_error_rate", (PyCFunction)(void(*)(void))average_error_rate_py, \
+     METH_VARARGS | METH_KEYWORDS, average_error_rate__doc__}
+
+static PyObject *
+average_error_rate_py(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    return quality_statistic_py(args, kwargs, "O|b:average_error_rate",
+                                QUALITY_STATISTIC_AVERAGE_ERROR_RATE);
+}
+
+PyDoc_STRVAR(qualmedian__doc__,
 "qualmedian($self, phred_scores, /, phred_offset=DEFAULT_PHRED_SCORE_OFFSET)\n"
 "--\n"
 "\n"
 "Returns the median quality score. \n"
 "\n"
 "  phred_scores\n"
-"    ASCII string with the phred scores.\n"
+"    ASCII string or bytes-like object with the phred scores.\n"
 );
 
 #define QUALMEDIAN_METHODDEF    \
@@ -249,55 +1531,279 @@ PyDoc_STRVAR(qualmedian__doc__,
 static PyObject *
 qualmedian_py(PyObject *module, PyObject *args, PyObject *kwargs)
 {
-    PyObject *phred_scores = NULL;
-    uint8_t phred_offset = DEFAULT_PHRED_SCORE_OFFSET;
-    char *kwarg_names[] = {"", "phred_offset", NULL};
-    const char *format = "O!|b:qualmedian";
-    if (!PyArg_ParseTupleAndKeywords(
-        args, kwargs, format, kwarg_names,
-        &PyUnicode_Type,
-        &phred_scores,
-        &phred_offset)) {
-            return NULL;
-    }
+    return quality_statistic_py(args, kwargs, "O|b:qualmedian",
+                                QUALITY_STATISTIC_QUALMEDIAN);
+}
 
-    if (!PyUnicode_IS_COMPACT_ASCII(phred_scores)) {
-        PyErr_SetString(PyExc_ValueError,
-                        "phred_scores must be ASCII encoded.");
-        return NULL;
-    }
-    uint8_t *phreds = PyUnicode_DATA(phred_scores);
-    size_t phred_length = PyUnicode_GET_LENGTH(phred_scores);
-    double median = qualmedian(phreds, phred_length, phred_offset);
-    if (median < 0.0) {
+PyDoc_STRVAR(qualmean_batch__doc__,
+"qualmean_batch($self, phred_scores, /, phred_offset=DEFAULT_PHRED_SCORE_OFFSET, *, offsets=None, out=None)\n"
+"--\n"
+"\n"
+"Returns a list with the mean quality score of each string. The GIL is\n"
+"released while the scores are computed.\n"
+"\n"
+"  phred_scores\n"
+"    A sequence of ASCII strings or bytes-like objects with phred scores.\n"
+"    With offsets, a single ASCII string or bytes-like object.\n"
+"  offsets\n"
+"    A buffer of int64 offsets. The statistic is computed for each slice\n"
+"    phred_scores[offsets[i]:offsets[i + 1]].\n"
+"  out\n"
+"    A writable buffer of float64 values, such as a NumPy array, with one\n"
+"    value for each statistic. When given the statistics are written to it\n"
+"    and it is returned instead of a list.\n"
+);
+
+#define QUALMEAN_BATCH_METHODDEF    \
+    {"qualmean_batch", (PyCFunction)(void(*)(void))qualmean_batch, \
+     METH_VARARGS | METH_KEYWORDS, qualmean_batch__doc__}
+
+static PyObject *
+qualmean_batch(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    return quality_statistic_batch_py(args, kwargs, "O|b$OO:qualmean_batch",
+                                      QUALITY_STATISTIC_QUALMEAN);
+}
+
+PyDoc_STRVAR(average_error_rate_batch__doc__,
+"average_error_rate_batch($self, phred_scores, /, phred_offset=DEFAULT_PHRED_SCORE_OFFSET, *, offsets=None, out=None)\n"
+"--\n"
+"\n"
+"Returns a list with the average error rate of each string. The GIL is\n"
+"released while the error rates are computed.\n"
+"\n"
+"  phred_scores\n"
+"    A sequence of ASCII strings or bytes-like objects with phred scores.\n"
+"    With offsets, a single ASCII string or bytes-like object.\n"
+"  offsets\n"
+"    A buffer of int64 offsets. The statistic is computed for each slice\n"
+"    phred_scores[offsets[i]:offsets[i + 1]].\n"
+"  out\n"
+"    A writable buffer of float64 values, such as a NumPy array, with one\n"
+"    value for each statistic. When given the statistics are written to it\n"
+"    and it is returned instead of a list.\n"
+);
+
+#define AVERAGE_ERROR_RATE_BATCH_METHODDEF    \
+    {"average_error_rate_batch", (PyCFunction)(void(*)(void))average_error_rate_batch, \
+     METH_VARARGS | METH_KEYWORDS, average_error_rate_batch__doc__}
+
+static PyObject *
+average_error_rate_batch(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    return quality_statistic_batch_py(args, kwargs, "O|b$OO:average_error_rate_batch",
+                                      QUALITY_STATISTIC_AVERAGE_ERROR_RATE);
+}
+
+PyDoc_STRVAR(qualmedian_batch__doc__,
+"qualmedian_batch($self, phred_scores, /, phred_offset=DEFAULT_PHRED_SCORE_OFFSET, *, offsets=None, out=None)\n"
+"--\n"
+"\n"
+"Returns a list with the median quality score of each string. The GIL is\n"
+"released while the medians are computed.\n"
+"\n"
+"  phred_scores\n"
+"    A sequence of ASCII strings or bytes-like objects with phred scores.\n"
+"    With offsets, a single ASCII string or bytes-like object.\n"
+"  offsets\n"
+"    A buffer of int64 offsets. The statistic is computed for each slice\n"
+"    phred_scores[offsets[i]:offsets[i + 1]].\n"
+"  out\n"
+"    A writable buffer of float64 values, such as a NumPy array, with one\n"
+"    value for each statistic. When given the statistics are written to it\n"
+"    and it is returned instead of a list.\n"
+);
+
+#define QUALMEDIAN_BATCH_METHODDEF    \
+    {"qualmedian_batch", (PyCFunction)(void(*)(void))qualmedian_batch, \
+     METH_VARARGS | METH_KEYWORDS, qualmedian_batch__doc__}
+
+static PyObject *
+qualmedian_batch(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    return quality_statistic_batch_py(args, kwargs, "O|b$OO:qualmedian_batch",
+                                      QUALITY_STATISTIC_QUALMEDIAN);
+}
+
+/*
+ * Vectorcall is only used from Python 3.9 onwards, where it is part of the
+ * public API. Older versions use tp_call.
+ */
+#if PY_VERSION_HEX >= 0x03090000
+#define FILTERS_USE_VECTORCALL
+#endif
+
+#define AVERAGE_ERROR_RATE_FILTER 1
+#define MEDIAN_QUALITY_FILTER 2
+#define MINIMUM_LENGTH_FILTER 3
+#define MAXIMUM_LENGTH_FILTER 4
+#define SLIDING_WINDOW_FILTER 5
+#define MAXIMUM_N_FILTER 6
+#define MAXIMUM_HOMOPOLYMER_FILTER 7
+
+#define DEFAULT_WINDOW_SIZE 4
+
+/*
+ * Module state
+ * ============
+ * The objects that the filters share are kept in the state of the module,
+ * rather than created for every filter. The filter types are static types,
+ * which can only find their module with PyState_FindModule on the Python
+ * versions that are supported, so the module uses single-phase
+ * initialization with a state of its own in each interpreter.
+ */
+
+typedef struct {
+    // dnaio.SequenceRecord, imported when a record is first checked, so the
+    // native path never imports dnaio.
+    PyTypeObject *sequence_record_class;
+    // The interned attribute names of a SequenceRecord.
+    PyObject *qualities_attr;
+    PyObject *sequence_attr;
+} FiltersModuleState;
+
+static struct PyModuleDef _filters_module;
+
+/**
+ * @brief Returns the state of the _filters module of the current
+ * interpreter, or NULL with an exception set.
+ */
+static FiltersModuleState *
+FiltersModuleState_get(void)
+{
+    PyObject *module = PyState_FindModule(&_filters_module);
+    if (module == NULL) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "The _filters module is not initialized.");
         return NULL;
     }
-    return PyFloat_FromDouble(median);
+    return PyModule_GetState(module);
 }
 
-static PyMethodDef _filters_functions[] = {
-    AVERAGE_ERROR_RATE_METHODDEF,
-    QUALMEAN_METHODDEF,
-    QUALMEDIAN_METHODDEF,
-    {NULL}
-};
+/**
+ * @brief Stores a new reference to dnaio.SequenceRecord in
+ * sequence_record_class, importing dnaio if this has not happened before.
+ * The import can release the GIL, so another thread may have stored the
+ * class in the meantime.
+ *
+ * @return int 0 on success, -1 with an exception set otherwise.
+ */
+static int
+FiltersModuleState_get_sequence_record_class(
+    PyTypeObject **sequence_record_class)
+{
+    FiltersModuleState *state = FiltersModuleState_get();
+    if (state == NULL) {
+        return -1;
+    }
+    if (state->sequence_record_class == NULL) {
+        PyObject *dnaio = PyImport_ImportModule("dnaio");
+        if (dnaio == NULL) {
+            return -1;
+        }
+        PyObject *record_class = PyObject_GetAttrString(dnaio, "SequenceRecord");
+        Py_DECREF(dnaio);
+        if (record_class == NULL) {
+            return -1;
+        }
+        if (!PyType_Check(record_class)) {
+            PyErr_Format(PyExc_TypeError,
+                         "dnaio.SequenceRecord must be a type, got %s",
+                         Py_TYPE(record_class)->tp_name);
+            Py_DECREF(record_class);
+            return -1;
+        }
+        if (state->sequence_record_class == NULL) {
+            state->sequence_record_class = (PyTypeObject *)record_class;
+        } else {
+            Py_DECREF(record_class);
+        }
+    }
+    if (*sequence_record_class == NULL) {
+        Py_INCREF(state->sequence_record_class);
+        *sequence_record_class = state->sequence_record_class;
+    }
+    return 0;
+}
 
 typedef struct {
     PyObject_HEAD
+#ifdef FILTERS_USE_VECTORCALL
+    vectorcallfunc vectorcall;
+#endif
     unsigned long long total; 
     unsigned long long pass;
+    double time;
     double threshold_d;
     Py_ssize_t threshold_i;
+    Py_ssize_t window_size;
+    // NULL until the first record is checked.
     PyTypeObject *sequence_record_class;
     PyObject *sequence_record_atrr;
+    // The name of the sequence attribute for the filters that need the
+    // sequence, NULL otherwise.
+    PyObject *sequence_attr;
     uint8_t phred_offset;
+    uint8_t kind;
+    char tail_first;
+    char fixed_point;
+    char timed;
+    // Whether a sliding window filter cuts the reads at the first failing
+    // window instead of rejecting them.
+    char trim;
+    // Error rates indexed by the raw quality byte. Only filled in for
+    // quality filters.
+    double error_rates[256];
+    uint32_t fixed_point_error_rates[256];
 } FastqFilter;
 
-static void
-FastqFilter_dealloc(FastqFilter *self) 
+static PyTypeObject AverageErrorRateFilter_Type;
+static PyTypeObject MedianQualityFilter_Type;
+static PyTypeObject MinimumLengthFilter_Type;
+static PyTypeObject MaximumLengthFilter_Type;
+static PyTypeObject SlidingWindowErrorRateFilter_Type;
+static PyTypeObject MaximumNFilter_Type;
+static PyTypeObject MaximumHomopolymerFilter_Type;
+
+#ifdef FILTERS_USE_VECTORCALL
+static PyObject *
+FastqFilter__vectorcall(FastqFilter *self, PyObject *const *args,
+                        size_t nargsf, PyObject *kwnames);
+#endif
+
+static int
+FastqFilter_kind(PyTypeObject *type)
+{
+    if (type == &AverageErrorRateFilter_Type) {
+        return AVERAGE_ERROR_RATE_FILTER;
+    }
+    if (type == &MedianQualityFilter_Type) {
+        return MEDIAN_QUALITY_FILTER;
+    }
+    if (type == &MinimumLengthFilter_Type) {
+        return MINIMUM_LENGTH_FILTER;
+    }
+    if (type == &MaximumLengthFilter_Type) {
+        return MAXIMUM_LENGTH_FILTER;
+    }
+    if (type == &SlidingWindowErrorRateFilter_Type) {
+        return SLIDING_WINDOW_FILTER;
+    }
+    if (type == &MaximumNFilter_Type) {
+        return MAXIMUM_N_FILTER;
+    }
+    if (type == &MaximumHomopolymerFilter_Type) {
+        return MAXIMUM_HOMOPOLYMER_FILTER;
+    }
+    return -1;
+}
+
+static void
+FastqFilter_dealloc(FastqFilter *self) 
 {
     Py_CLEAR(self->sequence_record_class);
     Py_CLEAR(self->sequence_record_atrr);
+    Py_CLEAR(self->sequence_attr);
     Py_TYPE(self)->tp_free((PyObject *)self);
 }
 
@@ -305,7 +1811,11 @@ FastqFilter_dealloc(FastqFilter *self)
     {"total", T_ULONGLONG, offsetof(FastqFilter, total), READONLY, \
      "the total number of reads checked by this filter"}, \
     {"passed", T_ULONGLONG, offsetof(FastqFilter, pass), READONLY, \
-     "the total number of reads to pass this filter"},
+     "the total number of reads to pass this filter"}, \
+    {"time", T_DOUBLE, offsetof(FastqFilter, time), READONLY, \
+     "the time in seconds spent evaluating this filter, if it is timed"}, \
+    {"timed", T_BOOL, offsetof(FastqFilter, timed), READONLY, \
+     "whether the time spent evaluating this filter is measured"},
 
 static PyMemberDef GenericQualityFilterMembers[] = {
     GENERIC_FILTER_MEMBERS
@@ -313,6 +1823,36 @@ static PyMemberDef GenericQualityFilterMembers[] = {
      "The threshold for this filter."},
     {"phred_offset", T_UBYTE, offsetof(FastqFilter, phred_offset), READONLY,
      "The phred offset used for this filter."},
+    {"tail_first", T_BOOL, offsetof(FastqFilter, tail_first), READONLY,
+     "Whether the qualities are scanned from the end of the read."},
+    {NULL}
+};
+
+static PyMemberDef AverageErrorRateFilterMembers[] = {
+    GENERIC_FILTER_MEMBERS
+    {"threshold", T_DOUBLE, offsetof(FastqFilter, threshold_d), READONLY, 
+     "The threshold for this filter."},
+    {"phred_offset", T_UBYTE, offsetof(FastqFilter, phred_offset), READONLY,
+     "The phred offset used for this filter."},
+    {"tail_first", T_BOOL, offsetof(FastqFilter, tail_first), READONLY,
+     "Whether the qualities are scanned from the end of the read."},
+    {"fixed_point", T_BOOL, offsetof(FastqFilter, fixed_point), READONLY,
+     "Whether the error rates are summed in fixed-point."},
+    {NULL}
+};
+
+static PyMemberDef SlidingWindowErrorRateFilterMembers[] = {
+    GENERIC_FILTER_MEMBERS
+    {"threshold", T_DOUBLE, offsetof(FastqFilter, threshold_d), READONLY,
+     "The threshold for this filter."},
+    {"window_size", T_PYSSIZET, offsetof(FastqFilter, window_size), READONLY,
+     "The number of bases in a window."},
+    {"phred_offset", T_UBYTE, offsetof(FastqFilter, phred_offset), READONLY,
+     "The phred offset used for this filter."},
+    {"tail_first", T_BOOL, offsetof(FastqFilter, tail_first), READONLY,
+     "Whether the windows are checked from the end of the read."},
+    {"trim", T_BOOL, offsetof(FastqFilter, trim), READONLY,
+     "Whether the reads are cut at the first failing window."},
     {NULL}
 };
 
@@ -323,366 +1863,3109 @@ static PyMemberDef GenericLengthFilterMembers[] = {
     {NULL}
 };
 
+static PyMemberDef MaximumNFilterMembers[] = {
+    GENERIC_FILTER_MEMBERS
+    {"threshold", T_DOUBLE, offsetof(FastqFilter, threshold_d), READONLY,
+     "The threshold for this filter."},
+    {NULL}
+};
+
+
+static PyObject *
+GenericQualityFilter__new__(PyTypeObject *type, PyObject *args, PyObject *kwargs) 
+{
+    uint8_t phred_offset = DEFAULT_PHRED_SCORE_OFFSET;
+    double threshold_d = 0.0L;
+    int tail_first = 0;
+    int fixed_point = 0;
+    int timed = 0;
+    int trim = 0;
+    int kind = FastqFilter_kind(type);
+    static char *kwarg_names[] = {
+        "threshold", "phred_offset", "tail_first", "timed", NULL};
+    static char *error_rate_kwarg_names[] = {
+        "threshold", "phred_offset", "tail_first", "timed", "fixed_point", NULL};
+    static char *window_kwarg_names[] = {
+        "threshold", "window_size", "phred_offset", "tail_first", "timed",
+        "trim", NULL};
+    Py_ssize_t window_size = DEFAULT_WINDOW_SIZE;
+    if (kind == SLIDING_WINDOW_FILTER) {
+        if (!PyArg_ParseTupleAndKeywords(
+            args, kwargs, "d|n$bppp:", window_kwarg_names,
+            &threshold_d,
+            &window_size,
+            &phred_offset,
+            &tail_first,
+            &timed,
+            &trim)) {
+                return NULL;
+        }
+        if (trim && tail_first) {
+            // The reads are cut at the first failing window from the start.
+            PyErr_SetString(PyExc_ValueError,
+                            "trim can not be combined with tail_first");
+            return NULL;
+        }
+        if (window_size < 1) {
+            PyErr_Format(PyExc_ValueError,
+                         "window_size must be at least 1, got %zd",
+                         window_size);
+            return NULL;
+        }
+    } else if (kind == AVERAGE_ERROR_RATE_FILTER) {
+        if (!PyArg_ParseTupleAndKeywords(
+            args, kwargs, "d|$bppp:", error_rate_kwarg_names,
+            &threshold_d,
+            &phred_offset,
+            &tail_first,
+            &timed,
+            &fixed_point)) {
+                return NULL;
+        }
+    } else if (!PyArg_ParseTupleAndKeywords(
+        args, kwargs, "d|$bpp:", kwarg_names,
+        &threshold_d,
+        &phred_offset,
+        &tail_first,
+        &timed)) {
+            return NULL;
+    }
+    FiltersModuleState *state = FiltersModuleState_get();
+    if (state == NULL) {
+        return NULL;
+    }
+    FastqFilter *self = PyObject_New(FastqFilter, type);
+    if (self == NULL) {
+        return NULL;
+    }
+#ifdef FILTERS_USE_VECTORCALL
+    self->vectorcall = (vectorcallfunc)FastqFilter__vectorcall;
+#endif
+    self->kind = kind;
+    self->phred_offset = phred_offset;
+    self->tail_first = (char)tail_first;
+    self->fixed_point = (char)fixed_point;
+    self->timed = (char)timed;
+    self->trim = (char)trim;
+    self->time = 0.0;
+    error_rate_table_init(self->error_rates, phred_offset);
+    fixed_point_error_rate_table_init(self->fixed_point_error_rates, phred_offset);
+    self->threshold_d = threshold_d;
+    self->threshold_i = 0;
+    self->window_size = window_size;
+    self->total = 0;
+    self->pass = 0;
+    self->sequence_record_class = NULL;
+    Py_INCREF(state->qualities_attr);
+    self->sequence_record_atrr = state->qualities_attr;
+    self->sequence_attr = NULL;
+    return (PyObject *)self;
+}
+
+static PyObject *
+GenericLengthFilter__new__(PyTypeObject *type, PyObject *args, PyObject *kwargs) 
+{
+    uint8_t phred_offset = DEFAULT_PHRED_SCORE_OFFSET;
+    Py_ssize_t threshold_i = 0L;
+    int timed = 0;
+    static char *kwarg_names[] = {"threshold", "timed", NULL};
+    static const char *format = "n|$p:";
+    if (!PyArg_ParseTupleAndKeywords(
+        args, kwargs, format, kwarg_names,
+        &threshold_i,
+        &timed)) {
+            return NULL;
+    }
+    FastqFilter *self = PyObject_New(FastqFilter, type);
+    if (self == NULL) {
+        return NULL;
+    }
+#ifdef FILTERS_USE_VECTORCALL
+    self->vectorcall = (vectorcallfunc)FastqFilter__vectorcall;
+#endif
+    self->kind = FastqFilter_kind(type);
+    self->phred_offset = phred_offset;
+    self->tail_first = 0;
+    self->fixed_point = 0;
+    self->timed = (char)timed;
+    self->trim = 0;
+    self->time = 0.0;
+    self->threshold_i = threshold_i;
+    self->threshold_d = 0.0L;
+    self->window_size = 0;
+    self->total = 0;
+    self->pass = 0;
+    self->sequence_record_class = NULL;
+    // The PyObject_Length method can be used directly on a dnaio.SequenceRecord
+    // rather than getting the "sequence" attribute and using PyUnicode_Length.
+    self->sequence_record_atrr = NULL;
+    self->sequence_attr = NULL;
+    return (PyObject *)self;
+}
+
+static PyObject *
+GenericSequenceFilter__new__(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    double threshold_d = 0.0L;
+    Py_ssize_t threshold_i = 0L;
+    int timed = 0;
+    int kind = FastqFilter_kind(type);
+    static char *kwarg_names[] = {"threshold", "timed", NULL};
+    if (kind == MAXIMUM_N_FILTER) {
+        if (!PyArg_ParseTupleAndKeywords(
+            args, kwargs, "d|$p:", kwarg_names,
+            &threshold_d,
+            &timed)) {
+                return NULL;
+        }
+    } else {
+        if (!PyArg_ParseTupleAndKeywords(
+            args, kwargs, "n|$p:", kwarg_names,
+            &threshold_i,
+            &timed)) {
+                return NULL;
+        }
+        if (threshold_i < 0) {
+            PyErr_Format(PyExc_ValueError,
+                         "threshold must be at least 0, got %zd",
+                         threshold_i);
+            return NULL;
+        }
+    }
+    FiltersModuleState *state = FiltersModuleState_get();
+    if (state == NULL) {
+        return NULL;
+    }
+    FastqFilter *self = PyObject_New(FastqFilter, type);
+    if (self == NULL) {
+        return NULL;
+    }
+#ifdef FILTERS_USE_VECTORCALL
+    self->vectorcall = (vectorcallfunc)FastqFilter__vectorcall;
+#endif
+    self->kind = kind;
+    self->phred_offset = DEFAULT_PHRED_SCORE_OFFSET;
+    self->tail_first = 0;
+    self->fixed_point = 0;
+    self->timed = (char)timed;
+    self->trim = 0;
+    self->time = 0.0;
+    self->threshold_i = threshold_i;
+    self->threshold_d = threshold_d;
+    self->window_size = 0;
+    self->total = 0;
+    self->pass = 0;
+    self->sequence_record_class = NULL;
+    self->sequence_record_atrr = NULL;
+    Py_INCREF(state->sequence_attr);
+    self->sequence_attr = state->sequence_attr;
+    return (PyObject *)self;
+}
+
+/**
+ * @brief Checks that arg is a tuple of SequenceRecord objects.
+ *
+ * @param sequence_record_class The cached SequenceRecord class of a filter.
+ *        It is looked up in the module state the first time a record is
+ *        checked.
+ * @return int 0 on success, -1 with an exception set otherwise.
+ */
+static int
+GenericFilter_CheckRecordTuple(PyObject *arg, PyTypeObject **sequence_record_class)
+{
+    if (!PyTuple_CheckExact(arg)) {
+        PyErr_Format(PyExc_TypeError, 
+                     "filter argument must be a tuple, got %s",
+                     Py_TYPE(arg)->tp_name);
+        return -1;
+    }
+    Py_ssize_t record_tuple_length = PyTuple_GET_SIZE(arg);
+    PyObject *record;
+    for (Py_ssize_t i=0; i < record_tuple_length; i++) {
+        record = PyTuple_GET_ITEM(arg, i);
+        if (Py_TYPE(record) != *sequence_record_class) {
+            if (*sequence_record_class == NULL) {
+                if (FiltersModuleState_get_sequence_record_class(
+                        sequence_record_class) < 0) {
+                    return -1;
+                }
+                if (Py_TYPE(record) == *sequence_record_class) {
+                    continue;
+                }
+            }
+            PyErr_Format(
+                PyExc_TypeError, 
+                "All records must be of type dnaio.SequenceRecord, "
+                "got %s at index %zd", 
+                Py_TYPE(record)->tp_name, i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static PyObject *
+GenericFilter_ParseArgsToRecordTuple(PyObject *args, 
+                                     PyObject *kwargs, 
+                                     PyTypeObject **sequence_record_class) 
+{
+    if (kwargs != NULL && PyDict_GET_SIZE(kwargs) != 0) {
+        PyErr_Format(PyExc_TypeError, 
+                     "filter takes exactly 0 keyword arguments, got %zd",
+                     PyDict_GET_SIZE(kwargs));
+        return NULL;
+    }
+    if (PyTuple_GET_SIZE(args) != 1) {
+        PyErr_Format(PyExc_TypeError, 
+                     "filter takes exactly 1 positional argument, got %zd",
+                     PyTuple_GET_SIZE(args));
+        return NULL;
+    }
+    PyObject *arg = PyTuple_GET_ITEM(args, 0);
+    if (GenericFilter_CheckRecordTuple(arg, sequence_record_class) < 0) {
+        return NULL;
+    }
+    return arg;
+}
+
+#ifdef FILTERS_USE_VECTORCALL
+static PyObject *
+GenericFilter_VectorcallArgsToRecordTuple(PyObject *const *args,
+                                          size_t nargsf,
+                                          PyObject *kwnames,
+                                          PyTypeObject **sequence_record_class)
+{
+    if (kwnames != NULL && PyTuple_GET_SIZE(kwnames) != 0) {
+        PyErr_Format(PyExc_TypeError,
+                     "filter takes exactly 0 keyword arguments, got %zd",
+                     PyTuple_GET_SIZE(kwnames));
+        return NULL;
+    }
+    Py_ssize_t nargs = PyVectorcall_NARGS(nargsf);
+    if (nargs != 1) {
+        PyErr_Format(PyExc_TypeError,
+                     "filter takes exactly 1 positional argument, got %zd",
+                     nargs);
+        return NULL;
+    }
+    if (GenericFilter_CheckRecordTuple(args[0], sequence_record_class) < 0) {
+        return NULL;
+    }
+    return args[0];
+}
+#endif
+
+/**
+ * @brief Returns a new reference to the qualities of a SequenceRecord, or
+ * NULL with an exception set when the record has no qualities.
+ */
+static PyObject *
+SequenceRecord_GetQualities(PyObject *record, PyObject *qualities_attr)
+{
+    PyObject *phred_scores = PyObject_GetAttr(record, qualities_attr);
+    if (phred_scores == NULL) {
+        return NULL;
+    }
+    if (phred_scores == Py_None) {
+        PyErr_Format(
+            PyExc_ValueError,
+            "SequenceRecord object with name %R does not have quality scores "
+            "(FASTA record)", PyObject_GetAttrString(record, "name")
+        );
+        Py_DECREF(phred_scores);
+        return NULL;
+    }
+    return phred_scores;
+}
+
+/**
+ * @brief Fills in the span of a SequenceRecord. The qualities and the
+ * sequence are only retrieved when their attribute name is given. When
+ * neither is needed only the length is filled in.
+ *
+ * @param references New references to the retrieved strings are appended
+ *        to this array, which needs room for two per record.
+ * @return int 0 on success, -1 with an exception set on error.
+ */
+static int
+RecordSpan_FromSequenceRecord(RecordSpan *span, PyObject *record,
+                              PyObject *qualities_attr, PyObject *sequence_attr,
+                              PyObject **references,
+                              Py_ssize_t *number_of_references)
+{
+    span->qualities = NULL;
+    span->sequence = NULL;
+    if (qualities_attr == NULL && sequence_attr == NULL) {
+        span->length = PyObject_Length(record);
+        return span->length < 0 ? -1 : 0;
+    }
+    if (qualities_attr != NULL) {
+        PyObject *phred_scores = SequenceRecord_GetQualities(record, qualities_attr);
+        if (phred_scores == NULL) {
+            return -1;
+        }
+        references[*number_of_references] = phred_scores;
+        *number_of_references += 1;
+        span->qualities = PyUnicode_DATA(phred_scores);
+        span->length = PyUnicode_GET_LENGTH(phred_scores);
+    }
+    if (sequence_attr != NULL) {
+        PyObject *sequence = PyObject_GetAttr(record, sequence_attr);
+        if (sequence == NULL) {
+            return -1;
+        }
+        references[*number_of_references] = sequence;
+        *number_of_references += 1;
+        span->sequence = PyUnicode_DATA(sequence);
+        span->length = PyUnicode_GET_LENGTH(sequence);
+    }
+    return 0;
+}
+
+// Record tuples rarely contain more than a few records, so the spans for
+// those are kept on the stack.
+#define RECORD_SPANS_ON_STACK 8
+
+/**
+ * The spans of the records in a record tuple. The qualities and sequence
+ * strings are referenced as long as the spans are in use.
+ */
+typedef struct {
+    RecordSpan *spans;
+    Py_ssize_t number_of_spans;
+    Py_ssize_t total_length;
+    PyObject **references;
+    Py_ssize_t number_of_references;
+    RecordSpan spans_on_stack[RECORD_SPANS_ON_STACK];
+    PyObject *references_on_stack[2 * RECORD_SPANS_ON_STACK];
+} RecordTupleSpans;
+
+static void
+RecordTupleSpans_Release(RecordTupleSpans *self)
+{
+    for (Py_ssize_t i=0; i < self->number_of_references; i++) {
+        Py_DECREF(self->references[i]);
+    }
+    if (self->spans != self->spans_on_stack) {
+        PyMem_Free(self->spans);
+        PyMem_Free(self->references);
+    }
+    self->spans = NULL;
+    self->references = NULL;
+    self->number_of_references = 0;
+}
+
+/**
+ * @brief Fills the spans with the records in the record tuple, see
+ * RecordSpan_FromSequenceRecord.
+ *
+ * @return int 0 on success, -1 on error. The spans must be released with
+ *         RecordTupleSpans_Release in both cases.
+ */
+static int
+RecordTupleSpans_Init(RecordTupleSpans *self, PyObject *record_tuple,
+                      PyObject *qualities_attr, PyObject *sequence_attr)
+{
+    Py_ssize_t record_tuple_length = PyTuple_GET_SIZE(record_tuple);
+    self->spans = self->spans_on_stack;
+    self->references = self->references_on_stack;
+    self->number_of_spans = record_tuple_length;
+    self->total_length = 0;
+    self->number_of_references = 0;
+    if (record_tuple_length > RECORD_SPANS_ON_STACK) {
+        self->spans = PyMem_Malloc(sizeof(RecordSpan) * record_tuple_length);
+        self->references = PyMem_Malloc(
+            sizeof(PyObject *) * 2 * record_tuple_length);
+        if (self->spans == NULL || self->references == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+    for (Py_ssize_t i=0; i < record_tuple_length; i++) {
+        PyObject *record = PyTuple_GET_ITEM(record_tuple, i);
+        RecordSpan *span = self->spans + i;
+        if (RecordSpan_FromSequenceRecord(
+                span, record, qualities_attr, sequence_attr,
+                self->references, &self->number_of_references) < 0) {
+            return -1;
+        }
+        if (qualities_attr != NULL || sequence_attr != NULL) {
+            self->total_length += span->length;
+        }
+    }
+    return 0;
+}
+
+// The quality filter kinds in a set of filter stages, used to select a
+// specialized kernel.
+#define STAGES_WITH_ERROR_RATE 1
+#define STAGES_WITH_MEDIAN 2
+#define STAGES_WITH_WINDOW 4
+
+/**
+ * The filters that are evaluated on a record tuple, in order. Used for both a
+ * single filter and a FilterPipeline. Contains no Python references of its
+ * own, the filters are kept alive by their owner.
+ */
+typedef struct {
+    FastqFilter **filters;
+    const uint8_t *kinds;
+    Py_ssize_t number_of_filters;
+    uint8_t phred_offset;
+    uint8_t quality_kinds;
+    // Whether the stages are timed, which is the case when any of the
+    // filters is timed.
+    char timed;
+    // Whether any of the filters trims the records. The trimmed lengths are
+    // written to the spans, and the records that pass are cut to them.
+    char trims;
+    // When not NULL, the number of evaluated and passed record tuples are
+    // added to counts[0] and counts[1] along with the filter counters.
+    unsigned long long *counts;
+} FilterStages;
+
+static uint8_t
+FilterStages_quality_kinds(const uint8_t *kinds, Py_ssize_t number_of_filters)
+{
+    uint8_t quality_kinds = 0;
+    for (Py_ssize_t i=0; i < number_of_filters; i++) {
+        if (kinds[i] == AVERAGE_ERROR_RATE_FILTER) {
+            quality_kinds |= STAGES_WITH_ERROR_RATE;
+        } else if (kinds[i] == MEDIAN_QUALITY_FILTER) {
+            quality_kinds |= STAGES_WITH_MEDIAN;
+        } else if (kinds[i] == SLIDING_WINDOW_FILTER) {
+            quality_kinds |= STAGES_WITH_WINDOW;
+        }
+    }
+    return quality_kinds;
+}
+
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+/**
+ * @brief Evaluates the filters on a set of records that belong together.
+ * Stops at the first filter that fails. The qualities are validated once,
+ * when the first quality filter is reached, and each statistic is only
+ * computed when its filter is reached.
+ *
+ * The filter counters are not updated, so that this function does not touch
+ * any Python objects and can be called without the GIL. The caller updates
+ * them with FilterStages_count or FilterStages_count_histogram.
+ *
+ * A trimming sliding window filter passes and shortens the lengths of the
+ * spans to the trimmed lengths, which the filters after it check.
+ *
+ * This is always inlined into the kernels below with compile-time constants
+ * for fixed_number_of_spans and quality_kinds, so each kernel only contains
+ * the loops and branches that its configuration can take.
+ *
+ * @param invalid_span Set to the index of the span with invalid phred scores
+ *        on error.
+ * @param fixed_number_of_spans The number of spans, or 0 when it is only
+ *        known at run time.
+ * @param quality_kinds The STAGES_WITH flags of the quality filters that can
+ *        occur in the stages.
+ * @param stage_times When not NULL, the time spent in each stage is added to
+ *        it in nanoseconds. The time of the quality validation is counted
+ *        in the first quality filter.
+ * @return Py_ssize_t The number of filters that passed, which equals
+ *         number_of_filters when the records pass, or -1 on invalid phred
+ *         scores.
+ */
+static ALWAYS_INLINE Py_ssize_t
+FilterStages_evaluate_kernel(const FilterStages *stages, RecordSpan *spans,
+                             Py_ssize_t number_of_spans, Py_ssize_t *invalid_span,
+                             uint64_t *stage_times,
+                             const Py_ssize_t fixed_number_of_spans,
+                             const int quality_kinds)
+{
+    if (fixed_number_of_spans) {
+        number_of_spans = fixed_number_of_spans;
+    }
+    int qualities_validated = 0;
+    uint64_t stage_start = stage_times != NULL ? monotonic_ns() : 0;
+    for (Py_ssize_t i=0; i < stages->number_of_filters; i++) {
+        FastqFilter *stage = stages->filters[i];
+        int pass = 0;
+        uint8_t kind = stages->kinds[i];
+        if (kind == MINIMUM_LENGTH_FILTER) {
+            // If any of the records passes the minimum length we pass.
+            // R1 and R2 sequence the same molecule so this is valid.
+            for (Py_ssize_t j=0; j < number_of_spans; j++) {
+                if (spans[j].length >= stage->threshold_i) {
+                    pass = 1;
+                    break;
+                }
+            }
+        } else if (kind == MAXIMUM_LENGTH_FILTER) {
+            // If any of the records exceeds the maximum length we fail.
+            pass = 1;
+            for (Py_ssize_t j=0; j < number_of_spans; j++) {
+                if (spans[j].length > stage->threshold_i) {
+                    pass = 0;
+                    break;
+                }
+            }
+        } else if (kind == MAXIMUM_N_FILTER) {
+            // If any of the records has too many N bases we fail. A threshold
+            // below 1 is a fraction of the length of each record.
+            pass = 1;
+            for (Py_ssize_t j=0; j < number_of_spans; j++) {
+                double max_n = stage->threshold_d < 1.0 ?
+                    stage->threshold_d * (double)spans[j].length :
+                    stage->threshold_d;
+                if ((double)count_n_bases(spans[j].sequence, spans[j].length) > max_n) {
+                    pass = 0;
+                    break;
+                }
+            }
+        } else if (kind == MAXIMUM_HOMOPOLYMER_FILTER) {
+            pass = 1;
+            for (Py_ssize_t j=0; j < number_of_spans; j++) {
+                if (homopolymer_longer_than(spans[j].sequence, spans[j].length,
+                                            stage->threshold_i)) {
+                    pass = 0;
+                    break;
+                }
+            }
+        } else if (quality_kinds) {
+            if (!qualities_validated) {
+                *invalid_span = find_invalid_record_span(
+                    spans, number_of_spans, stages->phred_offset);
+                if (*invalid_span >= 0) {
+                    return -1;
+                }
+                qualities_validated = 1;
+            }
+            // When only one quality kind can occur, the kind does not have
+            // to be checked.
+            if ((quality_kinds & STAGES_WITH_ERROR_RATE) &&
+                (quality_kinds == STAGES_WITH_ERROR_RATE ||
+                 kind == AVERAGE_ERROR_RATE_FILTER)) {
+                pass = average_error_rate_at_most_threshold(
+                    spans, number_of_spans, stage->threshold_d,
+                    stage->error_rates,
+                    stage->fixed_point ? stage->fixed_point_error_rates : NULL,
+                    stage->tail_first);
+            } else if ((quality_kinds & STAGES_WITH_MEDIAN) &&
+                       ((quality_kinds & ~STAGES_WITH_ERROR_RATE) ==
+                            STAGES_WITH_MEDIAN ||
+                        kind == MEDIAN_QUALITY_FILTER)) {
+                pass = median_at_least_threshold(
+                    spans, number_of_spans, stage->threshold_d,
+                    stages->phred_offset, stage->tail_first);
+            } else if (stage->trim) {
+                for (Py_ssize_t j=0; j < number_of_spans; j++) {
+                    spans[j].length = window_trim_length(
+                        spans[j].qualities, spans[j].length,
+                        stage->threshold_d, stage->window_size,
+                        stage->fixed_point_error_rates);
+                }
+                pass = 1;
+            } else {
+                pass = windows_at_most_threshold(
+                    spans, number_of_spans, stage->threshold_d,
+                    stage->window_size, stage->fixed_point_error_rates,
+                    stage->tail_first);
+            }
+        }
+        if (stage_times != NULL) {
+            uint64_t stage_end = monotonic_ns();
+            stage_times[i] += stage_end - stage_start;
+            stage_start = stage_end;
+        }
+        if (!pass) {
+            return i;
+        }
+    }
+    return stages->number_of_filters;
+}
+
+typedef Py_ssize_t (*FilterStagesKernel)(const FilterStages *, RecordSpan *,
+                                         Py_ssize_t, Py_ssize_t *, uint64_t *);
+
+#define FILTER_STAGES_KERNEL(name, fixed_number_of_spans, quality_kinds) \
+    static Py_ssize_t \
+    name(const FilterStages *stages, RecordSpan *spans, \
+         Py_ssize_t number_of_spans, Py_ssize_t *invalid_span, \
+         uint64_t *stage_times) \
+    { \
+        return FilterStages_evaluate_kernel( \
+            stages, spans, number_of_spans, invalid_span, stage_times, \
+            fixed_number_of_spans, quality_kinds); \
+    }
+
+#define FILTER_STAGES_KERNELS(suffix, quality_kinds) \
+    FILTER_STAGES_KERNEL(FilterStages_evaluate_any_##suffix, 0, quality_kinds) \
+    FILTER_STAGES_KERNEL(FilterStages_evaluate_single_##suffix, 1, quality_kinds) \
+    FILTER_STAGES_KERNEL(FilterStages_evaluate_paired_##suffix, 2, quality_kinds)
+
+FILTER_STAGES_KERNELS(length, 0)
+FILTER_STAGES_KERNELS(error_rate, STAGES_WITH_ERROR_RATE)
+FILTER_STAGES_KERNELS(median, STAGES_WITH_MEDIAN)
+FILTER_STAGES_KERNELS(error_rate_median, STAGES_WITH_ERROR_RATE | STAGES_WITH_MEDIAN)
+FILTER_STAGES_KERNELS(window, STAGES_WITH_WINDOW)
+FILTER_STAGES_KERNELS(error_rate_window, STAGES_WITH_ERROR_RATE | STAGES_WITH_WINDOW)
+FILTER_STAGES_KERNELS(median_window, STAGES_WITH_MEDIAN | STAGES_WITH_WINDOW)
+FILTER_STAGES_KERNELS(error_rate_median_window,
+                      STAGES_WITH_ERROR_RATE | STAGES_WITH_MEDIAN | STAGES_WITH_WINDOW)
+
+// Indexed by the quality kinds and by the number of spans, with 0 for any
+// other number of spans.
+static const FilterStagesKernel FILTER_STAGES_KERNELS_TABLE[8][3] = {
+    {FilterStages_evaluate_any_length,
+     FilterStages_evaluate_single_length,
+     FilterStages_evaluate_paired_length},
+    {FilterStages_evaluate_any_error_rate,
+     FilterStages_evaluate_single_error_rate,
+     FilterStages_evaluate_paired_error_rate},
+    {FilterStages_evaluate_any_median,
+     FilterStages_evaluate_single_median,
+     FilterStages_evaluate_paired_median},
+    {FilterStages_evaluate_any_error_rate_median,
+     FilterStages_evaluate_single_error_rate_median,
+     FilterStages_evaluate_paired_error_rate_median},
+    {FilterStages_evaluate_any_window,
+     FilterStages_evaluate_single_window,
+     FilterStages_evaluate_paired_window},
+    {FilterStages_evaluate_any_error_rate_window,
+     FilterStages_evaluate_single_error_rate_window,
+     FilterStages_evaluate_paired_error_rate_window},
+    {FilterStages_evaluate_any_median_window,
+     FilterStages_evaluate_single_median_window,
+     FilterStages_evaluate_paired_median_window},
+    {FilterStages_evaluate_any_error_rate_median_window,
+     FilterStages_evaluate_single_error_rate_median_window,
+     FilterStages_evaluate_paired_error_rate_median_window},
+};
+
+/**
+ * @brief Selects the kernel that is specialized for the filters in the
+ * stages and the number of records per record tuple. The kernel can be
+ * reused for all record tuples with that number of records.
+ */
+static FilterStagesKernel
+FilterStages_kernel(const FilterStages *stages, Py_ssize_t number_of_spans)
+{
+    Py_ssize_t spans_index = number_of_spans <= 2 ? number_of_spans : 0;
+    return FILTER_STAGES_KERNELS_TABLE[stages->quality_kinds][spans_index];
+}
+
+/**
+ * @brief Evaluates the filters on a single record tuple with the matching
+ * kernel. See FilterStages_evaluate_kernel.
+ */
+static Py_ssize_t
+FilterStages_evaluate(const FilterStages *stages, RecordSpan *spans,
+                      Py_ssize_t number_of_spans, Py_ssize_t *invalid_span,
+                      uint64_t *stage_times)
+{
+    return FilterStages_kernel(stages, number_of_spans)(
+        stages, spans, number_of_spans, invalid_span, stage_times);
+}
+
+/**
+ * @brief Allocates the array for the times of the stages, when the stages
+ * are timed.
+ *
+ * @return int 0 on success, -1 with an exception set when out of memory.
+ *         stage_times is set to NULL when the stages are not timed.
+ */
+static int
+FilterStages_alloc_times(const FilterStages *stages, uint64_t **stage_times)
+{
+    *stage_times = NULL;
+    if (!stages->timed) {
+        return 0;
+    }
+    *stage_times = PyMem_Calloc(stages->number_of_filters + 1, sizeof(uint64_t));
+    if (*stage_times == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Adds the times, in nanoseconds, to the time of each filter.
+ * Does nothing when stage_times is NULL.
+ */
+static void
+FilterStages_add_times(const FilterStages *stages, const uint64_t *stage_times)
+{
+    if (stage_times == NULL) {
+        return;
+    }
+    for (Py_ssize_t i=0; i < stages->number_of_filters; i++) {
+        stages->filters[i]->time += (double)stage_times[i] / 1e9;
+    }
+}
+
+/**
+ * @brief Updates the filter counters for a single evaluation that passed
+ * stages_passed filters.
+ */
+static void
+FilterStages_count(const FilterStages *stages, Py_ssize_t stages_passed)
+{
+    for (Py_ssize_t i=0; i < stages_passed; i++) {
+        stages->filters[i]->total += 1;
+        stages->filters[i]->pass += 1;
+    }
+    if (stages_passed < stages->number_of_filters) {
+        stages->filters[stages_passed]->total += 1;
+    }
+    if (stages->counts != NULL) {
+        stages->counts[0] += 1;
+        stages->counts[1] += stages_passed == stages->number_of_filters;
+    }
+}
+
+/**
+ * @brief Updates the filter counters from a histogram of the number of
+ * filters passed. Records that passed k filters were checked by the first
+ * k + 1 filters and passed the first k.
+ *
+ * @param stages_passed_counts Array of number_of_filters + 1 counts.
+ */
+static void
+FilterStages_count_histogram(const FilterStages *stages,
+                             const unsigned long long *stages_passed_counts)
+{
+    unsigned long long passed = stages_passed_counts[stages->number_of_filters];
+    unsigned long long reached = passed;
+    for (Py_ssize_t i=stages->number_of_filters - 1; i >= 0; i--) {
+        stages->filters[i]->pass += reached;
+        reached += stages_passed_counts[i];
+        stages->filters[i]->total += reached;
+    }
+    if (stages->counts != NULL) {
+        stages->counts[0] += reached;
+        stages->counts[1] += passed;
+    }
+}
+
+/**
+ * @brief Copies the stages with arrays of filters and kinds of their own, so
+ * the copy can be evaluated without the GIL while the filters of the
+ * original are reordered. The copy is freed with FilterStages_free_copy.
+ *
+ * @return int 0 on success, -1 with an exception set when out of memory.
+ */
+static int
+FilterStages_copy(const FilterStages *stages, FilterStages *copy)
+{
+    Py_ssize_t number_of_filters = stages->number_of_filters;
+    FastqFilter **filters = PyMem_Malloc(
+        number_of_filters * (sizeof(FastqFilter *) + sizeof(uint8_t)) + 1);
+    if (filters == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    uint8_t *kinds = (uint8_t *)(filters + number_of_filters);
+    memcpy(filters, stages->filters, number_of_filters * sizeof(FastqFilter *));
+    memcpy(kinds, stages->kinds, number_of_filters * sizeof(uint8_t));
+    *copy = *stages;
+    copy->filters = filters;
+    copy->kinds = kinds;
+    return 0;
+}
+
+static void
+FilterStages_free_copy(FilterStages *copy)
+{
+    PyMem_Free(copy->filters);
+    copy->filters = NULL;
+    copy->kinds = NULL;
+}
+
+/**
+ * @brief Replaces an attribute of a record with its first length characters.
+ *
+ * @return int 0 on success, -1 with an exception set on error.
+ */
+static int
+SequenceRecord_cut_attr(PyObject *record, PyObject *attr, Py_ssize_t length)
+{
+    PyObject *value = PyObject_GetAttr(record, attr);
+    if (value == NULL) {
+        return -1;
+    }
+    PyObject *cut = PyUnicode_Substring(value, 0, length);
+    Py_DECREF(value);
+    if (cut == NULL) {
+        return -1;
+    }
+    int ret = PyObject_SetAttr(record, attr, cut);
+    Py_DECREF(cut);
+    return ret;
+}
+
+/**
+ * @brief Cuts the sequence and qualities of the records in a record tuple to
+ * the lengths of their spans, for the records that a trimming filter
+ * shortened. The records are changed in place.
+ *
+ * @return int 0 on success, -1 with an exception set on error.
+ */
+static int
+RecordTuple_trim(PyObject *record_tuple, const RecordSpan *spans,
+                 PyObject *qualities_attr)
+{
+    FiltersModuleState *state = FiltersModuleState_get();
+    if (state == NULL) {
+        return -1;
+    }
+    for (Py_ssize_t i=0; i < PyTuple_GET_SIZE(record_tuple); i++) {
+        PyObject *record = PyTuple_GET_ITEM(record_tuple, i);
+        PyObject *qualities = PyObject_GetAttr(record, qualities_attr);
+        if (qualities == NULL) {
+            return -1;
+        }
+        Py_ssize_t length = PyUnicode_GET_LENGTH(qualities);
+        Py_DECREF(qualities);
+        if (spans[i].length < length &&
+            (SequenceRecord_cut_attr(record, state->sequence_attr,
+                                     spans[i].length) < 0 ||
+             SequenceRecord_cut_attr(record, qualities_attr,
+                                     spans[i].length) < 0)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Evaluates the filters on a record tuple that has been checked with
+ * GenericFilter_CheckRecordTuple. Does not update the counters. When the
+ * stages trim and the record tuple passes, its records are trimmed.
+ *
+ * @param qualities_attr The qualities attribute name, or NULL when none of
+ *        the filters needs the qualities.
+ * @param sequence_attr The sequence attribute name, or NULL when none of the
+ *        filters needs the sequence.
+ * @return Py_ssize_t The number of filters that passed or -1 with an
+ *         exception set.
+ */
+static Py_ssize_t
+FilterStages_evaluate_record_tuple(const FilterStages *stages,
+                                   PyObject *record_tuple,
+                                   PyObject *qualities_attr,
+                                   PyObject *sequence_attr)
+{
+    RecordTupleSpans record_spans;
+    Py_ssize_t stages_passed = -1;
+    uint64_t *stage_times = NULL;
+    if (FilterStages_alloc_times(stages, &stage_times) < 0) {
+        return -1;
+    }
+    if (RecordTupleSpans_Init(&record_spans, record_tuple, qualities_attr,
+                              sequence_attr) == 0) {
+        Py_ssize_t invalid_span = -1;
+        MAYBE_WITHOUT_GIL(
+            record_spans.total_length >= GIL_RELEASE_MINIMUM_LENGTH,
+            stages_passed = FilterStages_evaluate(
+                stages, record_spans.spans, record_spans.number_of_spans,
+                &invalid_span, stage_times));
+        FilterStages_add_times(stages, stage_times);
+        if (stages_passed < 0) {
+            const RecordSpan *span = record_spans.spans + invalid_span;
+            raise_invalid_phred_error(span->qualities, span->length,
+                                      stages->phred_offset);
+        } else if (stages->trims &&
+                   stages_passed == stages->number_of_filters &&
+                   RecordTuple_trim(record_tuple, record_spans.spans,
+                                    qualities_attr) < 0) {
+            stages_passed = -1;
+        }
+    }
+    RecordTupleSpans_Release(&record_spans);
+    PyMem_Free(stage_times);
+    return stages_passed;
+}
+
+/**
+ * @brief Evaluates the filters on each record tuple in a sequence. The
+ * records are collected with the GIL held, the filters are evaluated without
+ * it. The counters are updated once for the whole batch, also for the record
+ * tuples that were evaluated before an error occurred. When the stages trim,
+ * the records of the passing record tuples are trimmed.
+ *
+ * @return PyObject* A bytes object with 1 for each record tuple that passes
+ *         and 0 for each record tuple that fails. NULL on error.
+ */
+static PyObject *
+FilterStages_filter_batch(const FilterStages *stages, PyObject *record_tuples_arg,
+                          PyTypeObject **sequence_record_class,
+                          PyObject *qualities_attr, PyObject *sequence_attr)
+{
+    PyObject *record_tuples = PySequence_Tuple(record_tuples_arg);
+    if (record_tuples == NULL) {
+        return NULL;
+    }
+    Py_ssize_t number_of_tuples = PyTuple_GET_SIZE(record_tuples);
+    Py_ssize_t number_of_records = 0;
+    for (Py_ssize_t i=0; i < number_of_tuples; i++) {
+        PyObject *record_tuple = PyTuple_GET_ITEM(record_tuples, i);
+        if (GenericFilter_CheckRecordTuple(record_tuple, sequence_record_class) < 0) {
+            Py_DECREF(record_tuples);
+            return NULL;
+        }
+        number_of_records += PyTuple_GET_SIZE(record_tuple);
+    }
+    PyObject *result = NULL;
+    Py_ssize_t number_of_references = 0;
+    RecordSpan *spans = PyMem_Malloc(sizeof(RecordSpan) * (number_of_records + 1));
+    Py_ssize_t *tuple_starts = PyMem_Malloc(sizeof(Py_ssize_t) * (number_of_tuples + 1));
+    PyObject **references = PyMem_Malloc(
+        sizeof(PyObject *) * 2 * (number_of_records + 1));
+    unsigned long long *stages_passed_counts = PyMem_Calloc(
+        stages->number_of_filters + 1, sizeof(unsigned long long));
+    uint64_t *stage_times = NULL;
+    if (spans == NULL || tuple_starts == NULL || references == NULL ||
+        stages_passed_counts == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    if (FilterStages_alloc_times(stages, &stage_times) < 0) {
+        goto error;
+    }
+    Py_ssize_t span_index = 0;
+    for (Py_ssize_t i=0; i < number_of_tuples; i++) {
+        PyObject *record_tuple = PyTuple_GET_ITEM(record_tuples, i);
+        tuple_starts[i] = span_index;
+        for (Py_ssize_t j=0; j < PyTuple_GET_SIZE(record_tuple); j++) {
+            PyObject *record = PyTuple_GET_ITEM(record_tuple, j);
+            RecordSpan *span = spans + span_index;
+            span_index += 1;
+            if (RecordSpan_FromSequenceRecord(
+                    span, record, qualities_attr, sequence_attr,
+                    references, &number_of_references) < 0) {
+                goto error;
+            }
+        }
+    }
+    tuple_starts[number_of_tuples] = span_index;
+    result = PyBytes_FromStringAndSize(NULL, number_of_tuples);
+    if (result == NULL) {
+        goto error;
+    }
+    char *flags = PyBytes_AS_STRING(result);
+    Py_ssize_t failed_tuple = -1;
+    Py_ssize_t invalid_span = -1;
+    Py_BEGIN_ALLOW_THREADS
+    // The record tuples in a batch usually all have the same size, so the
+    // kernel is only selected again when the size changes.
+    Py_ssize_t kernel_spans = -1;
+    FilterStagesKernel evaluate = NULL;
+    for (Py_ssize_t i=0; i < number_of_tuples; i++) {
+        Py_ssize_t start = tuple_starts[i];
+        Py_ssize_t number_of_spans = tuple_starts[i + 1] - start;
+        if (number_of_spans != kernel_spans) {
+            evaluate = FilterStages_kernel(stages, number_of_spans);
+            kernel_spans = number_of_spans;
+        }
+        Py_ssize_t stages_passed = evaluate(
+            stages, spans + start, number_of_spans, &invalid_span, stage_times);
+        if (stages_passed < 0) {
+            failed_tuple = i;
+            break;
+        }
+        stages_passed_counts[stages_passed] += 1;
+        flags[i] = stages_passed == stages->number_of_filters;
+    }
+    Py_END_ALLOW_THREADS
+    FilterStages_count_histogram(stages, stages_passed_counts);
+    FilterStages_add_times(stages, stage_times);
+    if (failed_tuple >= 0) {
+        const RecordSpan *span = spans + tuple_starts[failed_tuple] + invalid_span;
+        raise_invalid_phred_error(span->qualities, span->length,
+                                  stages->phred_offset);
+        Py_CLEAR(result);
+        goto error;
+    }
+    for (Py_ssize_t i=0; stages->trims && i < number_of_tuples; i++) {
+        if (flags[i] && RecordTuple_trim(PyTuple_GET_ITEM(record_tuples, i),
+                                         spans + tuple_starts[i],
+                                         qualities_attr) < 0) {
+            Py_CLEAR(result);
+            break;
+        }
+    }
+error:
+    for (Py_ssize_t i=0; i < number_of_references; i++) {
+        Py_DECREF(references[i]);
+    }
+    PyMem_Free(spans);
+    PyMem_Free(tuple_starts);
+    PyMem_Free(references);
+    PyMem_Free(stages_passed_counts);
+    PyMem_Free(stage_times);
+    Py_DECREF(record_tuples);
+    return result;
+}
+
+static PyObject *
+FastqFilter_filter_record_tuple(FastqFilter *self, PyObject *record_tuple)
+{
+    // A single filter is evaluated as a FilterStages of one filter, so it
+    // shares the code paths of the FilterPipeline.
+    FastqFilter *filter = self;
+    FilterStages stages = {&filter, &self->kind, 1, self->phred_offset,
+                           FilterStages_quality_kinds(&self->kind, 1),
+                           self->timed, self->trim};
+    Py_ssize_t stages_passed = FilterStages_evaluate_record_tuple(
+        &stages, record_tuple, self->sequence_record_atrr, self->sequence_attr);
+    if (stages_passed < 0) {
+        return NULL;
+    }
+    FilterStages_count(&stages, stages_passed);
+    return PyBool_FromLong(stages_passed == 1);
+}
+
+static PyObject *
+FastqFilter__call__(FastqFilter *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *record_tuple = GenericFilter_ParseArgsToRecordTuple(
+        args, kwargs, &self->sequence_record_class);
+    if (record_tuple == NULL) {
+        return NULL;
+    }
+    return FastqFilter_filter_record_tuple(self, record_tuple);
+}
+
+#ifdef FILTERS_USE_VECTORCALL
+static PyObject *
+FastqFilter__vectorcall(FastqFilter *self, PyObject *const *args,
+                        size_t nargsf, PyObject *kwnames)
+{
+    PyObject *record_tuple = GenericFilter_VectorcallArgsToRecordTuple(
+        args, nargsf, kwnames, &self->sequence_record_class);
+    if (record_tuple == NULL) {
+        return NULL;
+    }
+    return FastqFilter_filter_record_tuple(self, record_tuple);
+}
+#endif
+
+PyDoc_STRVAR(FastqFilter_filter_batch__doc__,
+"filter_batch($self, record_tuples, /)\n"
+"--\n"
+"\n"
+"Filters many record tuples in one call. Returns a bytes object with a 1 for\n"
+"each record tuple that passes and a 0 for each record tuple that fails.\n"
+"The counters are updated as if the filter was called for each record\n"
+"tuple. The GIL is released while the records are evaluated.\n"
+"\n"
+"  record_tuples\n"
+"    A sequence of tuples of dnaio.SequenceRecord objects.\n"
+);
+
+#define FASTQFILTER_FILTER_BATCH_METHODDEF    \
+    {"filter_batch", (PyCFunction)FastqFilter_filter_batch, \
+     METH_O, FastqFilter_filter_batch__doc__}
+
+static PyObject *
+FastqFilter_filter_batch(FastqFilter *self, PyObject *record_tuples)
+{
+    FastqFilter *filter = self;
+    FilterStages stages = {&filter, &self->kind, 1, self->phred_offset,
+                           FilterStages_quality_kinds(&self->kind, 1),
+                           self->timed, self->trim};
+    return FilterStages_filter_batch(&stages, record_tuples,
+                                     &self->sequence_record_class,
+                                     self->sequence_record_atrr,
+                                     self->sequence_attr);
+}
+
+static PyMethodDef FastqFilter_methods[] = {
+    FASTQFILTER_FILTER_BATCH_METHODDEF,
+    {NULL}
+};
+
+static PyObject *
+AverageErrorRateFilter_get_name(PyObject *self, void *closure)
+{
+    return PyUnicode_FromString("average error rate");
+}
+
+static PyObject *
+MedianQualityFilter_get_name(PyObject *self, void *closure)
+{
+    return PyUnicode_FromString("median quality");
+}
+
+static PyObject *
+SlidingWindowErrorRateFilter_get_name(PyObject *self, void *closure)
+{
+    return PyUnicode_FromString("sliding window error rate");
+}
+
+static PyObject *
+MinimumLengthFilter_get_name(PyObject *self, void *closure)
+{
+    return PyUnicode_FromString("minimum length");
+}
+
+static PyObject *
+MaximumLengthFilter_get_name(PyObject *self, void *closure)
+{
+    return PyUnicode_FromString("maximum length");
+}
+
+static PyObject *
+MaximumNFilter_get_name(PyObject *self, void *closure)
+{
+    return PyUnicode_FromString("maximum N bases");
+}
+
+static PyObject *
+MaximumHomopolymerFilter_get_name(PyObject *self, void *closure)
+{
+    return PyUnicode_FromString("maximum homopolymer length");
+}
+
+static PyGetSetDef AverageErrorRateFilter_properties[] = {
+    {"name", AverageErrorRateFilter_get_name, NULL, NULL, NULL}, {NULL}};
+
+static PyGetSetDef MedianQualityFilter_properties[] = {
+    {"name", MedianQualityFilter_get_name, NULL, NULL, NULL}, {NULL}};
+
+static PyGetSetDef SlidingWindowErrorRateFilter_properties[] = {
+    {"name", SlidingWindowErrorRateFilter_get_name, NULL, NULL, NULL}, {NULL}};
+
+static PyGetSetDef MinimumLengthFilter_properties[] = {
+    {"name", MinimumLengthFilter_get_name, NULL, NULL, NULL}, {NULL}};
+
+static PyGetSetDef MaximumLengthFilter_properties[] = {
+    {"name", MaximumLengthFilter_get_name, NULL, NULL, NULL}, {NULL}};
+
+static PyGetSetDef MaximumNFilter_properties[] = {
+    {"name", MaximumNFilter_get_name, NULL, NULL, NULL}, {NULL}};
+
+static PyGetSetDef MaximumHomopolymerFilter_properties[] = {
+    {"name", MaximumHomopolymerFilter_get_name, NULL, NULL, NULL}, {NULL}};
+
+static PyTypeObject AverageErrorRateFilter_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_filter.AverageErrorRateFilter",
+    .tp_basicsize = sizeof(FastqFilter),
+    .tp_dealloc = (destructor)FastqFilter_dealloc,
+    .tp_new = GenericQualityFilter__new__,
+    .tp_call = (ternaryfunc)FastqFilter__call__,
+#ifdef FILTERS_USE_VECTORCALL
+    .tp_vectorcall_offset = offsetof(FastqFilter, vectorcall),
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_VECTORCALL,
+#endif
+    .tp_methods = FastqFilter_methods,
+    .tp_members = AverageErrorRateFilterMembers,
+    .tp_getset = AverageErrorRateFilter_properties,
+};
+
+static PyTypeObject MedianQualityFilter_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_filter.MedianQualityFilter",
+    .tp_basicsize = sizeof(FastqFilter),
+    .tp_dealloc = (destructor)FastqFilter_dealloc,
+    .tp_new = GenericQualityFilter__new__,
+    .tp_call = (ternaryfunc)FastqFilter__call__,
+#ifdef FILTERS_USE_VECTORCALL
+    .tp_vectorcall_offset = offsetof(FastqFilter, vectorcall),
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_VECTORCALL,
+#endif
+    .tp_methods = FastqFilter_methods,
+    .tp_members = GenericQualityFilterMembers,
+    .tp_getset = MedianQualityFilter_properties,
+};
+
+static PyTypeObject SlidingWindowErrorRateFilter_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_filter.SlidingWindowErrorRateFilter",
+    .tp_basicsize = sizeof(FastqFilter),
+    .tp_dealloc = (destructor)FastqFilter_dealloc,
+    .tp_new = GenericQualityFilter__new__,
+    .tp_call = (ternaryfunc)FastqFilter__call__,
+#ifdef FILTERS_USE_VECTORCALL
+    .tp_vectorcall_offset = offsetof(FastqFilter, vectorcall),
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_VECTORCALL,
+#endif
+    .tp_methods = FastqFilter_methods,
+    .tp_members = SlidingWindowErrorRateFilterMembers,
+    .tp_getset = SlidingWindowErrorRateFilter_properties,
+};
+
+static PyTypeObject MinimumLengthFilter_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_filter.MinimumLengthFilter",
+    .tp_basicsize = sizeof(FastqFilter),
+    .tp_dealloc = (destructor)FastqFilter_dealloc,
+    .tp_new = GenericLengthFilter__new__,
+    .tp_call = (ternaryfunc)FastqFilter__call__,
+#ifdef FILTERS_USE_VECTORCALL
+    .tp_vectorcall_offset = offsetof(FastqFilter, vectorcall),
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_VECTORCALL,
+#endif
+    .tp_methods = FastqFilter_methods,
+    .tp_members = GenericLengthFilterMembers,
+    .tp_getset = MinimumLengthFilter_properties,
+};
+
+static PyTypeObject MaximumLengthFilter_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_filter.MaximumLengthFilter",
+    .tp_basicsize = sizeof(FastqFilter),
+    .tp_dealloc = (destructor)FastqFilter_dealloc,
+    .tp_new = GenericLengthFilter__new__,
+    .tp_call = (ternaryfunc)FastqFilter__call__,
+#ifdef FILTERS_USE_VECTORCALL
+    .tp_vectorcall_offset = offsetof(FastqFilter, vectorcall),
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_VECTORCALL,
+#endif
+    .tp_methods = FastqFilter_methods,
+    .tp_members = GenericLengthFilterMembers,
+    .tp_getset = MaximumLengthFilter_properties,
+};
+
+static PyTypeObject MaximumNFilter_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_filter.MaximumNFilter",
+    .tp_basicsize = sizeof(FastqFilter),
+    .tp_dealloc = (destructor)FastqFilter_dealloc,
+    .tp_new = GenericSequenceFilter__new__,
+    .tp_call = (ternaryfunc)FastqFilter__call__,
+#ifdef FILTERS_USE_VECTORCALL
+    .tp_vectorcall_offset = offsetof(FastqFilter, vectorcall),
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_VECTORCALL,
+#endif
+    .tp_methods = FastqFilter_methods,
+    .tp_members = MaximumNFilterMembers,
+    .tp_getset = MaximumNFilter_properties,
+};
+
+static PyTypeObject MaximumHomopolymerFilter_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_filter.MaximumHomopolymerFilter",
+    .tp_basicsize = sizeof(FastqFilter),
+    .tp_dealloc = (destructor)FastqFilter_dealloc,
+    .tp_new = GenericSequenceFilter__new__,
+    .tp_call = (ternaryfunc)FastqFilter__call__,
+#ifdef FILTERS_USE_VECTORCALL
+    .tp_vectorcall_offset = offsetof(FastqFilter, vectorcall),
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_VECTORCALL,
+#endif
+    .tp_methods = FastqFilter_methods,
+    .tp_members = GenericLengthFilterMembers,
+    .tp_getset = MaximumHomopolymerFilter_properties,
+};
+
+/*
+ * Record statistics
+ * =================
+ * Histograms of the length and the mean quality of the passed and failed
+ * reads in a FilterPipeline. They are collected in filter_buffers while the
+ * records are in cache anyway. Every call collects into its own
+ * RecordStatistics without the GIL, which is added to the statistics of the
+ * pipeline once the GIL is held again.
+ *
+ * Lengths below LENGTH_HISTOGRAM_EXACT have a bin of their own, longer
+ * lengths are binned per power of two so long reads use a fixed number of
+ * bins. The mean quality is the phred score of the average error rate,
+ * rounded down. The reads of all files are counted in the same histograms.
+ */
+
+#define LENGTH_HISTOGRAM_EXACT 1024
+#define LENGTH_HISTOGRAM_EXACT_BITS 10
+#define LENGTH_HISTOGRAM_SIZE \
+    (LENGTH_HISTOGRAM_EXACT + 64 - LENGTH_HISTOGRAM_EXACT_BITS)
+#define QUALITY_HISTOGRAM_SIZE (MAXIMUM_PHRED_SCORE + 1)
+
+#define STATISTICS_FAILED 0
+#define STATISTICS_PASSED 1
+
+typedef struct {
+    uint64_t lengths[2][LENGTH_HISTOGRAM_SIZE];
+    uint64_t mean_qualities[2][QUALITY_HISTOGRAM_SIZE];
+} RecordStatistics;
+
+static inline size_t
+length_histogram_bin(size_t length)
+{
+    if (length < LENGTH_HISTOGRAM_EXACT) {
+        return length;
+    }
+    size_t bits = 0;
+    while ((length >> bits) > 1) {
+        bits += 1;
+    }
+    return LENGTH_HISTOGRAM_EXACT + bits - LENGTH_HISTOGRAM_EXACT_BITS;
+}
+
+/**
+ * @brief The first and last length in a bin of the length histogram.
+ */
+static void
+length_histogram_bin_range(size_t bin, uint64_t *first, uint64_t *last)
+{
+    if (bin < LENGTH_HISTOGRAM_EXACT) {
+        *first = bin;
+        *last = bin;
+        return;
+    }
+    size_t bits = bin - LENGTH_HISTOGRAM_EXACT + LENGTH_HISTOGRAM_EXACT_BITS;
+    *first = (uint64_t)1 << bits;
+    *last = bits == 63 ? UINT64_MAX : ((uint64_t)1 << (bits + 1)) - 1;
+}
+
+/**
+ * @brief Adds the reads of a record tuple to the histograms. Reads without
+ * bases or with qualities that are not valid for the phred offset are only
+ * counted in the length histogram, as they have no mean quality.
+ */
+static void
+RecordStatistics_add(RecordStatistics *statistics, const RecordSpan *spans,
+                     Py_ssize_t number_of_spans, int pass, uint8_t phred_offset)
+{
+    for (Py_ssize_t i=0; i < number_of_spans; i++) {
+        const uint8_t *qualities = spans[i].qualities;
+        size_t length = spans[i].length;
+        statistics->lengths[pass][length_histogram_bin(length)] += 1;
+        if (length == 0 || !phred_scores_valid(qualities, length, phred_offset)) {
+            continue;
+        }
+        double average_error_rate = sum_valid_error_rate(
+            qualities, length, phred_offset) / (double)length;
+        // Rounding errors in the error rates and the logarithm can put a
+        // read with only Q2 scores just below 2.
+        double mean_quality = -10 * log10(average_error_rate) + 1e-6;
+        size_t bin = mean_quality > 0 ? (size_t)mean_quality : 0;
+        if (bin >= QUALITY_HISTOGRAM_SIZE) {
+            bin = QUALITY_HISTOGRAM_SIZE - 1;
+        }
+        statistics->mean_qualities[pass][bin] += 1;
+    }
+}
+
+static void
+RecordStatistics_merge(RecordStatistics *statistics, const RecordStatistics *other)
+{
+    for (size_t pass=0; pass < 2; pass++) {
+        for (size_t i=0; i < LENGTH_HISTOGRAM_SIZE; i++) {
+            statistics->lengths[pass][i] += other->lengths[pass][i];
+        }
+        for (size_t i=0; i < QUALITY_HISTOGRAM_SIZE; i++) {
+            statistics->mean_qualities[pass][i] += other->mean_qualities[pass][i];
+        }
+    }
+}
+
+/**
+ * @brief Creates a dictionary with the length and mean_quality histograms
+ * of the passed or failed reads. The histograms are lists with a
+ * [first, last, count] list for each non-empty length bin and a
+ * [quality, count] list for each non-empty quality.
+ */
+static PyObject *
+RecordStatistics_histograms(const RecordStatistics *statistics, int pass)
+{
+    PyObject *lengths = PyList_New(0);
+    PyObject *mean_qualities = PyList_New(0);
+    PyObject *histograms = NULL;
+    if (lengths == NULL || mean_qualities == NULL) {
+        goto error;
+    }
+    for (size_t i=0; i < LENGTH_HISTOGRAM_SIZE; i++) {
+        uint64_t count = statistics->lengths[pass][i];
+        if (count == 0) {
+            continue;
+        }
+        uint64_t first, last;
+        length_histogram_bin_range(i, &first, &last);
+        PyObject *bin = Py_BuildValue("[KKK]", (unsigned long long)first,
+            (unsigned long long)last, (unsigned long long)count);
+        if (bin == NULL || PyList_Append(lengths, bin) < 0) {
+            Py_XDECREF(bin);
+            goto error;
+        }
+        Py_DECREF(bin);
+    }
+    for (size_t i=0; i < QUALITY_HISTOGRAM_SIZE; i++) {
+        uint64_t count = statistics->mean_qualities[pass][i];
+        if (count == 0) {
+            continue;
+        }
+        PyObject *bin = Py_BuildValue("[nK]", (Py_ssize_t)i,
+                                      (unsigned long long)count);
+        if (bin == NULL || PyList_Append(mean_qualities, bin) < 0) {
+            Py_XDECREF(bin);
+            goto error;
+        }
+        Py_DECREF(bin);
+    }
+    histograms = Py_BuildValue("{sOsO}", "length", lengths,
+                               "mean_quality", mean_qualities);
+error:
+    Py_XDECREF(lengths);
+    Py_XDECREF(mean_qualities);
+    return histograms;
+}
+
+/*
+ * Automatic filter order
+ * ======================
+ * A FilterPipeline created with auto_order=True measures the cost and the
+ * rejection rate of its filters in filter_buffers and reorders them, so the
+ * filters that reject the most records for their cost come first. The first
+ * AUTO_ORDER_SAMPLE_SIZE record tuples are timed, after which the filters are
+ * sorted by the time they spent per record tuple that they rejected. This is
+ * the order with the lowest expected cost when the filters reject records
+ * independently of each other. A new sample is taken after every
+ * AUTO_ORDER_INTERVAL record tuples, so the order follows changes in the
+ * data. The rejection rates are measured in the current order, so they are
+ * conditional on passing the filters before. A trimming filter changes the
+ * records that the filters after it see, so only the filters after the last
+ * trimming filter are reordered.
+ */
+
+#define AUTO_ORDER_SAMPLE_SIZE 10000
+#define AUTO_ORDER_INTERVAL 1000000
+
+typedef struct {
+    // Record tuples in the current sample, and since the last sample.
+    unsigned long long sampled;
+    unsigned long long since_sample;
+    // Arrays of number_of_filters entries, in the current filter order.
+    uint64_t *times;
+    unsigned long long *rejected;
+} FilterOrderSample;
+
+static FilterOrderSample *
+FilterOrderSample_new(Py_ssize_t number_of_filters)
+{
+    FilterOrderSample *sample = PyMem_Calloc(
+        1, sizeof(FilterOrderSample) +
+           number_of_filters * (sizeof(uint64_t) + sizeof(unsigned long long)));
+    if (sample == NULL) {
+        return NULL;
+    }
+    sample->times = (uint64_t *)(sample + 1);
+    sample->rejected = (unsigned long long *)(sample->times + number_of_filters);
+    return sample;
+}
+
+/*
+ * FilterPipeline
+ * ==============
+ * Evaluates a list of filters on a record tuple in one call. The filters are
+ * checked in order and evaluation stops at the first filter that fails, so
+ * the total and passed counters of each filter end up the same as when the
+ * filters are chained with the builtin filter function. The qualities are
+ * retrieved and validated only once per record, no matter how many quality
+ * filters there are.
+ */
+
+typedef struct {
+    PyObject_HEAD
+#ifdef FILTERS_USE_VECTORCALL
+    vectorcallfunc vectorcall;
+#endif
+    PyObject *filters;
+    FilterStages stages;
+    int needs_qualities;
+    int needs_sequences;
+    PyTypeObject *sequence_record_class;
+    PyObject *sequence_record_atrr;
+    PyObject *sequence_attr;
+    RecordStatistics *statistics;
+    // The number of record tuples that were evaluated and that passed.
+    unsigned long long counts[2];
+    // The measurements for auto_order, NULL when the order is fixed.
+    FilterOrderSample *order_sample;
+    // A pool of batches for filter_buffers. Only used with the GIL held.
+    struct RecordBatch *free_batches;
+    Py_ssize_t number_of_free_batches;
+} FilterPipeline;
+
+static void RecordBatch_free_list(struct RecordBatch *batch);
+
+static void
+FilterPipeline_dealloc(FilterPipeline *self)
+{
+    RecordBatch_free_list(self->free_batches);
+    PyMem_Free(self->stages.filters);
+    PyMem_Free((uint8_t *)self->stages.kinds);
+    PyMem_Free(self->statistics);
+    PyMem_Free(self->order_sample);
+    Py_CLEAR(self->filters);
+    Py_CLEAR(self->sequence_record_class);
+    Py_CLEAR(self->sequence_record_atrr);
+    Py_CLEAR(self->sequence_attr);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+#ifdef FILTERS_USE_VECTORCALL
+static PyObject *
+FilterPipeline__vectorcall(FilterPipeline *self, PyObject *const *args,
+                           size_t nargsf, PyObject *kwnames);
+#endif
+
+static PyObject *
+FilterPipeline__new__(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    PyObject *filter_iterable = NULL;
+    int collect_statistics = 0;
+    int auto_order = 0;
+    static char *kwarg_names[] = {"filters", "statistics", "auto_order", NULL};
+    static const char *format = "O|$pp:FilterPipeline";
+    if (!PyArg_ParseTupleAndKeywords(
+        args, kwargs, format, kwarg_names,
+        &filter_iterable, &collect_statistics, &auto_order)) {
+            return NULL;
+    }
+    PyObject *filters = PySequence_Tuple(filter_iterable);
+    if (filters == NULL) {
+        return NULL;
+    }
+    Py_ssize_t number_of_stages = PyTuple_GET_SIZE(filters);
+    int needs_qualities = 0;
+    int needs_sequences = 0;
+    int phred_offset = -1;
+    int timed = 0;
+    int trims = 0;
+    for (Py_ssize_t i=0; i < number_of_stages; i++) {
+        PyObject *filter = PyTuple_GET_ITEM(filters, i);
+        int kind = FastqFilter_kind(Py_TYPE(filter));
+        if (kind < 0) {
+            PyErr_Format(PyExc_TypeError,
+                         "FilterPipeline only supports the filters from this "
+                         "module, got %s at index %zd",
+                         Py_TYPE(filter)->tp_name, i);
+            Py_DECREF(filters);
+            return NULL;
+        }
+        timed |= ((FastqFilter *)filter)->timed;
+        trims |= ((FastqFilter *)filter)->trim;
+        if (kind == AVERAGE_ERROR_RATE_FILTER || kind == MEDIAN_QUALITY_FILTER ||
+            kind == SLIDING_WINDOW_FILTER) {
+            uint8_t filter_offset = ((FastqFilter *)filter)->phred_offset;
+            if (phred_offset >= 0 && filter_offset != phred_offset) {
+                PyErr_Format(PyExc_ValueError,
+                             "All quality filters in a FilterPipeline must "
+                             "use the same phred offset, got %d and %d",
+                             phred_offset, filter_offset);
+                Py_DECREF(filters);
+                return NULL;
+            }
+            phred_offset = filter_offset;
+            needs_qualities = 1;
+        } else if (kind == MAXIMUM_N_FILTER || kind == MAXIMUM_HOMOPOLYMER_FILTER) {
+            needs_sequences = 1;
+        }
+    }
+    FiltersModuleState *state = FiltersModuleState_get();
+    if (state == NULL) {
+        Py_DECREF(filters);
+        return NULL;
+    }
+    FastqFilter **stages = PyMem_Malloc(sizeof(FastqFilter *) * (number_of_stages + 1));
+    uint8_t *stage_kinds = PyMem_Malloc(sizeof(uint8_t) * (number_of_stages + 1));
+    RecordStatistics *statistics = NULL;
+    if (collect_statistics) {
+        statistics = PyMem_Calloc(1, sizeof(RecordStatistics));
+    }
+    FilterOrderSample *order_sample = NULL;
+    if (auto_order) {
+        order_sample = FilterOrderSample_new(number_of_stages);
+    }
+    if (stages == NULL || stage_kinds == NULL ||
+        (collect_statistics && statistics == NULL) ||
+        (auto_order && order_sample == NULL)) {
+        PyMem_Free(stages);
+        PyMem_Free(stage_kinds);
+        PyMem_Free(statistics);
+        PyMem_Free(order_sample);
+        Py_DECREF(filters);
+        return PyErr_NoMemory();
+    }
+    for (Py_ssize_t i=0; i < number_of_stages; i++) {
+        PyObject *filter = PyTuple_GET_ITEM(filters, i);
+        stages[i] = (FastqFilter *)filter;
+        stage_kinds[i] = FastqFilter_kind(Py_TYPE(filter));
+    }
+    FilterPipeline *self = PyObject_New(FilterPipeline, type);
+    if (self == NULL) {
+        PyMem_Free(stages);
+        PyMem_Free(stage_kinds);
+        PyMem_Free(statistics);
+        PyMem_Free(order_sample);
+        Py_DECREF(filters);
+        return NULL;
+    }
+#ifdef FILTERS_USE_VECTORCALL
+    self->vectorcall = (vectorcallfunc)FilterPipeline__vectorcall;
+#endif
+    self->filters = filters;
+    self->stages.filters = stages;
+    self->stages.kinds = stage_kinds;
+    self->stages.number_of_filters = number_of_stages;
+    self->stages.phred_offset = phred_offset < 0 ? DEFAULT_PHRED_SCORE_OFFSET : phred_offset;
+    self->stages.quality_kinds = FilterStages_quality_kinds(stage_kinds,
+                                                            number_of_stages);
+    self->stages.timed = (char)timed;
+    self->stages.trims = (char)trims;
+    self->stages.counts = self->counts;
+    self->counts[0] = 0;
+    self->counts[1] = 0;
+    self->order_sample = order_sample;
+    self->needs_qualities = needs_qualities;
+    self->needs_sequences = needs_sequences;
+    self->sequence_record_class = NULL;
+    Py_INCREF(state->qualities_attr);
+    self->sequence_record_atrr = state->qualities_attr;
+    Py_INCREF(state->sequence_attr);
+    self->sequence_attr = state->sequence_attr;
+    self->statistics = statistics;
+    self->free_batches = NULL;
+    self->number_of_free_batches = 0;
+    return (PyObject *)self;
+}
+
+static PyObject *
+FilterPipeline_filter_record_tuple(FilterPipeline *self, PyObject *record_tuple)
+{
+    PyObject *qualities_attr = self->needs_qualities ? self->sequence_record_atrr : NULL;
+    PyObject *sequence_attr = self->needs_sequences ? self->sequence_attr : NULL;
+    FilterStages copy;
+    const FilterStages *stages = &self->stages;
+    if (self->order_sample != NULL) {
+        // Long records are evaluated without the GIL, while another thread
+        // may reorder the filters, so a copy is evaluated and counted as in
+        // filter_batch.
+        if (FilterStages_copy(&self->stages, &copy) < 0) {
+            return NULL;
+        }
+        stages = &copy;
+    }
+    Py_ssize_t stages_passed = FilterStages_evaluate_record_tuple(
+        stages, record_tuple, qualities_attr, sequence_attr);
+    if (stages_passed >= 0) {
+        FilterStages_count(stages, stages_passed);
+    }
+    if (stages == &copy) {
+        FilterStages_free_copy(&copy);
+    }
+    if (stages_passed < 0) {
+        return NULL;
+    }
+    return PyBool_FromLong(stages_passed == self->stages.number_of_filters);
+}
+
+static PyObject *
+FilterPipeline__call__(FilterPipeline *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *record_tuple = GenericFilter_ParseArgsToRecordTuple(
+        args, kwargs, &self->sequence_record_class);
+    if (record_tuple == NULL) {
+        return NULL;
+    }
+    return FilterPipeline_filter_record_tuple(self, record_tuple);
+}
+
+#ifdef FILTERS_USE_VECTORCALL
+static PyObject *
+FilterPipeline__vectorcall(FilterPipeline *self, PyObject *const *args,
+                           size_t nargsf, PyObject *kwnames)
+{
+    PyObject *record_tuple = GenericFilter_VectorcallArgsToRecordTuple(
+        args, nargsf, kwnames, &self->sequence_record_class);
+    if (record_tuple == NULL) {
+        return NULL;
+    }
+    return FilterPipeline_filter_record_tuple(self, record_tuple);
+}
+#endif
+
+PyDoc_STRVAR(FilterPipeline_filter_batch__doc__,
+"filter_batch($self, record_tuples, /)\n"
+"--\n"
+"\n"
+"Filters many record tuples in one call. Returns a bytes object with a 1 for\n"
+"each record tuple that passes all filters and a 0 for each record tuple\n"
+"that fails. The counters of the filters are updated as if the pipeline was\n"
+"called for each record tuple. The GIL is released while the records are\n"
+"evaluated.\n"
+"\n"
+"  record_tuples\n"
+"    A sequence of tuples of dnaio.SequenceRecord objects.\n"
+);
+
+#define FILTERPIPELINE_FILTER_BATCH_METHODDEF    \
+    {"filter_batch", (PyCFunction)FilterPipeline_filter_batch, \
+     METH_O, FilterPipeline_filter_batch__doc__}
+
+static PyObject *
+FilterPipeline_filter_batch(FilterPipeline *self, PyObject *record_tuples)
+{
+    PyObject *qualities_attr = self->needs_qualities ? self->sequence_record_atrr : NULL;
+    PyObject *sequence_attr = self->needs_sequences ? self->sequence_attr : NULL;
+    if (self->order_sample == NULL) {
+        return FilterStages_filter_batch(&self->stages, record_tuples,
+                                         &self->sequence_record_class,
+                                         qualities_attr, sequence_attr);
+    }
+    // Another thread may reorder the filters while this one has released
+    // the GIL, so it evaluates a copy.
+    FilterStages stages;
+    if (FilterStages_copy(&self->stages, &stages) < 0) {
+        return NULL;
+    }
+    PyObject *result = FilterStages_filter_batch(&stages, record_tuples,
+                                                 &self->sequence_record_class,
+                                                 qualities_attr, sequence_attr);
+    FilterStages_free_copy(&stages);
+    return result;
+}
+
+/*
+ * Native FASTQ parsing
+ * ====================
+ * Records are parsed straight from a buffer of FASTQ data without creating
+ * Python objects. Passing records are copied to the output byte for byte.
+ */
+
+typedef struct {
+    const uint8_t *record_start;
+    const uint8_t *name;
+    size_t name_length;
+    const uint8_t *sequence;
+    const uint8_t *qualities;
+    size_t sequence_length;
+    size_t record_length;
+} FastqRecordView;
+
+#define FASTQ_PARSE_ERROR -1
+#define FASTQ_PARSE_INCOMPLETE 0
+#define FASTQ_PARSE_OK 1
+
+static inline size_t
+line_length_without_carriage_return(const uint8_t *start, const uint8_t *end)
+{
+    size_t length = end - start;
+    if (length > 0 && start[length - 1] == '\r') {
+        length -= 1;
+    }
+    return length;
+}
+
+/**
+ * @brief Finds the newline that ends the quality line. A well-formed quality
+ * line is exactly as long as the sequence line, so the newline is expected
+ * at that position. The qualities are still searched for a newline, without
+ * decoding them, as a shorter quality line could otherwise be taken together
+ * with the next line when that happens to end at the expected position.
+ * Records that are only filtered on length never have their qualities
+ * validated, so this must be caught when parsing.
+ */
+static inline const uint8_t *
+find_qualities_end(const uint8_t *qualities_start, const uint8_t *buffer_end,
+                   size_t sequence_length)
+{
+    size_t available = buffer_end - qualities_start;
+    if (sequence_length >= available) {
+        // Either incomplete or a shorter quality line, which the caller
+        // reports as a length difference.
+        return memchr(qualities_start, '\n', available);
+    }
+    const uint8_t *newline = memchr(qualities_start, '\n', sequence_length);
+    if (newline != NULL) {
+        return newline;
+    }
+    const uint8_t *expected_end = qualities_start + sequence_length;
+    if (expected_end[0] == '\r' && expected_end + 1 < buffer_end &&
+        expected_end[1] == '\n') {
+        return expected_end + 1;
+    }
+    return memchr(expected_end, '\n', buffer_end - expected_end);
+}
+
+/**
+ * @brief Parses the FASTQ record at the start of the buffer.
+ *
+ * @param buffer The buffer with FASTQ data.
+ * @param buffer_length The length of the buffer.
+ * @param view The view to store the record's positions in.
+ * @param error_message Set to a static message on FASTQ_PARSE_ERROR.
+ * @return int FASTQ_PARSE_OK, FASTQ_PARSE_INCOMPLETE when the buffer does not
+ *         contain a complete record, or FASTQ_PARSE_ERROR.
+ */
+static int
+parse_fastq_record(const uint8_t *buffer, size_t buffer_length,
+                   FastqRecordView *view, const char **error_message)
+{
+    const uint8_t *buffer_end = buffer + buffer_length;
+    if (buffer_length == 0) {
+        return FASTQ_PARSE_INCOMPLETE;
+    }
+    if (buffer[0] != '@') {
+        *error_message = "Record header does not start with '@'.";
+        return FASTQ_PARSE_ERROR;
+    }
+    const uint8_t *name_end = memchr(buffer, '\n', buffer_length);
+    if (name_end == NULL) {
+        return FASTQ_PARSE_INCOMPLETE;
+    }
+    const uint8_t *sequence_start = name_end + 1;
+    const uint8_t *sequence_end = memchr(sequence_start, '\n',
+                                         buffer_end - sequence_start);
+    if (sequence_end == NULL) {
+        return FASTQ_PARSE_INCOMPLETE;
+    }
+    const uint8_t *plus_start = sequence_end + 1;
+    if (plus_start == buffer_end) {
+        return FASTQ_PARSE_INCOMPLETE;
+    }
+    if (plus_start[0] != '+') {
+        *error_message = "Line expected to start with '+'.";
+        return FASTQ_PARSE_ERROR;
+    }
+    const uint8_t *plus_end = memchr(plus_start, '\n', buffer_end - plus_start);
+    if (plus_end == NULL) {
+        return FASTQ_PARSE_INCOMPLETE;
+    }
+    size_t sequence_length = line_length_without_carriage_return(
+        sequence_start, sequence_end);
+    const uint8_t *qualities_start = plus_end + 1;
+    const uint8_t *qualities_end = find_qualities_end(
+        qualities_start, buffer_end, sequence_length);
+    if (qualities_end == NULL) {
+        return FASTQ_PARSE_INCOMPLETE;
+    }
+    size_t name_length = line_length_without_carriage_return(buffer + 1, name_end);
+    size_t qualities_length = line_length_without_carriage_return(
+        qualities_start, qualities_end);
+    size_t plus_length = line_length_without_carriage_return(plus_start, plus_end);
+    if (plus_length > 1 && (plus_length - 1 != name_length ||
+                            memcmp(plus_start + 1, buffer + 1, name_length) != 0)) {
+        *error_message = "Sequence descriptions don't match.";
+        return FASTQ_PARSE_ERROR;
+    }
+    if (sequence_length != qualities_length) {
+        *error_message = "Sequence length and qualities length differ.";
+        return FASTQ_PARSE_ERROR;
+    }
+    view->record_start = buffer;
+    view->name = buffer + 1;
+    view->name_length = name_length;
+    view->sequence = sequence_start;
+    view->qualities = qualities_start;
+    view->sequence_length = sequence_length;
+    view->record_length = (qualities_end + 1) - buffer;
+    return FASTQ_PARSE_OK;
+}
+
+static inline int
+is_mate_number(uint8_t c)
+{
+    return c == '1' || c == '2' || c == '3';
+}
+
+static inline int
+is_name_end(const uint8_t *name, size_t name_length, size_t position)
+{
+    return position == name_length || name[position] == ' ' ||
+           name[position] == '\t';
+}
+
+/**
+ * @brief Returns the length of the part of the name that identifies the
+ * record. The same rules as dnaio's record_ids_match are used: only the part
+ * up to the first whitespace counts and a trailing 1, 2 or 3 is ignored.
+ * The whitespace is searched with memchr, which is vectorized in most C
+ * libraries.
+ */
+static inline size_t
+record_id_length(const uint8_t *name, size_t name_length)
+{
+    const uint8_t *space = memchr(name, ' ', name_length);
+    size_t id_length = space != NULL ? (size_t)(space - name) : name_length;
+    const uint8_t *tab = memchr(name, '\t', id_length);
+    if (tab != NULL) {
+        id_length = tab - name;
+    }
+    if (id_length > 0 && is_mate_number(name[id_length - 1])) {
+        id_length -= 1;
+    }
+    return id_length;
+}
+
+/**
+ * @brief Finds the first record whose name does not match the name of the
+ * first record.
+ *
+ * Only the id of the first name is searched for. The other names match when
+ * they start with the same id, which is compared with memcmp, and the id
+ * ends at the same position. The id of a name ends right after the shared
+ * prefix, or one character later when that character is a mate number that
+ * is ignored.
+ *
+ * @return Py_ssize_t The index of the mismatching record or -1.
+ */
+static inline Py_ssize_t
+find_mate_mismatch(const uint8_t *const *names, const size_t *name_lengths,
+                   Py_ssize_t number_of_names)
+{
+    const uint8_t *id = names[0];
+    size_t id_length = record_id_length(id, name_lengths[0]);
+    // A name that ends right after an id ending in a mate number has a
+    // shorter id, as its last character is ignored.
+    int id_ends_in_mate_number = id_length > 0 &&
+                                 is_mate_number(id[id_length - 1]);
+    for (Py_ssize_t i=1; i < number_of_names; i++) {
+        const uint8_t *name = names[i];
+        size_t name_length = name_lengths[i];
+        if (name_length < id_length || memcmp(name, id, id_length) != 0) {
+            return i;
+        }
+        if (is_name_end(name, name_length, id_length)) {
+            if (id_ends_in_mate_number) {
+                return i;
+            }
+        } else if (!(is_mate_number(name[id_length]) &&
+                     is_name_end(name, name_length, id_length + 1))) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Sets a dnaio.FastqFormatError with the formatted message.
+ */
+static void
+raise_fastq_format_error(const char *format, ...)
+{
+    va_list vargs;
+    va_start(vargs, format);
+    PyObject *message = PyUnicode_FromFormatV(format, vargs);
+    va_end(vargs);
+    if (message == NULL) {
+        return;
+    }
+    PyObject *dnaio = PyImport_ImportModule("dnaio");
+    if (dnaio == NULL) {
+        Py_DECREF(message);
+        return;
+    }
+    PyObject *error_type = PyObject_GetAttrString(dnaio, "FastqFormatError");
+    Py_DECREF(dnaio);
+    if (error_type == NULL) {
+        Py_DECREF(message);
+        return;
+    }
+    PyObject *error = PyObject_CallFunction(error_type, "OO", message, Py_None);
+    Py_DECREF(message);
+    if (error != NULL) {
+        PyErr_SetObject(error_type, error);
+        Py_DECREF(error);
+    }
+    Py_DECREF(error_type);
+}
+
+/**
+ * @brief Finds the end of the first number_of_records records in the buffer
+ * by counting lines. Stops counting once number_of_records is reached.
+ *
+ * @return size_t The offset after the last complete record that was found.
+ * The number of complete records is stored in records_found.
+ */
+static size_t
+complete_records_end_by_lines(const uint8_t *buffer, size_t buffer_length,
+                              size_t number_of_records, size_t *records_found)
+{
+    const uint8_t *cursor = buffer;
+    const uint8_t *buffer_end = buffer + buffer_length;
+    size_t records = 0;
+    size_t end = 0;
+    size_t lines = 0;
+    while (records < number_of_records && cursor < buffer_end) {
+        const uint8_t *newline = memchr(cursor, '\n', buffer_end - cursor);
+        if (newline == NULL) {
+            break;
+        }
+        cursor = newline + 1;
+        lines += 1;
+        if (lines == 4) {
+            lines = 0;
+            records += 1;
+            end = cursor - buffer;
+        }
+    }
+    *records_found = records;
+    return end;
+}
+
+/**
+ * @brief Finds the end of the first number_of_records records in the buffer.
+ * The records are parsed the same way as when they are filtered, so the
+ * quality lines are not decoded. From the first
+ * malformed record onwards lines are counted instead, so that the record
+ * ends up in a chunk that is filtered and the error is reported there.
+ *
+ * @return size_t The offset after the last complete record that was found.
+ * The number of complete records is stored in records_found.
+ */
+static size_t
+complete_records_end(const uint8_t *buffer, size_t buffer_length,
+                     size_t number_of_records, size_t *records_found)
+{
+    size_t records = 0;
+    size_t end = 0;
+    FastqRecordView view;
+    const char *error_message;
+    while (records < number_of_records) {
+        int ret = parse_fastq_record(buffer + end, buffer_length - end,
+                                     &view, &error_message);
+        if (ret == FASTQ_PARSE_INCOMPLETE) {
+            break;
+        }
+        if (ret == FASTQ_PARSE_ERROR) {
+            size_t records_after_error;
+            end += complete_records_end_by_lines(
+                buffer + end, buffer_length - end,
+                number_of_records - records, &records_after_error);
+            records += records_after_error;
+            break;
+        }
+        end += view.record_length;
+        records += 1;
+    }
+    *records_found = records;
+    return end;
+}
+
+PyDoc_STRVAR(complete_record_offsets__doc__,
+"complete_record_offsets($self, buffers, /)\n"
+"--\n"
+"\n"
+"Returns a tuple with the offset after the last complete FASTQ record for\n"
+"each buffer, such that all buffers contain the same number of records up\n"
+"to their offset. The records are delimited the same way as when they are\n"
+"filtered, the qualities are not validated. This allows splitting the\n"
+"buffers into chunks that can be filtered independently.\n"
+"\n"
+"  buffers\n"
+"    A sequence of objects supporting the buffer protocol, one for each\n"
+"    FASTQ file.\n"
+);
+
+#define COMPLETE_RECORD_OFFSETS_METHODDEF    \
+    {"complete_record_offsets", (PyCFunction)complete_record_offsets, \
+     METH_O, complete_record_offsets__doc__}
+
+static PyObject *
+complete_record_offsets(PyObject *module, PyObject *buffers_arg)
+{
+    PyObject *buffers = PySequence_Tuple(buffers_arg);
+    if (buffers == NULL) {
+        return NULL;
+    }
+    Py_ssize_t number_of_buffers = PyTuple_GET_SIZE(buffers);
+    PyObject *result = NULL;
+    Py_ssize_t number_of_acquired_buffers = 0;
+    Py_buffer *input_buffers = PyMem_Calloc(number_of_buffers + 1, sizeof(Py_buffer));
+    size_t *offsets = PyMem_Calloc(number_of_buffers + 1, sizeof(size_t));
+    if (input_buffers == NULL || offsets == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    for (Py_ssize_t i=0; i < number_of_buffers; i++) {
+        if (PyObject_GetBuffer(PyTuple_GET_ITEM(buffers, i), &input_buffers[i],
+                               PyBUF_SIMPLE) != 0) {
+            goto error;
+        }
+        number_of_acquired_buffers += 1;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    size_t number_of_records = SIZE_MAX;
+    size_t records_found;
+    // Each buffer only needs to be counted up to the lowest number of
+    // records found so far. The buffers that were counted further than the
+    // final number of records are counted again.
+    for (Py_ssize_t i=0; i < number_of_buffers; i++) {
+        offsets[i] = complete_records_end(input_buffers[i].buf,
+                                          input_buffers[i].len,
+                                          number_of_records, &records_found);
+        number_of_records = records_found;
+    }
+    for (Py_ssize_t i=0; i < number_of_buffers - 1; i++) {
+        offsets[i] = complete_records_end(input_buffers[i].buf,
+                                          input_buffers[i].len,
+                                          number_of_records, &records_found);
+    }
+    Py_END_ALLOW_THREADS
+
+    result = PyTuple_New(number_of_buffers);
+    if (result == NULL) {
+        goto error;
+    }
+    for (Py_ssize_t i=0; i < number_of_buffers; i++) {
+        PyObject *offset = PyLong_FromSize_t(offsets[i]);
+        if (offset == NULL) {
+            Py_CLEAR(result);
+            goto error;
+        }
+        PyTuple_SET_ITEM(result, i, offset);
+    }
+error:
+    for (Py_ssize_t i=0; i < number_of_acquired_buffers; i++) {
+        PyBuffer_Release(&input_buffers[i]);
+    }
+    PyMem_Free(input_buffers);
+    PyMem_Free(offsets);
+    Py_DECREF(buffers);
+    return result;
+}
+
+/*
+ * Record batches
+ * ==============
+ * FilterPipeline.filter_buffers parses the records of its buffers into
+ * batches of up to RECORD_BATCH_SIZE record tuples before any filter is
+ * evaluated. A batch stores each field of the records in its own array. The
+ * entries for the records of one tuple are next to each other, so the spans
+ * of a tuple can be passed to a filter kernel as is. All arrays of a batch
+ * are carved out of a single allocation. The batches are kept in a pool on
+ * the pipeline and are reused by later calls, so a call does not allocate
+ * anything for its records.
+ */
+
+// Large enough to make the per batch overhead negligible, small enough that
+// the records of a batch are still in the cache when they are copied.
+#define RECORD_BATCH_SIZE 256
+// Batches in the pool of a pipeline, one for each thread that is filtering.
+#define RECORD_BATCH_POOL_SIZE 16
+
+typedef struct RecordBatch {
+    struct RecordBatch *next;
+    Py_ssize_t number_of_buffers;
+    RecordSpan *spans;
+    const uint8_t **names;
+    size_t *name_lengths;
+    size_t *record_lengths;
+    // The lengths of the sequences as parsed, the spans hold the lengths
+    // after trimming.
+    size_t *sequence_lengths;
+    uint8_t *passed;
+} RecordBatch;
+
+static RecordBatch *
+RecordBatch_new(Py_ssize_t number_of_buffers)
+{
+    size_t entries = (size_t)RECORD_BATCH_SIZE * number_of_buffers;
+    size_t entry_size = sizeof(RecordSpan) + sizeof(uint8_t *) +
+                        sizeof(size_t) * 3;
+    RecordBatch *batch = PyMem_Malloc(sizeof(RecordBatch) +
+                                      entries * entry_size + RECORD_BATCH_SIZE);
+    if (batch == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    // The arrays are ordered by alignment, the passed flags come last.
+    batch->next = NULL;
+    batch->number_of_buffers = number_of_buffers;
+    batch->spans = (RecordSpan *)(batch + 1);
+    batch->names = (const uint8_t **)(batch->spans + entries);
+    batch->name_lengths = (size_t *)(batch->names + entries);
+    batch->record_lengths = batch->name_lengths + entries;
+    batch->sequence_lengths = batch->record_lengths + entries;
+    batch->passed = (uint8_t *)(batch->sequence_lengths + entries);
+    return batch;
+}
+
+static void
+RecordBatch_free_list(RecordBatch *batch)
+{
+    while (batch != NULL) {
+        RecordBatch *next = batch->next;
+        PyMem_Free(batch);
+        batch = next;
+    }
+}
+
+/**
+ * @brief Parses the next batch of record tuples, starting at the current
+ * positions. Each buffer is parsed on its own up to the number of records
+ * found in the buffers before it, as the record tuples end at the first
+ * buffer that runs out of complete records.
+ *
+ * @return Py_ssize_t The number of complete record tuples. When a buffer
+ *         contains an invalid record, error_index is set to that buffer and
+ *         error_message is set, and the return value is the index of the
+ *         record tuple with the invalid record. Otherwise error_index is -1.
+ */
+static Py_ssize_t
+RecordBatch_parse(RecordBatch *batch, const uint8_t *const *inputs,
+                  const size_t *input_lengths, const size_t *positions,
+                  Py_ssize_t *error_index, const char **error_message)
+{
+    Py_ssize_t number_of_buffers = batch->number_of_buffers;
+    Py_ssize_t number_of_tuples = RECORD_BATCH_SIZE;
+    *error_index = -1;
+    for (Py_ssize_t i=0; i < number_of_buffers; i++) {
+        const uint8_t *input = inputs[i];
+        size_t position = positions[i];
+        size_t input_length = input_lengths[i];
+        Py_ssize_t entry = i;
+        Py_ssize_t t = 0;
+        for (; t < number_of_tuples; t++) {
+            FastqRecordView view;
+            const char *message = NULL;
+            int ret = parse_fastq_record(input + position,
+                                         input_length - position,
+                                         &view, &message);
+            if (ret != FASTQ_PARSE_OK) {
+                // This buffer stops before the tuple where the buffers
+                // before it stopped, so its result replaces theirs.
+                if (ret == FASTQ_PARSE_ERROR) {
+                    *error_index = i;
+                    *error_message = message;
+                } else {
+                    *error_index = -1;
+                }
+                break;
+            }
+            batch->spans[entry].qualities = view.qualities;
+            batch->spans[entry].sequence = view.sequence;
+            batch->spans[entry].length = view.sequence_length;
+            batch->names[entry] = view.name;
+            batch->name_lengths[entry] = view.name_length;
+            batch->record_lengths[entry] = view.record_length;
+            batch->sequence_lengths[entry] = view.sequence_length;
+            position += view.record_length;
+            entry += number_of_buffers;
+        }
+        number_of_tuples = t;
+    }
+    return number_of_tuples;
+}
+
+/**
+ * @brief Takes a batch for the number of buffers from the pool, or allocates
+ * a new one when there is none. Must be called with the GIL held.
+ *
+ * @return RecordBatch* The batch or NULL with an exception set.
+ */
+static RecordBatch *
+FilterPipeline_take_batch(FilterPipeline *self, Py_ssize_t number_of_buffers)
+{
+    RecordBatch **link = &self->free_batches;
+    while (*link != NULL) {
+        RecordBatch *batch = *link;
+        if (batch->number_of_buffers == number_of_buffers) {
+            *link = batch->next;
+            self->number_of_free_batches -= 1;
+            return batch;
+        }
+        link = &batch->next;
+    }
+    return RecordBatch_new(number_of_buffers);
+}
+
+/**
+ * @brief Returns a batch to the pool, or frees it when the pool is full.
+ * Must be called with the GIL held.
+ */
+static void
+FilterPipeline_return_batch(FilterPipeline *self, RecordBatch *batch)
+{
+    if (self->number_of_free_batches >= RECORD_BATCH_POOL_SIZE) {
+        PyMem_Free(batch);
+        return;
+    }
+    batch->next = self->free_batches;
+    self->free_batches = batch;
+    self->number_of_free_batches += 1;
+}
+
+#define BUFFER_FILTER_OK 0
+#define BUFFER_FILTER_FORMAT_ERROR 1
+#define BUFFER_FILTER_OUT_OF_SYNC 2
+#define BUFFER_FILTER_INVALID_PHRED 3
+
+/**
+ * The state for filtering a set of buffers in lockstep. It does not contain
+ * Python objects so the filtering can run without the GIL. Errors are
+ * stored in the state and raised by the caller once it holds the GIL again.
+ * The record tuple with the error is still in the batch at that point.
+ */
+typedef struct {
+    Py_ssize_t number_of_buffers;
+    const uint8_t **inputs;
+    size_t *input_lengths;
+    size_t *positions;
+    uint8_t **outputs;
+    size_t *output_positions;
+    // The outputs for the failing records, NULL when they are dropped.
+    uint8_t **failed_outputs;
+    size_t *failed_output_positions;
+    const FilterStages *stages;
+    RecordBatch *batch;
+    unsigned long long *stages_passed_counts;
+    uint64_t *stage_times;
+    RecordStatistics *statistics;
+    int error;
+    Py_ssize_t error_tuple;
+    Py_ssize_t error_index;
+    const char *error_message;
+} BufferFilterState;
+
+/**
+ * @brief Writes a record with its sequence and qualities cut to the length of
+ * its span: the header and the kept sequence, the line end, the plus line and
+ * the kept qualities, and the line end after the qualities.
+ *
+ * @param sequence_length The length of the sequence as parsed.
+ * @return uint8_t* The output position after the record.
+ */
+static uint8_t *
+write_trimmed_record(uint8_t *output, const uint8_t *record,
+                     size_t record_length, const RecordSpan *span,
+                     size_t sequence_length)
+{
+    size_t length = span->length;
+    const uint8_t *sequence_end = span->sequence + sequence_length;
+    const uint8_t *qualities_end = span->qualities + sequence_length;
+    size_t head = span->sequence + length - record;
+    size_t middle = span->qualities + length - sequence_end;
+    size_t tail = record + record_length - qualities_end;
+    memcpy(output, record, head);
+    output += head;
+    memcpy(output, sequence_end, middle);
+    output += middle;
+    memcpy(output, qualities_end, tail);
+    return output + tail;
+}
+
+/**
+ * @brief Copies the passing records of the first number_of_tuples tuples of
+ * the batch to the outputs, and the failing records to the failed outputs
+ * when there are any, and advances the positions past all of them. Records
+ * in a buffer are contiguous, so each run of records that all pass or all
+ * fail is copied with a single memcpy. A passing record that was trimmed
+ * ends the run and is written with write_trimmed_record.
+ */
+static void
+BufferFilterState_copy_records(BufferFilterState *state,
+                              Py_ssize_t number_of_tuples)
+{
+    Py_ssize_t number_of_buffers = state->number_of_buffers;
+    const RecordBatch *batch = state->batch;
+    for (Py_ssize_t i=0; i < number_of_buffers; i++) {
+        const uint8_t *record = state->inputs[i] + state->positions[i];
+        const uint8_t *run_start = record;
+        uint8_t run_passed = 1;
+        uint8_t *outputs[2] = {
+            NULL, state->outputs[i] + state->output_positions[i]};
+        if (state->failed_outputs != NULL) {
+            outputs[0] = (state->failed_outputs[i] +
+                          state->failed_output_positions[i]);
+        }
+        const size_t *record_lengths = batch->record_lengths + i;
+        for (Py_ssize_t t=0; t < number_of_tuples; t++) {
+            Py_ssize_t entry = t * number_of_buffers + i;
+            size_t record_length = record_lengths[t * number_of_buffers];
+            if (batch->passed[t] != run_passed) {
+                size_t run_length = record - run_start;
+                if (outputs[run_passed] != NULL) {
+                    memcpy(outputs[run_passed], run_start, run_length);
+                    outputs[run_passed] += run_length;
+                }
+                run_start = record;
+                run_passed = batch->passed[t];
+            }
+            if (state->stages->trims && run_passed &&
+                (size_t)batch->spans[entry].length <
+                    batch->sequence_lengths[entry]) {
+                size_t run_length = record - run_start;
+                memcpy(outputs[1], run_start, run_length);
+                outputs[1] = write_trimmed_record(
+                    outputs[1] + run_length, record, record_length,
+                    batch->spans + entry, batch->sequence_lengths[entry]);
+                run_start = record + record_length;
+            }
+            record += record_length;
+        }
+        size_t run_length = record - run_start;
+        if (outputs[run_passed] != NULL) {
+            memcpy(outputs[run_passed], run_start, run_length);
+            outputs[run_passed] += run_length;
+        }
+        state->output_positions[i] = outputs[1] - state->outputs[i];
+        if (state->failed_outputs != NULL) {
+            state->failed_output_positions[i] = (
+                outputs[0] - state->failed_outputs[i]);
+        }
+        state->positions[i] = record - state->inputs[i];
+    }
+}
+
+/**
+ * @brief Filters all complete record tuples in the input buffers of the
+ * state. Each batch is parsed completely, then the mates are checked and the
+ * filters are evaluated for all of its record tuples, and then the passing
+ * records are copied. The tuples before an error are still evaluated and
+ * counted, like they are when the tuples are handled one by one. Does not
+ * use the Python API.
+ *
+ * @return int BUFFER_FILTER_OK or one of the BUFFER_FILTER error codes.
+ */
+static int
+FilterPipeline_filter_buffers_nogil(BufferFilterState *state)
+{
+    Py_ssize_t number_of_buffers = state->number_of_buffers;
+    RecordBatch *batch = state->batch;
+    const FilterStages *stages = state->stages;
+    Py_ssize_t number_of_filters = stages->number_of_filters;
+    FilterStagesKernel evaluate = FilterStages_kernel(stages, number_of_buffers);
+    while (1) {
+        int error = BUFFER_FILTER_OK;
+        Py_ssize_t error_index = -1;
+        Py_ssize_t number_of_tuples = RecordBatch_parse(
+            batch, state->inputs, state->input_lengths, state->positions,
+            &error_index, &state->error_message);
+        int batch_is_full = number_of_tuples == RECORD_BATCH_SIZE;
+        if (error_index >= 0) {
+            error = BUFFER_FILTER_FORMAT_ERROR;
+            state->error_index = error_index;
+        }
+        if (number_of_buffers > 1) {
+            for (Py_ssize_t t=0; t < number_of_tuples; t++) {
+                Py_ssize_t entry = t * number_of_buffers;
+                Py_ssize_t mismatch = find_mate_mismatch(
+                    batch->names + entry, batch->name_lengths + entry,
+                    number_of_buffers);
+                if (mismatch >= 0) {
+                    error = BUFFER_FILTER_OUT_OF_SYNC;
+                    state->error_index = mismatch;
+                    number_of_tuples = t;
+                    break;
+                }
+            }
+        }
+        for (Py_ssize_t t=0; t < number_of_tuples; t++) {
+            RecordSpan *spans = batch->spans + t * number_of_buffers;
+            Py_ssize_t stages_passed = evaluate(
+                stages, spans, number_of_buffers, &error_index,
+                state->stage_times);
+            if (stages_passed < 0) {
+                error = BUFFER_FILTER_INVALID_PHRED;
+                state->error_index = error_index;
+                number_of_tuples = t;
+                break;
+            }
+            state->stages_passed_counts[stages_passed] += 1;
+            int pass = stages_passed == number_of_filters;
+            batch->passed[t] = (uint8_t)pass;
+            if (!pass && stages->trims) {
+                // Failing records are written as they are, and their
+                // statistics describe them that way.
+                for (Py_ssize_t i=0; i < number_of_buffers; i++) {
+                    spans[i].length = batch->sequence_lengths[
+                        t * number_of_buffers + i];
+                }
+            }
+            if (state->statistics != NULL) {
+                RecordStatistics_add(state->statistics, spans, number_of_buffers,
+                                     pass, stages->phred_offset);
+            }
+        }
+        BufferFilterState_copy_records(state, number_of_tuples);
+        if (error != BUFFER_FILTER_OK) {
+            state->error_tuple = number_of_tuples;
+            return error;
+        }
+        if (!batch_is_full) {
+            return BUFFER_FILTER_OK;
+        }
+    }
+}
 
-static PyTypeObject * 
-import_dnaio_sequence_record() 
+/**
+ * @brief Raises the error stored in the state as a Python exception.
+ */
+static void
+FilterPipeline_raise_buffer_error(FilterPipeline *self, BufferFilterState *state)
 {
-    PyObject *dnaio = PyImport_ImportModule("dnaio");
-    if (dnaio == NULL) {
-        return NULL;
-    }
-    PyTypeObject *SequenceRecord = (PyTypeObject *)PyObject_GetAttrString(dnaio, "SequenceRecord");
-    if (SequenceRecord == NULL) {
-        return NULL;
+    Py_ssize_t index = state->error_index;
+    Py_ssize_t entry = state->error_tuple * state->number_of_buffers;
+    const RecordBatch *batch = state->batch;
+    if (state->error == BUFFER_FILTER_FORMAT_ERROR) {
+        raise_fastq_format_error("Error in FASTQ record in file %zd: %s",
+                                 index, state->error_message);
+    } else if (state->error == BUFFER_FILTER_OUT_OF_SYNC) {
+        PyObject *name1 = PyUnicode_DecodeLatin1(
+            (const char *)batch->names[entry],
+            batch->name_lengths[entry], NULL);
+        PyObject *name2 = PyUnicode_DecodeLatin1(
+            (const char *)batch->names[entry + index],
+            batch->name_lengths[entry + index], NULL);
+        if (name1 != NULL && name2 != NULL) {
+            raise_fastq_format_error(
+                "Records are out of sync, names %U, %U do not match.",
+                name1, name2);
+        }
+        Py_XDECREF(name1);
+        Py_XDECREF(name2);
+    } else if (state->error == BUFFER_FILTER_INVALID_PHRED) {
+        const RecordSpan *span = batch->spans + entry + index;
+        raise_invalid_phred_error(span->qualities, span->length,
+                                  self->stages.phred_offset);
     }
-    return SequenceRecord;
 }
 
-static PyObject *
-GenericQualityFilter__new__(PyTypeObject *type, PyObject *args, PyObject *kwargs) 
+/**
+ * @brief Whether filter_buffers should time the filters for the order
+ * sample.
+ */
+static inline int
+FilterPipeline_is_sampling(const FilterPipeline *self)
 {
-    uint8_t phred_offset = DEFAULT_PHRED_SCORE_OFFSET;
-    double threshold_d = 0.0L;
-    static char *kwarg_names[] = {"threshold", "phred_offset", NULL};
-    static const char *format = "d|$b:";
-    if (!PyArg_ParseTupleAndKeywords(
-        args, kwargs, format, kwarg_names,
-        &threshold_d,
-        &phred_offset)) {
-            return NULL;
+    return self->order_sample != NULL &&
+           self->order_sample->sampled < AUTO_ORDER_SAMPLE_SIZE;
+}
+
+/**
+ * @brief Puts the filters in order of the time they spent per record tuple
+ * that they rejected, see "Automatic filter order". Filters that rejected
+ * nothing go last and filters that rank the same keep their order. Trimming
+ * filters and the filters before them keep their place, as moving a filter
+ * across a trimming filter changes which reads pass.
+ *
+ * @return int 0 on success, -1 with an exception set.
+ */
+static int
+FilterPipeline_reorder(FilterPipeline *self)
+{
+    FilterOrderSample *sample = self->order_sample;
+    Py_ssize_t number_of_filters = self->stages.number_of_filters;
+    FastqFilter **filters = self->stages.filters;
+    uint8_t *kinds = (uint8_t *)self->stages.kinds;
+    PyObject *ordered = PyTuple_New(number_of_filters);
+    double *ranks = PyMem_Malloc(sizeof(double) * (number_of_filters + 1));
+    if (ordered == NULL || ranks == NULL) {
+        Py_XDECREF(ordered);
+        PyMem_Free(ranks);
+        PyErr_NoMemory();
+        return -1;
     }
-    PyTypeObject *sequence_record_class = import_dnaio_sequence_record();
-    if (sequence_record_class == NULL) {
-        return NULL;
+    for (Py_ssize_t i=0; i < number_of_filters; i++) {
+        ranks[i] = sample->rejected[i] == 0 ? INFINITY :
+                   (double)sample->times[i] / (double)sample->rejected[i];
     }
-    PyObject *sequence_record_attr = PyUnicode_FromString("qualities");
-    if (sequence_record_attr == NULL) {
-        return NULL;
+    Py_ssize_t first_sorted = 0;
+    for (Py_ssize_t i=0; i < number_of_filters; i++) {
+        if (filters[i]->trim) {
+            first_sorted = i + 1;
+        }
     }
-    FastqFilter *self = PyObject_New(FastqFilter, type);
-    self->phred_offset = phred_offset;
-    self->threshold_d = threshold_d;
-    self->threshold_i = 0;
-    self->total = 0;
-    self->pass = 0;
-    self->sequence_record_class = sequence_record_class;
-    self->sequence_record_atrr = sequence_record_attr;
-    return (PyObject *)self;
+    // An insertion sort is stable, and pipelines have only a few filters.
+    for (Py_ssize_t i=first_sorted + 1; i < number_of_filters; i++) {
+        double rank = ranks[i];
+        FastqFilter *filter = filters[i];
+        uint8_t kind = kinds[i];
+        Py_ssize_t j = i;
+        while (j > first_sorted && ranks[j - 1] > rank) {
+            ranks[j] = ranks[j - 1];
+            filters[j] = filters[j - 1];
+            kinds[j] = kinds[j - 1];
+            j -= 1;
+        }
+        ranks[j] = rank;
+        filters[j] = filter;
+        kinds[j] = kind;
+    }
+    for (Py_ssize_t i=0; i < number_of_filters; i++) {
+        Py_INCREF(filters[i]);
+        PyTuple_SET_ITEM(ordered, i, (PyObject *)filters[i]);
+    }
+    Py_SETREF(self->filters, ordered);
+    PyMem_Free(ranks);
+    return 0;
 }
 
-static PyObject *
-GenericLengthFilter__new__(PyTypeObject *type, PyObject *args, PyObject *kwargs) 
+/**
+ * @brief Adds the measurements of a filter_buffers call to the order sample
+ * and reorders the filters once the sample is complete. The record tuples
+ * were evaluated with a copy of the stages made at the start of the call, so
+ * its filters are looked up in the current order.
+ *
+ * @param evaluated The stages that were evaluated.
+ * @param stage_times The times of the stages, or NULL when the call did not
+ *        sample.
+ * @return int 0 on success, -1 with an exception set.
+ */
+static int
+FilterPipeline_add_order_sample(FilterPipeline *self,
+                                const FilterStages *evaluated,
+                                const unsigned long long *stages_passed_counts,
+                                const uint64_t *stage_times)
 {
-    uint8_t phred_offset = DEFAULT_PHRED_SCORE_OFFSET;
-    Py_ssize_t threshold_i = 0L;
-    static char *kwarg_names[] = {"threshold", NULL};
-    static const char *format = "n|:";
-    if (!PyArg_ParseTupleAndKeywords(
-        args, kwargs, format, kwarg_names,
-        &threshold_i)) {
-            return NULL;
+    FilterOrderSample *sample = self->order_sample;
+    Py_ssize_t number_of_filters = evaluated->number_of_filters;
+    unsigned long long reached = stages_passed_counts[number_of_filters];
+    for (Py_ssize_t i=0; i < number_of_filters; i++) {
+        reached += stages_passed_counts[i];
     }
-    PyTypeObject *sequence_record_class = import_dnaio_sequence_record();
-    if (sequence_record_class == NULL) {
-        return NULL;
+    if (stage_times == NULL || !FilterPipeline_is_sampling(self)) {
+        sample->since_sample += reached;
+        if (sample->since_sample >= AUTO_ORDER_INTERVAL) {
+            sample->sampled = 0;
+            sample->since_sample = 0;
+            memset(sample->times, 0, sizeof(uint64_t) * number_of_filters);
+            memset(sample->rejected, 0,
+                   sizeof(unsigned long long) * number_of_filters);
+        }
+        return 0;
     }
-    FastqFilter *self = PyObject_New(FastqFilter, type);
-    self->phred_offset = phred_offset;
-    self->threshold_i = threshold_i;
-    self->threshold_d = 0.0L;
-    self-> total = 0;
-    self->pass = 0;
-    self->sequence_record_class = sequence_record_class;
-    // The PyObject_Length method can be used directly on a dnaio.SequenceRecord
-    // rather than getting the "sequence" attribute and using PyUnicode_Length.
-    self->sequence_record_atrr = NULL;
-    return (PyObject *)self;
+    sample->sampled += reached;
+    for (Py_ssize_t i=0; i < number_of_filters; i++) {
+        Py_ssize_t current = 0;
+        while (self->stages.filters[current] != evaluated->filters[i]) {
+            current += 1;
+        }
+        sample->times[current] += stage_times[i];
+        sample->rejected[current] += stages_passed_counts[i];
+    }
+    if (sample->sampled < AUTO_ORDER_SAMPLE_SIZE) {
+        return 0;
+    }
+    return FilterPipeline_reorder(self);
 }
 
+/**
+ * @brief Moves the records in the output regions of the buffers next to
+ * those of the first buffer, so the unused space can be released.
+ *
+ * @param output The bytes object with the output regions. It is resized.
+ * @return PyObject * A tuple with a memoryview of the records of each
+ *         buffer, or NULL with an exception set.
+ */
 static PyObject *
-GenericFilter_ParseArgsToRecordTuple(PyObject *args, 
-                                     PyObject *kwargs, 
-                                     PyTypeObject *sequence_record_class) 
+FilterPipeline_output_views(PyObject **output, uint8_t **outputs,
+                            const size_t *output_positions,
+                            Py_ssize_t number_of_buffers)
 {
-    if (kwargs != NULL) {
-        PyErr_Format(PyExc_TypeError, 
-                     "filter takes exactly 0 keyword arguments, got %d",
-                     PyDict_GET_SIZE(kwargs));
-        return NULL;
+    uint8_t *output_start = (uint8_t *)PyBytes_AS_STRING(*output);
+    size_t output_length = output_positions[0];
+    for (Py_ssize_t i=1; i < number_of_buffers; i++) {
+        memmove(output_start + output_length, outputs[i],
+                output_positions[i]);
+        output_length += output_positions[i];
     }
-    if (PyTuple_GET_SIZE(args) != 1) {
-        PyErr_Format(PyExc_TypeError, 
-                     "filter takes exactly 1 positional argument, got %d",
-                     PyTuple_GET_SIZE(args));
+    if (_PyBytes_Resize(output, output_length) != 0) {
         return NULL;
     }
-    PyObject *arg = PyTuple_GET_ITEM(args, 0);
-    if (!PyTuple_CheckExact(arg)) {
-        PyErr_Format(PyExc_TypeError, 
-                     "filter argument must be a tuple, got %s",
-                     Py_TYPE(arg)->tp_name);
+    PyObject *output_view = PyMemoryView_FromObject(*output);
+    if (output_view == NULL) {
         return NULL;
     }
-    Py_ssize_t record_tuple_length = PyTuple_GET_SIZE(arg);
-    PyObject *record;
-    for (Py_ssize_t i=0; i < record_tuple_length; i++) {
-        record = PyTuple_GET_ITEM(arg, i);
-        if (!(Py_TYPE(record) == sequence_record_class)) {
-            PyErr_Format(
-                PyExc_TypeError, 
-                "All records must be of type dnaio.SequenceRecord, "
-                "got %s at index %zd", 
-                Py_TYPE(arg)->tp_name, i);
-        return NULL;
+    PyObject *views = PyTuple_New(number_of_buffers);
+    Py_ssize_t output_position = 0;
+    for (Py_ssize_t i=0; views != NULL && i < number_of_buffers; i++) {
+        Py_ssize_t output_end = output_position + output_positions[i];
+        PyObject *view = PySequence_GetSlice(output_view, output_position,
+                                             output_end);
+        if (view == NULL) {
+            Py_CLEAR(views);
+            break;
         }
+        PyTuple_SET_ITEM(views, i, view);
+        output_position = output_end;
     }
-    return arg;
+    Py_DECREF(output_view);
+    return views;
 }
 
+PyDoc_STRVAR(FilterPipeline_filter_buffers__doc__,
+"filter_buffers($self, buffers, /, *, failed=False)\n"
+"--\n"
+"\n"
+"Filters the FASTQ records in the buffers without creating Python objects.\n"
+"Records are taken from all buffers in lockstep and only complete records\n"
+"are processed. Returns a tuple of the passing records for each buffer and\n"
+"a tuple with the number of bytes that were consumed from each buffer. The\n"
+"passing records are copied as is, apart from the sequences and qualities\n"
+"that a trimming filter cuts. They are returned as memoryviews of a single\n"
+"bytes object.\n"
+"\n"
+"The GIL is released while filtering, so multiple threads can filter\n"
+"different buffers with the same pipeline at the same time.\n"
+"\n"
+"  buffers\n"
+"    A sequence of objects supporting the buffer protocol, one for each\n"
+"    FASTQ file.\n"
+"  failed\n"
+"    Also return a tuple of the failing records for each buffer, as the\n"
+"    third item of the result.\n"
+);
+
+#define FILTERPIPELINE_FILTER_BUFFERS_METHODDEF    \
+    {"filter_buffers", (PyCFunction)(void(*)(void))FilterPipeline_filter_buffers, \
+     METH_VARARGS | METH_KEYWORDS, FilterPipeline_filter_buffers__doc__}
+
 static PyObject *
-AverageErrorRateFilter__call__(FastqFilter *self, PyObject *args, PyObject *kwargs) 
+FilterPipeline_filter_buffers(FilterPipeline *self, PyObject *args,
+                              PyObject *kwargs)
 {
-    PyObject *record_tuple = GenericFilter_ParseArgsToRecordTuple(
-        args, kwargs, self->sequence_record_class);
-    if (record_tuple == NULL) {
+    PyObject *buffers_arg = NULL;
+    int keep_failed = 0;
+    static char *kwarg_names[] = {"", "failed", NULL};
+    static const char *format = "O|$p:filter_buffers";
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, format, kwarg_names,
+                                     &buffers_arg, &keep_failed)) {
         return NULL;
     }
-    PyObject *record;
-    PyObject *phred_scores;
-    uint8_t *phreds;
-    Py_ssize_t phred_length;
-    uint8_t phred_offset = self->phred_offset;
-    double total_error_sum = 0.0;
-    size_t length_sum = 0;
-    Py_ssize_t record_tuple_length = PyTuple_GET_SIZE(record_tuple);
-    for (Py_ssize_t i=0; i < record_tuple_length; i++) {
-        record = PyTuple_GET_ITEM(record_tuple, i);
-        phred_scores = PyObject_GetAttr(record, self->sequence_record_atrr);
-        if (phred_scores == NULL) {
-            return NULL;
-        }
-        if (phred_scores == Py_None) {
-            PyErr_Format(
-                PyExc_ValueError,
-                "SequenceRecord object with name %R does not have quality scores "
-                "(FASTA record)", PyObject_GetAttrString(record, "name")
-            );
-            Py_DECREF(phred_scores);
-            return NULL;
-        }
-        phreds = PyUnicode_DATA(phred_scores);
-        phred_length = PyUnicode_GET_LENGTH(phred_scores);
-        double error_sum = sum_error_rate(phreds, phred_length, phred_offset);
-        Py_DECREF(phred_scores);
-        if (error_sum < 0) {
-            return NULL; 
-        }
-        total_error_sum += error_sum;
-        length_sum += phred_length;
-    }
-    double error_rate = total_error_sum / (double)length_sum;
-    self->total += 1;
-    int pass = error_rate <= self->threshold_d;
-    if (pass) {
-        self->pass += 1;
+    PyObject *buffers = PySequence_Tuple(buffers_arg);
+    if (buffers == NULL) {
+        return NULL;
     }
-    return PyBool_FromLong(pass);
-}
-
-static PyObject *
-MedianQualityFilter__call__(FastqFilter *self, PyObject *args, PyObject *kwargs) 
-{
-    PyObject *record_tuple = GenericFilter_ParseArgsToRecordTuple(
-        args, kwargs, self->sequence_record_class);
-    if (record_tuple == NULL) {
+    Py_ssize_t number_of_buffers = PyTuple_GET_SIZE(buffers);
+    if (number_of_buffers == 0) {
+        PyErr_SetString(PyExc_ValueError, "At least one buffer is required.");
+        Py_DECREF(buffers);
         return NULL;
     }
-    Py_ssize_t record_tuple_length = PyTuple_GET_SIZE(record_tuple);
-    uint8_t phred_offset = self->phred_offset;
-    size_t total_phred_length = 0;
-    int ret;
-    PyObject *record;
-    size_t histogram[128];
-    memset(histogram, 0, sizeof(size_t) * 128);
-    for (Py_ssize_t i=0; i < record_tuple_length; i++) {
-        record = PyTuple_GET_ITEM(record_tuple, i);
-        PyObject *phred_scores = PyObject_GetAttr(record, self->sequence_record_atrr);
-        if (phred_scores == NULL) {
+    PyObject *result = NULL;
+    PyObject *output = NULL;
+    PyObject *failed_output = NULL;
+    PyObject *outputs = NULL;
+    PyObject *failed_outputs = NULL;
+    PyObject *consumed = NULL;
+    Py_ssize_t number_of_acquired_buffers = 0;
+    BufferFilterState state = {
+        .number_of_buffers = number_of_buffers,
+        .error = BUFFER_FILTER_OK,
+    };
+    FilterStages stages = self->stages;
+    int sampling = FilterPipeline_is_sampling(self);
+    if (self->order_sample != NULL) {
+        // Another thread may reorder the filters while this one has
+        // released the GIL, so it evaluates a copy.
+        if (FilterStages_copy(&self->stages, &stages) < 0) {
+            Py_DECREF(buffers);
             return NULL;
         }
-        if (phred_scores == Py_None) {
-            PyErr_Format(
-                PyExc_ValueError,
-                "SequenceRecord object with name %R does not have quality scores "
-                "(FASTA record)", PyObject_GetAttrString(record, "name")
-            );
-            Py_DECREF(phred_scores);
-            return NULL;
+    }
+    state.stages = &stages;
+    Py_buffer *input_buffers = PyMem_Calloc(number_of_buffers, sizeof(Py_buffer));
+    state.inputs = PyMem_Calloc(number_of_buffers, sizeof(uint8_t *));
+    state.input_lengths = PyMem_Calloc(number_of_buffers, sizeof(size_t));
+    state.positions = PyMem_Calloc(number_of_buffers, sizeof(size_t));
+    state.outputs = PyMem_Calloc(number_of_buffers, sizeof(uint8_t *));
+    state.output_positions = PyMem_Calloc(number_of_buffers, sizeof(size_t));
+    state.stages_passed_counts = PyMem_Calloc(self->stages.number_of_filters + 1,
+                                              sizeof(unsigned long long));
+    if (keep_failed) {
+        state.failed_outputs = PyMem_Calloc(number_of_buffers, sizeof(uint8_t *));
+        state.failed_output_positions = PyMem_Calloc(number_of_buffers,
+                                                     sizeof(size_t));
+    }
+    if (input_buffers == NULL || state.inputs == NULL ||
+        state.input_lengths == NULL || state.positions == NULL ||
+        state.outputs == NULL || state.output_positions == NULL ||
+        state.stages_passed_counts == NULL ||
+        (keep_failed && (state.failed_outputs == NULL ||
+                         state.failed_output_positions == NULL))) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    state.batch = FilterPipeline_take_batch(self, number_of_buffers);
+    if (state.batch == NULL) {
+        goto error;
+    }
+    if (sampling) {
+        state.stage_times = PyMem_Calloc(stages.number_of_filters + 1,
+                                         sizeof(uint64_t));
+        if (state.stage_times == NULL) {
+            PyErr_NoMemory();
+            goto error;
         }
-        uint8_t *phreds = PyUnicode_DATA(phred_scores);
-        Py_ssize_t phred_length = PyUnicode_GetLength(phred_scores);
-        ret = make_histogram(histogram, phreds, phred_length, phred_offset);
-        Py_DECREF(phred_scores);
-        if (ret != 0) {
-            return NULL;
+    } else if (FilterStages_alloc_times(&stages, &state.stage_times) < 0) {
+        goto error;
+    }
+    if (self->statistics != NULL) {
+        state.statistics = PyMem_Calloc(1, sizeof(RecordStatistics));
+        if (state.statistics == NULL) {
+            PyErr_NoMemory();
+            goto error;
         }
-        total_phred_length += phred_length;
     }
-    double median = median_from_histogram(histogram, total_phred_length, phred_offset);
-    if (median < 0.0) {
-        return NULL;
+    Py_ssize_t total_input_length = 0;
+    for (Py_ssize_t i=0; i < number_of_buffers; i++) {
+        if (PyObject_GetBuffer(PyTuple_GET_ITEM(buffers, i), &input_buffers[i],
+                               PyBUF_SIMPLE) != 0) {
+            goto error;
+        }
+        number_of_acquired_buffers += 1;
+        state.inputs[i] = input_buffers[i].buf;
+        state.input_lengths[i] = input_buffers[i].len;
+        total_input_length += input_buffers[i].len;
     }
-    self->total += 1;
-    int pass = median >= self->threshold_d;
-    if (pass) {
-        self->pass += 1;
+    // The passing records of all buffers are copied into one bytes object,
+    // as passing records can never take more space than the input. Separate
+    // objects of a similar size for each buffer make glibc's malloc return
+    // their memory to the OS after each call, so every call would start with
+    // fresh pages that have to be faulted in again.
+    output = PyBytes_FromStringAndSize(NULL, total_input_length);
+    if (output == NULL) {
+        goto error;
     }
-    return PyBool_FromLong(pass);
-}
-
-
-static PyObject * 
-MinLengthFilter__call__(FastqFilter *self, PyObject *args, PyObject *kwargs)
-{
-    PyObject *record_tuple = GenericFilter_ParseArgsToRecordTuple(
-        args, kwargs, self->sequence_record_class);
-    if (record_tuple == NULL) {
-        return NULL;
+    uint8_t *output_start = (uint8_t *)PyBytes_AS_STRING(output);
+    for (Py_ssize_t i=0; i < number_of_buffers; i++) {
+        state.outputs[i] = output_start;
+        output_start += state.input_lengths[i];
     }
-    PyObject *record;
-    Py_ssize_t record_tuple_length = PyTuple_GET_SIZE(record_tuple);
-    for (Py_ssize_t i=0; i < record_tuple_length; i++) {
-        record = PyTuple_GET_ITEM(record_tuple, i);
-        Py_ssize_t length = PyObject_Length(record);
-        if (length < 0) {
-            return NULL;
+    if (keep_failed) {
+        // The failing records get an object of their own, so the passing
+        // records can be released separately.
+        failed_output = PyBytes_FromStringAndSize(NULL, total_input_length);
+        if (failed_output == NULL) {
+            goto error;
         }
-        // If any of the records passes the minimum length we pass.
-        // R1 and R2 sequence the same molecule so this is valid.
-        if (length >= self->threshold_i) {
-            self->pass += 1;
-            self->total += 1;
-            Py_RETURN_TRUE;
+        output_start = (uint8_t *)PyBytes_AS_STRING(failed_output);
+        for (Py_ssize_t i=0; i < number_of_buffers; i++) {
+            state.failed_outputs[i] = output_start;
+            output_start += state.input_lengths[i];
         }
     }
-    self->total += 1;
-    Py_RETURN_FALSE;
-}
 
-static PyObject *
-MaxLengthFilter__call__(FastqFilter *self, PyObject *args, PyObject *kwargs) 
-{
-    PyObject *record_tuple = GenericFilter_ParseArgsToRecordTuple(
-        args, kwargs, self->sequence_record_class);
-    if (record_tuple == NULL) {
-        return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    state.error = FilterPipeline_filter_buffers_nogil(&state);
+    Py_END_ALLOW_THREADS
+
+    // Count the records that were evaluated, also when an error occurred.
+    FilterStages_count_histogram(&stages, state.stages_passed_counts);
+    if (stages.timed) {
+        FilterStages_add_times(&stages, state.stage_times);
     }
-    PyObject *record;
-    Py_ssize_t record_tuple_length = PyTuple_GET_SIZE(record_tuple);
-    for (Py_ssize_t i=0; i < record_tuple_length; i++) {
-        record = PyTuple_GET_ITEM(record_tuple, i);
-        Py_ssize_t length = PyObject_Length(record);
-        if (length < 0) {
-            return NULL;
+    if (state.statistics != NULL) {
+        RecordStatistics_merge(self->statistics, state.statistics);
+    }
+    if (self->order_sample != NULL &&
+        FilterPipeline_add_order_sample(
+            self, &stages, state.stages_passed_counts,
+            sampling ? state.stage_times : NULL) < 0) {
+        goto error;
+    }
+    if (state.error != BUFFER_FILTER_OK) {
+        FilterPipeline_raise_buffer_error(self, &state);
+        goto error;
+    }
+    outputs = FilterPipeline_output_views(&output, state.outputs,
+                                          state.output_positions,
+                                          number_of_buffers);
+    if (outputs == NULL) {
+        goto error;
+    }
+    if (keep_failed) {
+        failed_outputs = FilterPipeline_output_views(
+            &failed_output, state.failed_outputs,
+            state.failed_output_positions, number_of_buffers);
+        if (failed_outputs == NULL) {
+            goto error;
         }
-        // If any of the records exceeds the maximum length we fail.
-        // R1 and R2 sequence the same molecule so this is valid.
-        if (length > self->threshold_i) {
-            self->total += 1;
-            Py_RETURN_FALSE;
+    }
+    consumed = PyTuple_New(number_of_buffers);
+    if (consumed == NULL) {
+        goto error;
+    }
+    for (Py_ssize_t i=0; i < number_of_buffers; i++) {
+        PyObject *consumed_bytes = PyLong_FromSize_t(state.positions[i]);
+        if (consumed_bytes == NULL) {
+            goto error;
         }
+        PyTuple_SET_ITEM(consumed, i, consumed_bytes);
     }
-    self->pass += 1;
-    self->total += 1;
-    Py_RETURN_TRUE;
-}
-
-static PyObject *
-AverageErrorRateFilter_get_name(PyObject *self, void *closure)
-{
-    return PyUnicode_FromString("average error rate");
+    if (keep_failed) {
+        result = PyTuple_Pack(3, outputs, consumed, failed_outputs);
+    } else {
+        result = PyTuple_Pack(2, outputs, consumed);
+    }
+error:
+    for (Py_ssize_t i=0; i < number_of_acquired_buffers; i++) {
+        PyBuffer_Release(&input_buffers[i]);
+    }
+    PyMem_Free(input_buffers);
+    PyMem_Free(state.inputs);
+    PyMem_Free(state.input_lengths);
+    PyMem_Free(state.positions);
+    PyMem_Free(state.outputs);
+    PyMem_Free(state.output_positions);
+    PyMem_Free(state.failed_outputs);
+    PyMem_Free(state.failed_output_positions);
+    if (state.batch != NULL) {
+        FilterPipeline_return_batch(self, state.batch);
+    }
+    PyMem_Free(state.stages_passed_counts);
+    PyMem_Free(state.stage_times);
+    PyMem_Free(state.statistics);
+    if (self->order_sample != NULL) {
+        FilterStages_free_copy(&stages);
+    }
+    Py_XDECREF(output);
+    Py_XDECREF(failed_output);
+    Py_XDECREF(outputs);
+    Py_XDECREF(failed_outputs);
+    Py_XDECREF(consumed);
+    Py_DECREF(buffers);
+    return result;
 }
 
-static PyObject *
-MedianQualityFilter_get_name(PyObject *self, void *closure)
-{
-    return PyUnicode_FromString("median quality");
-}
+static PyMethodDef FilterPipeline_methods[] = {
+    FILTERPIPELINE_FILTER_BATCH_METHODDEF,
+    FILTERPIPELINE_FILTER_BUFFERS_METHODDEF,
+    {NULL}
+};
 
 static PyObject *
-MinimumLengthFilter_get_name(PyObject *self, void *closure)
+FilterPipeline_get_statistics(FilterPipeline *self, void *closure)
 {
-    return PyUnicode_FromString("minimum length");
+    if (self->statistics == NULL) {
+        Py_RETURN_NONE;
+    }
+    PyObject *passed = RecordStatistics_histograms(self->statistics,
+                                                   STATISTICS_PASSED);
+    PyObject *failed = RecordStatistics_histograms(self->statistics,
+                                                   STATISTICS_FAILED);
+    PyObject *statistics = NULL;
+    if (passed != NULL && failed != NULL) {
+        statistics = Py_BuildValue("{sOsO}", "passed", passed,
+                                   "failed", failed);
+    }
+    Py_XDECREF(passed);
+    Py_XDECREF(failed);
+    return statistics;
 }
 
 static PyObject *
-MaximumLengthFilter_get_name(PyObject *self, void *closure)
+FilterPipeline_get_auto_order(FilterPipeline *self, void *closure)
 {
-    return PyUnicode_FromString("maximum length");
+    return PyBool_FromLong(self->order_sample != NULL);
 }
 
-static PyGetSetDef AverageErrorRateFilter_properties[] = {
-    {"name", AverageErrorRateFilter_get_name, NULL, NULL, NULL}, {NULL}};
-
-static PyGetSetDef MedianQualityFilter_properties[] = {
-    {"name", MedianQualityFilter_get_name, NULL, NULL, NULL}, {NULL}};
+static PyGetSetDef FilterPipeline_properties[] = {
+    {"auto_order", (getter)FilterPipeline_get_auto_order, NULL,
+     "Whether filter_buffers orders the filters by their measured cost and "
+     "rejection rate.", NULL},
+    {"statistics", (getter)FilterPipeline_get_statistics, NULL,
+     "The length and mean quality histograms of the passed and failed reads "
+     "in filter_buffers. None when the pipeline was created without "
+     "statistics=True.", NULL},
+    {NULL}
+};
 
-static PyGetSetDef MinimumLengthFilter_properties[] = {
-    {"name", MinimumLengthFilter_get_name, NULL, NULL, NULL}, {NULL}};
+static PyMemberDef FilterPipelineMembers[] = {
+    {"filters", T_OBJECT_EX, offsetof(FilterPipeline, filters), READONLY,
+     "The filters in this pipeline in order of evaluation."},
+    {"total", T_ULONGLONG, offsetof(FilterPipeline, counts[0]), READONLY,
+     "The number of record tuples evaluated by this pipeline."},
+    {"passed", T_ULONGLONG, offsetof(FilterPipeline, counts[1]), READONLY,
+     "The number of record tuples that passed all filters."},
+    {NULL}
+};
 
-static PyGetSetDef MaximumLengthFilter_properties[] = {
-    {"name", MaximumLengthFilter_get_name, NULL, NULL, NULL}, {NULL}};
+PyDoc_STRVAR(FilterPipeline__doc__,
+"FilterPipeline(filters, *, statistics=False, auto_order=False)\n"
+"--\n"
+"\n"
+"Evaluates multiple filters on a tuple of records in a single call.\n"
+"Filters are evaluated in order and evaluation stops at the first filter\n"
+"that fails. The total and passed counters of the filters are updated the\n"
+"same way as when the filters are chained. The filters after a\n"
+"SlidingWindowErrorRateFilter with trim=True check the trimmed records.\n"
+"\n"
+"  filters\n"
+"    An iterable of filters from this module.\n"
+"  statistics\n"
+"    Collect histograms of the length and mean quality of the passed and\n"
+"    failed reads in filter_buffers. They are available in the statistics\n"
+"    attribute.\n"
+"  auto_order\n"
+"    Time the filters in filter_buffers on a sample of the records and put\n"
+"    the filters that reject the most records for their cost first. A new\n"
+"    sample is taken every million record tuples. The filters attribute\n"
+"    shows the current order. Trimming filters and the filters before them\n"
+"    keep their place.\n"
+);
 
-static PyTypeObject AverageErrorRateFilter_Type = {
+static PyTypeObject FilterPipeline_Type = {
     PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "_filter.AverageErrorRateFilter",
-    .tp_basicsize = sizeof(FastqFilter),
-    .tp_dealloc = (destructor)FastqFilter_dealloc,
-    .tp_new = GenericQualityFilter__new__,
-    .tp_call = (ternaryfunc)AverageErrorRateFilter__call__,
-    .tp_members = GenericQualityFilterMembers,
-    .tp_getset = AverageErrorRateFilter_properties,
+    .tp_name = "_filter.FilterPipeline",
+    .tp_basicsize = sizeof(FilterPipeline),
+    .tp_dealloc = (destructor)FilterPipeline_dealloc,
+    .tp_new = FilterPipeline__new__,
+    .tp_call = (ternaryfunc)FilterPipeline__call__,
+#ifdef FILTERS_USE_VECTORCALL
+    .tp_vectorcall_offset = offsetof(FilterPipeline, vectorcall),
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_VECTORCALL,
+#endif
+    .tp_members = FilterPipelineMembers,
+    .tp_methods = FilterPipeline_methods,
+    .tp_getset = FilterPipeline_properties,
+    .tp_doc = FilterPipeline__doc__,
 };
 
-static PyTypeObject MedianQualityFilter_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "_filter.MedianQualityFilter",
-    .tp_basicsize = sizeof(FastqFilter),
-    .tp_dealloc = (destructor)FastqFilter_dealloc,
-    .tp_new = GenericQualityFilter__new__,
-    .tp_call = (ternaryfunc)MedianQualityFilter__call__,
-    .tp_members = GenericQualityFilterMembers,
-    .tp_getset = MedianQualityFilter_properties,
+static PyMethodDef _filters_functions[] = {
+    AVERAGE_ERROR_RATE_METHODDEF,
+    QUALMEAN_METHODDEF,
+    QUALMEDIAN_METHODDEF,
+    AVERAGE_ERROR_RATE_BATCH_METHODDEF,
+    QUALMEAN_BATCH_METHODDEF,
+    QUALMEDIAN_BATCH_METHODDEF,
+    COMPLETE_RECORD_OFFSETS_METHODDEF,
+    {NULL}
 };
 
-static PyTypeObject MinimumLengthFilter_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "_filter.MinimumLengthFilter",
-    .tp_basicsize = sizeof(FastqFilter),
-    .tp_dealloc = (destructor)FastqFilter_dealloc,
-    .tp_new = GenericLengthFilter__new__,
-    .tp_call = (ternaryfunc)MinLengthFilter__call__,
-    .tp_members = GenericLengthFilterMembers,
-    .tp_getset = MinimumLengthFilter_properties
-};
+static int
+_filters_module_traverse(PyObject *module, visitproc visit, void *arg)
+{
+    FiltersModuleState *state = PyModule_GetState(module);
+    Py_VISIT(state->sequence_record_class);
+    Py_VISIT(state->qualities_attr);
+    Py_VISIT(state->sequence_attr);
+    return 0;
+}
 
-static PyTypeObject MaximumLengthFilter_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "_filter.MaximumLengthFilter",
-    .tp_basicsize = sizeof(FastqFilter),
-    .tp_dealloc = (destructor)FastqFilter_dealloc,
-    .tp_new = GenericLengthFilter__new__,
-    .tp_call = (ternaryfunc)MaxLengthFilter__call__,
-    .tp_members = GenericLengthFilterMembers,
-    .tp_getset = MaximumLengthFilter_properties,
-};
+static int
+_filters_module_clear(PyObject *module)
+{
+    FiltersModuleState *state = PyModule_GetState(module);
+    Py_CLEAR(state->sequence_record_class);
+    Py_CLEAR(state->qualities_attr);
+    Py_CLEAR(state->sequence_attr);
+    return 0;
+}
+
+static void
+_filters_module_free(void *module)
+{
+    _filters_module_clear((PyObject *)module);
+}
 
 static struct PyModuleDef _filters_module = {
     PyModuleDef_HEAD_INIT,
     "_filters",   /* name of module */
     NULL, /* module documentation, may be NULL */
-    -1,
-    _filters_functions  /* module methods */
+    sizeof(FiltersModuleState),
+    _filters_functions,  /* module methods */
+    NULL,
+    _filters_module_traverse,
+    _filters_module_clear,
+    _filters_module_free,
 };
 
 #define MODULE_ADD_TYPE(module, typename, type) \
@@ -700,12 +4983,26 @@ PyInit__filters(void)
     if (m == NULL) {
         return NULL;
     }
+    FiltersModuleState *state = PyModule_GetState(m);
+    state->qualities_attr = PyUnicode_InternFromString("qualities");
+    state->sequence_attr = PyUnicode_InternFromString("sequence");
+    if (state->qualities_attr == NULL || state->sequence_attr == NULL) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    select_simd_kernels();
 
     MODULE_ADD_TYPE(m, AverageErrorRateFilter, AverageErrorRateFilter_Type)
     MODULE_ADD_TYPE(m, MedianQualityFilter, MedianQualityFilter_Type)
     MODULE_ADD_TYPE(m, MinimumLengthFilter, MinimumLengthFilter_Type)
     MODULE_ADD_TYPE(m, MaximumLengthFilter, MaximumLengthFilter_Type)
+    MODULE_ADD_TYPE(m, SlidingWindowErrorRateFilter,
+                    SlidingWindowErrorRateFilter_Type)
+    MODULE_ADD_TYPE(m, MaximumNFilter, MaximumNFilter_Type)
+    MODULE_ADD_TYPE(m, MaximumHomopolymerFilter, MaximumHomopolymerFilter_Type)
+    MODULE_ADD_TYPE(m, FilterPipeline, FilterPipeline_Type)
 
     PyModule_AddIntMacro(m, DEFAULT_PHRED_SCORE_OFFSET);
+    PyModule_AddStringConstant(m, "KERNELS", selected_kernels);
     return m;
 }
\ No newline at end of file
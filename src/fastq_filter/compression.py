@@ -0,0 +1,419 @@
+# Copyright (c) 2021 Leiden University Medical Center
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+"""
+Compression and decompression on worker threads.
+
+zlib releases the GIL while it compresses and decompresses, so independent
+blocks can be processed in parallel by a thread pool. Each compressed block
+becomes a separate gzip member. Concatenated gzip members are a valid gzip
+file that every gzip reader can decompress.
+"""
+
+import collections
+import concurrent.futures
+import io
+import os
+import queue
+import stat
+import struct
+import sys
+import threading
+import zlib
+from typing import Any, BinaryIO, Deque, List, Union
+
+import xopen  # type: ignore
+
+try:
+    import fcntl
+except ImportError:  # Windows
+    fcntl = None  # type: ignore
+
+# Blocks of this size keep the worker threads busy without using much
+# memory.
+DEFAULT_BLOCK_SIZE = 1024 * 1024
+
+# BGZF blocks may not exceed 64 KiB compressed. This uncompressed size
+# leaves room for the headers when the data does not compress.
+BGZF_BLOCK_SIZE = 0xff00
+
+# The empty block that marks the end of a BGZF file.
+BGZF_EOF = (b"\x1f\x8b\x08\x04\x00\x00\x00\x00\x00\xff\x06\x00\x42\x43\x02\x00"
+            b"\x1b\x00\x03\x00\x00\x00\x00\x00\x00\x00\x00\x00")
+
+_GZIP_MAGIC = b"\x1f\x8b"
+_GZIP_DEFLATE = 8
+_GZIP_FEXTRA = 4
+_GZIP_OS_UNKNOWN = 255
+_BGZF_HEADER_START = b"\x1f\x8b\x08\x04"
+_BGZF_HEADER_SIZE = 18
+
+# The size of the compressed reads of the ThreadedGzipReader and the number
+# of decompressed chunks it keeps ready.
+READ_CHUNK_SIZE = 128 * 1024
+DEFAULT_QUEUE_SIZE = 16
+
+# The number of BGZF blocks (of up to 64 KiB) that are decompressed per job.
+BGZF_BLOCKS_PER_JOB = 16
+
+# Pipes are 64 KiB by default on Linux. Unprivileged processes can grow them
+# up to /proc/sys/fs/pipe-max-size, which is 1 MiB by default.
+PIPE_SIZE = 1024 * 1024
+# fcntl only has the constant from Python 3.10 onwards.
+if sys.platform.startswith("linux") and fcntl is not None:
+    F_SETPIPE_SZ = getattr(fcntl, "F_SETPIPE_SZ", 1031)
+else:
+    F_SETPIPE_SZ = None
+
+
+def gzip_member(data: bytes, compresslevel: int, bgzf: bool = False) -> bytes:
+    """
+    Compress data into a single gzip member. When bgzf is True the member
+    has the BGZF extra field with the size of the member, so it can be
+    indexed. The data must then be at most BGZF_BLOCK_SIZE bytes.
+    """
+    compressor = zlib.compressobj(compresslevel, zlib.DEFLATED, -zlib.MAX_WBITS)
+    compressed = compressor.compress(data) + compressor.flush()
+    trailer = struct.pack("<II", zlib.crc32(data), len(data) & 0xffffffff)
+    if not bgzf:
+        header = struct.pack("<2sBBIBB", _GZIP_MAGIC, _GZIP_DEFLATE, 0, 0, 0,
+                             _GZIP_OS_UNKNOWN)
+        return header + compressed + trailer
+    if len(data) > BGZF_BLOCK_SIZE:
+        raise ValueError(f"BGZF blocks can hold at most {BGZF_BLOCK_SIZE} "
+                         f"bytes, got {len(data)}.")
+    # The header with the extra field is 18 bytes and the trailer 8 bytes.
+    block_size = 18 + len(compressed) + 8
+    header = struct.pack("<2sBBIBBH2sHH", _GZIP_MAGIC, _GZIP_DEFLATE,
+                         _GZIP_FEXTRA, 0, 0, _GZIP_OS_UNKNOWN, 6, b"BC", 2,
+                         block_size - 1)
+    return header + compressed + trailer
+
+
+class ParallelGzipWriter(io.RawIOBase):
+    """
+    A binary file that compresses the written data on worker threads. The
+    data is split in blocks that are compressed as separate gzip members and
+    written in order.
+
+    :param filename: A filename, "-" for stdout, or a binary file object.
+    :param compresslevel: The zlib compression level.
+    :param threads: The number of compression threads.
+    :param bgzf: Write BGZF blocks, so that the output can be indexed.
+    :param block_size: The uncompressed size of each gzip member. Ignored
+    when bgzf is True.
+    """
+    def __init__(self, filename: Union[str, BinaryIO], compresslevel: int = 6,
+                 threads: int = 1, bgzf: bool = False,
+                 block_size: int = DEFAULT_BLOCK_SIZE):
+        super().__init__()
+        if threads < 1:
+            raise ValueError(f"threads must be at least 1, got {threads}.")
+        if isinstance(filename, str):
+            if filename == "-":
+                self._raw: BinaryIO = sys.stdout.buffer
+                self._close_raw = False
+            else:
+                self._raw = open(filename, "wb")
+                self._close_raw = True
+        else:
+            self._raw = filename
+            self._close_raw = False
+        self._compresslevel = compresslevel
+        self._bgzf = bgzf
+        self._block_size = BGZF_BLOCK_SIZE if bgzf else block_size
+        self._buffer = bytearray()
+        self._executor = concurrent.futures.ThreadPoolExecutor(threads)
+        # Limit the number of blocks in flight to bound the memory usage.
+        self._max_pending = threads * 2
+        self._pending: Deque[concurrent.futures.Future] = collections.deque()
+
+    def writable(self) -> bool:
+        return True
+
+    def write(self, data) -> int:  # type: ignore
+        if self.closed:
+            raise ValueError("I/O operation on closed file.")
+        self._buffer += data
+        block_size = self._block_size
+        if len(self._buffer) >= block_size:
+            buffer = self._buffer
+            end = len(buffer) - len(buffer) % block_size
+            for start in range(0, end, block_size):
+                self._submit(bytes(buffer[start:start + block_size]))
+            del buffer[:end]
+        return len(data)
+
+    def _submit(self, block: bytes):
+        while len(self._pending) >= self._max_pending:
+            self._raw.write(self._pending.popleft().result())
+        self._pending.append(self._executor.submit(
+            gzip_member, block, self._compresslevel, self._bgzf))
+
+    def flush(self):
+        """Compress and write all data that was written so far."""
+        if self.closed:
+            return
+        if self._buffer:
+            self._submit(bytes(self._buffer))
+            self._buffer.clear()
+        while self._pending:
+            self._raw.write(self._pending.popleft().result())
+        self._raw.flush()
+
+    def close(self):
+        if self.closed:
+            return
+        try:
+            self.flush()
+            if self._bgzf:
+                self._raw.write(BGZF_EOF)
+                self._raw.flush()
+        finally:
+            self._executor.shutdown(wait=True)
+            super().close()
+            if self._close_raw:
+                self._raw.close()
+
+
+def is_bgzf_header(data: bytes) -> bool:
+    """Check whether data starts with the header of a BGZF block."""
+    return (data[:4] == _BGZF_HEADER_START and len(data) >= _BGZF_HEADER_SIZE
+            and data[10:16] == b"\x06\x00BC\x02\x00")
+
+
+def decompress_bgzf_blocks(blocks: List[bytes]) -> bytes:
+    """Decompress BGZF blocks and check their checksums."""
+    decompressed = []
+    for block in blocks:
+        data = zlib.decompress(block[_BGZF_HEADER_SIZE:-8], -zlib.MAX_WBITS)
+        crc, size = struct.unpack("<II", block[-8:])
+        if zlib.crc32(data) != crc or len(data) != size:
+            raise OSError("CRC check failed for BGZF block.")
+        decompressed.append(data)
+    return b"".join(decompressed)
+
+
+class ThreadedGzipReader(io.RawIOBase):
+    """
+    A binary file that decompresses gzip data on a background thread. The
+    decompressed chunks are handed over through a bounded queue, so the
+    decompression runs ahead of the reader by at most queue_size chunks.
+
+    BGZF files are decompressed block-parallel on a thread pool when threads
+    is larger than 1. For other gzip files the member boundaries are only
+    known after decompressing, so they are decompressed on the background
+    thread only.
+
+    :param filename: A filename, "-" for stdin, or a binary file object.
+    :param threads: The number of threads for decompressing BGZF blocks.
+    :param queue_size: The number of decompressed chunks to keep ready.
+    """
+    def __init__(self, filename: Union[str, BinaryIO], threads: int = 1,
+                 queue_size: int = DEFAULT_QUEUE_SIZE):
+        super().__init__()
+        if threads < 1:
+            raise ValueError(f"threads must be at least 1, got {threads}.")
+        if isinstance(filename, str):
+            if filename == "-":
+                self._raw: BinaryIO = sys.stdin.buffer
+                self._close_raw = False
+            else:
+                self._raw = open(filename, "rb")
+                self._close_raw = True
+        else:
+            self._raw = filename
+            self._close_raw = False
+        self._threads = threads
+        self._queue: queue.Queue = queue.Queue(queue_size)
+        self._stop = threading.Event()
+        self._chunk = memoryview(b"")
+        self._at_eof = False
+        self._thread = threading.Thread(target=self._run, daemon=True)
+        self._thread.start()
+
+    def readable(self) -> bool:
+        return True
+
+    def _put(self, item) -> bool:
+        """Put an item on the queue. Returns False when the reader closed."""
+        while not self._stop.is_set():
+            try:
+                self._queue.put(item, timeout=0.05)
+                return True
+            except queue.Full:
+                continue
+        return False
+
+    def _run(self):
+        try:
+            data = self._raw.read(READ_CHUNK_SIZE)
+            if self._threads > 1 and is_bgzf_header(data):
+                data = self._run_bgzf(data)
+            self._run_stream(data)
+            self._put(None)
+        except BaseException as error:
+            self._put(error)
+
+    def _run_bgzf(self, data: bytes) -> bytes:
+        """
+        Decompress BGZF blocks on a thread pool. Returns the remaining data
+        when a gzip member that is not a BGZF block is encountered.
+        """
+        with concurrent.futures.ThreadPoolExecutor(self._threads) as executor:
+            blocks: List[bytes] = []
+            position = 0
+            while not self._stop.is_set():
+                if len(data) - position < _BGZF_HEADER_SIZE:
+                    data = data[position:] + self._raw.read(READ_CHUNK_SIZE)
+                    position = 0
+                if position == len(data) or not is_bgzf_header(
+                        data[position:position + _BGZF_HEADER_SIZE]):
+                    break
+                block_size = struct.unpack(
+                    "<H", data[position + 16:position + 18])[0] + 1
+                while len(data) - position < block_size:
+                    more = self._raw.read(READ_CHUNK_SIZE)
+                    if not more:
+                        raise EOFError("Compressed file ended before the "
+                                       "end-of-stream marker was reached")
+                    data = data[position:] + more
+                    position = 0
+                blocks.append(data[position:position + block_size])
+                position += block_size
+                if len(blocks) == BGZF_BLOCKS_PER_JOB:
+                    self._put(executor.submit(decompress_bgzf_blocks, blocks))
+                    blocks = []
+            if blocks:
+                self._put(executor.submit(decompress_bgzf_blocks, blocks))
+        return data[position:]
+
+    def _run_stream(self, data: bytes):
+        """Decompress the gzip members in order on this thread."""
+        decompressor = zlib.decompressobj(16 + zlib.MAX_WBITS)
+        in_member = False
+        while data and not self._stop.is_set():
+            while data:
+                decompressed = decompressor.decompress(data)
+                in_member = True
+                if decompressed:
+                    self._put(decompressed)
+                if not decompressor.eof:
+                    break
+                # Start a new member with the data after this member.
+                data = decompressor.unused_data
+                decompressor = zlib.decompressobj(16 + zlib.MAX_WBITS)
+                in_member = False
+            data = self._raw.read(READ_CHUNK_SIZE)
+        if in_member and not self._stop.is_set():
+            raise EOFError("Compressed file ended before the end-of-stream "
+                           "marker was reached")
+
+    def readinto(self, buffer) -> int:  # type: ignore
+        if self.closed:
+            raise ValueError("I/O operation on closed file.")
+        while not self._chunk:
+            if self._at_eof:
+                return 0
+            item = self._queue.get()
+            if item is None:
+                self._at_eof = True
+                return 0
+            if isinstance(item, BaseException):
+                self._at_eof = True
+                raise item
+            if isinstance(item, concurrent.futures.Future):
+                item = item.result()
+            self._chunk = memoryview(item)
+        size = min(len(buffer), len(self._chunk))
+        buffer[:size] = self._chunk[:size]
+        self._chunk = self._chunk[size:]
+        return size
+
+    def close(self):
+        if self.closed:
+            return
+        self._stop.set()
+        self._thread.join()
+        if self._close_raw:
+            self._raw.close()
+        super().close()
+
+
+def enlarge_pipe(file_h: Any, size: int = PIPE_SIZE) -> bool:
+    """
+    Grow the buffer of file_h to size bytes when it is a pipe, so the
+    processes on both ends of a shell pipeline can move a whole block per
+    system call. Only Linux can resize pipes.
+
+    :return: Whether the pipe was resized.
+    """
+    if F_SETPIPE_SZ is None:
+        return False
+    try:
+        fd = file_h.fileno()
+        if not stat.S_ISFIFO(os.fstat(fd).st_mode):
+            return False
+        fcntl.fcntl(fd, F_SETPIPE_SZ, size)
+    except (AttributeError, OSError, ValueError):
+        # Objects without a file descriptor raise io.UnsupportedOperation,
+        # which is an OSError. Sizes above the limit raise EPERM.
+        return False
+    return True
+
+
+def open_input(filename: str, mode: str = "rb", threads: int = 0) -> BinaryIO:
+    """
+    Open an input file for reading. Gzip compressed files (with a .gz
+    extension) are decompressed on background threads with a
+    ThreadedGzipReader when threads is larger than 0. Otherwise xopen is
+    used, which decompresses on the calling thread. Input pipes are enlarged
+    with enlarge_pipe.
+    """
+    if "r" not in mode or "b" not in mode:
+        raise ValueError(f"Only binary reading is supported, got mode {mode}")
+    if filename == "-":
+        enlarge_pipe(sys.stdin)
+    if filename.endswith(".gz") and threads > 0:
+        return io.BufferedReader(  # type: ignore
+            ThreadedGzipReader(filename, threads=threads), READ_CHUNK_SIZE)
+    file_h = xopen.xopen(filename, mode="rb", threads=0)
+    # Named pipes, such as those of process substitution, are enlarged too.
+    enlarge_pipe(file_h)
+    return file_h
+
+
+def open_output(filename: str, compresslevel: int, threads: int = 0,
+                bgzf: bool = False) -> BinaryIO:
+    """
+    Open an output file for writing. Gzip compressed files (with a .gz
+    extension) are written with a ParallelGzipWriter when threads or bgzf
+    are given. Otherwise xopen is used, which compresses on the calling
+    thread. Output pipes are enlarged with enlarge_pipe.
+    """
+    if filename == "-":
+        enlarge_pipe(sys.stdout)
+    if filename.endswith(".gz") and (threads > 0 or bgzf):
+        return ParallelGzipWriter(filename, compresslevel=compresslevel,
+                                  threads=max(threads, 1),
+                                  bgzf=bgzf)  # type: ignore
+    file_h = xopen.xopen(filename, mode="wb", threads=0,
+                         compresslevel=compresslevel)
+    enlarge_pipe(file_h)
+    return file_h
@@ -0,0 +1,473 @@
+# Copyright (c) 2021 Leiden University Medical Center
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+"""
+Splitting FASTQ files into shards that are filtered independently.
+
+Shard i of N covers the records that start after byte i * size / N of each
+input file. Uncompressed files are split at that byte, BGZF files at the
+first block after it. The first record after the split is found with the
+layout of FASTQ records: a line starting with @, a sequence, a line starting
+with + and qualities as long as the sequence. For paired files the shard
+starts at the first record whose mates are found in all files, so the files
+stay in sync. The boundary between two shards is computed the same way by
+both, so every record is in exactly one shard.
+
+A position in a file is a (base, skip) tuple: the data is read from byte
+base, or from the BGZF block at byte base, and the first skip bytes of the
+(decompressed) data are skipped.
+"""
+
+import io
+import os
+import struct
+from typing import (Any, BinaryIO, Dict, Iterator, List, Optional, Sequence,
+                    Tuple)
+
+from .compression import (BGZF_EOF, _BGZF_HEADER_SIZE, _BGZF_HEADER_START,
+                          decompress_bgzf_blocks, is_bgzf_header)
+
+Position = Tuple[int, int]
+
+# Large enough for a complete BGZF block, which is at most 64 KiB.
+SHARD_READ_SIZE = 128 * 1024
+
+# The number of records that are searched for the mates of a record at the
+# start of a shard.
+MAX_ALIGNMENT_RECORDS = 256 * 1024
+
+
+def parse_shard(value: str) -> Tuple[int, int]:
+    """Parse a shard in the i/N format into a (index, count) tuple."""
+    try:
+        index_string, count_string = value.split("/")
+        index, count = int(index_string), int(count_string)
+    except ValueError:
+        raise ValueError(f"Shard must be in the i/N format, got {value!r}.")
+    if not 0 <= index < count:
+        raise ValueError(f"Shard index must be at least 0 and less than the "
+                         f"number of shards, got {value!r}.")
+    return index, count
+
+
+def is_bgzf_file(filename: str) -> bool:
+    """Check whether filename is a regular file in the BGZF format."""
+    if filename == "-" or not os.path.isfile(filename):
+        return False
+    with open(filename, "rb") as file_h:
+        return is_bgzf_header(file_h.read(_BGZF_HEADER_SIZE))
+
+
+def bgzf_blocks(file_h: BinaryIO, offset: int) -> Iterator[Tuple[int, bytes]]:
+    """
+    Yield the offset and the decompressed data of each BGZF block, starting
+    with the block at offset.
+    """
+    file_h.seek(offset)
+    while True:
+        header = file_h.read(_BGZF_HEADER_SIZE)
+        if not header:
+            return
+        if not is_bgzf_header(header):
+            raise OSError(f"Invalid BGZF block at byte {offset}.")
+        block_size = struct.unpack("<H", header[16:18])[0] + 1
+        block = header + file_h.read(block_size - _BGZF_HEADER_SIZE)
+        if len(block) < block_size:
+            raise EOFError("Compressed file ended before the end-of-stream "
+                           "marker was reached")
+        yield offset, decompress_bgzf_blocks([block])
+        offset += block_size
+
+
+def find_bgzf_block(file_h: BinaryIO, offset: int) -> int:
+    """
+    Find the first BGZF block that starts at or after offset. A block is
+    only accepted when it is followed by another block or the end of the
+    file, so compressed data that looks like a header is skipped.
+
+    :return: The offset of the block, or the file size when there is none.
+    """
+    size = os.fstat(file_h.fileno()).st_size
+    while offset < size:
+        file_h.seek(offset)
+        data = file_h.read(SHARD_READ_SIZE)
+        index = data.find(_BGZF_HEADER_START)
+        while index != -1:
+            candidate = offset + index
+            file_h.seek(candidate)
+            header = file_h.read(_BGZF_HEADER_SIZE)
+            if is_bgzf_header(header):
+                end = candidate + struct.unpack("<H", header[16:18])[0] + 1
+                file_h.seek(end)
+                if end == size or is_bgzf_header(
+                        file_h.read(_BGZF_HEADER_SIZE)):
+                    return candidate
+            index = data.find(_BGZF_HEADER_START, index + 1)
+        # Headers that straddle the end of the data are found next time.
+        offset += max(len(data) - _BGZF_HEADER_SIZE, 1)
+    return size
+
+
+class _FileWindow:
+    """The (decompressed) data of a file from a base offset, read on demand."""
+    def __init__(self, file_h: BinaryIO, base: int, bgzf: bool):
+        self.data = bytearray()
+        self.at_eof = False
+        self._chunks: Iterator[bytes]
+        if bgzf:
+            self._chunks = (data for _, data in bgzf_blocks(file_h, base))
+        else:
+            file_h.seek(base)
+            self._chunks = iter(lambda: file_h.read(SHARD_READ_SIZE), b"")
+
+    def extend(self) -> bool:
+        """Read more data. Returns False at the end of the file."""
+        for chunk in self._chunks:
+            self.data += chunk
+            return True
+        self.at_eof = True
+        return False
+
+    def lines(self, start: int, number_of_lines: int) -> List[bytes]:
+        """
+        Return the lines from start without their line endings. Fewer lines
+        are returned at the end of the file.
+        """
+        lines = []
+        position = start
+        while len(lines) < number_of_lines:
+            newline = self.data.find(b"\n", position)
+            if newline == -1:
+                if self.extend():
+                    continue
+                if position < len(self.data):
+                    lines.append(bytes(self.data[position:]))
+                break
+            lines.append(bytes(self.data[position:newline]).rstrip(b"\r"))
+            position = newline + 1
+        return lines
+
+    def line_end(self, start: int, number_of_lines: int) -> int:
+        """The position after number_of_lines lines from start."""
+        position = start
+        for _ in range(number_of_lines):
+            newline = self.data.find(b"\n", position)
+            while newline == -1 and self.extend():
+                newline = self.data.find(b"\n", position)
+            if newline == -1:
+                return len(self.data)
+            position = newline + 1
+        return position
+
+
+def is_record_start(lines: Sequence[bytes], at_eof: bool) -> bool:
+    """
+    Check whether the first four lines look like a FASTQ record. Quality
+    lines can start with @ as well, but then the third line is a sequence,
+    which never starts with +. The line after the record must start the next
+    record.
+    """
+    if len(lines) < 4:
+        return False
+    if not (lines[0].startswith(b"@") and lines[2].startswith(b"+") and
+            len(lines[1]) == len(lines[3])):
+        return False
+    if len(lines) == 5:
+        return lines[4].startswith(b"@")
+    return at_eof
+
+
+def find_record_start(window: _FileWindow) -> Optional[int]:
+    """
+    Find the first record that starts at a line in the window. The start of
+    the window is not known to be the start of a line, so it is never
+    considered.
+
+    :return: The position of the record, or None when there is none.
+    """
+    position = 0
+    while True:
+        newline = window.data.find(b"\n", position)
+        if newline == -1:
+            if window.extend():
+                continue
+            return None
+        start = newline + 1
+        lines = window.lines(start, 5)
+        if is_record_start(lines, window.at_eof):
+            return start
+        position = start
+
+
+def record_id(name: bytes) -> bytes:
+    """
+    The id of a record name, which is the same for its mates: the name up
+    to the first whitespace, without a /1, /2 or /3 mate suffix.
+    """
+    parts = name.split(maxsplit=1)
+    identifier = parts[0] if parts else b""
+    if len(identifier) >= 2 and identifier[-1:] in b"123" and \
+            not identifier[-2:-1].isalnum():
+        return identifier[:-1]
+    return identifier
+
+
+def _record_ids(window: _FileWindow, start: int) -> Iterator[Tuple[bytes, int]]:
+    """Yield the id and the start of each record from start."""
+    while True:
+        lines = window.lines(start, 1)
+        if not lines:
+            return
+        yield record_id(lines[0][1:]), start
+        start = window.line_end(start, 4)
+
+
+def align_records(windows: Sequence[_FileWindow], starts: Sequence[int]
+                  ) -> List[int]:
+    """
+    Find the first records from the starts that are mates in all windows.
+    The records are read from all windows in step, so the files can be ahead
+    or behind each other by the same number of records.
+
+    :return: The positions of the mates in each window.
+    """
+    iterators = [_record_ids(window, start)
+                 for window, start in zip(windows, starts)]
+    seen: List[Dict[bytes, int]] = [{} for _ in windows]
+    for _ in range(MAX_ALIGNMENT_RECORDS):
+        new_ids = []
+        for iterator, ids in zip(iterators, seen):
+            for new_id, start in iterator:
+                ids.setdefault(new_id, start)
+                new_ids.append(new_id)
+                break
+        if not new_ids:
+            break
+        for new_id in new_ids:
+            if all(new_id in ids for ids in seen):
+                return [ids[new_id] for ids in seen]
+    raise ValueError(f"No mates found in the {MAX_ALIGNMENT_RECORDS} records "
+                     f"after the shard boundary. Are the input files paired?")
+
+
+def shard_boundary(input_files: Sequence[str], index: int, count: int
+                   ) -> List[Position]:
+    """The positions in each file where shard index of count shards starts."""
+    if index == 0:
+        return [(0, 0)] * len(input_files)
+    bases = []
+    windows = []
+    starts = []
+    file_handles = [open(input_file, "rb") for input_file in input_files]
+    try:
+        for file_h in file_handles:
+            bgzf = is_bgzf_header(file_h.read(_BGZF_HEADER_SIZE))
+            size = os.fstat(file_h.fileno()).st_size
+            base = index * size // count
+            if bgzf:
+                base = find_bgzf_block(file_h, base)
+            window = _FileWindow(file_h, base, bgzf)
+            start = find_record_start(window)
+            if start is None:
+                # All records are in the shards before this one.
+                return [(os.path.getsize(input_file), 0)
+                        for input_file in input_files]
+            bases.append(base)
+            windows.append(window)
+            starts.append(start)
+        if len(windows) > 1:
+            starts = align_records(windows, starts)
+    finally:
+        for file_h in file_handles:
+            file_h.close()
+    return list(zip(bases, starts))
+
+
+def shard_range(input_files: Sequence[str], index: int, count: int
+                ) -> Tuple[List[Position], Optional[List[Position]]]:
+    """
+    The start and the end position of a shard in each file. The end is None
+    for the last shard, which continues to the end of the files.
+    """
+    start = shard_boundary(input_files, index, count)
+    end = (shard_boundary(input_files, index + 1, count)
+           if index + 1 < count else None)
+    return start, end
+
+
+class ShardReader(io.RawIOBase):
+    """
+    A binary file with the (decompressed) data of a file from the start to
+    the end position of a shard.
+
+    :param filename: An uncompressed or BGZF file.
+    :param start: The position of the first byte.
+    :param end: The position after the last byte, or None to read to the end
+    of the file.
+    """
+    def __init__(self, filename: str, start: Position,
+                 end: Optional[Position] = None):
+        super().__init__()
+        self._raw = open(filename, "rb")
+        bgzf = is_bgzf_header(self._raw.read(_BGZF_HEADER_SIZE))
+        self._chunks = (self._bgzf_chunks(start, end) if bgzf
+                        else self._plain_chunks(start, end))
+        self._chunk = memoryview(b"")
+
+    def readable(self) -> bool:
+        return True
+
+    def _plain_chunks(self, start: Position, end: Optional[Position]
+                      ) -> Iterator[bytes]:
+        position = sum(start)
+        self._raw.seek(position)
+        end_position = sum(end) if end is not None else None
+        while end_position is None or position < end_position:
+            size = SHARD_READ_SIZE
+            if end_position is not None:
+                size = min(size, end_position - position)
+            chunk = self._raw.read(size)
+            if not chunk:
+                return
+            position += len(chunk)
+            yield chunk
+
+    def _bgzf_chunks(self, start: Position, end: Optional[Position]
+                     ) -> Iterator[bytes]:
+        base, skip = start
+        # The number of bytes from the start of the base block.
+        position = 0
+        limit = None
+        for offset, data in bgzf_blocks(self._raw, base):
+            if end is not None and limit is None and offset >= end[0]:
+                limit = position + end[1]
+            if limit is not None:
+                data = data[:max(limit - position, 0)]
+                if not data:
+                    return
+            chunk_start = max(skip - position, 0)
+            position += len(data)
+            if chunk_start < len(data):
+                yield data[chunk_start:]
+
+    def readinto(self, buffer) -> int:  # type: ignore
+        if self.closed:
+            raise ValueError("I/O operation on closed file.")
+        while not self._chunk:
+            chunk = next(self._chunks, None)
+            if chunk is None:
+                return 0
+            self._chunk = memoryview(chunk)
+        size = min(len(buffer), len(self._chunk))
+        buffer[:size] = self._chunk[:size]
+        self._chunk = self._chunk[size:]
+        return size
+
+    def close(self):
+        if self.closed:
+            return
+        self._raw.close()
+        super().close()
+
+
+def merge_files(input_files: Sequence[str], output: BinaryIO):
+    """
+    Concatenate the outputs of the shards of one file in shard order. The
+    files are copied as is, as concatenated gzip files are valid gzip files.
+    The BGZF end-of-stream markers of all but the last file are left out.
+    """
+    for i, input_file in enumerate(input_files):
+        with open(input_file, "rb") as input_h:
+            size = os.fstat(input_h.fileno()).st_size
+            if i + 1 < len(input_files) and size >= len(BGZF_EOF):
+                input_h.seek(size - len(BGZF_EOF))
+                if input_h.read() == BGZF_EOF:
+                    size -= len(BGZF_EOF)
+                input_h.seek(0)
+            while size > 0:
+                block = input_h.read(min(SHARD_READ_SIZE, size))
+                if not block:
+                    break
+                output.write(block)
+                size -= len(block)
+
+
+def _merge_histogram(histograms: Sequence[List[List[int]]]) -> List[List[int]]:
+    """Sum the counts of the bins, which are the last items."""
+    counts: Dict[Tuple[int, ...], int] = {}
+    for histogram in histograms:
+        for *bin_range, count in histogram:
+            key = tuple(bin_range)
+            counts[key] = counts.get(key, 0) + count
+    return [[*key, count] for key, count in sorted(counts.items())]
+
+
+def merge_reports(reports: Sequence[Dict[str, Any]]) -> Dict[str, Any]:
+    """
+    Combine the JSON reports of the shards of a run. The counts, times and
+    histograms are summed. The wall time is that of the slowest shard, as
+    the shards run at the same time.
+    """
+    if not reports:
+        raise ValueError("At least one report is required.")
+    shards = [report.get("shard") for report in reports]
+    if any(shard is not None for shard in shards) and shards != [
+            f"{i}/{len(reports)}" for i in range(len(reports))]:
+        raise ValueError(f"The reports must be of all shards in order, got "
+                         f"shards {', '.join(map(str, shards))}.")
+    first = reports[0]
+    filter_keys = [(f["name"], f["threshold"]) for f in first["filters"]]
+    for report in reports[1:]:
+        if [(f["name"], f["threshold"]) for f in report["filters"]] != \
+                filter_keys:
+            raise ValueError("The reports were made with different filters.")
+    stage_times: Dict[str, float] = {}
+    for report in reports:
+        for stage, stage_time in report["stage_times"].items():
+            stage_times[stage] = stage_times.get(stage, 0.0) + stage_time
+    histograms: Dict[str, Any] = {}
+    for outcome in ("passed", "failed"):
+        parts = [report["histograms"][outcome] for report in reports
+                 if outcome in report["histograms"]]
+        if parts:
+            histograms[outcome] = {
+                kind: _merge_histogram([part[kind] for part in parts])
+                for kind in ("length", "mean_quality")}
+    return {
+        "shard": None,
+        "input_files": first["input_files"],
+        "output_files": [output_file for report in reports
+                         for output_file in report["output_files"]],
+        "total": (sum(report["total"] for report in reports)
+                  if first["total"] is not None else None),
+        "passed": (sum(report["passed"] for report in reports)
+                   if first["passed"] is not None else None),
+        "wall_time": max(report["wall_time"] for report in reports),
+        "stage_times": stage_times,
+        "filters": [
+            {"name": name,
+             "threshold": threshold,
+             "total": sum(report["filters"][i]["total"] for report in reports),
+             "passed": sum(report["filters"][i]["passed"]
+                           for report in reports),
+             "time": sum(report["filters"][i]["time"] for report in reports)}
+            for i, (name, threshold) in enumerate(filter_keys)
+        ],
+        "histograms": histograms,
+    }
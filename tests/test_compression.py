@@ -0,0 +1,213 @@
+# Copyright (c) 2021 Leiden University Medical Center
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+import gzip
+import io
+import os
+import struct
+import sys
+
+from fastq_filter import file_to_fastq_records, filter_fastq
+from fastq_filter.compression import (
+    BGZF_BLOCK_SIZE,
+    BGZF_EOF,
+    ParallelGzipWriter,
+    PIPE_SIZE,
+    ThreadedGzipReader,
+    enlarge_pipe,
+    gzip_member,
+    open_input,
+)
+
+import pytest
+
+DATA = os.urandom(100_000) + b"@read\nACGT\n+\nIIII\n" * 50_000
+
+
+def bgzf_blocks(data: bytes):
+    position = 0
+    while position < len(data):
+        assert data[position:position + 4] == b"\x1f\x8b\x08\x04"
+        xlen, = struct.unpack("<H", data[position + 10:position + 12])
+        assert xlen == 6
+        assert data[position + 12:position + 14] == b"BC"
+        block_size, = struct.unpack("<H", data[position + 16:position + 18])
+        block_size += 1
+        yield data[position:position + block_size]
+        position += block_size
+    assert position == len(data)
+
+
+@pytest.mark.parametrize("bgzf", [False, True])
+def test_gzip_member(bgzf):
+    member = gzip_member(b"ACGT" * 1000, 2, bgzf)
+    assert gzip.decompress(member) == b"ACGT" * 1000
+    if bgzf:
+        assert list(bgzf_blocks(member)) == [member]
+
+
+def test_gzip_member_bgzf_too_large():
+    with pytest.raises(ValueError):
+        gzip_member(bytes(BGZF_BLOCK_SIZE + 1), 1, bgzf=True)
+
+
+@pytest.mark.parametrize(["threads", "block_size"],
+                         [(1, 1000), (3, 7777), (8, 1024 * 1024)])
+def test_parallel_gzip_writer(tmp_path, threads, block_size):
+    out = tmp_path / "out.gz"
+    with ParallelGzipWriter(str(out), compresslevel=1, threads=threads,
+                            block_size=block_size) as writer:
+        for start in range(0, len(DATA), 5000):
+            writer.write(DATA[start:start + 5000])
+    assert gzip.decompress(out.read_bytes()) == DATA
+
+
+def test_parallel_gzip_writer_bgzf(tmp_path):
+    out = tmp_path / "out.gz"
+    with ParallelGzipWriter(str(out), threads=4, bgzf=True) as writer:
+        writer.write(DATA)
+    compressed = out.read_bytes()
+    assert compressed.endswith(BGZF_EOF)
+    blocks = list(bgzf_blocks(compressed))
+    assert len(blocks) == len(DATA) // BGZF_BLOCK_SIZE + 2
+    assert b"".join(gzip.decompress(block) for block in blocks) == DATA
+
+
+def test_parallel_gzip_writer_closed(tmp_path):
+    writer = ParallelGzipWriter(str(tmp_path / "out.gz"))
+    writer.close()
+    writer.close()
+    with pytest.raises(ValueError):
+        writer.write(b"A")
+
+
+def test_parallel_gzip_writer_threads():
+    with pytest.raises(ValueError):
+        ParallelGzipWriter(None, threads=0)  # type: ignore
+
+
+@pytest.mark.parametrize("bgzf", [False, True])
+def test_filter_fastq_compression_threads(tmp_path, bgzf):
+    in_f = tmp_path / "in.fq"
+    in_f.write_bytes(b"@TEST\nAA\n+\nAA\n@TEST\nA\n+\n-\n" * 10_000)
+    out = tmp_path / "out.fq.gz"
+    filter_fastq([str(in_f)], [str(out)], [], compression_threads=2,
+                 bgzf=bgzf)
+    assert gzip.decompress(out.read_bytes()) == in_f.read_bytes()
+
+
+def read_all(reader, size=100_000):
+    blocks = []
+    while True:
+        block = reader.read(size)
+        if not block:
+            return b"".join(blocks)
+        blocks.append(block)
+
+
+@pytest.mark.parametrize(["bgzf", "threads"], [
+    (False, 1), (False, 4), (True, 1), (True, 4)])
+def test_threaded_gzip_reader(tmp_path, bgzf, threads):
+    compressed = tmp_path / "in.gz"
+    with ParallelGzipWriter(str(compressed), threads=2, bgzf=bgzf,
+                            block_size=30_000) as writer:
+        writer.write(DATA)
+    with ThreadedGzipReader(str(compressed), threads=threads,
+                            queue_size=2) as reader:
+        assert read_all(reader) == DATA
+
+
+def test_threaded_gzip_reader_bgzf_then_gzip(tmp_path):
+    compressed = tmp_path / "in.gz"
+    compressed.write_bytes(gzip_member(DATA[:1000], 1, bgzf=True) +
+                           gzip.compress(DATA[1000:]) +
+                           gzip_member(b"end", 1, bgzf=True))
+    with ThreadedGzipReader(str(compressed), threads=3) as reader:
+        assert read_all(reader) == DATA + b"end"
+
+
+@pytest.mark.parametrize("bgzf", [False, True])
+def test_threaded_gzip_reader_truncated(tmp_path, bgzf):
+    compressed = tmp_path / "in.gz"
+    data = b"".join(gzip_member(DATA[i:i + BGZF_BLOCK_SIZE], 1, bgzf=bgzf)
+                    for i in range(0, len(DATA), BGZF_BLOCK_SIZE))
+    compressed.write_bytes(data[:-100])
+    with ThreadedGzipReader(str(compressed), threads=2) as reader:
+        with pytest.raises(EOFError):
+            read_all(reader)
+
+
+def test_threaded_gzip_reader_close_early(tmp_path):
+    compressed = tmp_path / "in.gz"
+    compressed.write_bytes(gzip.compress(DATA * 4))
+    reader = ThreadedGzipReader(str(compressed), queue_size=1)
+    assert reader.read(10) == DATA[:10]
+    reader.close()
+    with pytest.raises(ValueError):
+        reader.read(10)
+
+
+def test_open_input_threads(tmp_path):
+    compressed = tmp_path / "in.fq.gz"
+    compressed.write_bytes(gzip.compress(b"@TEST\nA\n+\nA\n" * 3))
+    with open_input(str(compressed), threads=2) as reader:
+        assert reader.read() == b"@TEST\nA\n+\nA\n" * 3
+    assert len(list(file_to_fastq_records(str(compressed),
+                                          input_threads=1))) == 3
+
+
+@pytest.mark.parametrize("input_threads", [1, 3])
+def test_filter_fastq_input_threads(tmp_path, input_threads):
+    fastq = b"@TEST\nAA\n+\nAA\n@TEST\nA\n+\n-\n" * 10_000
+    compressed = tmp_path / "in.fq.gz"
+    with ParallelGzipWriter(str(compressed), bgzf=True) as writer:
+        writer.write(fastq)
+    out = tmp_path / "out.fq"
+    filter_fastq([str(compressed)], [str(out)], [],
+                 input_threads=input_threads)
+    assert out.read_bytes() == fastq
+
+
+@pytest.mark.skipif(not sys.platform.startswith("linux"),
+                    reason="Only Linux can resize pipes.")
+def test_enlarge_pipe():
+    import fcntl
+    F_GETPIPE_SZ = getattr(fcntl, "F_GETPIPE_SZ", 1032)
+    read_fd, write_fd = os.pipe()
+    try:
+        with open(read_fd, "rb") as read_h, open(write_fd, "wb") as write_h:
+            assert enlarge_pipe(read_h) is True
+            assert fcntl.fcntl(read_fd, F_GETPIPE_SZ) == PIPE_SIZE
+            write_h.write(b"A" * 100_000)
+            write_h.flush()
+            assert read_h.read(100_000) == b"A" * 100_000
+    finally:
+        for fd in (read_fd, write_fd):
+            try:
+                os.close(fd)
+            except OSError:
+                pass
+
+
+def test_enlarge_pipe_no_pipe(tmp_path):
+    regular = tmp_path / "regular"
+    regular.write_bytes(b"")
+    with open(regular, "rb") as regular_h:
+        assert enlarge_pipe(regular_h) is False
+    assert enlarge_pipe(io.BytesIO()) is False
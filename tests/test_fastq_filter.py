@@ -18,12 +18,17 @@
 # OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 # SOFTWARE.
 import array
+import concurrent.futures
+import gzip
 import itertools
+import json
 import math
+import random
 import statistics
 import sys
 from typing import List
 
+import dnaio
 from dnaio import Sequence
 
 import fastq_filter
@@ -76,6 +81,28 @@ def test_qualmedian_correct():
     assert type(result) == float
 
 
+# Lengths around the vector widths of the SIMD kernels.
+@pytest.mark.parametrize("length", list(range(0, 70)) + [150, 151, 300, 10000])
+def test_average_error_rate_lengths(length):
+    qualstring = (QUAL_STRINGS[0] * (length // len(QUAL_STRINGS[0]) + 1))[:length]
+    error_rates = [10 ** ((ord(qual) - DEFAULT_PHRED_SCORE_OFFSET) / -10)
+                   for qual in qualstring]
+    result = fastq_filter.average_error_rate(qualstring)
+    if length == 0:
+        assert math.isnan(result)
+    else:
+        assert result == pytest.approx(statistics.mean(error_rates))
+
+
+@pytest.mark.parametrize(["func", "position"], itertools.product(
+    [qualmean, qualmedian], [0, 15, 16, 31, 32, 33, 63, 64, 70]))
+def test_outside_range_phred_position(func, position):
+    qualstring = "~" * position + "\x7f" + "~" * (70 - position)
+    with pytest.raises(ValueError) as error:
+        func(qualstring)
+    assert error.match("outside of valid phred range")
+
+
 TOO_LOW_PHREDS = [chr(x) for x in range(33)]
 TOO_HIGH_PHREDS = [chr(127)]
 OUTSIDE_RANGE_PHREDS = TOO_LOW_PHREDS + TOO_HIGH_PHREDS
@@ -100,6 +127,141 @@ def test_non_ascii_phreds(func, quals):
     assert error.match("phred_scores must be ASCII encoded.")
 
 
+@pytest.mark.parametrize(["batch_func", "func"], [
+    (fastq_filter.qualmean_batch, qualmean),
+    (fastq_filter.qualmedian_batch, qualmedian),
+    (fastq_filter.average_error_rate_batch, fastq_filter.average_error_rate),
+])
+def test_batch_same_as_single(batch_func, func):
+    # Include a string long enough to release the GIL in the single version.
+    qualstrings = QUAL_STRINGS + ["I", QUAL_STRINGS[0] * 50]
+    assert batch_func(qualstrings) == [func(q) for q in qualstrings]
+    assert batch_func(tuple(qualstrings), phred_offset=0) == [
+        func(q, 0) for q in qualstrings]
+    assert batch_func([]) == []
+
+
+@pytest.mark.parametrize("batch_func", [fastq_filter.qualmean_batch,
+                                        fastq_filter.qualmedian_batch,
+                                        fastq_filter.average_error_rate_batch])
+def test_batch_errors(batch_func):
+    with pytest.raises(ValueError) as error:
+        batch_func(QUAL_STRINGS + ["II\x7f"])
+    error.match("outside of valid phred range")
+    with pytest.raises(TypeError) as error:
+        batch_func(QUAL_STRINGS + [3])
+    error.match("index 2")
+
+
+def buffer_types(qualstring: str):
+    data = qualstring.encode("ascii")
+    return [data, bytearray(data), memoryview(data),
+            memoryview(b"XX" + data + b"XX")[2:-2], array.array("B", data)]
+
+
+@pytest.mark.parametrize(["func", "qualstring"], itertools.product(
+    [qualmean, qualmedian, fastq_filter.average_error_rate],
+    QUAL_STRINGS + ["", "I", QUAL_STRINGS[0] * 50]))
+def test_buffer_same_as_str(func, qualstring):
+    expected = func(qualstring)
+    for phred_scores in buffer_types(qualstring):
+        result = func(phred_scores)
+        if math.isnan(expected):
+            assert math.isnan(result)
+        else:
+            assert result == expected
+
+
+@pytest.mark.parametrize("func", [qualmean, qualmedian,
+                                  fastq_filter.average_error_rate])
+def test_buffer_errors(func):
+    with pytest.raises(ValueError) as error:
+        func(b"II\x80")
+    error.match("outside of valid phred range")
+    with pytest.raises(TypeError) as error:
+        func(array.array("i", [60, 60]))
+    error.match("item size")
+    with pytest.raises(TypeError) as error:
+        func(30)
+    error.match("bytes-like object")
+
+
+def test_batch_buffers():
+    phred_scores = buffer_types(QUAL_STRINGS[0]) + [QUAL_STRINGS[0]]
+    assert fastq_filter.qualmean_batch(phred_scores) == [
+        qualmean(QUAL_STRINGS[0])] * len(phred_scores)
+
+
+def test_numpy_phred_scores():
+    numpy = pytest.importorskip("numpy")
+    phred_scores = numpy.frombuffer(QUAL_STRINGS[0].encode("ascii"),
+                                    dtype=numpy.uint8)
+    assert qualmedian(phred_scores) == qualmedian(QUAL_STRINGS[0])
+
+
+def test_batch_threads():
+    qualstrings = [QUAL_STRINGS[i % 2][:i] for i in range(1, 150)] * 20
+    expected = fastq_filter.qualmean_batch(qualstrings)
+    with concurrent.futures.ThreadPoolExecutor(4) as executor:
+        results = list(executor.map(fastq_filter.qualmean_batch,
+                                    [qualstrings] * 8))
+    assert results == [expected] * 8
+
+
+@pytest.mark.parametrize("batch_func", [fastq_filter.qualmean_batch,
+                                        fastq_filter.qualmedian_batch,
+                                        fastq_filter.average_error_rate_batch])
+def test_batch_out_and_offsets(batch_func):
+    qualstrings = QUAL_STRINGS + ["", "I", QUAL_STRINGS[0] * 50]
+    expected = batch_func(qualstrings)
+    out = array.array("d", [0.0] * len(qualstrings))
+    assert batch_func(qualstrings, out=out) is out
+    offsets = array.array("q", [0])
+    for qualstring in qualstrings:
+        offsets.append(offsets[-1] + len(qualstring))
+    concatenated = "".join(qualstrings)
+    from_offsets = batch_func(concatenated, offsets=offsets)
+    out2 = array.array("d", [0.0] * len(qualstrings))
+    batch_func(concatenated.encode("ascii"), offsets=memoryview(offsets),
+               out=out2)
+    # The empty string gives NaN, so the results are compared as strings.
+    for results in (out, from_offsets, out2):
+        assert [repr(x) for x in results] == [repr(x) for x in expected]
+
+
+@pytest.mark.parametrize("batch_func", [fastq_filter.qualmean_batch,
+                                        fastq_filter.qualmedian_batch,
+                                        fastq_filter.average_error_rate_batch])
+def test_batch_out_and_offsets_errors(batch_func):
+    with pytest.raises(ValueError) as error:
+        batch_func(QUAL_STRINGS, out=array.array("d", [0.0]))
+    error.match("length of 2")
+    with pytest.raises(TypeError) as error:
+        batch_func(QUAL_STRINGS, out=array.array("f", [0.0, 0.0]))
+    error.match("float64")
+    with pytest.raises(BufferError):
+        batch_func(QUAL_STRINGS, out=bytes(16))
+    with pytest.raises(TypeError) as error:
+        batch_func("IIII", offsets=array.array("i", [0, 4]))
+    error.match("int64")
+    for offsets in ([0, 5], [2, 1], [-1, 2]):
+        with pytest.raises(ValueError) as error:
+            batch_func("IIII", offsets=array.array("q", offsets))
+        error.match("index 0")
+    with pytest.raises(ValueError):
+        batch_func("IIII", offsets=array.array("q", []))
+    with pytest.raises(ValueError) as error:
+        batch_func("II\x7f", offsets=array.array("q", [0, 3]))
+    error.match("outside of valid phred range")
+
+
+def test_batch_numpy_out():
+    numpy = pytest.importorskip("numpy")
+    out = numpy.empty(len(QUAL_STRINGS))
+    fastq_filter.qualmean_batch(QUAL_STRINGS, out=out)
+    assert list(out) == fastq_filter.qualmean_batch(QUAL_STRINGS)
+
+
 def test_fastq_records_to_file(tmp_path):
     records = [Sequence("TEST", "A", "A")] * 3
     out = tmp_path / "test.fq"
@@ -125,6 +287,888 @@ def test_main(tmp_path):
     assert out_f.read_bytes() == b"@TEST\nAA\n+\nAA\n"
 
 
+def test_main_window_quality(tmp_path):
+    in_f = tmp_path / "in.fq"
+    out_f = tmp_path / "out.fq"
+    in_f.write_bytes(b"@GOOD\nAAAAAA\n+\nI#II#I\n@BAD\nAAAAAA\n+\nII##II\n")
+    sys.argv = ["", "--quiet", "-w", "5", "--window-size", "3", str(in_f),
+                "-o", str(out_f)]
+    fastq_filter.main()
+    assert out_f.read_bytes() == b"@GOOD\nAAAAAA\n+\nI#II#I\n"
+
+
+def test_main_sequence_filters(tmp_path):
+    in_f = tmp_path / "in.fq"
+    out_f = tmp_path / "out.fq"
+    in_f.write_bytes(b"@GOOD\nACGTNA\n+\nIIIIII\n@N\nACNTNA\n+\nIIIIII\n"
+                     b"@POLYG\nAGGGGG\n+\nIIIIII\n")
+    sys.argv = ["", "--quiet", "--max-n", "1", "--max-homopolymer", "4",
+                str(in_f), "-o", str(out_f)]
+    fastq_filter.main()
+    assert out_f.read_bytes() == b"@GOOD\nACGTNA\n+\nIIIIII\n"
+
+
+def test_main_verbose(tmp_path, capsys):
+    in_f = tmp_path / "in.fq"
+    out_f = tmp_path / "out.fq"
+    in_f.write_bytes(b"@TEST\nAA\n+\nAA\n@TEST\nA\n+\n-\n@TEST\nA\n+\nA\n")
+    sys.argv = ["", "--verbose", "-q", "20", "-l", "2", str(in_f),
+                "-o", str(out_f)]
+    fastq_filter.main()
+    assert out_f.read_bytes() == b"@TEST\nAA\n+\nAA\n"
+    log = capsys.readouterr().err
+    assert "wall time" in log
+    assert "filter minimum length" in log
+
+
+def test_main_json_report(tmp_path):
+    in_f = tmp_path / "in.fq"
+    out_f = tmp_path / "out.fq"
+    report_f = tmp_path / "report.json"
+    in_f.write_bytes(b"@TEST\nAA\n+\nAA\n@TEST\nA\n+\n-\n@TEST\nA\n+\nA\n")
+    sys.argv = ["", "--quiet", "-q", "20", "-l", "2", str(in_f),
+                "-o", str(out_f), "--json-report", str(report_f)]
+    fastq_filter.main()
+    report = json.loads(report_f.read_text())
+    assert report["input_files"] == [str(in_f)]
+    assert report["output_files"] == [str(out_f)]
+    assert report["total"] == 3
+    assert report["passed"] == 1
+    assert set(report["stage_times"]) == set(fastq_filter.STAGES)
+    assert [(f["name"], f["total"], f["passed"]) for f in report["filters"]] \
+        == [("minimum length", 3, 1), ("average error rate", 1, 1)]
+    assert all(f["time"] > 0.0 for f in report["filters"])
+    assert report["histograms"] == {
+        "passed": {"length": [[2, 2, 1]], "mean_quality": [[32, 1]]},
+        "failed": {"length": [[1, 1, 2]], "mean_quality": [[12, 1], [32, 1]]},
+    }
+
+
+@pytest.mark.parametrize("native", [True, False])
+@pytest.mark.parametrize("timed", [True, False])
+@pytest.mark.parametrize("threads", [1, 2])
+def test_filter_fastq_failed_output(tmp_path, native, timed, threads):
+    r1 = many_fastq_records(3000, 1, seed=1)
+    r2 = many_fastq_records(3000, 2, seed=2)
+    input_files = [str(tmp_path / "r1.fq"), str(tmp_path / "r2.fq")]
+    for input_file, data in zip(input_files, (r1, r2)):
+        open(input_file, "wb").write(data)
+    output_files = [str(tmp_path / "out1.fq"), str(tmp_path / "out2.fq")]
+    failed_files = [str(tmp_path / "failed1.fq"), str(tmp_path / "failed2.fq")]
+    filters = [fastq_filter.AverageErrorRateFilter(0.001)]
+    if not native:
+        filters.append(lambda records: True)
+    fastq_filter.filter_fastq(input_files, output_files, filters,
+                              threads=threads,
+                              stage_times={} if timed else None,
+                              failed_output_files=failed_files)
+    records = [r1.splitlines(keepends=True), r2.splitlines(keepends=True)]
+    expected = ([], [])
+    expected_failed = ([], [])
+    for i in range(0, len(records[0]), 4):
+        passed = records[0][i + 3] == records[1][i + 3] == b"I\n"
+        for mate in range(2):
+            group = expected if passed else expected_failed
+            group[mate].extend(records[mate][i:i + 4])
+    for mate in range(2):
+        assert open(output_files[mate], "rb").read() == b"".join(
+            expected[mate])
+        assert open(failed_files[mate], "rb").read() == b"".join(
+            expected_failed[mate])
+    assert filters[0].total == 3000
+
+
+def test_filter_fastq_failed_output_count(tmp_path):
+    with pytest.raises(ValueError) as error:
+        fastq_filter.filter_fastq(["in.fq"], ["out.fq"], [],
+                                  failed_output_files=[])
+    error.match("failed outputs")
+
+
+def test_main_failed_output(tmp_path):
+    in_f = tmp_path / "in.fq"
+    out_f = tmp_path / "out.fq"
+    failed_f = tmp_path / "failed.fq.gz"
+    in_f.write_bytes(b"@TEST\nAA\n+\nAA\n@TEST\nA\n+\n-\n@TEST\nA\n+\nA\n")
+    sys.argv = ["", "--quiet", "-q", "20", "-l", "2", str(in_f),
+                "-o", str(out_f), "--failed-output", str(failed_f)]
+    fastq_filter.main()
+    assert out_f.read_bytes() == b"@TEST\nAA\n+\nAA\n"
+    with gzip.open(failed_f, "rb") as failed_h:
+        assert failed_h.read() == b"@TEST\nA\n+\n-\n@TEST\nA\n+\nA\n"
+
+
+def test_filter_buffers_failed():
+    pipeline = fastq_filter.FilterPipeline(
+        [fastq_filter.AverageErrorRateFilter(0.001)])
+    passed, consumed, failed = pipeline.filter_buffers(
+        [FASTQ_RECORDS, FASTQ_RECORDS_R2], failed=True)
+    assert consumed == (len(FASTQ_RECORDS), len(FASTQ_RECORDS_R2))
+    assert passed == (b"@read1/1\nAACC\n+\nIIII\n",
+                      b"@read1/2\nGG\n+read1/2\nII\n")
+    assert failed == (FASTQ_RECORDS[len(passed[0]):],
+                      FASTQ_RECORDS_R2[len(passed[1]):])
+    assert len(pipeline.filter_buffers([FASTQ_RECORDS], failed=False)) == 2
+
+
+def test_main_auto_order(tmp_path):
+    in_f = tmp_path / "in.fq"
+    out_f = tmp_path / "out.fq"
+    report_f = tmp_path / "report.json"
+    data = many_fastq_records(12000, 1)
+    in_f.write_bytes(data)
+    sys.argv = ["", "--quiet", "--auto-order", "-l", "1", "-q", "20",
+                str(in_f), "-o", str(out_f), "--json-report", str(report_f)]
+    fastq_filter.main()
+    records = data.splitlines(keepends=True)
+    expected = [b"".join(records[i:i + 4]) for i in range(0, len(records), 4)
+                if records[i + 3] == b"I\n"]
+    assert out_f.read_bytes() == b"".join(expected)
+    report = json.loads(report_f.read_text())
+    assert report["total"] == 12000
+    assert report["passed"] == len(expected)
+
+
+@pytest.mark.parametrize("verbose", [[], ["--verbose"]])
+def test_main_no_reads_left(tmp_path, verbose):
+    # The length filter rejects every read, so the later filters get none.
+    in_f = tmp_path / "in.fq"
+    out_f = tmp_path / "out.fq"
+    report_f = tmp_path / "report.json"
+    in_f.write_bytes(FASTQ_RECORDS)
+    sys.argv = ["", *verbose, "-l", "100", "-q", "20", "-w", "10",
+                str(in_f), "-o", str(out_f), "--json-report", str(report_f)]
+    fastq_filter.main()
+    assert out_f.read_bytes() == b""
+    report = json.loads(report_f.read_text())
+    assert report["passed"] == 0
+    assert [f["total"] for f in report["filters"]][1:] == [0, 0]
+
+
+@pytest.mark.parametrize("native", [True, False])
+def test_filter_fastq_stage_times(tmp_path, native):
+    in_f = tmp_path / "in.fq"
+    in_f.write_bytes(FASTQ_RECORDS * 100)
+    filters = [fastq_filter.MinimumLengthFilter(4, timed=True),
+               fastq_filter.AverageErrorRateFilter(0.001, timed=True)]
+    if not native:
+        filters.append(lambda records: True)
+    stage_times = {"read": 1.0}
+    fastq_filter.filter_fastq([str(in_f)], [str(tmp_path / "out.fq")],
+                              filters, stage_times=stage_times)
+    assert set(stage_times) == set(fastq_filter.STAGES)
+    assert stage_times["read"] > 1.0
+    assert all(stage_time >= 0.0 for stage_time in stage_times.values())
+    assert filters[0].time > 0.0
+    assert filters[1].time > 0.0
+
+
 @pytest.mark.parametrize("func", [qualmean, qualmedian])
 def test_empty_quals_returns_nan(func):
     assert math.isnan(func(""))
+
+
+FASTQ_RECORDS = (b"@read1/1\nAACC\n+\nIIII\n"
+                 b"@read2/1\nAAC\n+\n###\n"
+                 b"@read3/1\nAACCGGTT\n+\nIIII####\n")
+FASTQ_RECORDS_R2 = (b"@read1/2\nGG\n+read1/2\nII\n"
+                    b"@read2/2\nGGT\n+\nIII\n"
+                    b"@read3/2\nGGTTA\n+\nIIIII\n")
+
+
+def test_filter_buffers():
+    pipeline = fastq_filter.FilterPipeline(
+        [fastq_filter.MinimumLengthFilter(4)])
+    partial = FASTQ_RECORDS[:-3]
+    passed, consumed = pipeline.filter_buffers([partial])
+    # The last record is incomplete and should not be consumed.
+    assert consumed == (len(b"@read1/1\nAACC\n+\nIIII\n@read2/1\nAAC\n+\n###\n"),)
+    assert passed == (b"@read1/1\nAACC\n+\nIIII\n",)
+    assert pipeline.filters[0].total == 2
+    assert pipeline.filters[0].passed == 1
+
+
+def test_filter_buffers_paired():
+    pipeline = fastq_filter.FilterPipeline(
+        [fastq_filter.AverageErrorRateFilter(0.001)])
+    passed, consumed = pipeline.filter_buffers(
+        [FASTQ_RECORDS, FASTQ_RECORDS_R2])
+    assert consumed == (len(FASTQ_RECORDS), len(FASTQ_RECORDS_R2))
+    assert passed == (b"@read1/1\nAACC\n+\nIIII\n",
+                      b"@read1/2\nGG\n+read1/2\nII\n")
+
+
+def many_fastq_records(number_of_records, mate, seed=0):
+    rand = random.Random(seed)
+    return b"".join(
+        f"@read{i}/{mate}\nA\n+\n{rand.choice('I#')}\n".encode()
+        for i in range(number_of_records))
+
+
+def test_filter_buffers_many_records():
+    # More records than fit in one batch, with pipelines of both sizes
+    # reusing the batches of earlier calls.
+    r1 = many_fastq_records(1000, 1, seed=1)
+    r2 = many_fastq_records(1000, 2, seed=2)
+    records1 = r1.splitlines(keepends=True)
+    records2 = r2.splitlines(keepends=True)
+    expected = ([], [])
+    expected_single = []
+    for i in range(0, len(records1), 4):
+        if records1[i + 3] == b"I\n":
+            expected_single.extend(records1[i:i + 4])
+            if records2[i + 3] == b"I\n":
+                expected[0].extend(records1[i:i + 4])
+                expected[1].extend(records2[i:i + 4])
+    pipeline = fastq_filter.FilterPipeline(
+        [fastq_filter.AverageErrorRateFilter(0.001)])
+    for _ in range(3):
+        passed, consumed = pipeline.filter_buffers([r1, r2])
+        assert consumed == (len(r1), len(r2))
+        assert passed == (b"".join(expected[0]), b"".join(expected[1]))
+        passed, consumed = pipeline.filter_buffers([r1])
+        assert consumed == (len(r1),)
+        assert passed == (b"".join(expected_single),)
+    assert pipeline.filters[0].total == 6000
+
+
+@pytest.mark.parametrize(["r2_error", "message"], [
+    (b"@wrong/2\nA\n+\nI\n", "out of sync"),
+    (b"@read700/2\nA\n-\nI\n", "file 1"),
+    (b"@read700/2\nA\n+\n\x7f\n", "phred"),
+])
+def test_filter_buffers_error_in_later_batch(r2_error, message):
+    r1 = many_fastq_records(1000, 1)
+    records2 = many_fastq_records(1000, 2).splitlines(keepends=True)
+    records2[700 * 4:701 * 4] = [r2_error]
+    pipeline = fastq_filter.FilterPipeline(
+        [fastq_filter.AverageErrorRateFilter(0.5)])
+    with pytest.raises(Exception) as error:
+        pipeline.filter_buffers([r1, b"".join(records2)])
+    error.match(message)
+    # The record tuples before the error are still counted.
+    assert pipeline.filters[0].total == 700
+
+
+@pytest.mark.parametrize("buffer_type", [bytearray, memoryview])
+def test_filter_buffers_buffer_types(buffer_type):
+    pipeline = fastq_filter.FilterPipeline(
+        [fastq_filter.AverageErrorRateFilter(0.001)])
+    passed, consumed = pipeline.filter_buffers(
+        [buffer_type(FASTQ_RECORDS), buffer_type(FASTQ_RECORDS_R2)])
+    assert consumed == (len(FASTQ_RECORDS), len(FASTQ_RECORDS_R2))
+    assert passed == (b"@read1/1\nAACC\n+\nIIII\n",
+                      b"@read1/2\nGG\n+read1/2\nII\n")
+
+
+def test_filter_buffers_out_of_sync():
+    pipeline = fastq_filter.FilterPipeline([])
+    with pytest.raises(dnaio.FastqFormatError) as error:
+        pipeline.filter_buffers([b"@readA\nA\n+\nA\n", b"@readB\nA\n+\nA\n"])
+    error.match("out of sync")
+
+
+@pytest.mark.parametrize("number_of_files", [2, 3])
+def test_filter_buffers_mates_same_as_dnaio(number_of_files):
+    # Names made of the characters that matter for the id, so names that
+    # only differ in them are common.
+    rand = random.Random(number_of_files)
+    pipeline = fastq_filter.FilterPipeline([])
+    for _ in range(2000):
+        names = ["".join(rand.choice("a12 \t3")
+                         for _ in range(rand.randint(0, 5)))
+                 for _ in range(number_of_files)]
+        if rand.random() < 0.5 and names[0]:
+            names[1] = names[0][:-1] + rand.choice("123")
+        buffers = [f"@{name}\nA\n+\nA\n".encode() for name in names]
+        records = [dnaio.SequenceRecord(name, "A", "A") for name in names]
+        try:
+            pipeline.filter_buffers(buffers)
+            mates = True
+        except dnaio.FastqFormatError:
+            mates = False
+        assert mates == dnaio.records_are_mates(*records), names
+
+
+def test_filter_fastq_out_of_sync(tmp_path):
+    r1 = tmp_path / "r1.fq"
+    r2 = tmp_path / "r2.fq"
+    r1.write_bytes(b"@readA/1\nA\n+\nA\n")
+    r2.write_bytes(b"@readB/2\nA\n+\nA\n")
+    for filters in ([], [lambda records: True]):
+        with pytest.raises(dnaio.FastqFormatError) as error:
+            fastq_filter.filter_fastq([str(r1), str(r2)],
+                                      [str(tmp_path / "o1.fq"),
+                                       str(tmp_path / "o2.fq")], filters)
+        error.match("names readA/1, readB/2 do not match")
+
+
+@pytest.mark.parametrize("fastq", [
+    b"read1\nA\n+\nA\n",
+    b"@read1\nA\nA\nA\n",
+    b"@read1\nAA\n+\nA\n",
+    b"@read1\nA\n+read2\nA\n",
+])
+def test_filter_buffers_format_error(fastq):
+    pipeline = fastq_filter.FilterPipeline([])
+    with pytest.raises(dnaio.FastqFormatError):
+        pipeline.filter_buffers([fastq])
+
+
+def test_filter_buffers_length_does_not_validate_qualities():
+    # Records are filtered on length without reading the qualities, so
+    # invalid phred scores go unnoticed when there are no quality filters.
+    pipeline = fastq_filter.FilterPipeline(
+        [fastq_filter.MinimumLengthFilter(4)])
+    fastq = b"@read1\nAAAA\n+\nIIII\n@read2\nAAA\n+\n\x7f\x7f\x7f\n"
+    passed, consumed = pipeline.filter_buffers([fastq])
+    assert passed == (b"@read1\nAAAA\n+\nIIII\n",)
+    assert consumed == (len(fastq),)
+
+
+def test_filter_buffers_statistics():
+    pipeline = fastq_filter.FilterPipeline(
+        [fastq_filter.MinimumLengthFilter(4)], statistics=True)
+    pipeline.filter_buffers([FASTQ_RECORDS])
+    pipeline.filter_buffers([FASTQ_RECORDS])
+    assert pipeline.statistics == {
+        "passed": {"length": [[4, 4, 2], [8, 8, 2]],
+                   "mean_quality": [[5, 2], [40, 2]]},
+        "failed": {"length": [[3, 3, 2]],
+                   "mean_quality": [[2, 2]]},
+    }
+
+
+def test_filter_buffers_statistics_paired():
+    pipeline = fastq_filter.FilterPipeline([], statistics=True)
+    pipeline.filter_buffers([FASTQ_RECORDS, FASTQ_RECORDS_R2])
+    histograms = pipeline.statistics["passed"]
+    assert histograms["length"] == [
+        [2, 2, 1], [3, 3, 2], [4, 4, 1], [5, 5, 1], [8, 8, 1]]
+    assert sum(count for _, count in histograms["mean_quality"]) == 6
+    assert pipeline.statistics["failed"] == {"length": [],
+                                             "mean_quality": []}
+
+
+def test_filter_buffers_statistics_long_reads():
+    pipeline = fastq_filter.FilterPipeline([], statistics=True)
+    fastq = b"".join(b"@read\n" + length * b"A" + b"\n+\n" + length * b"5" +
+                     b"\n" for length in (1023, 1024, 2047, 2048, 5000))
+    pipeline.filter_buffers([fastq])
+    assert pipeline.statistics["passed"] == {
+        "length": [[1023, 1023, 1], [1024, 2047, 2], [2048, 4095, 1],
+                   [4096, 8191, 1]],
+        "mean_quality": [[20, 5]]}
+
+
+def test_filter_buffers_statistics_invalid_qualities():
+    # Reads with invalid qualities have no mean quality.
+    pipeline = fastq_filter.FilterPipeline(
+        [fastq_filter.MinimumLengthFilter(4)], statistics=True)
+    fastq = b"@read1\nAAAA\n+\nIIII\n@read2\nAAA\n+\n\x7f\x7f\x7f\n"
+    pipeline.filter_buffers([fastq])
+    assert pipeline.statistics["failed"] == {"length": [[3, 3, 1]],
+                                             "mean_quality": []}
+
+
+def test_filter_buffers_pipeline_counts():
+    pipeline = fastq_filter.FilterPipeline(
+        [fastq_filter.MinimumLengthFilter(4),
+         fastq_filter.AverageErrorRateFilter(0.001)])
+    assert (pipeline.total, pipeline.passed) == (0, 0)
+    pipeline.filter_buffers([FASTQ_RECORDS])
+    pipeline.filter_batch([(dnaio.SequenceRecord("r", "AACC", "IIII"),)])
+    assert (pipeline.total, pipeline.passed) == (4, 2)
+    assert not pipeline.auto_order
+
+
+def test_filter_buffers_auto_order():
+    # The length filter rejects nothing, so the error rate filter, which
+    # rejects half of the records, should be evaluated first.
+    records = many_fastq_records(12000, 1).splitlines(keepends=True)
+    length_filter = fastq_filter.MinimumLengthFilter(1)
+    error_rate_filter = fastq_filter.AverageErrorRateFilter(0.001)
+    pipeline = fastq_filter.FilterPipeline(
+        [length_filter, error_rate_filter], auto_order=True)
+    fixed = fastq_filter.FilterPipeline(
+        [fastq_filter.MinimumLengthFilter(1),
+         fastq_filter.AverageErrorRateFilter(0.001)])
+    assert pipeline.auto_order
+    for start in range(0, len(records), 4000):
+        chunk = b"".join(records[start:start + 4000])
+        assert pipeline.filter_buffers([chunk]) == fixed.filter_buffers([chunk])
+    assert pipeline.filters == (error_rate_filter, length_filter)
+    assert (pipeline.total, pipeline.passed) == (fixed.total, fixed.passed)
+    assert error_rate_filter.total == 12000
+    assert error_rate_filter.passed == fixed.passed
+
+
+def test_filter_pipeline_auto_order_call_threaded():
+    # The long records are evaluated without the GIL while filter_buffers
+    # reorders the filters on another thread. Every record tuple must still
+    # be rejected by exactly one filter or by none.
+    rand = random.Random(0)
+    long_records = []
+    for i in range(200):
+        length = rand.randint(2048, 4096)
+        qualities = "".join(rand.choice("I#") if i % 2 else "I"
+                            for _ in range(length))
+        long_records.append((Sequence(f"read{i}", "A" * length, qualities),))
+
+    # The short records of filter_buffers all fail the minimum length, so
+    # that filter is moved to the front.
+    def make_filters():
+        return [fastq_filter.MaximumLengthFilter(4000),
+                fastq_filter.AverageErrorRateFilter(0.001),
+                fastq_filter.MinimumLengthFilter(3000)]
+    filters = make_filters()
+    pipeline = fastq_filter.FilterPipeline(filters, auto_order=True)
+    fixed = fastq_filter.FilterPipeline(make_filters())
+    expected = [fixed(record) for record in long_records]
+    chunks = [many_fastq_records(4000, 1, seed=seed) for seed in range(5)]
+    with concurrent.futures.ThreadPoolExecutor(2) as executor:
+        buffers = executor.submit(
+            lambda: [pipeline.filter_buffers([chunk]) for chunk in chunks])
+        results = [pipeline(record) for record in long_records * 5]
+        buffers.result()
+    assert pipeline.filters[0] is filters[2]
+    assert results == expected * 5
+    assert pipeline.total == 20000 + 1000
+    rejected = sum(f.total - f.passed for f in filters)
+    assert rejected == pipeline.total - pipeline.passed
+
+
+def test_filter_pipeline_no_statistics():
+    pipeline = fastq_filter.FilterPipeline([])
+    pipeline.filter_buffers([FASTQ_RECORDS])
+    assert pipeline.statistics is None
+
+
+@pytest.mark.parametrize("fastq", [
+    b"@read1\nAAAA\n+\nI\nII\n",
+    b"@read1\r\nAAAA\r\n+\r\nI\r\nI\r\n",
+    b"@r1\nAAAA\n+\nII\nI\n@r2\nA\n+\nI\n",
+])
+# Length filters and copying never validate the qualities.
+@pytest.mark.parametrize("filter_factory", [
+    lambda: [fastq_filter.AverageErrorRateFilter(0.1)],
+    lambda: [fastq_filter.MinimumLengthFilter(1)],
+    lambda: [],
+])
+def test_filter_buffers_newline_in_qualities(fastq, filter_factory):
+    # The quality line is split, but ends where a full quality line would.
+    pipeline = fastq_filter.FilterPipeline(filter_factory())
+    with pytest.raises(dnaio.FastqFormatError) as error:
+        pipeline.filter_buffers([fastq])
+    error.match("qualities length differ")
+
+
+def test_filter_buffers_crlf():
+    pipeline = fastq_filter.FilterPipeline(
+        [fastq_filter.AverageErrorRateFilter(0.1)])
+    fastq = b"@read1\r\nAAAA\r\n+\r\nIIII\r\n@read2\r\nA\r\n+\r\n#\r\n"
+    passed, consumed = pipeline.filter_buffers([fastq])
+    assert passed == (b"@read1\r\nAAAA\r\n+\r\nIIII\r\n",)
+    assert consumed == (len(fastq),)
+
+
+def sliding_window_trim(qualities: bytes, threshold: float,
+                        window_size: int) -> int:
+    """The length of a read cut at its first failing window."""
+    error_rates = [10 ** -((q - DEFAULT_PHRED_SCORE_OFFSET) / 10)
+                   for q in qualities]
+    if not error_rates:
+        return 0
+    window_size = min(window_size, len(error_rates))
+    for i in range(len(error_rates) - window_size + 1):
+        if statistics.mean(error_rates[i:i + window_size]) > threshold:
+            return i
+    return len(error_rates)
+
+
+def random_trim_records(number_of_records, mate, seed=0, plus_names=True):
+    """
+    Records as (name, sequence, plus line, qualities) tuples. Windows of 3
+    bases have an average error rate below 0.011 without a '#' and above 0.2
+    with one, so a threshold of 0.1 is far from all of them.
+    """
+    rand = random.Random(seed)
+    records = []
+    for i in range(number_of_records):
+        length = rand.randint(0, 20)
+        name = f"read{i}/{mate}".encode()
+        plus = b"+" + name if plus_names and rand.random() < 0.5 else b"+"
+        sequence = bytes(rand.choice(b"ACGT") for _ in range(length))
+        qualities = bytes(rand.choice(b"III5#") for _ in range(length))
+        records.append((name, sequence, plus, qualities))
+    return records
+
+
+def trim_records_to_fastq(records, lengths=None, line_end=b"\n"):
+    if lengths is None:
+        lengths = [len(sequence) for _, sequence, _, _ in records]
+    return b"".join(
+        b"@" + name + line_end + sequence[:length] + line_end + plus +
+        line_end + qualities[:length] + line_end
+        for (name, sequence, plus, qualities), length in zip(records, lengths))
+
+
+@pytest.mark.parametrize(["number_of_buffers", "line_end"],
+                         itertools.product([1, 2], [b"\n", b"\r\n"]))
+def test_filter_buffers_window_trim(number_of_buffers, line_end):
+    # More records than fit in one batch.
+    files = [random_trim_records(600, mate, seed=mate)
+             for mate in range(1, number_of_buffers + 1)]
+    lengths = [[sliding_window_trim(qualities, 0.1, 3)
+                for _, _, _, qualities in records] for records in files]
+    passed = [any(length >= 5 for length in tuple_lengths)
+              for tuple_lengths in zip(*lengths)]
+    trim_filter = fastq_filter.SlidingWindowErrorRateFilter(0.1, 3, trim=True)
+    length_filter = fastq_filter.MinimumLengthFilter(5)
+    pipeline = fastq_filter.FilterPipeline([trim_filter, length_filter],
+                                           statistics=True)
+    buffers = [trim_records_to_fastq(records, line_end=line_end)
+               for records in files]
+    passed_records, consumed, failed_records = pipeline.filter_buffers(
+        buffers, failed=True)
+    assert consumed == tuple(len(buffer) for buffer in buffers)
+    # Passing records are cut and failing records are written as they were.
+    assert passed_records == tuple(
+        trim_records_to_fastq(
+            [record for record, flag in zip(records, passed) if flag],
+            [length for length, flag in zip(file_lengths, passed) if flag],
+            line_end)
+        for records, file_lengths in zip(files, lengths))
+    assert failed_records == tuple(
+        trim_records_to_fastq(
+            [record for record, flag in zip(records, passed) if not flag],
+            line_end=line_end)
+        for records in files)
+    assert trim_filter.total == trim_filter.passed == 600
+    assert length_filter.total == 600
+    assert length_filter.passed == pipeline.passed == sum(passed)
+    # The statistics describe the reads as they were written.
+    passed_lengths = pipeline.statistics["passed"]["length"]
+    assert sum(count * low for low, high, count in passed_lengths) == sum(
+        length for file_lengths in lengths
+        for length, flag in zip(file_lengths, passed) if flag)
+
+
+def test_filter_buffers_window_trim_auto_order():
+    # The trimming filter cuts nothing here. The filters after it are
+    # reordered, the filters up to it keep their place.
+    records = many_fastq_records(12000, 1).splitlines(keepends=True)
+    first_length_filter = fastq_filter.MinimumLengthFilter(1)
+    trim_filter = fastq_filter.SlidingWindowErrorRateFilter(0.9, trim=True)
+    length_filter = fastq_filter.MinimumLengthFilter(1)
+    error_rate_filter = fastq_filter.AverageErrorRateFilter(0.001)
+    pipeline = fastq_filter.FilterPipeline(
+        [first_length_filter, trim_filter, length_filter, error_rate_filter],
+        auto_order=True)
+    fixed = fastq_filter.FilterPipeline(
+        [fastq_filter.AverageErrorRateFilter(0.001)])
+    for start in range(0, len(records), 4000):
+        chunk = b"".join(records[start:start + 4000])
+        assert pipeline.filter_buffers([chunk]) == fixed.filter_buffers([chunk])
+    assert pipeline.filters == (first_length_filter, trim_filter,
+                                error_rate_filter, length_filter)
+
+
+def test_main_window_trim(tmp_path):
+    in_f = tmp_path / "in.fq"
+    out_f = tmp_path / "out.fq"
+    in_f.write_bytes(b"@A\nACGTAC\n+\nIIII##\n@B\nACGT\n+\nI###\n"
+                     b"@C\nAC\n+\nII\n@D\nACGTA\n+\nIIIII\n")
+    sys.argv = ["", "--quiet", "-w", "20", "--window-size", "2",
+                "--window-trim", "--tail-first", "-l", "3", str(in_f),
+                "-o", str(out_f)]
+    fastq_filter.main()
+    assert out_f.read_bytes() == (b"@A\nACG\n+\nIII\n"
+                                  b"@D\nACGTA\n+\nIIIII\n")
+
+
+def test_filter_fastq_window_trim_native_same_as_records(tmp_path):
+    r1 = tmp_path / "r1.fq"
+    r2 = tmp_path / "r2.fq"
+    r1.write_bytes(trim_records_to_fastq(
+        random_trim_records(100, 1, seed=1, plus_names=False)))
+    r2.write_bytes(trim_records_to_fastq(
+        random_trim_records(100, 2, seed=2, plus_names=False)))
+    native_out = [str(tmp_path / "native_r1.fq"),
+                  str(tmp_path / "native_r2.fq")]
+    records_out = [str(tmp_path / "records_r1.fq"),
+                   str(tmp_path / "records_r2.fq")]
+    fastq_filter.filter_fastq(
+        [str(r1), str(r2)], native_out,
+        [fastq_filter.SlidingWindowErrorRateFilter(0.1, 3, trim=True),
+         fastq_filter.MinimumLengthFilter(5)])
+    # A lambda forces the per-record Python path.
+    fastq_filter.filter_fastq(
+        [str(r1), str(r2)], records_out,
+        [fastq_filter.SlidingWindowErrorRateFilter(0.1, 3, trim=True),
+         fastq_filter.MinimumLengthFilter(5), lambda records: True])
+    for native, records in zip(native_out, records_out):
+        with open(native, "rb") as native_h, open(records, "rb") as records_h:
+            native_data = native_h.read()
+            assert native_data == records_h.read()
+            assert native_data
+
+
+@pytest.mark.parametrize("buffer_size", [5, 40, 1024 * 1024])
+def test_filter_fastq_native_same_as_records(tmp_path, monkeypatch,
+                                             buffer_size):
+    monkeypatch.setattr(fastq_filter, "READ_BUFFER_SIZE", buffer_size)
+    r1 = tmp_path / "r1.fq"
+    r2 = tmp_path / "r2.fq"
+    r1.write_bytes(FASTQ_RECORDS * 20)
+    r2.write_bytes(FASTQ_RECORDS_R2.replace(b"+read1/2", b"+") * 20)
+    native_out = [str(tmp_path / "native_r1.fq"),
+                  str(tmp_path / "native_r2.fq")]
+    records_out = [str(tmp_path / "records_r1.fq"),
+                   str(tmp_path / "records_r2.fq")]
+    native_filter = fastq_filter.MedianQualityFilter(30)
+    fastq_filter.filter_fastq([str(r1), str(r2)], native_out, [native_filter])
+    records_filter = fastq_filter.MedianQualityFilter(30)
+    # A lambda forces the per-record Python path.
+    fastq_filter.filter_fastq([str(r1), str(r2)], records_out,
+                              [records_filter, lambda records: True])
+    for native, records in zip(native_out, records_out):
+        with open(native, "rb") as native_h, open(records, "rb") as records_h:
+            assert native_h.read() == records_h.read()
+    assert native_filter.total == records_filter.total == 60
+    assert native_filter.passed == records_filter.passed == 40
+
+
+@pytest.mark.parametrize(["output_buffer_size", "number_of_files", "native"],
+                         itertools.product([1, 100, 1024 * 1024], [1, 2, 3],
+                                           [True, False]))
+def test_filter_fastq_output_buffer_size(tmp_path, output_buffer_size,
+                                         number_of_files, native):
+    in_f = tmp_path / "in.fq"
+    in_f.write_bytes(FASTQ_RECORDS * 10)
+    output_files = [str(tmp_path / f"out{i}.fq")
+                    for i in range(number_of_files)]
+    filters = [fastq_filter.MinimumLengthFilter(4)]
+    if not native:
+        filters.append(lambda records: True)
+    fastq_filter.filter_fastq([str(in_f)] * number_of_files, output_files,
+                              filters, output_buffer_size=output_buffer_size)
+    for output_file in output_files:
+        with open(output_file, "rb") as output_h:
+            assert output_h.read() == (b"@read1/1\nAACC\n+\nIIII\n"
+                                       b"@read3/1\nAACCGGTT\n+\nIIII####\n"
+                                       ) * 10
+
+
+def test_filter_fastq_output_buffer_size_invalid(tmp_path):
+    with pytest.raises(ValueError) as error:
+        fastq_filter.filter_fastq([], [], [], output_buffer_size=0)
+    error.match("output_buffer_size")
+
+
+class RecordingOutput:
+    def __init__(self, writes: List[bytes]):
+        self.writes = writes
+
+    def write(self, data):
+        self.writes.append(bytes(data))
+
+
+def test_output_buffers_write_in_step():
+    writes: List[bytes] = []
+    output_buffers = fastq_filter.OutputBuffers(
+        [RecordingOutput(writes), RecordingOutput(writes)], buffer_size=8)
+    output_buffers.write([b"AA", b"B"])
+    assert writes == []
+    # The second buffer is full, so both are written.
+    output_buffers.write([b"A", b"BBBBBBB"])
+    assert writes == [b"AAA", b"BBBBBBBB"]
+    output_buffers.write([b"A", b""])
+    output_buffers.flush()
+    # Empty buffers are not written.
+    assert writes == [b"AAA", b"BBBBBBBB", b"A"]
+
+
+def test_output_buffers_write_large_data_directly():
+    writes: List[bytes] = []
+    output_buffers = fastq_filter.OutputBuffers(
+        [RecordingOutput(writes), RecordingOutput(writes)], buffer_size=8)
+    output_buffers.write([b"AAAA", b"BB"])
+    assert writes == [b"AAAA", b"BB"]
+    assert output_buffers.buffers == [bytearray(), bytearray()]
+
+
+def test_complete_record_offsets():
+    # The second buffer has only one complete record, so the first buffer
+    # should also be cut after one record.
+    offsets = fastq_filter.complete_record_offsets(
+        [FASTQ_RECORDS, FASTQ_RECORDS_R2[:30]])
+    assert offsets == (len(b"@read1/1\nAACC\n+\nIIII\n"),
+                       len(b"@read1/2\nGG\n+read1/2\nII\n"))
+    assert fastq_filter.complete_record_offsets([b"@read1\nA\n+\n"]) == (0,)
+
+
+def test_complete_record_offsets_newline_in_qualities():
+    # A quality line with a newline before the sequence length is malformed,
+    # even when a newline follows at the sequence length, so lines are
+    # counted.
+    fastq = b"@read1\nAAAA\n+\nI\nII\n@read2\nA\n+\nI\n"
+    assert fastq_filter.complete_record_offsets([fastq]) == (
+        len(b"@read1\nAAAA\n+\nI\nII\n@read2\nA\n+\n"),)
+
+
+def test_complete_record_offsets_format_error():
+    # From a malformed record onwards, lines are counted.
+    fastq = b"@read1\nA\n+\nI\nread2\nA\n+\nI\n@read3\nA\n"
+    assert fastq_filter.complete_record_offsets([fastq]) == (
+        len(b"@read1\nA\n+\nI\nread2\nA\n+\nI\n"),)
+
+
+@pytest.mark.parametrize("threads", [2, 3, 8])
+def test_filter_fastq_native_threads(tmp_path, monkeypatch, threads):
+    monkeypatch.setattr(fastq_filter, "READ_BUFFER_SIZE", 40)
+    r1 = tmp_path / "r1.fq"
+    r2 = tmp_path / "r2.fq"
+    r1.write_bytes(FASTQ_RECORDS * 20)
+    r2.write_bytes(FASTQ_RECORDS_R2 * 20)
+    single_out = [str(tmp_path / "single_r1.fq"),
+                  str(tmp_path / "single_r2.fq")]
+    threaded_out = [str(tmp_path / "threaded_r1.fq"),
+                    str(tmp_path / "threaded_r2.fq")]
+    single_filters = [fastq_filter.MinimumLengthFilter(3),
+                      fastq_filter.MedianQualityFilter(30)]
+    threaded_filters = [fastq_filter.MinimumLengthFilter(3),
+                        fastq_filter.MedianQualityFilter(30)]
+    fastq_filter.filter_fastq([str(r1), str(r2)], single_out, single_filters)
+    fastq_filter.filter_fastq([str(r1), str(r2)], threaded_out,
+                              threaded_filters, threads=threads)
+    for single, threaded in zip(single_out, threaded_out):
+        with open(single, "rb") as single_h, open(threaded, "rb") as threaded_h:
+            assert single_h.read() == threaded_h.read()
+    for single_filter, threaded_filter in zip(single_filters,
+                                              threaded_filters):
+        assert single_filter.total == threaded_filter.total
+        assert single_filter.passed == threaded_filter.passed
+    assert threaded_filters[0].total == 60
+    assert threaded_filters[-1].passed == 40
+
+
+@pytest.mark.parametrize(["threads", "max_buffer_size"], itertools.product(
+    [1, 2, 4], [1, 4000, 10_000, 100_000]))
+def test_filter_chunks_threaded_max_buffer_size(threads, max_buffer_size):
+    in_flight = 0
+    max_in_flight = 0
+
+    def chunks():
+        nonlocal in_flight, max_in_flight
+        for i in range(50):
+            in_flight += 1
+            max_in_flight = max(max_in_flight, in_flight)
+            yield [bytes([i]) * 1000]
+
+    results = []
+    for result in fastq_filter.filter_chunks_threaded(
+            lambda chunk: chunk[0][:10], chunks(), threads, max_buffer_size):
+        results.append(result)
+        in_flight -= 1
+    assert results == [bytes([i]) * 10 for i in range(50)]
+    # Each chunk counts for 2000 bytes, but one chunk is always allowed.
+    assert max_in_flight == max(1, min(max_buffer_size // 2000, threads * 2))
+
+
+def test_filter_fastq_max_buffer_size(tmp_path, monkeypatch):
+    monkeypatch.setattr(fastq_filter, "READ_BUFFER_SIZE", 40)
+    in_f = tmp_path / "in.fq"
+    out_f = tmp_path / "out.fq"
+    in_f.write_bytes(FASTQ_RECORDS * 20)
+    fastq_filter.filter_fastq([str(in_f)], [str(out_f)], [], threads=3,
+                              max_buffer_size=100)
+    assert out_f.read_bytes() == FASTQ_RECORDS * 20
+    with pytest.raises(ValueError) as error:
+        fastq_filter.filter_fastq([str(in_f)], [str(out_f)], [], threads=3,
+                                  max_buffer_size=0)
+    error.match("max_buffer_size")
+
+
+def test_filter_fastq_native_threads_error(tmp_path):
+    in_f = tmp_path / "in.fq"
+    in_f.write_bytes(b"@TEST\nAA\n+\nAA\n" * 10 + b"TEST\nA\n+\nA\n")
+    with pytest.raises(dnaio.FastqFormatError):
+        fastq_filter.filter_fastq([str(in_f)], [str(tmp_path / "out.fq")],
+                                  [], threads=4)
+
+
+@pytest.mark.parametrize(["buffer_size", "fastq"], itertools.product(
+    [5, 40, 1024 * 1024],
+    [b"", FASTQ_RECORDS, FASTQ_RECORDS[:-1], FASTQ_RECORDS * 10]))
+def test_mapped_fastq_chunks_same_as_fastq_chunks(tmp_path, monkeypatch,
+                                                  buffer_size, fastq):
+    monkeypatch.setattr(fastq_filter, "READ_BUFFER_SIZE", buffer_size)
+    in_f = tmp_path / "in.fq"
+    in_f.write_bytes(fastq)
+    with open(in_f, "rb") as in_h:
+        expected = b"".join(chunk[0] for chunk in
+                            fastq_filter.fastq_chunks([in_h]))
+    with fastq_filter.map_file(str(in_f)) as mapping:
+        chunks = fastq_filter.mapped_fastq_chunks([mapping])
+        assert b"".join(bytes(chunk[0]) for chunk in chunks) == expected
+
+
+def test_is_uncompressed_file(tmp_path):
+    plain = tmp_path / "in.fq"
+    plain.write_bytes(FASTQ_RECORDS)
+    assert fastq_filter.is_uncompressed_file(str(plain))
+    compressed = tmp_path / "compressed.fq"
+    compressed.write_bytes(b"\x1f\x8b\x08\x00")
+    assert not fastq_filter.is_uncompressed_file(str(compressed))
+    assert not fastq_filter.is_uncompressed_file(str(tmp_path / "in.fq.gz"))
+    assert not fastq_filter.is_uncompressed_file("-")
+    assert not fastq_filter.is_uncompressed_file(str(tmp_path))
+
+
+@pytest.mark.parametrize(["r1", "r2"], [
+    (FASTQ_RECORDS[:-1], FASTQ_RECORDS_R2 + FASTQ_RECORDS_R2[:28]),
+    (FASTQ_RECORDS + FASTQ_RECORDS[:10], FASTQ_RECORDS_R2[:-1]),
+])
+def test_filter_fastq_native_unequal_records_at_end(tmp_path, r1, r2):
+    r1_f = tmp_path / "r1.fq"
+    r2_f = tmp_path / "r2.fq"
+    r1_f.write_bytes(r1)
+    r2_f.write_bytes(r2)
+    with pytest.raises(dnaio.FastqFormatError) as error:
+        fastq_filter.filter_fastq(
+            [str(r1_f), str(r2_f)],
+            [str(tmp_path / "o1.fq"), str(tmp_path / "o2.fq")], [])
+    error.match("unequal number")
+
+
+def test_filter_fastq_native_no_final_newline(tmp_path):
+    in_f = tmp_path / "in.fq"
+    out_f = tmp_path / "out.fq"
+    in_f.write_bytes(b"@TEST\nAA\n+\nAA\n@TEST\nA\n+\nA")
+    fastq_filter.filter_fastq([str(in_f)], [str(out_f)], [])
+    assert out_f.read_bytes() == b"@TEST\nAA\n+\nAA\n@TEST\nA\n+\nA\n"
+
+
+@pytest.mark.parametrize(["r1", "r2"], [
+    (FASTQ_RECORDS, FASTQ_RECORDS_R2 * 2),
+    (FASTQ_RECORDS * 2, FASTQ_RECORDS_R2),
+])
+def test_filter_fastq_native_unequal_records(tmp_path, r1, r2):
+    r1_f = tmp_path / "r1.fq"
+    r2_f = tmp_path / "r2.fq"
+    r1_f.write_bytes(r1)
+    r2_f.write_bytes(r2)
+    with pytest.raises(dnaio.FastqFormatError) as error:
+        fastq_filter.filter_fastq(
+            [str(r1_f), str(r2_f)],
+            [str(tmp_path / "o1.fq"), str(tmp_path / "o2.fq")], [])
+    error.match("unequal number")
+
+
+def test_filter_fastq_native_truncated(tmp_path):
+    in_f = tmp_path / "in.fq"
+    in_f.write_bytes(b"@TEST\nAA\n+\nAA\n@TEST\nA\n")
+    with pytest.raises(dnaio.FastqFormatError) as error:
+        fastq_filter.filter_fastq([str(in_f)], [str(tmp_path / "out.fq")], [])
+    error.match("Premature end of file")
@@ -19,6 +19,11 @@
 # SOFTWARE.
 import array
 import itertools
+import os
+import random
+import statistics
+import subprocess
+import sys
 from typing import List
 
 from dnaio import SequenceRecord
@@ -26,9 +31,13 @@ from dnaio import SequenceRecord
 from fastq_filter import (
     AverageErrorRateFilter,
     DEFAULT_PHRED_SCORE_OFFSET,
+    FilterPipeline,
+    MaximumHomopolymerFilter,
     MaximumLengthFilter,
+    MaximumNFilter,
     MedianQualityFilter,
-    MinimumLengthFilter
+    MinimumLengthFilter,
+    SlidingWindowErrorRateFilter
 )
 
 import pytest
@@ -108,6 +117,395 @@ def test_median_quality_filter(threshold, qualities, result):
     #     assert filter.passed == 0
 
 
+@pytest.mark.parametrize(["threshold", "qualities"], itertools.product(
+    [0, 0.5, 10, 10.5, 20, 20.25, 39, 40, 40.5, 93, 94, 200],
+    [[[20]], [[10, 30]], [[10, 31]], [[20, 21]], [[19, 21]],
+     [[40] * 300 + [10] * 300], [[40] * 299 + [10] * 301],
+     [[40] * 301 + [10] * 299], [[0, 93]], [[93] * 3, [0] * 2],
+     [[10] * 5, [40] * 5, [20, 21]]]
+))
+def test_median_quality_filter_matches_median(threshold, qualities):
+    filter = MedianQualityFilter(threshold)
+    records = [SequenceRecord("name", len(qual) * 'A', quallist_to_string(qual))
+               for qual in qualities]
+    median = statistics.median(itertools.chain(*qualities))
+    assert filter(tuple(records)) is (median >= threshold)
+
+
+@pytest.mark.parametrize("seed", range(20))
+def test_median_quality_filter_random(seed):
+    rand = random.Random(seed)
+    qualities = [rand.randint(0, 41) for _ in range(rand.randint(1, 1000))]
+    threshold = rand.randint(0, 41)
+    record = SequenceRecord("name", len(qualities) * 'A',
+                            quallist_to_string(qualities))
+    filter = MedianQualityFilter(threshold)
+    assert filter((record,)) is (statistics.median(qualities) >= threshold)
+
+
+def test_median_quality_filter_empty():
+    filter = MedianQualityFilter(20)
+    assert filter((SequenceRecord("name", "", ""),)) is False
+    assert filter.total == 1
+    assert filter.passed == 0
+
+
+@pytest.mark.parametrize(["filter_class", "tail_first", "seed"],
+                         itertools.product(
+                             [AverageErrorRateFilter, MedianQualityFilter],
+                             [False, True], range(20)))
+def test_quality_filter_early_exit(filter_class, tail_first, seed):
+    rand = random.Random(seed)
+    qualities = [[rand.randint(0, 41) for _ in range(rand.randint(1, 500))]
+                 for _ in range(rand.randint(1, 3))]
+    all_qualities = list(itertools.chain(*qualities))
+    if filter_class is AverageErrorRateFilter:
+        threshold = 10 ** -(rand.randint(5, 30) / 10)
+        error_rate = statistics.mean(10 ** -(q / 10) for q in all_qualities)
+        expected = error_rate <= threshold
+    else:
+        threshold = rand.randint(0, 41)
+        expected = statistics.median(all_qualities) >= threshold
+    records = tuple(SequenceRecord("name", len(qual) * 'A',
+                                   quallist_to_string(qual))
+                    for qual in qualities)
+    filter = filter_class(threshold, tail_first=tail_first)
+    assert filter.tail_first is tail_first
+    assert filter(records) is expected
+    assert filter.total == 1
+    assert filter.passed == int(expected)
+
+
+def test_average_error_rate_filter_bad_tail():
+    # The low quality tail decides the outcome regardless of scan direction.
+    record = SequenceRecord("name", 300 * "A",
+                            quallist_to_string([40] * 200 + [2] * 100))
+    assert AverageErrorRateFilter(0.01)((record,)) is False
+    assert AverageErrorRateFilter(0.01, tail_first=True)((record,)) is False
+
+
+@pytest.mark.parametrize(["tail_first", "seed"],
+                         itertools.product([False, True], range(20)))
+def test_average_error_rate_filter_fixed_point(tail_first, seed):
+    rand = random.Random(seed)
+    qualities = [[rand.randint(0, 93) for _ in range(rand.randint(1, 500))]
+                 for _ in range(rand.randint(1, 3))]
+    error_rate = statistics.mean(
+        10 ** -(q / 10) for q in itertools.chain(*qualities))
+    # Thresholds close to the actual error rate test the error bound.
+    threshold = error_rate * rand.choice([0.5, 1 - 1e-6, 1 + 1e-6, 2])
+    records = tuple(SequenceRecord("name", len(qual) * 'A',
+                                   quallist_to_string(qual))
+                    for qual in qualities)
+    filter = AverageErrorRateFilter(threshold, tail_first=tail_first,
+                                    fixed_point=True)
+    assert filter.fixed_point is True
+    result = filter(records)
+    if abs(error_rate - threshold) > 2 ** -25:
+        assert result is (error_rate <= threshold)
+
+
+@pytest.mark.parametrize(["threshold", "tail_first"], itertools.product(
+    [float("nan"), float("inf"), -float("inf"), -0.5, 1.0],
+    [False, True]))
+def test_average_error_rate_filter_fixed_point_special_thresholds(
+        threshold, tail_first):
+    # Further than 2 ** -25 from the average error rate of any read, so
+    # both modes must agree.
+    rand = random.Random(0)
+    fixed = AverageErrorRateFilter(threshold, tail_first=tail_first,
+                                   fixed_point=True)
+    double = AverageErrorRateFilter(threshold, tail_first=tail_first)
+    for length in (0, 1, 10, 300, 5000):
+        for phreds in ([0] * length, [1] * length, [93] * length,
+                       [rand.randint(0, 93) for _ in range(length)]):
+            record = (SequenceRecord("name", length * "A",
+                                     quallist_to_string(phreds)),)
+            assert fixed(record) is double(record)
+            # Empty reads pass the sliding window filter.
+            assert SlidingWindowErrorRateFilter(threshold, 4)(record) is (
+                length == 0 or sliding_window_passes(phreds, threshold, 4))
+
+
+def test_average_error_rate_filter_fixed_point_phred_offset():
+    record = SequenceRecord("name", "AAAA", "hhhh")  # Phred 40 with offset 64.
+    assert AverageErrorRateFilter(
+        0.0002, phred_offset=64, fixed_point=True)((record,)) is True
+    assert AverageErrorRateFilter(
+        0.00005, phred_offset=64, fixed_point=True)((record,)) is False
+
+
+def test_average_error_rate_filter_fixed_point_empty():
+    filter = AverageErrorRateFilter(0.001, fixed_point=True)
+    assert filter((SequenceRecord("name", "", ""),)) is False
+
+
+def sliding_window_passes(qualities: List[int], threshold: float,
+                          window_size: int) -> bool:
+    error_rates = [10 ** -(q / 10) for q in qualities]
+    window_size = min(window_size, len(error_rates))
+    return all(
+        statistics.mean(error_rates[i:i + window_size]) <= threshold
+        for i in range(len(error_rates) - window_size + 1))
+
+
+@pytest.mark.parametrize(["tail_first", "seed"],
+                         itertools.product([False, True], range(20)))
+def test_sliding_window_error_rate_filter_random(tail_first, seed):
+    rand = random.Random(seed)
+    window_size = rand.randint(1, 20)
+    qualities = [[rand.randint(0, 41) for _ in range(rand.randint(1, 300))]
+                 for _ in range(rand.randint(1, 3))]
+    threshold = 10 ** -(rand.randint(0, 30) / 10)
+    expected = all(sliding_window_passes(qual, threshold, window_size)
+                   for qual in qualities)
+    records = tuple(SequenceRecord("name", len(qual) * 'A',
+                                   quallist_to_string(qual))
+                    for qual in qualities)
+    filter = SlidingWindowErrorRateFilter(threshold, window_size,
+                                          tail_first=tail_first)
+    assert filter.window_size == window_size
+    assert filter.tail_first is tail_first
+    assert filter(records) is expected
+    assert filter.total == 1
+    assert filter.passed == int(expected)
+
+
+@pytest.mark.parametrize(["qualities", "window_size", "result"], (
+    ([40] * 50 + [2] * 4 + [40] * 50, 4, False),
+    ([40] * 50 + [2] * 3 + [40] * 50, 4, True),
+    ([40] * 50 + [2, 2, 2, 2, 2], 5, False),
+    ([2, 40], 4, True),
+    ([2, 2], 4, False),
+    ([], 4, True),
+))
+def test_sliding_window_error_rate_filter(qualities, window_size, result):
+    filter = SlidingWindowErrorRateFilter(0.5, window_size)
+    record = SequenceRecord("name", len(qualities) * "A",
+                            quallist_to_string(qualities))
+    assert filter((record,)) is result
+
+
+def test_sliding_window_error_rate_filter_window_size():
+    assert SlidingWindowErrorRateFilter(0.01).window_size == 4
+    with pytest.raises(ValueError) as error:
+        SlidingWindowErrorRateFilter(0.01, 0)
+    error.match("window_size must be at least 1")
+
+
+def sliding_window_trim(qualities: List[int], threshold: float,
+                        window_size: int) -> int:
+    """The length of a read cut at its first failing window."""
+    error_rates = [10 ** -(q / 10) for q in qualities]
+    if not error_rates:
+        return 0
+    window_size = min(window_size, len(error_rates))
+    for i in range(len(error_rates) - window_size + 1):
+        if statistics.mean(error_rates[i:i + window_size]) > threshold:
+            return i
+    return len(error_rates)
+
+
+def random_trim_threshold(rand: random.Random, qualities: List[List[int]],
+                          window_size: int) -> float:
+    # The fixed-point window sums may deviate 2 ** -25 from the exact mean,
+    # so no window mean should be that close to the threshold.
+    means = [statistics.mean(10 ** -(q / 10) for q in qual[i:i + window])
+             for qual in qualities
+             for window in [min(window_size, len(qual))]
+             for i in range(len(qual) - window + 1) if qual]
+    while True:
+        threshold = 10 ** -(rand.uniform(0, 30) / 10)
+        if all(abs(mean - threshold) > 1e-6 for mean in means):
+            return threshold
+
+
+def random_trim_records(seed: int):
+    rand = random.Random(seed)
+    window_size = rand.randint(1, 10)
+    qualities = [[[rand.choice([2, 10, 20, 30, 40])
+                   for _ in range(rand.randint(0, 60))]
+                  for _ in range(rand.randint(1, 3))]
+                 for _ in range(50)]
+    threshold = random_trim_threshold(
+        rand, [qual for quals in qualities for qual in quals], window_size)
+    record_tuples = [
+        tuple(SequenceRecord("name", random_sequence(rand, len(qual)),
+                             quallist_to_string(qual)) for qual in quals)
+        for quals in qualities]
+    return window_size, threshold, qualities, record_tuples
+
+
+@pytest.mark.parametrize(["method", "seed"], itertools.product(
+    ["call", "filter_batch", "pipeline", "pipeline_filter_batch"], range(10)))
+def test_sliding_window_error_rate_filter_trim(method, seed):
+    window_size, threshold, qualities, record_tuples = random_trim_records(seed)
+    originals = [tuple((record.sequence, record.qualities) for record in records)
+                 for records in record_tuples]
+    trim_filter = SlidingWindowErrorRateFilter(threshold, window_size,
+                                               trim=True)
+    assert trim_filter.trim
+    # The length filter checks the trimmed reads.
+    min_length = random.Random(seed).randint(0, 40)
+    if method == "call":
+        flags = bytes(trim_filter(records) for records in record_tuples)
+    elif method == "filter_batch":
+        flags = trim_filter.filter_batch(record_tuples)
+    else:
+        pipeline = FilterPipeline([trim_filter,
+                                   MinimumLengthFilter(min_length)])
+        if method == "pipeline":
+            flags = bytes(pipeline(records) for records in record_tuples)
+        else:
+            flags = pipeline.filter_batch(record_tuples)
+    assert trim_filter.total == trim_filter.passed == len(record_tuples)
+    for records, quals, original, flag in zip(
+            record_tuples, qualities, originals, flags):
+        lengths = [sliding_window_trim(qual, threshold, window_size)
+                   for qual in quals]
+        if method.startswith("pipeline"):
+            assert flag == any(length >= min_length for length in lengths)
+        else:
+            assert flag == 1
+        if not flag:
+            lengths = [len(qual) for qual in quals]
+        assert [(record.sequence, record.qualities) for record in records] == [
+            (sequence[:length], qualities[:length])
+            for (sequence, qualities), length in zip(original, lengths)]
+
+
+@pytest.mark.parametrize(["qualities", "window_size", "length"], (
+    ([40] * 10 + [2] * 4 + [40] * 10, 4, 10),
+    ([40] * 10 + [2] * 3 + [40] * 10, 4, 23),
+    ([2, 2, 40, 40, 40], 2, 0),
+    ([40, 40, 2, 2, 2], 2, 2),
+    ([40, 40, 40, 40, 2], 5, 5),
+    ([2, 40], 4, 2),
+    ([2, 2], 4, 0),
+    ([], 4, 0),
+))
+def test_sliding_window_error_rate_filter_trim_lengths(qualities, window_size,
+                                                       length):
+    assert sliding_window_trim(qualities, 0.5, window_size) == length
+    record = SequenceRecord("name", len(qualities) * "A",
+                            quallist_to_string(qualities))
+    assert SlidingWindowErrorRateFilter(0.5, window_size, trim=True)((record,))
+    assert record.sequence == length * "A"
+    assert record.qualities == quallist_to_string(qualities[:length])
+
+
+@pytest.mark.parametrize("threshold", [float("nan"), -0.5])
+def test_sliding_window_error_rate_filter_trim_special_thresholds(threshold):
+    record = SequenceRecord("name", "AAAA", quallist_to_string([40] * 4))
+    assert SlidingWindowErrorRateFilter(threshold, 2, trim=True)((record,))
+    assert (record.sequence, record.qualities) == ("", "")
+
+
+def test_sliding_window_error_rate_filter_trim_tail_first():
+    assert SlidingWindowErrorRateFilter(0.01).trim is False
+    with pytest.raises(ValueError) as error:
+        SlidingWindowErrorRateFilter(0.01, trim=True, tail_first=True)
+    error.match("trim can not be combined with tail_first")
+
+
+def n_bases_pass(sequence: str, threshold: float) -> bool:
+    n_bases = sequence.upper().count("N")
+    if threshold < 1:
+        return n_bases <= threshold * len(sequence)
+    return n_bases <= threshold
+
+
+@pytest.mark.parametrize("seed", range(20))
+def test_maximum_n_filter_random(seed):
+    rand = random.Random(seed)
+    sequences = ["".join(rand.choice("ACGTNn") for _ in
+                         range(rand.randint(0, 300)))
+                 for _ in range(rand.randint(1, 3))]
+    threshold = rand.choice([0, 0.05, 0.2, 0.5, 1, 10, 60])
+    expected = all(n_bases_pass(sequence, threshold)
+                   for sequence in sequences)
+    records = tuple(SequenceRecord("name", sequence, len(sequence) * "I")
+                    for sequence in sequences)
+    filter = MaximumNFilter(threshold)
+    assert filter.threshold == threshold
+    assert filter(records) is expected
+    assert filter.total == 1
+    assert filter.passed == int(expected)
+
+
+@pytest.mark.parametrize(["threshold", "sequence", "result"], (
+    (0, "", True),
+    (0, "ACGT", True),
+    (0, "ACNT", False),
+    (2, "NNAN", False),
+    (3, "NNAn", True),
+    (0.5, "NNAA", True),
+    (0.5, "NNNA", False),
+    # The lanes of the vectorized counters must not overflow.
+    (10000, "N" * 10000, True),
+    (9999, "N" * 10000, False),
+))
+def test_maximum_n_filter(threshold, sequence, result):
+    record = SequenceRecord("name", sequence, len(sequence) * "I")
+    assert MaximumNFilter(threshold)((record,)) is result
+
+
+def longest_homopolymer(sequence: str) -> int:
+    return max((len(list(run)) for _, run in
+                itertools.groupby(sequence.upper())), default=0)
+
+
+@pytest.mark.parametrize("seed", range(50))
+def test_maximum_homopolymer_filter_random(seed):
+    rand = random.Random(seed)
+    sequences = []
+    for _ in range(rand.randint(1, 3)):
+        # Runs of all lengths, also across the 64 base blocks of the
+        # vectorized kernels.
+        runs = [rand.choice("ACGTNacgtn") * rand.randint(1, 80)
+                for _ in range(rand.randint(0, 20))]
+        sequences.append("".join(runs))
+    threshold = rand.randint(0, 100)
+    expected = all(longest_homopolymer(sequence) <= threshold
+                   for sequence in sequences)
+    records = tuple(SequenceRecord("name", sequence, len(sequence) * "I")
+                    for sequence in sequences)
+    filter = MaximumHomopolymerFilter(threshold)
+    assert filter.threshold == threshold
+    assert filter(records) is expected
+    assert filter.total == 1
+    assert filter.passed == int(expected)
+
+
+@pytest.mark.parametrize(["threshold", "length"], itertools.product(
+    [1, 2, 31, 32, 63, 64, 65, 100, 127, 128, 129],
+    [1, 63, 64, 65, 66, 128, 129, 130, 200]))
+def test_maximum_homopolymer_filter_run_positions(threshold, length):
+    for start in (0, 1, 63, 64, 65, 100):
+        sequence = "AC" * 100
+        sequence = sequence[:start] + "G" * length + sequence[start:]
+        record = SequenceRecord("name", sequence, len(sequence) * "I")
+        assert MaximumHomopolymerFilter(threshold)((record,)) is (
+            length <= threshold)
+
+
+def test_maximum_homopolymer_filter_ignores_case():
+    record = SequenceRecord("name", "ACggGGT", "IIIIIII")
+    assert MaximumHomopolymerFilter(3)((record,)) is False
+    assert MaximumHomopolymerFilter(4)((record,)) is True
+
+
+def test_maximum_homopolymer_filter_negative_threshold():
+    with pytest.raises(ValueError) as error:
+        MaximumHomopolymerFilter(-1)
+    error.match("at least 0")
+
+
+def test_median_quality_filter_no_fixed_point():
+    with pytest.raises(TypeError):
+        MedianQualityFilter(20, fixed_point=True)
+
+
 TOO_LOW_PHREDS = [chr(x) for x in range(33)]
 TOO_HIGH_PHREDS = [chr(127)]
 OUTSIDE_RANGE_PHREDS = TOO_LOW_PHREDS + TOO_HIGH_PHREDS
@@ -116,7 +514,8 @@ OUTSIDE_RANGE_PHREDS = TOO_LOW_PHREDS + TOO_HIGH_PHREDS
 @pytest.mark.parametrize(
     ["filter_class", "quals"],
     itertools.product(
-        [AverageErrorRateFilter, MedianQualityFilter], OUTSIDE_RANGE_PHREDS)
+        [AverageErrorRateFilter, MedianQualityFilter,
+         SlidingWindowErrorRateFilter], OUTSIDE_RANGE_PHREDS)
 )
 def test_outside_range(filter_class, quals):
     record = SequenceRecord("name", "A", quals)
@@ -126,6 +525,14 @@ def test_outside_range(filter_class, quals):
     error.match("outside of valid phred range")
 
 
+@pytest.mark.parametrize("quals", OUTSIDE_RANGE_PHREDS)
+def test_outside_range_fixed_point(quals):
+    record = SequenceRecord("name", "AA", "I" + quals)
+    with pytest.raises(ValueError) as error:
+        AverageErrorRateFilter(1, fixed_point=True)((record,))
+    error.match("outside of valid phred range")
+
+
 @pytest.mark.parametrize(
     ["threshold", "lengths", "result"], (
         (10, [10], True),
@@ -166,3 +573,245 @@ def test_minimum_length_filter(threshold, lengths, result):
     #     assert filter.passed == 1
     # else:
     #     assert filter.passed == 0
+
+
+PIPELINE_RECORDS = [
+    (SequenceRecord("name", "A" * 10, quallist_to_string([30] * 10)),),
+    (SequenceRecord("name", "A" * 4, quallist_to_string([30] * 4)),),
+    (SequenceRecord("name", "A" * 30, quallist_to_string([30] * 30)),),
+    (SequenceRecord("name", "A" * 10, quallist_to_string([5] * 10)),),
+    (SequenceRecord("name", "A" * 10, quallist_to_string([10] * 6 + [40] * 4)),),
+    (SequenceRecord("name", "A" * 10, quallist_to_string([40] * 6 + [2] * 4)),),
+    (SequenceRecord("name", "A" * 8, quallist_to_string([30] * 8)),
+     SequenceRecord("name", "A" * 3, quallist_to_string([2] * 3))),
+    (SequenceRecord("name", "ACGTNNACGTAC", quallist_to_string([30] * 12)),),
+    (SequenceRecord("name", "ACGT" + "G" * 14, quallist_to_string([30] * 18)),),
+]
+
+
+def pipeline_filters():
+    return [MinimumLengthFilter(5), MaximumLengthFilter(20),
+            AverageErrorRateFilter(0.01), MedianQualityFilter(20),
+            SlidingWindowErrorRateFilter(0.05), MaximumNFilter(0.1),
+            MaximumHomopolymerFilter(12)]
+
+
+@pytest.mark.parametrize("order", itertools.permutations(range(4)))
+def test_filter_pipeline_same_as_chained(order):
+    chained_filters = [pipeline_filters()[i] for i in order]
+    pipeline_stages = [pipeline_filters()[i] for i in order]
+    pipeline = FilterPipeline(pipeline_stages)
+    chained = PIPELINE_RECORDS
+    for filter_func in chained_filters:
+        chained = filter(filter_func, chained)
+    assert list(chained) == list(filter(pipeline, PIPELINE_RECORDS))
+    for chained_filter, stage in zip(chained_filters, pipeline.filters):
+        assert chained_filter.total == stage.total
+        assert chained_filter.passed == stage.passed
+
+
+def random_sequence(rand: random.Random, length: int):
+    if rand.random() < 0.5:
+        return length * "A"
+    return "".join(rand.choice("ACGTN") for _ in range(length))
+
+
+def random_record_tuples(rand: random.Random, tuple_sizes: List[int]):
+    record_tuples = []
+    for _ in range(100):
+        size = rand.choice(tuple_sizes)
+        record_tuples.append(tuple(
+            SequenceRecord("name", random_sequence(rand, length),
+                           quallist_to_string(
+                               [rand.choice([2, 10, 20, 30, 40])
+                                for _ in range(length)]))
+            for length in (rand.randint(0, 30) for _ in range(size))))
+    return record_tuples
+
+
+# Every combination of filters and record tuple size has its own kernel.
+@pytest.mark.parametrize(["filter_indexes", "tuple_sizes"], itertools.product(
+    [indexes for size in range(8)
+     for indexes in itertools.combinations(range(7), size)],
+    [[1], [2], [3], [1, 2, 3]]))
+def test_filter_pipeline_kernels_same_as_chained(filter_indexes, tuple_sizes):
+    record_tuples = random_record_tuples(random.Random(len(filter_indexes)),
+                                         tuple_sizes)
+    chained = record_tuples
+    for i in filter_indexes:
+        chained = filter(pipeline_filters()[i], chained)
+    expected = set(map(id, chained))
+    pipeline = FilterPipeline([pipeline_filters()[i] for i in filter_indexes])
+    flags = pipeline.filter_batch(record_tuples)
+    assert flags == bytes(id(records) in expected
+                          for records in record_tuples)
+
+
+@pytest.mark.parametrize("filter_index", range(7))
+def test_filter_timed(filter_index):
+    timed_filter = pipeline_filters()[filter_index]
+    timed_filter = type(timed_filter)(timed_filter.threshold, timed=True)
+    untimed_filter = pipeline_filters()[filter_index]
+    assert timed_filter.timed is True
+    assert untimed_filter.timed is False
+    for records in PIPELINE_RECORDS:
+        timed_filter(records)
+        untimed_filter(records)
+    time_after_calls = timed_filter.time
+    assert time_after_calls > 0.0
+    assert untimed_filter.time == 0.0
+    timed_filter.filter_batch(PIPELINE_RECORDS)
+    assert timed_filter.time > time_after_calls
+
+
+def test_filter_pipeline_timed():
+    timed_filter = AverageErrorRateFilter(0.01, timed=True)
+    untimed_filter = MinimumLengthFilter(5)
+    pipeline = FilterPipeline([untimed_filter, timed_filter])
+    pipeline.filter_batch(PIPELINE_RECORDS)
+    # All stages are timed when one of the filters is timed.
+    assert timed_filter.time > 0.0
+    assert untimed_filter.time > 0.0
+
+
+def test_filter_pipeline_empty():
+    pipeline = FilterPipeline([])
+    assert pipeline.filters == ()
+    assert pipeline(PIPELINE_RECORDS[0]) is True
+
+
+def test_filter_pipeline_unsupported_filter():
+    with pytest.raises(TypeError) as error:
+        FilterPipeline([MinimumLengthFilter(10), lambda records: True])
+    error.match("index 1")
+
+
+def test_filter_pipeline_phred_offsets_differ():
+    with pytest.raises(ValueError) as error:
+        FilterPipeline([AverageErrorRateFilter(0.01, phred_offset=33),
+                        MedianQualityFilter(20, phred_offset=64)])
+    error.match("same phred offset")
+
+
+@pytest.mark.parametrize("quals", OUTSIDE_RANGE_PHREDS)
+def test_filter_pipeline_outside_range(quals):
+    pipeline = FilterPipeline([AverageErrorRateFilter(1),
+                               MedianQualityFilter(1)])
+    with pytest.raises(ValueError) as error:
+        pipeline((SequenceRecord("name", "A", quals),))
+    error.match("outside of valid phred range")
+
+
+@pytest.mark.parametrize("filter_index", range(7))
+def test_filter_batch_same_as_call(filter_index):
+    batch_filter = pipeline_filters()[filter_index]
+    call_filter = pipeline_filters()[filter_index]
+    flags = batch_filter.filter_batch(PIPELINE_RECORDS)
+    assert flags == bytes(call_filter(records) for records in PIPELINE_RECORDS)
+    assert batch_filter.total == call_filter.total
+    assert batch_filter.passed == call_filter.passed
+
+
+@pytest.mark.parametrize("order", itertools.permutations(range(4)))
+def test_filter_pipeline_filter_batch_same_as_call(order):
+    batch_pipeline = FilterPipeline([pipeline_filters()[i] for i in order])
+    call_pipeline = FilterPipeline([pipeline_filters()[i] for i in order])
+    flags = batch_pipeline.filter_batch(PIPELINE_RECORDS)
+    assert flags == bytes(call_pipeline(records)
+                          for records in PIPELINE_RECORDS)
+    for batch_stage, call_stage in zip(batch_pipeline.filters,
+                                       call_pipeline.filters):
+        assert batch_stage.total == call_stage.total
+        assert batch_stage.passed == call_stage.passed
+
+
+def test_filter_batch_empty():
+    assert MedianQualityFilter(20).filter_batch([]) == b""
+    assert FilterPipeline([]).filter_batch(PIPELINE_RECORDS) == (
+        b"\x01" * len(PIPELINE_RECORDS))
+
+
+def test_filter_batch_error_counts_evaluated():
+    median_filter = MedianQualityFilter(20)
+    records = PIPELINE_RECORDS[:3] + [
+        (SequenceRecord("name", "A", "\x7f"),)] + PIPELINE_RECORDS
+    with pytest.raises(ValueError) as error:
+        median_filter.filter_batch(records)
+    error.match("outside of valid phred range")
+    assert median_filter.total == 3
+    assert median_filter.passed == 3
+
+
+@pytest.mark.parametrize("batch", [
+    [SequenceRecord("name", "A", "A")],
+    [(SequenceRecord("name", "A", "A"), "A")],
+    None,
+])
+def test_filter_batch_wrong_type(batch):
+    with pytest.raises(TypeError):
+        MinimumLengthFilter(1).filter_batch(batch)
+
+
+@pytest.mark.parametrize("filter_func", pipeline_filters() + [
+    FilterPipeline(pipeline_filters())])
+def test_filter_call_arguments(filter_func):
+    records = PIPELINE_RECORDS[0]
+    with pytest.raises(TypeError) as error:
+        filter_func(records=records)
+    error.match("keyword")
+    with pytest.raises(TypeError) as error:
+        filter_func(records, records)
+    error.match("exactly 1 positional argument, got 2")
+    with pytest.raises(TypeError) as error:
+        filter_func()
+    error.match("exactly 1 positional argument, got 0")
+    assert filter_func(records) in (True, False)
+
+
+def test_filter_construction_does_not_leak_dnaio():
+    dnaio = sys.modules["dnaio"]
+    filters = pipeline_filters()
+    FilterPipeline(filters)(PIPELINE_RECORDS[0])
+    references = sys.getrefcount(dnaio)
+    for _ in range(100):
+        filters = pipeline_filters()
+        pipeline = FilterPipeline(filters)
+        pipeline(PIPELINE_RECORDS[0])
+        filters[0](PIPELINE_RECORDS[0])
+    assert sys.getrefcount(dnaio) == references
+
+
+KERNEL_RESULTS_SCRIPT = """
+import random
+from dnaio import SequenceRecord
+from fastq_filter import _filters
+
+rand = random.Random(0)
+filters = [_filters.AverageErrorRateFilter(0.01),
+           _filters.MedianQualityFilter(25),
+           _filters.MaximumNFilter(0.02),
+           _filters.MaximumHomopolymerFilter(6)]
+results = []
+for length in range(200):
+    sequence = "".join(rand.choice("AAACGTN") for _ in range(length))
+    qualities = "".join(chr(rand.randint(2, 41) + 33) for _ in range(length))
+    record = (SequenceRecord("name", sequence, qualities),)
+    results.append([filter(record) for filter in filters])
+print(_filters.KERNELS, results)
+"""
+
+
+@pytest.mark.parametrize("kernels", ["scalar", "sse2"])
+def test_limited_kernels_same_results(kernels):
+    def run(limit):
+        env = dict(os.environ, FASTQ_FILTER_KERNELS=limit)
+        return subprocess.run([sys.executable, "-c", KERNEL_RESULTS_SCRIPT],
+                              env=env, capture_output=True, check=True,
+                              text=True).stdout.split(" ", 1)
+    selected, results = run(kernels)
+    _, fastest_results = run("")
+    if kernels == "scalar":
+        assert selected == "scalar"
+    else:
+        assert selected != "avx2"
+    assert results == fastest_results
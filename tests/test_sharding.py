@@ -0,0 +1,325 @@
+# Copyright (c) 2021 Leiden University Medical Center
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+import gzip
+import io
+import json
+import random
+import sys
+
+import fastq_filter
+from fastq_filter.compression import BGZF_EOF, ParallelGzipWriter
+from fastq_filter.sharding import (
+    ShardReader,
+    find_record_start,
+    is_record_start,
+    merge_files,
+    merge_reports,
+    parse_shard,
+    record_id,
+    shard_range,
+    _FileWindow,
+)
+
+import pytest
+
+
+def paired_fastq(number_of_records, seed=0):
+    """
+    Paired records of very different lengths, so the same byte offset is at
+    different records in the two files. Qualities start with @ and + too.
+    """
+    rand = random.Random(seed)
+    files = []
+    for mate, max_length in ((1, 300), (2, 20)):
+        records = []
+        for i in range(number_of_records):
+            length = rand.randint(1, max_length)
+            sequence = "".join(rand.choice("ACGT") for _ in range(length))
+            qualities = "".join(rand.choice("@+I#5") for _ in range(length))
+            records.append(f"@read{i}/{mate} x\n{sequence}\n+\n{qualities}\n")
+        files.append("".join(records).encode())
+    return files
+
+
+def write_inputs(tmp_path, data, bgzf):
+    input_files = []
+    for i, file_data in enumerate(data):
+        path = tmp_path / f"in{i}.fq"
+        if bgzf:
+            path = tmp_path / f"in{i}.fq.gz"
+            with ParallelGzipWriter(str(path), compresslevel=1,
+                                    bgzf=True) as writer:
+                writer.write(file_data)
+        else:
+            path.write_bytes(file_data)
+        input_files.append(str(path))
+    return input_files
+
+
+@pytest.mark.parametrize(["value", "expected"], [
+    ("0/1", (0, 1)), ("3/8", (3, 8)), ("7/8", (7, 8))])
+def test_parse_shard(value, expected):
+    assert parse_shard(value) == expected
+
+
+@pytest.mark.parametrize("value", ["1", "1/2/3", "a/2", "2/2", "-1/2", "0/0"])
+def test_parse_shard_invalid(value):
+    with pytest.raises(ValueError):
+        parse_shard(value)
+
+
+@pytest.mark.parametrize(["lines", "at_eof", "expected"], [
+    ([b"@r", b"AC", b"+", b"II", b"@r2"], False, True),
+    ([b"@r", b"AC", b"+", b"II"], True, True),
+    ([b"@r", b"AC", b"+", b"II"], False, False),
+    ([b"@r", b"AC", b"+", b"I", b"@r2"], False, False),
+    # A quality line starting with @ is followed by the name and sequence.
+    ([b"@I", b"@r2", b"AC", b"+", b"II"], False, False),
+    ([b"@r", b"AC", b"+", b"II", b"AC"], False, False),
+])
+def test_is_record_start(lines, at_eof, expected):
+    assert is_record_start(lines, at_eof) is expected
+
+
+def test_find_record_start():
+    data = b"CGT\n+\n@II\n@r2\nAC\n+\n@I\n@r3\nA\n+\nI\n"
+    window = _FileWindow(io.BytesIO(data), 0, bgzf=False)
+    assert find_record_start(window) == data.index(b"@r2")
+
+
+def test_find_record_start_skips_window_start():
+    # The window may start halfway a line, so its start is not a record.
+    data = b"@r1\nAC\n+\nII\n@r2\nAC\n+\nII\n"
+    window = _FileWindow(io.BytesIO(data), 0, bgzf=False)
+    assert find_record_start(window) == data.index(b"@r2")
+    window = _FileWindow(io.BytesIO(data), data.index(b"@r2"), bgzf=False)
+    assert find_record_start(window) is None
+
+
+@pytest.mark.parametrize(["name", "expected"], [
+    (b"read1/1", b"read1/"),
+    (b"read1/2 comment", b"read1/"),
+    (b"read12", b"read12"),
+    (b"read1\tcomment", b"read1"),
+    (b"", b""),
+])
+def test_record_id(name, expected):
+    assert record_id(name) == expected
+
+
+@pytest.mark.parametrize("bgzf", [False, True])
+@pytest.mark.parametrize("native", [True, False])
+def test_shards_cover_all_records(tmp_path, bgzf, native):
+    input_files = write_inputs(tmp_path, paired_fastq(3000), bgzf)
+
+    def run(prefix, shard=None):
+        filters = [fastq_filter.AverageErrorRateFilter(0.2)]
+        if not native:
+            filters.append(lambda records: True)
+        outputs = [str(tmp_path / f"{prefix}.{i}.fq") for i in range(2)]
+        fastq_filter.filter_fastq(input_files, outputs, filters, shard=shard)
+        return filters[0].total, outputs
+
+    total, full_outputs = run("full")
+    assert total == 3000
+    for number_of_shards in (1, 3, 16):
+        shard_outputs = []
+        shard_total = 0
+        for i in range(number_of_shards):
+            shard_count, outputs = run(f"shard{i}", (i, number_of_shards))
+            shard_total += shard_count
+            shard_outputs.append(outputs)
+        assert shard_total == total
+        for i, full_output in enumerate(full_outputs):
+            merged = tmp_path / "merged.fq"
+            with open(merged, "wb") as merged_h:
+                merge_files([outputs[i] for outputs in shard_outputs],
+                            merged_h)
+            assert merged.read_bytes() == open(full_output, "rb").read()
+
+
+@pytest.mark.parametrize("bgzf", [False, True])
+def test_shard_reader(tmp_path, bgzf):
+    data = paired_fastq(1000)[0]
+    input_files = write_inputs(tmp_path, [data], bgzf)
+    number_of_shards = 5
+    boundaries = [shard_range(input_files, i, number_of_shards)
+                  for i in range(number_of_shards)]
+    pieces = []
+    for starts, ends in boundaries:
+        reader = ShardReader(input_files[0], starts[0],
+                             ends[0] if ends else None)
+        with io.BufferedReader(reader) as reader_h:
+            pieces.append(reader_h.read())
+    assert b"".join(pieces) == data
+    assert all(piece.startswith(b"@read") for piece in pieces)
+
+
+def test_shard_range_unpaired_files(tmp_path):
+    r1, r2 = paired_fastq(1000)
+    r2 = r2.replace(b"@read", b"@other")
+    input_files = write_inputs(tmp_path, [r1, r2], False)
+    with pytest.raises(ValueError) as error:
+        shard_range(input_files, 1, 2)
+    error.match("No mates found")
+
+
+def test_shard_more_shards_than_records(tmp_path):
+    data = b"@read1\nA\n+\nI\n@read2\nA\n+\nI\n"
+    input_files = write_inputs(tmp_path, [data], False)
+    pieces = []
+    for i in range(20):
+        output = str(tmp_path / f"out{i}.fq")
+        fastq_filter.filter_fastq(input_files, [output], [], shard=(i, 20))
+        pieces.append(open(output, "rb").read())
+    assert b"".join(pieces) == data
+
+
+def test_shard_gzip_input(tmp_path):
+    input_file = tmp_path / "in.fq.gz"
+    input_file.write_bytes(gzip.compress(b"@read1\nA\n+\nI\n"))
+    with pytest.raises(ValueError) as error:
+        fastq_filter.filter_fastq([str(input_file)], [str(tmp_path / "o.fq")],
+                                  [], shard=(0, 2))
+    error.match("uncompressed or BGZF")
+
+
+def test_merge_files_bgzf(tmp_path):
+    inputs = []
+    for i in range(3):
+        path = tmp_path / f"shard{i}.fq.gz"
+        with ParallelGzipWriter(str(path), compresslevel=1,
+                                bgzf=True) as writer:
+            writer.write(f"@read{i}\nA\n+\nI\n".encode())
+        inputs.append(str(path))
+    merged = io.BytesIO()
+    merge_files(inputs, merged)
+    data = merged.getvalue()
+    # Only the end-of-stream marker of the last file is kept.
+    assert data.count(BGZF_EOF) == 1
+    assert data.endswith(BGZF_EOF)
+    assert gzip.decompress(data) == (b"@read0\nA\n+\nI\n@read1\nA\n+\nI\n"
+                                     b"@read2\nA\n+\nI\n")
+
+
+def shard_report(shard, total, passed):
+    return {
+        "shard": shard,
+        "input_files": ["in.fq"],
+        "output_files": [f"out{shard[0]}.fq"],
+        "total": total,
+        "passed": passed,
+        "wall_time": total / 10,
+        "stage_times": {"read": 1.0, "filter": 2.0},
+        "filters": [{"name": "minimum length", "threshold": 10,
+                     "total": total, "passed": passed, "time": 0.5}],
+        "histograms": {
+            "passed": {"length": [[10, 10, passed]],
+                       "mean_quality": [[30, passed]]},
+            "failed": {"length": [[total, total + 1, total - passed]],
+                       "mean_quality": [[20, total - passed]]},
+        },
+    }
+
+
+def test_merge_reports():
+    merged = merge_reports([shard_report("0/2", 10, 4),
+                            shard_report("1/2", 20, 5)])
+    assert merged["shard"] is None
+    assert merged["output_files"] == ["out0.fq", "out1.fq"]
+    assert merged["total"] == 30
+    assert merged["passed"] == 9
+    assert merged["wall_time"] == 2.0
+    assert merged["stage_times"] == {"read": 2.0, "filter": 4.0}
+    assert merged["filters"] == [{"name": "minimum length", "threshold": 10,
+                                  "total": 30, "passed": 9, "time": 1.0}]
+    assert merged["histograms"] == {
+        "passed": {"length": [[10, 10, 9]], "mean_quality": [[30, 9]]},
+        "failed": {"length": [[10, 11, 6], [20, 21, 15]],
+                   "mean_quality": [[20, 21]]},
+    }
+
+
+@pytest.mark.parametrize("shards", [["1/2", "0/2"], ["0/3", "1/3"]])
+def test_merge_reports_missing_shards(shards):
+    with pytest.raises(ValueError) as error:
+        merge_reports([shard_report(shard, 10, 4) for shard in shards])
+    error.match("all shards in order")
+
+
+def test_merge_reports_different_filters():
+    report = shard_report("1/2", 10, 4)
+    report["filters"][0]["threshold"] = 11
+    with pytest.raises(ValueError) as error:
+        merge_reports([shard_report("0/2", 10, 4), report])
+    error.match("different filters")
+
+
+def test_main_shard_and_merge(tmp_path):
+    data = paired_fastq(500)[0]
+    in_f = tmp_path / "in.fq"
+    in_f.write_bytes(data)
+    outputs = []
+    reports = []
+    for i in range(3):
+        outputs.append(str(tmp_path / f"out{i}.fq"))
+        reports.append(str(tmp_path / f"report{i}.json"))
+        sys.argv = ["", "--quiet", "-l", "10", "--shard", f"{i}/3", str(in_f),
+                    "-o", outputs[-1], "--json-report", reports[-1]]
+        fastq_filter.main()
+    merged_f = tmp_path / "merged.fq"
+    merged_report = tmp_path / "merged.json"
+    sys.argv = ["", *outputs, "-o", str(merged_f),
+                *(arg for report in reports for arg in ("--report", report)),
+                "--json-report", str(merged_report)]
+    fastq_filter.merge_main()
+    records = [b"".join(lines) for lines in
+               zip(*[iter(data.splitlines(keepends=True))] * 4)
+               if len(lines[1]) > 10]
+    assert merged_f.read_bytes() == b"".join(records)
+    report = json.loads(merged_report.read_text())
+    assert report["shard"] is None
+    assert report["total"] == 500
+    assert report["passed"] == len(records)
+
+
+def test_main_shard_and_merge_more_shards_than_records(tmp_path):
+    # Most shards have no records, but still write their report.
+    data = b"@read1\nACGTACGT\n+\nIIIIIIII\n"
+    in_f = tmp_path / "in.fq"
+    in_f.write_bytes(data)
+    outputs = []
+    reports = []
+    for i in range(3):
+        outputs.append(str(tmp_path / f"out{i}.fq"))
+        reports.append(str(tmp_path / f"report{i}.json"))
+        sys.argv = ["", "-l", "4", "-q", "20", "-w", "10", "--shard",
+                    f"{i}/3", str(in_f), "-o", outputs[-1],
+                    "--json-report", reports[-1]]
+        fastq_filter.main()
+    merged_f = tmp_path / "merged.fq"
+    merged_report = tmp_path / "merged.json"
+    sys.argv = ["", *outputs, "-o", str(merged_f),
+                *(arg for report in reports for arg in ("--report", report)),
+                "--json-report", str(merged_report)]
+    fastq_filter.merge_main()
+    assert merged_f.read_bytes() == data
+    report = json.loads(merged_report.read_text())
+    assert (report["total"], report["passed"]) == (1, 1)